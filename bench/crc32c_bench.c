@@ -0,0 +1,102 @@
+#include "fs/crc32c.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Throughput of the block checksums, compared with the copy that tfs_read
+ * makes of the same bytes anyway.
+ *
+ * Blocks are taken from a buffer larger than the caches, so that the numbers
+ * include the cost of bringing the data in from memory.
+ */
+#define BUFFER_SIZE (64 << 20)
+#define TOTAL_BYTES (1ul << 30) // per measurement
+#define GB (1e9)
+
+static unsigned char *buffer;
+static unsigned char *destination;
+static volatile uint32_t sink; // keeps the checksums from being optimized out
+
+typedef void (*kernel_t)(unsigned char const *block, size_t block_size);
+
+static void copy_kernel(unsigned char const *block, size_t block_size) {
+    memcpy(destination, block, block_size);
+}
+
+static void crc32c_kernel(unsigned char const *block, size_t block_size) {
+    sink = crc32c(0, block, block_size);
+}
+
+static void scalar_kernel(unsigned char const *block, size_t block_size) {
+    sink = crc32c_scalar(0, block, block_size);
+}
+
+static double now(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (double)time.tv_sec + (double)time.tv_nsec / 1e9;
+}
+
+/**
+ * Run a kernel over TOTAL_BYTES, one block at a time.
+ *
+ * Returns the time taken, in seconds.
+ */
+static double measure(kernel_t kernel, size_t block_size) {
+    double start = now();
+    size_t offset = 0;
+    for (size_t done = 0; done < TOTAL_BYTES; done += block_size) {
+        kernel(buffer + offset, block_size);
+        offset = (offset + block_size) % BUFFER_SIZE;
+    }
+    return now() - start;
+}
+
+static void report(char const *name, double seconds, double baseline) {
+    double bytes = (double)TOTAL_BYTES;
+    printf("  %-28s %7.2f GB/s %8.1f ms/GB", name, bytes / seconds / GB,
+           seconds / (bytes / GB) * 1e3);
+    if (baseline > 0) {
+        printf("  (%.2fx the time of the copy)", seconds / baseline);
+    }
+    printf("\n");
+}
+
+int main() {
+    buffer = malloc(BUFFER_SIZE);
+    destination = malloc(BUFFER_SIZE);
+    assert(buffer != NULL && destination != NULL);
+
+    uint64_t state = 88172645463325252ull;
+    for (size_t i = 0; i < BUFFER_SIZE; i++) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        buffer[i] = (unsigned char)state;
+    }
+
+    crc32c_init();
+    assert(crc32c(0, buffer, BUFFER_SIZE) ==
+           crc32c_scalar(0, buffer, BUFFER_SIZE));
+
+    printf("crc32c implementation: %s\n", crc32c_implementation());
+    size_t const block_sizes[] = {1024, 4096};
+    for (size_t i = 0; i < sizeof(block_sizes) / sizeof(*block_sizes); i++) {
+        size_t block_size = block_sizes[i];
+        printf("%zu-byte blocks:\n", block_size);
+
+        double copy = measure(copy_kernel, block_size);
+        report("copy (tfs_read)", copy, 0);
+        report("crc32c", measure(crc32c_kernel, block_size), copy);
+        report("crc32c (scalar fallback)", measure(scalar_kernel, block_size),
+               copy);
+    }
+
+    free(buffer);
+    free(destination);
+    return 0;
+}
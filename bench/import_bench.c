@@ -0,0 +1,97 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Throughput of tfs_copy_from_external_fs against the size of the file
+ * imported, compared with copying it through stdio one block at a time (as
+ * the import used to).
+ *
+ * Small files are imported repeatedly, so that every measurement covers at
+ * least MIN_TOTAL_BYTES. The file system keeps its default block size, with
+ * enough blocks for the largest file.
+ */
+#define SOURCE_PATH "/tmp/tfs_import_bench.src"
+#define MIN_SIZE (16 << 10)
+#define MAX_SIZE (16 << 20)
+#define MIN_TOTAL_BYTES (64 << 20)
+#define MB (1e6)
+
+static double now(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (double)time.tv_sec + (double)time.tv_nsec / 1e9;
+}
+
+/**
+ * Import a file through stdio, one block at a time.
+ */
+static int stdio_import(char const *source_path, char const *dest_path) {
+    FILE *source = fopen(source_path, "r");
+    assert(source != NULL);
+    int dest = tfs_open(dest_path, TFS_O_CREAT | TFS_O_TRUNC);
+    assert(dest != -1);
+
+    size_t block_size = tfs_default_params().block_size;
+    char buffer[block_size];
+    size_t read_bytes;
+    while ((read_bytes = fread(buffer, 1, block_size, source)) > 0) {
+        assert(tfs_write(dest, buffer, read_bytes) == (ssize_t)read_bytes);
+    }
+
+    assert(fclose(source) == 0);
+    return tfs_close(dest);
+}
+
+/**
+ * Import a file repeatedly.
+ *
+ * Returns the throughput, in MB/s.
+ */
+static double measure(int (*import)(char const *, char const *),
+                      size_t size) {
+    size_t rounds = (MIN_TOTAL_BYTES + size - 1) / size;
+    double start = now();
+    for (size_t i = 0; i < rounds; i++) {
+        assert(import(SOURCE_PATH, "/imported") == 0);
+    }
+    return (double)(rounds * size) / (now() - start) / MB;
+}
+
+int main() {
+    char *contents = malloc(MAX_SIZE);
+    assert(contents != NULL);
+    uint64_t state = 88172645463325252ull;
+    for (size_t i = 0; i < MAX_SIZE; i++) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        contents[i] = (char)state;
+    }
+
+    tfs_params params = tfs_default_params();
+    params.max_block_count = MAX_SIZE / params.block_size + 64;
+    assert(tfs_init(&params) != -1);
+
+    printf("%10s %14s %14s\n", "file size", "stdio (MB/s)", "import (MB/s)");
+    for (size_t size = MIN_SIZE; size <= MAX_SIZE; size *= 4) {
+        FILE *source = fopen(SOURCE_PATH, "w");
+        assert(source != NULL);
+        assert(fwrite(contents, 1, size, source) == size);
+        assert(fclose(source) == 0);
+
+        double stdio = measure(stdio_import, size);
+        double import = measure(tfs_copy_from_external_fs, size);
+        printf("%8zu K %14.1f %14.1f  (%.2fx)\n", size >> 10, stdio, import,
+               import / stdio);
+    }
+
+    assert(tfs_destroy() != -1);
+    assert(unlink(SOURCE_PATH) == 0);
+    free(contents);
+    return 0;
+}
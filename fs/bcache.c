@@ -0,0 +1,199 @@
+#include "bcache.h"
+#include "utils.h"
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Buffer cache
+ *
+ * Keeps track of which units of the image (runs of unit_size bytes, e.g., an
+ * inode, a data block or a part of a bitmap) are held in memory, as opposed to
+ * only in (emulated) secondary storage. Only misses pay the storage access
+ * delay, and so do the write-backs of dirty units when they are evicted or
+ * when the cache is destroyed.
+ *
+ * The contents themselves always live in the image, so the cache only holds
+ * the state of each frame. Frames are split in shards (by the hash of the
+ * unit), each with its own lock and CLOCK hand: a frame that was referenced
+ * since the hand last passed gets a second chance, the first one that was not
+ * is evicted.
+ */
+#define SHARD_FRAMES (BCACHE_FRAMES / BCACHE_SHARDS)
+
+typedef struct {
+    size_t unit;
+    bool valid;
+    bool referenced;
+    bool dirty;
+} frame_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    frame_t frames[SHARD_FRAMES];
+    size_t hand;
+} shard_t;
+
+static shard_t shards[BCACHE_SHARDS];
+static size_t bcache_unit_size;
+static void (*bcache_storage_access)(void);
+static bool active; // the cache is not used before bcache_init
+
+static atomic_size_t hits;
+static atomic_size_t misses;
+static atomic_size_t write_backs;
+
+/**
+ * Find the shard of a unit.
+ *
+ * Input:
+ *   - unit: the unit number
+ */
+static shard_t *shard_for(size_t unit) {
+    uint64_t hash = (uint64_t)unit * 0x9e3779b97f4a7c15u;
+    return &shards[(hash >> 32) % BCACHE_SHARDS];
+}
+
+/**
+ * Start using the cache (empty).
+ *
+ * Input:
+ *   - unit_size: the size of the units cached
+ *   - storage_access: emulates an access to secondary storage
+ */
+void bcache_init(size_t unit_size, void (*storage_access)(void)) {
+    bcache_unit_size = unit_size;
+    bcache_storage_access = storage_access;
+    for (size_t s = 0; s < BCACHE_SHARDS; s++) {
+        mutex_init(&shards[s].lock);
+        for (size_t f = 0; f < SHARD_FRAMES; f++) {
+            shards[s].frames[f].valid = false;
+        }
+        shards[s].hand = 0;
+    }
+    atomic_init(&hits, 0);
+    atomic_init(&misses, 0);
+    atomic_init(&write_backs, 0);
+    active = true;
+}
+
+/**
+ * Stop using the cache, writing back the dirty units.
+ *
+ * Must not be called concurrently with other cache operations.
+ */
+void bcache_destroy(void) {
+    for (size_t s = 0; s < BCACHE_SHARDS; s++) {
+        for (size_t f = 0; f < SHARD_FRAMES; f++) {
+            frame_t *frame = &shards[s].frames[f];
+            if (frame->valid && frame->dirty) {
+                bcache_storage_access();
+                atomic_fetch_add(&write_backs, 1);
+            }
+        }
+        mutex_destroy(&shards[s].lock);
+    }
+    active = false;
+}
+
+/**
+ * Access a unit, bringing it into the cache if needed.
+ *
+ * Input:
+ *   - unit: the unit number
+ *   - write: whether the unit is changed
+ *   - whole: whether the whole unit is overwritten (so that its contents need
+ *     not be read from storage on a miss, which is then not counted as such)
+ */
+static void bcache_access(size_t unit, bool write, bool whole) {
+    shard_t *shard = shard_for(unit);
+    bool miss = true;
+    bool write_back = false;
+
+    mutex_lock(&shard->lock);
+    for (size_t f = 0; f < SHARD_FRAMES && miss; f++) {
+        frame_t *frame = &shard->frames[f];
+        if (frame->valid && frame->unit == unit) {
+            frame->referenced = true;
+            frame->dirty |= write;
+            miss = false;
+        }
+    }
+
+    if (miss) {
+        // Give referenced frames a second chance
+        frame_t *victim = &shard->frames[shard->hand];
+        while (victim->valid && victim->referenced) {
+            victim->referenced = false;
+            shard->hand = (shard->hand + 1) % SHARD_FRAMES;
+            victim = &shard->frames[shard->hand];
+        }
+        shard->hand = (shard->hand + 1) % SHARD_FRAMES;
+
+        write_back = victim->valid && victim->dirty;
+        victim->unit = unit;
+        victim->valid = true;
+        victim->referenced = true;
+        victim->dirty = write;
+    }
+    mutex_unlock(&shard->lock);
+
+    // The storage is accessed without holding up the other units of the shard
+    if (write_back) {
+        bcache_storage_access();
+        atomic_fetch_add(&write_backs, 1);
+    }
+    if (miss && !whole) {
+        bcache_storage_access();
+        atomic_fetch_add(&misses, 1);
+    } else if (!miss) {
+        atomic_fetch_add(&hits, 1);
+    }
+}
+
+/**
+ * Read from the image, through the cache.
+ *
+ * Input:
+ *   - offset: the offset (within the image) read
+ */
+void bcache_read(size_t offset) {
+    if (active) {
+        bcache_access(offset / bcache_unit_size, false, false);
+    }
+}
+
+/**
+ * Write to the image, through the cache (the units written are dirty until
+ * they are written back, and those written whole are not read first).
+ *
+ * Input:
+ *   - offset: the offset (within the image) of the range written
+ *   - length: the length of the range written
+ */
+void bcache_write(size_t offset, size_t length) {
+    if (!active || length == 0) {
+        return;
+    }
+
+    for (size_t unit = offset / bcache_unit_size;
+         unit <= (offset + length - 1) / bcache_unit_size; unit++) {
+        size_t start = unit * bcache_unit_size;
+        bool whole =
+            start >= offset && start + bcache_unit_size <= offset + length;
+        bcache_access(unit, true, whole);
+    }
+}
+
+/**
+ * Obtain the counters of the cache.
+ *
+ * Input:
+ *   - stats: where to store them
+ */
+void bcache_stats(bcache_stats_t *stats) {
+    stats->hits = atomic_load(&hits);
+    stats->misses = atomic_load(&misses);
+    stats->write_backs = atomic_load(&write_backs);
+}
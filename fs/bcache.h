@@ -0,0 +1,24 @@
+#ifndef BCACHE_H
+#define BCACHE_H
+
+#include "config.h"
+
+#include <stddef.h>
+
+/**
+ * Buffer cache counters (since bcache_init).
+ */
+typedef struct {
+    size_t hits;
+    size_t misses;
+    size_t write_backs;
+} bcache_stats_t;
+
+void bcache_init(size_t unit_size, void (*storage_access)(void));
+void bcache_destroy(void);
+
+void bcache_read(size_t offset);
+void bcache_write(size_t offset, size_t length);
+void bcache_stats(bcache_stats_t *stats);
+
+#endif // BCACHE_H
@@ -0,0 +1,361 @@
+#include "bitmap.h"
+
+#include <stdlib.h>
+
+#define WORD_BITS (64)
+#define FULL_WORD (~(uint64_t)0)
+
+static inline uint64_t bit_mask(size_t bit) { return (uint64_t)1 << bit; }
+
+/**
+ * Mask with a run of set bits.
+ *
+ * Input:
+ *   - first: position of the first bit of the run
+ *   - length: number of bits in the run (1 to WORD_BITS - first)
+ */
+static inline uint64_t run_mask(size_t first, size_t length) {
+    uint64_t ones =
+        length == WORD_BITS ? FULL_WORD : bit_mask(length) - (uint64_t)1;
+    return ones << first;
+}
+
+/**
+ * Count the clear bits of a word from a given position onwards, up to the
+ * first set bit.
+ *
+ * Input:
+ *   - word: the word
+ *   - first: position where the count starts
+ */
+static inline size_t clear_run(uint64_t word, size_t first) {
+    uint64_t rest = word >> first;
+    if (rest == 0) {
+        return WORD_BITS - first;
+    }
+    return (size_t)__builtin_ctzll(rest);
+}
+
+/**
+ * Record in the summary that a word became full.
+ *
+ * The summary is only used to skip words when searching, but it must never
+ * hide free bits: if a bit of the word is freed concurrently, either the
+ * freeing thread clears the summary bit after us, or we see the free bit here
+ * and clear it ourselves.
+ *
+ * Input:
+ *   - bitmap: the bitmap
+ *   - word_index: index of the full word
+ */
+static void mark_full(bitmap_t *bitmap, size_t word_index) {
+    _Atomic uint64_t *summary = &bitmap->summary[word_index / WORD_BITS];
+    uint64_t mask = bit_mask(word_index % WORD_BITS);
+
+    atomic_fetch_or(summary, mask);
+    if (atomic_load(&bitmap->words[word_index]) != FULL_WORD) {
+        atomic_fetch_and(summary, ~mask);
+    }
+}
+
+/**
+ * Report a change to a word to the user of the bitmap.
+ *
+ * Input:
+ *   - bitmap: the bitmap
+ *   - word_index: index of the word that changed
+ */
+static inline void word_changed(bitmap_t *bitmap, size_t word_index) {
+    if (bitmap->changed != NULL) {
+        bitmap->changed(&bitmap->words[word_index]);
+    }
+}
+
+/**
+ * Size of the words of a bitmap.
+ *
+ * Input:
+ *   - bit_count: number of bits
+ *
+ * Returns the size (in bytes) of the memory to provide to bitmap_init.
+ */
+size_t bitmap_words_size(size_t bit_count) {
+    return (bit_count + WORD_BITS - 1) / WORD_BITS * sizeof(uint64_t);
+}
+
+/**
+ * Initialize a bitmap over the given words.
+ *
+ * Input:
+ *   - bitmap: the bitmap
+ *   - bit_count: number of bits
+ *   - words: memory for the words (bitmap_words_size(bit_count) bytes, 8-byte
+ *     aligned), which must outlive the bitmap
+ *   - clear: whether to clear all bits (otherwise, the words are kept as they
+ *     are, as when loading an existing FS image)
+ *   - changed: called with each word after it changes (NULL if not needed)
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - malloc failure.
+ */
+int bitmap_init(bitmap_t *bitmap, size_t bit_count, void *words, bool clear,
+                void (*changed)(_Atomic uint64_t *word)) {
+    size_t word_count = (bit_count + WORD_BITS - 1) / WORD_BITS;
+    size_t summary_count = (word_count + WORD_BITS - 1) / WORD_BITS;
+
+    bitmap->bit_count = bit_count;
+    bitmap->word_count = word_count;
+    bitmap->words = words;
+    bitmap->changed = changed;
+    bitmap->summary = malloc(summary_count * sizeof(_Atomic uint64_t));
+    if (bitmap->summary == NULL) {
+        return -1;
+    }
+
+    if (clear) {
+        for (size_t i = 0; i < word_count; i++) {
+            atomic_init(&bitmap->words[i], 0);
+        }
+
+        // Bits past the end are permanently taken
+        if (bit_count % WORD_BITS != 0) {
+            atomic_init(&bitmap->words[word_count - 1],
+                        FULL_WORD << (bit_count % WORD_BITS));
+        }
+    }
+
+    // Words past the end are permanently full
+    for (size_t i = 0; i < summary_count; i++) {
+        atomic_init(&bitmap->summary[i], 0);
+    }
+    if (word_count % WORD_BITS != 0) {
+        atomic_init(&bitmap->summary[summary_count - 1],
+                    FULL_WORD << (word_count % WORD_BITS));
+    }
+    for (size_t i = 0; i < word_count; i++) {
+        if (atomic_load(&bitmap->words[i]) == FULL_WORD) {
+            atomic_fetch_or(&bitmap->summary[i / WORD_BITS],
+                            bit_mask(i % WORD_BITS));
+        }
+    }
+
+    atomic_init(&bitmap->cursor, 0);
+
+    return 0;
+}
+
+/**
+ * Free the memory used by a bitmap (except for its words).
+ *
+ * Input:
+ *   - bitmap: the bitmap
+ */
+void bitmap_destroy(bitmap_t *bitmap) {
+    free(bitmap->summary);
+    bitmap->words = NULL;
+    bitmap->summary = NULL;
+}
+
+/**
+ * Set a run of clear bits.
+ *
+ * The search starts at the word where the previous one ended (next fit) and
+ * only looks at words that the summary does not report as full. The run
+ * starts at the first clear bit found and extends over the clear bits that
+ * follow it in the same word, up to max_length bits.
+ *
+ * Input:
+ *   - bitmap: the bitmap
+ *   - max_length: maximum number of bits to set (at least 1)
+ *   - length: set to the number of bits actually set
+ *
+ * Returns the index of the first bit of the run, or -1 if all bits are set.
+ */
+long bitmap_alloc_run(bitmap_t *bitmap, size_t max_length, size_t *length) {
+    size_t summary_count = (bitmap->word_count + WORD_BITS - 1) / WORD_BITS;
+    size_t start = atomic_load(&bitmap->cursor);
+
+    // The summary word of the cursor is visited twice: first from the cursor
+    // onwards, then (after wrapping around) in full
+    for (size_t i = 0; i <= summary_count; i++) {
+        size_t s = (start / WORD_BITS + i) % summary_count;
+        uint64_t not_full = ~atomic_load(&bitmap->summary[s]);
+        if (i == 0) {
+            not_full &= FULL_WORD << (start % WORD_BITS);
+        }
+
+        while (not_full != 0) {
+            size_t w = s * WORD_BITS + (size_t)__builtin_ctzll(not_full);
+            not_full &= not_full - 1;
+
+            uint64_t word = atomic_load(&bitmap->words[w]);
+            while (word != FULL_WORD) {
+                size_t first = (size_t)__builtin_ctzll(~word);
+                size_t run = clear_run(word, first);
+                if (run > max_length) {
+                    run = max_length;
+                }
+
+                uint64_t taken = word | run_mask(first, run);
+                if (atomic_compare_exchange_weak(&bitmap->words[w], &word,
+                                                 taken)) {
+                    word_changed(bitmap, w);
+                    if (taken == FULL_WORD) {
+                        mark_full(bitmap, w);
+                    }
+                    atomic_store(&bitmap->cursor, w);
+                    *length = run;
+                    return (long)(w * WORD_BITS + first);
+                }
+            }
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * Set a run of exactly a given number of clear bits.
+ *
+ * Like bitmap_alloc_run, but only runs of clear bits that are long enough are
+ * taken (and, like those, they never span more than one word).
+ *
+ * Input:
+ *   - bitmap: the bitmap
+ *   - length: number of bits to set (1 to WORD_BITS)
+ *
+ * Returns the index of the first bit of the run, or -1 if there is no such
+ * run of clear bits.
+ */
+long bitmap_alloc_exact(bitmap_t *bitmap, size_t length) {
+    size_t summary_count = (bitmap->word_count + WORD_BITS - 1) / WORD_BITS;
+    size_t start = atomic_load(&bitmap->cursor);
+
+    // See bitmap_alloc_run
+    for (size_t i = 0; i <= summary_count; i++) {
+        size_t s = (start / WORD_BITS + i) % summary_count;
+        uint64_t not_full = ~atomic_load(&bitmap->summary[s]);
+        if (i == 0) {
+            not_full &= FULL_WORD << (start % WORD_BITS);
+        }
+
+        while (not_full != 0) {
+            size_t w = s * WORD_BITS + (size_t)__builtin_ctzll(not_full);
+            not_full &= not_full - 1;
+
+            uint64_t word = atomic_load(&bitmap->words[w]);
+            while (true) {
+                // Positions where length clear bits start
+                uint64_t starts = ~word;
+                for (size_t k = 1; k < length; k++) {
+                    starts &= ~word >> k;
+                }
+                if (starts == 0) {
+                    break;
+                }
+
+                size_t first = (size_t)__builtin_ctzll(starts);
+                uint64_t taken = word | run_mask(first, length);
+                if (atomic_compare_exchange_weak(&bitmap->words[w], &word,
+                                                 taken)) {
+                    word_changed(bitmap, w);
+                    if (taken == FULL_WORD) {
+                        mark_full(bitmap, w);
+                    }
+                    atomic_store(&bitmap->cursor, w);
+                    return (long)(w * WORD_BITS + first);
+                }
+            }
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * Set the clear bits starting at a given bit.
+ *
+ * Input:
+ *   - bitmap: the bitmap
+ *   - bit: the first bit to set
+ *   - max_length: maximum number of bits to set
+ *
+ * Returns the number of bits set (0 if the given bit is already set).
+ */
+size_t bitmap_alloc_at(bitmap_t *bitmap, size_t bit, size_t max_length) {
+    size_t taken = 0;
+
+    while (taken < max_length && bit < bitmap->bit_count) {
+        size_t w = bit / WORD_BITS;
+        size_t first = bit % WORD_BITS;
+
+        uint64_t word = atomic_load(&bitmap->words[w]);
+        uint64_t updated;
+        size_t run;
+        do {
+            run = clear_run(word, first);
+            if (run > max_length - taken) {
+                run = max_length - taken;
+            }
+            if (run == 0) {
+                return taken;
+            }
+            updated = word | run_mask(first, run);
+        } while (!atomic_compare_exchange_weak(&bitmap->words[w], &word,
+                                               updated));
+        word_changed(bitmap, w);
+
+        if (updated == FULL_WORD) {
+            mark_full(bitmap, w);
+        }
+
+        taken += run;
+        bit += run;
+        if (first + run < WORD_BITS) {
+            break; // reached a set bit (or max_length)
+        }
+    }
+
+    return taken;
+}
+
+/**
+ * Clear a run of bits.
+ *
+ * Input:
+ *   - bitmap: the bitmap
+ *   - bit: the first bit to clear
+ *   - length: number of bits to clear
+ */
+void bitmap_free_run(bitmap_t *bitmap, size_t bit, size_t length) {
+    while (length > 0) {
+        size_t w = bit / WORD_BITS;
+        size_t first = bit % WORD_BITS;
+        size_t run = WORD_BITS - first;
+        if (run > length) {
+            run = length;
+        }
+
+        atomic_fetch_and(&bitmap->words[w], ~run_mask(first, run));
+        word_changed(bitmap, w);
+        atomic_fetch_and(&bitmap->summary[w / WORD_BITS],
+                         ~bit_mask(w % WORD_BITS));
+
+        bit += run;
+        length -= run;
+    }
+}
+
+/**
+ * Check whether a bit is set.
+ *
+ * Input:
+ *   - bitmap: the bitmap
+ *   - bit: the bit
+ */
+bool bitmap_is_set(bitmap_t *bitmap, size_t bit) {
+    uint64_t word = atomic_load(&bitmap->words[bit / WORD_BITS]);
+    return (word & bit_mask(bit % WORD_BITS)) != 0;
+}
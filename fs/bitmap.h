@@ -0,0 +1,43 @@
+#ifndef BITMAP_H
+#define BITMAP_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Allocation bitmap
+ *
+ * One bit per slot (set if taken), packed in 64-bit words that are updated
+ * with compare-and-swap, plus a summary level with one bit per word (set if
+ * the word is full) used to skip full words when searching.
+ *
+ * The words are provided by the user (so that they can be kept in the FS
+ * image), while the summary is rebuilt from them when the bitmap is
+ * initialized.
+ *
+ * Whenever a word changes, the changed callback (if any) is called with it,
+ * after the change is made.
+ */
+typedef struct {
+    _Atomic uint64_t *words;
+    _Atomic uint64_t *summary;
+    size_t bit_count;
+    size_t word_count;
+    atomic_size_t cursor; // word where the next search starts (next fit)
+    void (*changed)(_Atomic uint64_t *word);
+} bitmap_t;
+
+size_t bitmap_words_size(size_t bit_count);
+int bitmap_init(bitmap_t *bitmap, size_t bit_count, void *words, bool clear,
+                void (*changed)(_Atomic uint64_t *word));
+void bitmap_destroy(bitmap_t *bitmap);
+
+long bitmap_alloc_run(bitmap_t *bitmap, size_t max_length, size_t *length);
+long bitmap_alloc_exact(bitmap_t *bitmap, size_t length);
+size_t bitmap_alloc_at(bitmap_t *bitmap, size_t bit, size_t max_length);
+void bitmap_free_run(bitmap_t *bitmap, size_t bit, size_t length);
+bool bitmap_is_set(bitmap_t *bitmap, size_t bit);
+
+#endif // BITMAP_H
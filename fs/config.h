@@ -6,6 +6,46 @@
 
 #define MAX_FILE_NAME (40)
 
+// Number of extents stored directly in the inode
+#define INODE_EXTENTS (4)
+
 #define DELAY (5000)
 
+// Number of frames (units of the image held in memory) in the buffer cache,
+// and number of shards they are split in
+#define BCACHE_FRAMES (512)
+#define BCACHE_SHARDS (16)
+
+// Number of slots in the directory entry cache
+#define DCACHE_SLOTS (1024)
+
+// Number of blocks in each chunk of a compressed file (including its header)
+#define COMPRESS_CHUNK_BLOCKS (8)
+
+// Size of the chunks in which files are copied from (or to) the OS' file
+// system when they cannot be mapped (or borrowed)
+#define EXTERNAL_CHUNK_SIZE (1 << 20)
+
+// Maximum number of spans borrowed at a time when copying a file to the OS'
+// file system
+#define EXPORT_SPANS (64)
+
+// Maximum length of the spans of zeros lent for the holes of sparse files by
+// tfs_read_borrow
+#define HOLE_SPAN_SIZE (1 << 16)
+
+// Maximum number of requests of a ring merged into a single vectored read or
+// write
+#define RING_MAX_MERGE (64)
+
+// Maximum number of unlinked files reclaimed (freed) by a single operation of
+// the background reclaimer
+#define ORPHAN_BATCH (32)
+
+// Maximum number of snapshots that can exist at the same time
+#define MAX_SNAPSHOTS (8)
+
+// Size of the journal (in bytes) past which it is checkpointed
+#define JOURNAL_CHECKPOINT_SIZE (1 << 20)
+
 #endif // CONFIG_H
@@ -0,0 +1,239 @@
+#include "crc32c.h"
+
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+/*
+ * CRC32C (Castagnoli polynomial, as used by iSCSI, ext4 and btrfs)
+ *
+ * Computed with the SSE4.2 crc32 instruction when the CPU has it, and with a
+ * table-driven (slicing-by-8) loop otherwise. The implementation is selected
+ * once, at run time, by crc32c_init.
+ *
+ * The crc32 instruction has a latency of 3 cycles but a throughput of one per
+ * cycle, so three lanes of CRC32C_LANE bytes are computed at once and then
+ * combined (shifting a CRC over a lane of zeros is a linear map, applied with
+ * crc32c_lane_shift).
+ */
+#define CRC32C_POLYNOMIAL (0x82f63b78u) // bit-reversed
+#define CRC32C_LANE (128)               // a power of 2
+
+static uint32_t crc32c_table[8][256];
+static uint32_t crc32c_lane_shift[4][256];
+static uint32_t (*crc32c_update)(uint32_t crc, unsigned char const *data,
+                                 size_t length);
+static char const *crc32c_name;
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Continue a CRC over some bytes, 8 at a time (slicing-by-8).
+ *
+ * Input:
+ *   - crc: the CRC so far (not inverted)
+ *   - data: the bytes
+ *   - length: number of bytes
+ */
+static uint32_t crc32c_update_scalar(uint32_t crc, unsigned char const *data,
+                                     size_t length) {
+    for (; length >= 8; data += 8, length -= 8) {
+        uint32_t low, high;
+        memcpy(&low, data, sizeof(low));
+        memcpy(&high, data + 4, sizeof(high));
+        low ^= crc;
+        crc = crc32c_table[7][low & 0xff] ^
+              crc32c_table[6][(low >> 8) & 0xff] ^
+              crc32c_table[5][(low >> 16) & 0xff] ^
+              crc32c_table[4][low >> 24] ^ crc32c_table[3][high & 0xff] ^
+              crc32c_table[2][(high >> 8) & 0xff] ^
+              crc32c_table[1][(high >> 16) & 0xff] ^
+              crc32c_table[0][high >> 24];
+    }
+    for (; length > 0; data++, length--) {
+        crc = crc32c_table[0][(crc ^ *data) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+/**
+ * Multiply a vector by a matrix over GF(2).
+ *
+ * Input:
+ *   - matrix: the matrix (32 columns)
+ *   - vector: the vector
+ */
+static uint32_t gf2_matrix_times(uint32_t const *matrix, uint32_t vector) {
+    uint32_t sum = 0;
+    for (; vector != 0; vector >>= 1, matrix++) {
+        if (vector & 1) {
+            sum ^= *matrix;
+        }
+    }
+    return sum;
+}
+
+/**
+ * Square a matrix over GF(2).
+ *
+ * Input:
+ *   - square: where to store the result
+ *   - matrix: the matrix (32 columns)
+ */
+static void gf2_matrix_square(uint32_t *square, uint32_t const *matrix) {
+    for (size_t n = 0; n < 32; n++) {
+        square[n] = gf2_matrix_times(matrix, matrix[n]);
+    }
+}
+
+/**
+ * Build the tables that shift a CRC over a number of zero bytes.
+ *
+ * Input:
+ *   - shift: the tables (one per byte of the CRC)
+ *   - length: the number of zero bytes (a power of 2)
+ */
+static void crc32c_shift_tables(uint32_t shift[4][256], size_t length) {
+    // Operators for one and two zero bits, squared up to length zero bytes
+    uint32_t odd[32], even[32];
+    odd[0] = CRC32C_POLYNOMIAL;
+    for (size_t n = 1; n < 32; n++) {
+        odd[n] = 1u << (n - 1);
+    }
+    gf2_matrix_square(even, odd); // 2 bits
+    gf2_matrix_square(odd, even); // 4 bits
+    uint32_t *op = odd;
+    for (size_t bytes = 1; bytes <= length; bytes <<= 1) {
+        uint32_t *other = op == odd ? even : odd;
+        gf2_matrix_square(other, op); // 8 bits, 16 bits, ...
+        op = other;
+    }
+
+    for (uint32_t byte = 0; byte < 256; byte++) {
+        for (size_t i = 0; i < 4; i++) {
+            shift[i][byte] = gf2_matrix_times(op, byte << (8 * i));
+        }
+    }
+}
+
+/**
+ * Shift a CRC over CRC32C_LANE zero bytes.
+ *
+ * Input:
+ *   - crc: the CRC (not inverted)
+ */
+static inline uint32_t crc32c_shift_lane(uint32_t crc) {
+    return crc32c_lane_shift[0][crc & 0xff] ^
+           crc32c_lane_shift[1][(crc >> 8) & 0xff] ^
+           crc32c_lane_shift[2][(crc >> 16) & 0xff] ^
+           crc32c_lane_shift[3][crc >> 24];
+}
+
+#if defined(__x86_64__)
+/**
+ * Continue a CRC over some bytes with the SSE4.2 crc32 instruction (8 bytes
+ * per instruction, over three lanes at a time).
+ *
+ * Input:
+ *   - crc: the CRC so far (not inverted)
+ *   - data: the bytes
+ *   - length: number of bytes
+ */
+__attribute__((target("sse4.2"))) static uint32_t
+crc32c_update_sse42(uint32_t crc, unsigned char const *data, size_t length) {
+    uint64_t crc64 = crc;
+    for (; length >= 3 * CRC32C_LANE;
+         data += 3 * CRC32C_LANE, length -= 3 * CRC32C_LANE) {
+        uint64_t crc1 = 0, crc2 = 0;
+        for (size_t i = 0; i < CRC32C_LANE; i += 8) {
+            uint64_t word0, word1, word2;
+            memcpy(&word0, data + i, sizeof(word0));
+            memcpy(&word1, data + CRC32C_LANE + i, sizeof(word1));
+            memcpy(&word2, data + 2 * CRC32C_LANE + i, sizeof(word2));
+            crc64 = _mm_crc32_u64(crc64, word0);
+            crc1 = _mm_crc32_u64(crc1, word1);
+            crc2 = _mm_crc32_u64(crc2, word2);
+        }
+        crc64 = crc32c_shift_lane((uint32_t)crc64) ^ crc1;
+        crc64 = crc32c_shift_lane((uint32_t)crc64) ^ crc2;
+    }
+    for (; length >= 8; data += 8, length -= 8) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = (uint32_t)crc64;
+    for (; length > 0; data++, length--) {
+        crc = _mm_crc32_u8(crc, *data);
+    }
+    return crc;
+}
+#endif
+
+/**
+ * Build the tables and select the implementation (see crc32c_init).
+ */
+static void crc32c_setup(void) {
+    for (uint32_t byte = 0; byte < 256; byte++) {
+        uint32_t crc = byte;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ ((crc & 1) ? CRC32C_POLYNOMIAL : 0);
+        }
+        crc32c_table[0][byte] = crc;
+    }
+    for (size_t byte = 0; byte < 256; byte++) {
+        for (size_t slice = 1; slice < 8; slice++) {
+            uint32_t previous = crc32c_table[slice - 1][byte];
+            crc32c_table[slice][byte] =
+                (previous >> 8) ^ crc32c_table[0][previous & 0xff];
+        }
+    }
+
+    crc32c_shift_tables(crc32c_lane_shift, CRC32C_LANE);
+
+    crc32c_update = crc32c_update_scalar;
+    crc32c_name = "scalar (slicing-by-8)";
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) {
+        crc32c_update = crc32c_update_sse42;
+        crc32c_name = "sse4.2";
+    }
+#endif
+}
+
+/**
+ * Select the fastest implementation supported by the CPU.
+ *
+ * Can be called any number of times (and must be called before the other
+ * crc32c functions).
+ */
+void crc32c_init(void) { pthread_once(&crc32c_once, crc32c_setup); }
+
+/**
+ * Compute the CRC32C of some bytes, continuing from a previous CRC.
+ *
+ * Input:
+ *   - crc: the CRC of the preceding bytes (0 to start)
+ *   - data: the bytes
+ *   - length: number of bytes
+ *
+ * Returns the CRC of the preceding bytes followed by data.
+ */
+uint32_t crc32c(uint32_t crc, void const *data, size_t length) {
+    return ~crc32c_update(~crc, data, length);
+}
+
+/**
+ * Compute a CRC32C like crc32c, but always with the table-driven loop.
+ */
+uint32_t crc32c_scalar(uint32_t crc, void const *data, size_t length) {
+    return ~crc32c_update_scalar(~crc, data, length);
+}
+
+/**
+ * Name the implementation selected by crc32c_init.
+ */
+char const *crc32c_implementation(void) { return crc32c_name; }
@@ -0,0 +1,12 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+void crc32c_init(void);
+uint32_t crc32c(uint32_t crc, void const *data, size_t length);
+uint32_t crc32c_scalar(uint32_t crc, void const *data, size_t length);
+char const *crc32c_implementation(void);
+
+#endif // CRC32C_H
@@ -0,0 +1,154 @@
+#include "dcache.h"
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Directory entry cache
+ *
+ * Maps (directory inumber, name) to the inumber of the sub file, or to -1 if
+ * the directory is known not to contain that name (negative entry). Lookups
+ * hitting the cache do not access the directory at all.
+ *
+ * The cache is direct mapped and each slot is protected by a sequence lock:
+ * writers make the sequence number odd while they update the slot, and readers
+ * retry (or give up) if the sequence number was odd or changed while they were
+ * copying the slot, so readers never take a lock nor write to shared memory.
+ *
+ * The cache is kept coherent by its callers: updates are made with the lock of
+ * the directory held (in write mode when the directory changes, in read mode
+ * when filling the cache after a miss), so a stale mapping can never be stored
+ * after a newer one.
+ */
+
+#define NAME_WORDS ((MAX_FILE_NAME + sizeof(uint64_t) - 1) / sizeof(uint64_t))
+
+// Number of times a reader retries a slot being concurrently written
+#define READ_RETRIES (4)
+
+typedef struct {
+    atomic_uint seq;
+    atomic_int dir_inumber; // -1 if the slot is unused
+    atomic_int sub_inumber; // -1 for negative entries
+    _Atomic uint64_t name[NAME_WORDS];
+} dcache_slot_t;
+
+static dcache_slot_t dcache[DCACHE_SLOTS];
+
+/**
+ * Pack a file name into zero-padded words.
+ *
+ * Input:
+ *   - sub_name: the file name
+ *   - words: destination buffer
+ */
+static void pack_name(char const *sub_name, uint64_t words[NAME_WORDS]) {
+    char buffer[NAME_WORDS * sizeof(uint64_t)] = {0};
+    strncpy(buffer, sub_name, MAX_FILE_NAME - 1);
+    memcpy(words, buffer, sizeof(buffer));
+}
+
+/**
+ * Find the slot for a key.
+ *
+ * Input:
+ *   - dir_inumber: directory inumber
+ *   - words: the packed file name
+ */
+static dcache_slot_t *slot_for(int dir_inumber, uint64_t const *words) {
+    uint64_t hash = (uint64_t)dir_inumber * 0x9e3779b97f4a7c15u;
+    for (size_t i = 0; i < NAME_WORDS; i++) {
+        hash = (hash ^ words[i]) * 0x100000001b3u;
+    }
+    hash ^= hash >> 29;
+    return &dcache[hash % DCACHE_SLOTS];
+}
+
+/**
+ * Empty the cache.
+ *
+ * Must not be called concurrently with other cache operations.
+ */
+void dcache_init(void) {
+    for (size_t i = 0; i < DCACHE_SLOTS; i++) {
+        atomic_store(&dcache[i].seq, 0);
+        atomic_store(&dcache[i].dir_inumber, -1);
+    }
+}
+
+/**
+ * Look up a name in the cache.
+ *
+ * Input:
+ *   - dir_inumber: directory inumber
+ *   - sub_name: sub file name
+ *   - sub_inumber: set to the cached inumber (-1 if the name is known not to
+ *     exist) on a hit
+ *
+ * Returns true on a hit, false on a miss.
+ */
+bool dcache_lookup(int dir_inumber, char const *sub_name, int *sub_inumber) {
+    if (strnlen(sub_name, MAX_FILE_NAME) == MAX_FILE_NAME) {
+        return false; // not a valid file name
+    }
+
+    uint64_t words[NAME_WORDS];
+    pack_name(sub_name, words);
+    dcache_slot_t *slot = slot_for(dir_inumber, words);
+
+    for (int retry = 0; retry < READ_RETRIES; retry++) {
+        unsigned int seq = atomic_load(&slot->seq);
+        if (seq & 1) {
+            continue; // being written
+        }
+
+        bool match = atomic_load(&slot->dir_inumber) == dir_inumber;
+        for (size_t i = 0; match && i < NAME_WORDS; i++) {
+            match = atomic_load(&slot->name[i]) == words[i];
+        }
+        int inumber = atomic_load(&slot->sub_inumber);
+
+        if (atomic_load(&slot->seq) == seq) {
+            if (match) {
+                *sub_inumber = inumber;
+            }
+            return match;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Store the mapping of a name in the cache (replacing whatever the slot held).
+ *
+ * Must be called with the lock of the directory held, and with a valid file
+ * name.
+ *
+ * Input:
+ *   - dir_inumber: directory inumber
+ *   - sub_name: sub file name
+ *   - sub_inumber: inumber of the sub file, -1 if it does not exist
+ */
+void dcache_update(int dir_inumber, char const *sub_name, int sub_inumber) {
+    uint64_t words[NAME_WORDS];
+    pack_name(sub_name, words);
+    dcache_slot_t *slot = slot_for(dir_inumber, words);
+
+    // Take the slot by making its sequence number odd
+    unsigned int seq = atomic_load(&slot->seq);
+    do {
+        while (seq & 1) {
+            seq = atomic_load(&slot->seq);
+        }
+    } while (!atomic_compare_exchange_weak(&slot->seq, &seq, seq + 1));
+
+    atomic_store(&slot->dir_inumber, dir_inumber);
+    for (size_t i = 0; i < NAME_WORDS; i++) {
+        atomic_store(&slot->name[i], words[i]);
+    }
+    atomic_store(&slot->sub_inumber, sub_inumber);
+
+    atomic_store(&slot->seq, seq + 2);
+}
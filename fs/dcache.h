@@ -0,0 +1,13 @@
+#ifndef DCACHE_H
+#define DCACHE_H
+
+#include "config.h"
+
+#include <stdbool.h>
+
+void dcache_init(void);
+
+bool dcache_lookup(int dir_inumber, char const *sub_name, int *sub_inumber);
+void dcache_update(int dir_inumber, char const *sub_name, int sub_inumber);
+
+#endif // DCACHE_H
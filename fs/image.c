@@ -0,0 +1,224 @@
+#define _DEFAULT_SOURCE // for MAP_ANONYMOUS
+#include "image.h"
+#include "bitmap.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define IMAGE_MAGIC (0x49534654u) // "TFSI"
+#define IMAGE_VERSION (4)
+
+/**
+ * Round an offset up to a multiple of the page size.
+ *
+ * Input:
+ *   - offset: the offset
+ */
+static uint64_t page_align(uint64_t offset) {
+    uint64_t page = (uint64_t)sysconf(_SC_PAGESIZE);
+    return (offset + page - 1) / page * page;
+}
+
+/**
+ * Compute the offsets of the regions of an image (and its size) from its
+ * geometry.
+ *
+ * Input:
+ *   - superblock: superblock with the geometry fields filled in
+ */
+static void image_layout(superblock_t *superblock) {
+    superblock->s_inode_table = page_align(sizeof(superblock_t));
+    superblock->s_inode_bitmap =
+        page_align(superblock->s_inode_table +
+                   superblock->s_inode_count * superblock->s_inode_size);
+    superblock->s_block_bitmap =
+        page_align(superblock->s_inode_bitmap +
+                   bitmap_words_size(superblock->s_inode_count));
+    superblock->s_block_checksums =
+        page_align(superblock->s_block_bitmap +
+                   bitmap_words_size(superblock->s_block_count));
+    superblock->s_data =
+        page_align(superblock->s_block_checksums +
+                   superblock->s_block_count * sizeof(uint32_t));
+    superblock->s_size =
+        page_align(superblock->s_data +
+                   superblock->s_block_count * superblock->s_block_size);
+}
+
+/**
+ * Check whether the superblock of an existing image is valid and describes
+ * the expected geometry and layout.
+ *
+ * Input:
+ *   - superblock: the superblock read from the image
+ *   - expected: the expected superblock
+ */
+static bool image_valid(superblock_t const *superblock,
+                        superblock_t const *expected) {
+    return superblock->s_magic == IMAGE_MAGIC &&
+           superblock->s_version == IMAGE_VERSION &&
+           superblock->s_inode_size == expected->s_inode_size &&
+           superblock->s_inode_count == expected->s_inode_count &&
+           superblock->s_block_count == expected->s_block_count &&
+           superblock->s_block_size == expected->s_block_size &&
+           superblock->s_inode_table == expected->s_inode_table &&
+           superblock->s_inode_bitmap == expected->s_inode_bitmap &&
+           superblock->s_block_bitmap == expected->s_block_bitmap &&
+           superblock->s_block_checksums == expected->s_block_checksums &&
+           superblock->s_data == expected->s_data &&
+           superblock->s_size == expected->s_size;
+}
+
+/**
+ * Map an FS image in memory, creating it if needed.
+ *
+ * Image files are mapped privately: changes made in memory only reach the
+ * file when they are written back with image_write_back (see journal.c).
+ * image->unclean is set if an existing image was not closed cleanly (its
+ * superblock is marked as not clean while it is open).
+ *
+ * Input:
+ *   - image: the image
+ *   - path: path of the image file (in the OS' file system), or NULL to keep
+ *     the image in memory only
+ *   - geometry: superblock with the geometry fields filled in (s_inode_size,
+ *     s_inode_count, s_block_count and s_block_size)
+ *   - created: set to whether the image is new (and must be initialized by
+ *     the caller, as it is filled with zeros)
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - The image file cannot be opened, resized or mapped.
+ *   - The image file exists but is not a valid image, or has a different
+ *     geometry.
+ */
+int image_open(image_t *image, char const *path, superblock_t const *geometry,
+               bool *created) {
+    superblock_t expected = *geometry;
+    expected.s_magic = IMAGE_MAGIC;
+    expected.s_version = IMAGE_VERSION;
+    expected.s_clean = 0;
+    image_layout(&expected);
+
+    image->size = expected.s_size;
+    image->fd = -1;
+
+    void *base;
+    if (path == NULL) {
+        base = mmap(NULL, image->size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED) {
+            return -1;
+        }
+        *created = true;
+    } else {
+        image->fd = open(path, O_RDWR | O_CREAT, 0644);
+        if (image->fd == -1) {
+            return -1;
+        }
+
+        struct stat status;
+        if (fstat(image->fd, &status) == -1) {
+            close(image->fd);
+            return -1;
+        }
+        *created = status.st_size == 0;
+
+        if ((*created && ftruncate(image->fd, (off_t)image->size) == -1) ||
+            (!*created && (uint64_t)status.st_size != image->size)) {
+            close(image->fd);
+            return -1; // cannot be resized, or not of the expected size
+        }
+
+        base = mmap(NULL, image->size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                    image->fd, 0);
+        if (base == MAP_FAILED) {
+            close(image->fd);
+            return -1;
+        }
+    }
+
+    image->base = base;
+    image->superblock = base;
+
+    // The superblock is written last when an image is created, so an image
+    // whose creation was interrupted is still all zeros
+    if (!*created && image->superblock->s_magic == 0) {
+        *created = true;
+    }
+
+    if (*created) {
+        *image->superblock = expected;
+    } else if (!image_valid(image->superblock, &expected)) {
+        munmap(image->base, image->size);
+        close(image->fd);
+        return -1;
+    }
+
+    // Until it is closed, the image may not be consistent
+    image->unclean = !*created && image->superblock->s_clean == 0;
+    image->superblock->s_clean = 0;
+
+    return 0;
+}
+
+/**
+ * Write a range of an FS image back to its file.
+ *
+ * Input:
+ *   - image: the image (which must be backed by a file)
+ *   - offset: the offset of the range
+ *   - length: the length of the range
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int image_write_back(image_t const *image, size_t offset, size_t length) {
+    while (length > 0) {
+        ssize_t written =
+            pwrite(image->fd, image->base + offset, length, (off_t)offset);
+        if (written <= 0) {
+            return -1;
+        }
+        offset += (size_t)written;
+        length -= (size_t)written;
+    }
+    return 0;
+}
+
+/**
+ * Wait until everything written back to the file of an FS image is stable.
+ *
+ * Input:
+ *   - image: the image (which must be backed by a file)
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int image_sync(image_t const *image) { return fsync(image->fd); }
+
+/**
+ * Unmap an FS image (changes that were not written back are lost).
+ *
+ * Input:
+ *   - image: the image
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int image_close(image_t *image) {
+    int result = 0;
+
+    if (image->fd != -1 && close(image->fd) == -1) {
+        result = -1;
+    }
+    if (munmap(image->base, image->size) == -1) {
+        result = -1;
+    }
+
+    image->base = NULL;
+    image->superblock = NULL;
+    image->fd = -1;
+
+    return result;
+}
@@ -0,0 +1,50 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Superblock (at the start of the FS image)
+ *
+ * Describes the geometry of the FS and where each region of the image starts
+ * (offsets are page aligned).
+ */
+typedef struct {
+    uint32_t s_magic;
+    uint32_t s_version;
+    uint32_t s_clean;      // 1 if the image was closed cleanly
+    uint32_t s_inode_size; // sizeof(inode_t) when the image was created
+    uint32_t s_shared;     // 1 if data blocks may be held by several files
+    uint32_t s_reserved;   // (zero)
+    uint64_t s_inode_count;
+    uint64_t s_block_count;
+    uint64_t s_block_size;
+
+    uint64_t s_inode_table;     // offset of the inode table
+    uint64_t s_inode_bitmap;    // offset of the inode bitmap words
+    uint64_t s_block_bitmap;    // offset of the data block bitmap words
+    uint64_t s_block_checksums; // offset of the data block checksums
+    uint64_t s_data;            // offset of the data blocks
+    uint64_t s_size;            // size of the image
+} superblock_t;
+
+/**
+ * FS image, mapped in memory
+ */
+typedef struct {
+    char *base;
+    size_t size;
+    int fd; // -1 if the image is only kept in memory
+    superblock_t *superblock;
+    bool unclean; // the image was loaded without having been closed cleanly
+} image_t;
+
+int image_open(image_t *image, char const *path, superblock_t const *geometry,
+               bool *created);
+int image_write_back(image_t const *image, size_t offset, size_t length);
+int image_sync(image_t const *image);
+int image_close(image_t *image);
+
+#endif // IMAGE_H
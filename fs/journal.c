@@ -0,0 +1,823 @@
+#include "journal.h"
+#include "bcache.h"
+#include "betterassert.h"
+#include "config.h"
+#include "crc32c.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * Metadata journal
+ *
+ * Image files are mapped privately, so changes to the FS only reach the file
+ * when they are written back here. Every change to metadata (inodes, bitmap
+ * words, directory entries, extent blocks and symbolic link targets) is logged
+ * as a redo record with the new contents of the changed bytes, copied while
+ * the lock that protects them is held, so records are appended to the log in
+ * the order the changes were made. An operation returns once the log is in the
+ * journal file up to its last record (commit).
+ *
+ * Commits are grouped: the first thread to commit becomes the leader and
+ * writes every record appended so far as a single batch, followed by a single
+ * sync, while threads that commit meanwhile wait for the next batch (which
+ * covers them all).
+ *
+ * Once the journal grows past JOURNAL_CHECKPOINT_SIZE, and when the FS is
+ * destroyed, it is checkpointed: with no operation running, the pages of the
+ * image changed since the previous checkpoint are written back to the image
+ * file, and the journal is emptied.
+ *
+ * If a batch or a checkpoint cannot be written (e.g., the disk is full), the
+ * journal fails: the operations waiting for their records to be committed
+ * fail, and no new ones can start (the image is left as the valid batches of
+ * the journal describe it).
+ *
+ * When an image is loaded, the valid batches of its journal are applied to it
+ * first (a batch torn by a crash fails its checksum, and is ignored along with
+ * anything after it). As a batch may also hold records of operations that
+ * were still running, operations make their changes in an order that never
+ * leaves references to freed inodes or blocks behind (e.g., a new inode is
+ * initialized before it is added to a directory): at worst, an interrupted
+ * operation leaves an inode or some data blocks taken but unused, which are
+ * freed when the allocation bitmaps of an image that was not closed cleanly
+ * are rebuilt (see state_init). File data is not journaled, so data written
+ * since the last checkpoint may be lost in a crash.
+ */
+
+#define JOURNAL_MAGIC (0x4c4a4654u) // "TFJL"
+
+/**
+ * Batch of records, as written to the journal file
+ *
+ * The checksum covers the header (with b_checksum set to 0) and the records.
+ */
+typedef struct {
+    uint32_t b_magic;
+    uint32_t b_checksum;
+    uint64_t b_sequence; // 1 for the first batch after a checkpoint
+    uint64_t b_length;   // length of the records that follow
+} journal_batch_t;
+
+/**
+ * Redo record: the new contents of a range of the image follow it (padded to
+ * a multiple of 8 bytes)
+ */
+typedef struct {
+    uint64_t r_offset;
+    uint64_t r_length;
+} journal_record_t;
+
+/**
+ * Records appended to the log in memory, starting with space for the header
+ * of the batch they will be written in
+ */
+typedef struct {
+    char *data;
+    size_t length;
+    size_t capacity;
+} log_buffer_t;
+
+static bool enabled; // only images backed by a file are journaled
+static image_t const *journal_image;
+static int journal_fd = -1;
+
+// One flag per page of the image, set if it changed since the last checkpoint
+static size_t page_size;
+static atomic_uchar *dirty_pages;
+
+// Held (shared) by running operations, and (exclusive) by checkpoints and
+// while the FS is frozen (operations are tracked even if nothing is journaled)
+static pthread_rwlock_t operations_lock;
+
+// The log (records are numbered from 1, in the order they were appended)
+static pthread_mutex_t log_mutex;
+static pthread_cond_t log_written;
+static log_buffer_t pending; // records not written yet
+static log_buffer_t spare;   // buffer of the last batch written, for reuse
+static uint64_t appended;    // last record appended
+static uint64_t durable;     // last record in the journal file
+static bool writing;         // whether a leader is writing a batch
+static atomic_bool failed;   // whether a batch or a checkpoint failed
+static uint64_t batch_sequence;
+static size_t journal_size; // bytes in the journal file
+
+// Operation being run by the calling thread
+static _Thread_local int operation_depth;
+static _Thread_local uint64_t operation_record; // its last record (0 if none)
+
+/**
+ * Build the path of the journal of an image (the image path with ".journal"
+ * appended).
+ *
+ * Input:
+ *   - image_path: path of the image file
+ *
+ * Returns the path (to be freed by the caller), or NULL if malloc fails.
+ */
+static char *journal_path(char const *image_path) {
+    static char const suffix[] = ".journal";
+    size_t length = strlen(image_path);
+
+    char *path = malloc(length + sizeof(suffix));
+    if (path != NULL) {
+        memcpy(path, image_path, length);
+        memcpy(path + length, suffix, sizeof(suffix));
+    }
+    return path;
+}
+
+/**
+ * Write a buffer at a given offset of a file.
+ *
+ * Input:
+ *   - fd: the file
+ *   - buffer: the buffer
+ *   - length: length of the buffer
+ *   - offset: where to write it
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int write_all(int fd, void const *buffer, size_t length, size_t offset) {
+    char const *bytes = buffer;
+    while (length > 0) {
+        ssize_t written = pwrite(fd, bytes, length, (off_t)offset);
+        if (written <= 0) {
+            return -1;
+        }
+        bytes += written;
+        length -= (size_t)written;
+        offset += (size_t)written;
+    }
+    return 0;
+}
+
+/**
+ * Read a buffer from a given offset of a file.
+ *
+ * Input:
+ *   - fd: the file
+ *   - buffer: the buffer
+ *   - length: length of the buffer
+ *   - offset: where to read it from
+ *
+ * Returns 0 if successful, -1 otherwise (including if the file is shorter).
+ */
+static int read_all(int fd, void *buffer, size_t length, size_t offset) {
+    char *bytes = buffer;
+    while (length > 0) {
+        ssize_t count = pread(fd, bytes, length, (off_t)offset);
+        if (count <= 0) {
+            return -1;
+        }
+        bytes += count;
+        length -= (size_t)count;
+        offset += (size_t)count;
+    }
+    return 0;
+}
+
+/**
+ * Apply the records of a batch to an image file.
+ *
+ * Input:
+ *   - records: the records
+ *   - length: length of the records
+ *   - image_fd: the image file
+ *   - image_size: size of the image file
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int batch_apply(char const *records, size_t length, int image_fd,
+                       size_t image_size) {
+    size_t offset = 0;
+    while (offset < length) {
+        journal_record_t record;
+        if (length - offset < sizeof(record)) {
+            return -1; // malformed batch
+        }
+        memcpy(&record, records + offset, sizeof(record));
+        offset += sizeof(record);
+
+        size_t padded = ((size_t)record.r_length + 7) & ~(size_t)7;
+        if (record.r_length > length - offset || padded > length - offset ||
+            record.r_offset > image_size ||
+            record.r_length > image_size - record.r_offset) {
+            return -1; // malformed record
+        }
+        if (write_all(image_fd, records + offset, (size_t)record.r_length,
+                      (size_t)record.r_offset) == -1) {
+            return -1;
+        }
+        offset += padded;
+    }
+    return 0;
+}
+
+/**
+ * Apply the valid batches of a journal to an image file.
+ *
+ * Input:
+ *   - fd: the journal file
+ *   - image_fd: the image file
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int journal_replay(int fd, int image_fd) {
+    struct stat status;
+    struct stat image_status;
+    if (fstat(fd, &status) == -1 || fstat(image_fd, &image_status) == -1) {
+        return -1;
+    }
+
+    size_t size = (size_t)status.st_size;
+    if (size == 0) {
+        return 0; // nothing to apply
+    }
+    char *log = malloc(size);
+    if (log == NULL) {
+        return -1;
+    }
+    if (read_all(fd, log, size, 0) == -1) {
+        free(log);
+        return -1;
+    }
+
+    int result = 0;
+    size_t offset = 0;
+    for (uint64_t sequence = 1;
+         result == 0 && size - offset >= sizeof(journal_batch_t); sequence++) {
+        journal_batch_t batch;
+        memcpy(&batch, log + offset, sizeof(batch));
+        if (batch.b_magic != JOURNAL_MAGIC || batch.b_sequence != sequence ||
+            batch.b_length > size - offset - sizeof(batch)) {
+            break; // end of the log
+        }
+
+        size_t batch_size = sizeof(batch) + (size_t)batch.b_length;
+        batch.b_checksum = 0;
+        uint32_t checksum = crc32c(0, &batch, sizeof(batch));
+        checksum = crc32c(checksum, log + offset + sizeof(batch),
+                          (size_t)batch.b_length);
+        memcpy(&batch, log + offset, sizeof(batch));
+        if (checksum != batch.b_checksum) {
+            break; // torn batch
+        }
+
+        result = batch_apply(log + offset + sizeof(batch),
+                             (size_t)batch.b_length, image_fd,
+                             (size_t)image_status.st_size);
+        offset += batch_size;
+    }
+
+    if (result == 0) {
+        result = fsync(image_fd);
+    }
+    free(log);
+    return result;
+}
+
+/**
+ * Bring an image file up to date with its journal (if any), and empty the
+ * journal.
+ *
+ * Must be called before the image is mapped.
+ *
+ * Input:
+ *   - image_path: path of the image file
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - The journal or the image cannot be read or written.
+ *   - The journal holds records that do not fit in the image.
+ */
+int journal_recover(char const *image_path) {
+    crc32c_init();
+    char *path = journal_path(image_path);
+    if (path == NULL) {
+        return -1;
+    }
+    int fd = open(path, O_RDWR);
+    free(path);
+    if (fd == -1) {
+        return errno == ENOENT ? 0 : -1; // no journal
+    }
+
+    // Without an image, there is nothing to apply the journal to
+    int result = 0;
+    int image_fd = open(image_path, O_RDWR);
+    if (image_fd != -1) {
+        result = journal_replay(fd, image_fd);
+        if (close(image_fd) == -1) {
+            result = -1;
+        }
+    } else if (errno != ENOENT) {
+        result = -1;
+    }
+
+    // The journal is only emptied once its records are in the image
+    if (result == 0 && (ftruncate(fd, 0) == -1 || fsync(fd) == -1)) {
+        result = -1;
+    }
+    if (close(fd) == -1) {
+        result = -1;
+    }
+    return result;
+}
+
+/**
+ * Start journaling the changes to an image.
+ *
+ * Input:
+ *   - image: the image (mapped, with journal_recover called before)
+ *   - image_path: path of the image file, or NULL if the image is only kept
+ *     in memory (in which case nothing is journaled)
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - The journal file cannot be opened.
+ *   - malloc failure.
+ */
+int journal_init(image_t const *image, char const *image_path) {
+    enabled = false;
+    rwlock_init(&operations_lock);
+    journal_image = image; // (changes go through the buffer cache regardless)
+    if (image_path == NULL) {
+        return 0;
+    }
+
+    char *path = journal_path(image_path);
+    if (path == NULL) {
+        return -1;
+    }
+    journal_fd = open(path, O_WRONLY | O_CREAT, 0644);
+    free(path);
+    if (journal_fd == -1) {
+        rwlock_destroy(&operations_lock);
+        return -1;
+    }
+
+    page_size = (size_t)sysconf(_SC_PAGESIZE);
+    dirty_pages = calloc(image->size / page_size, sizeof(atomic_uchar));
+    if (dirty_pages == NULL) {
+        close(journal_fd);
+        rwlock_destroy(&operations_lock);
+        return -1;
+    }
+
+    mutex_init(&log_mutex);
+    cond_init(&log_written);
+    pending = (log_buffer_t){.data = NULL, .length = 0, .capacity = 0};
+    spare = pending;
+    appended = 0;
+    durable = 0;
+    writing = false;
+    atomic_store(&failed, false);
+    batch_sequence = 0;
+    journal_size = 0; // emptied by journal_recover
+
+    enabled = true;
+    return 0;
+}
+
+/**
+ * Checkpoint and close the journal.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int journal_destroy(void) {
+    if (!enabled) {
+        rwlock_destroy(&operations_lock);
+        journal_image = NULL;
+        return 0;
+    }
+
+    int result = journal_checkpoint();
+    if (close(journal_fd) == -1) {
+        result = -1;
+    }
+
+    rwlock_destroy(&operations_lock);
+    mutex_destroy(&log_mutex);
+    cond_destroy(&log_written);
+    free(pending.data);
+    free(spare.data);
+    free(dirty_pages);
+
+    journal_fd = -1;
+    dirty_pages = NULL;
+    journal_image = NULL;
+    enabled = false;
+
+    return result;
+}
+
+/**
+ * Write a batch to the end of the journal file and wait until it is stable.
+ *
+ * Input:
+ *   - batch: the records (with space for the header at the start)
+ *   - sequence: sequence number of the batch
+ *   - offset: where the batch is written
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int batch_write(log_buffer_t *batch, uint64_t sequence, size_t offset) {
+    journal_batch_t header = {
+        .b_magic = JOURNAL_MAGIC,
+        .b_checksum = 0,
+        .b_sequence = sequence,
+        .b_length = batch->length - sizeof(journal_batch_t),
+    };
+    memcpy(batch->data, &header, sizeof(header));
+    header.b_checksum = crc32c(0, batch->data, batch->length);
+    memcpy(batch->data, &header, sizeof(header));
+
+    if (write_all(journal_fd, batch->data, batch->length, offset) == -1) {
+        return -1;
+    }
+    return fdatasync(journal_fd);
+}
+
+/**
+ * Wait until the log is in the journal file up to a given record, writing it
+ * if no other thread is.
+ *
+ * Input:
+ *   - record: the record
+ *   - full: set to whether the journal should be checkpointed
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - The journal failed (now, or before the record was written).
+ */
+static int journal_commit(uint64_t record, bool *full) {
+    mutex_lock(&log_mutex);
+    while (durable < record && !atomic_load(&failed)) {
+        if (writing) {
+            cond_wait(&log_written, &log_mutex);
+            continue;
+        }
+
+        // Become the leader, and write every record appended so far
+        writing = true;
+        log_buffer_t batch = pending;
+        pending = spare;
+        uint64_t last = appended;
+        uint64_t sequence = ++batch_sequence;
+        size_t offset = journal_size;
+        mutex_unlock(&log_mutex);
+
+        int result = batch_write(&batch, sequence, offset);
+
+        // (the records of a failed batch are dropped, as nothing can be
+        // written after them)
+        mutex_lock(&log_mutex);
+        if (result == 0) {
+            journal_size += batch.length;
+            durable = last;
+        } else {
+            atomic_store(&failed, true);
+        }
+        batch.length = 0;
+        spare = batch;
+        writing = false;
+        cond_broadcast(&log_written);
+    }
+    int result = durable < record ? -1 : 0;
+    *full = journal_size >= JOURNAL_CHECKPOINT_SIZE;
+    mutex_unlock(&log_mutex);
+
+    return result;
+}
+
+/**
+ * Write back the changed pages of the image and empty the journal (the
+ * journal fails if this fails).
+ *
+ * Must be called with no operations running (operations_lock held
+ * exclusively).
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int journal_write_back(void) {
+    // Every change must be in the journal before it reaches the image, so that
+    // an interrupted write back is completed when the image is loaded again
+    mutex_lock(&log_mutex);
+    uint64_t last = appended;
+    mutex_unlock(&log_mutex);
+    bool full;
+    if (journal_commit(last, &full) == -1) {
+        return -1;
+    }
+
+    int result = 0;
+    size_t page_count = journal_image->size / page_size;
+    for (size_t first = 1; first < page_count && result == 0;) {
+        if (!atomic_exchange(&dirty_pages[first], 0)) {
+            first++;
+            continue;
+        }
+
+        // Write runs of changed pages at once
+        size_t end = first + 1;
+        while (end < page_count && atomic_exchange(&dirty_pages[end], 0)) {
+            end++;
+        }
+        result = image_write_back(journal_image, first * page_size,
+                                  (end - first) * page_size);
+        for (size_t i = first; result == -1 && i < end; i++) {
+            atomic_store(&dirty_pages[i], 1);
+        }
+        first = end;
+    }
+
+    // The superblock goes last (see image_open)
+    if (result == 0 && atomic_exchange(&dirty_pages[0], 0)) {
+        if (image_sync(journal_image) == -1 ||
+            image_write_back(journal_image, 0, page_size) == -1) {
+            atomic_store(&dirty_pages[0], 1);
+            result = -1;
+        }
+    }
+    if (result == 0) {
+        result = image_sync(journal_image);
+    }
+
+    if (result == 0) {
+        mutex_lock(&log_mutex);
+        if (ftruncate(journal_fd, 0) == -1 || fsync(journal_fd) == -1) {
+            result = -1;
+        } else {
+            journal_size = 0;
+            batch_sequence = 0;
+        }
+        mutex_unlock(&log_mutex);
+    }
+
+    if (result == -1) {
+        atomic_store(&failed, true);
+    }
+    return result;
+}
+
+/**
+ * Write back every change to the image and empty the journal, waiting for the
+ * running operations to finish.
+ *
+ * Must not be called from within an operation.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int journal_checkpoint(void) {
+    if (!enabled) {
+        return 0;
+    }
+
+    rwlock_writelock(&operations_lock);
+    int result = journal_write_back();
+    rwlock_unlock(&operations_lock);
+
+    return result;
+}
+
+/**
+ * Start an operation: its changes are committed together by journal_end.
+ *
+ * Operations may be nested (only the outermost one commits, and nested ones
+ * always start).
+ *
+ * Returns 0 if successful, -1 otherwise (in which case journal_end must not
+ * be called).
+ *
+ * Possible errors:
+ *   - The journal failed.
+ */
+int journal_begin(void) {
+    if (operation_depth > 0) {
+        operation_depth++;
+        return 0;
+    }
+    if (atomic_load(&failed)) {
+        return -1;
+    }
+
+    operation_depth++;
+    rwlock_readlock(&operations_lock);
+    return 0;
+}
+
+/**
+ * Finish an operation started with journal_begin, waiting until its changes
+ * are committed.
+ *
+ * Returns 0 if successful, -1 otherwise (in which case the changes of the
+ * operation may be lost in a crash, or after journal_destroy).
+ *
+ * Possible errors:
+ *   - The journal failed before the changes were committed.
+ *   - The journal had to be checkpointed, and the checkpoint failed (the
+ *     changes are still in the journal).
+ */
+int journal_end(void) {
+    ALWAYS_ASSERT(operation_depth > 0, "journal_end: no operation running");
+    if (--operation_depth > 0) {
+        return 0;
+    }
+
+    uint64_t record = operation_record;
+    operation_record = 0;
+    rwlock_unlock(&operations_lock);
+
+    if (!enabled || record == 0) {
+        return 0; // nothing changed
+    }
+    bool full;
+    if (journal_commit(record, &full) == -1) {
+        return -1;
+    }
+    if (!full) {
+        return 0;
+    }
+
+    // Checkpoint if no operation is running. Waiting for them could deadlock,
+    // as they may be waiting for a lease held by the calling thread (if this
+    // is not possible, a later operation will try again)
+    int result = 0;
+    if (pthread_rwlock_trywrlock(&operations_lock) == 0) {
+        result = journal_write_back();
+        rwlock_unlock(&operations_lock);
+    }
+    return result;
+}
+
+/**
+ * Freeze the FS: wait for the running operations to finish, and keep new ones
+ * from starting until journal_thaw is called.
+ *
+ * Must not be called from within an operation.
+ *
+ * Returns 0 if successful, -1 otherwise (in which case journal_thaw must not
+ * be called).
+ *
+ * Possible errors:
+ *   - The journal failed.
+ */
+int journal_freeze(void) {
+    rwlock_writelock(&operations_lock);
+    if (atomic_load(&failed)) {
+        rwlock_unlock(&operations_lock);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Let operations run again after journal_freeze.
+ */
+void journal_thaw(void) { rwlock_unlock(&operations_lock); }
+
+/**
+ * Append a record to the log (the journal fails if the log cannot grow).
+ *
+ * Must be called with log_mutex held.
+ *
+ * Input:
+ *   - offset: offset of the changed range in the image
+ *   - data: the new contents of the range
+ *   - length: length of the range
+ */
+static void log_append(size_t offset, void const *data, size_t length) {
+    size_t padded = (length + 7) & ~(size_t)7;
+    size_t needed = sizeof(journal_record_t) + padded;
+    if (pending.length == 0) {
+        needed += sizeof(journal_batch_t);
+    }
+
+    if (pending.capacity - pending.length < needed) {
+        size_t capacity = pending.capacity * 2;
+        if (capacity < pending.length + needed) {
+            capacity = pending.length + needed;
+        }
+        char *grown = realloc(pending.data, capacity);
+        if (grown == NULL) {
+            // The record is dropped, so nothing can be committed after it
+            // (the operation fails when it commits)
+            atomic_store(&failed, true);
+            appended++;
+            if (operation_depth > 0) {
+                operation_record = appended;
+            }
+            return;
+        }
+        pending.data = grown;
+        pending.capacity = capacity;
+    }
+
+    if (pending.length == 0) {
+        pending.length = sizeof(journal_batch_t); // filled in by batch_write
+    }
+
+    journal_record_t record = {.r_offset = offset, .r_length = length};
+    char *end = pending.data + pending.length;
+    memcpy(end, &record, sizeof(record));
+    memcpy(end + sizeof(record), data, length);
+    memset(end + sizeof(record) + length, 0, padded - length);
+    pending.length += sizeof(record) + padded;
+
+    // Records made outside of operations are committed by checkpoints
+    appended++;
+    if (operation_depth > 0) {
+        operation_record = appended;
+    }
+}
+
+/**
+ * Log the new contents of a range of the image.
+ *
+ * Must be called right after changing the range, with the lock that protects
+ * it still held.
+ *
+ * Input:
+ *   - address: start of the range (within the image)
+ *   - length: length of the range
+ */
+void journal_log(void const *address, size_t length) {
+    if (!enabled) {
+        journal_dirty(address, length); // (through the buffer cache)
+        return;
+    }
+
+    char const *start = address;
+    ALWAYS_ASSERT(start >= journal_image->base &&
+                      start + length <= journal_image->base +
+                                            journal_image->size,
+                  "journal_log: range must be within the image");
+
+    mutex_lock(&log_mutex);
+    log_append((size_t)(start - journal_image->base), address, length);
+    mutex_unlock(&log_mutex);
+
+    journal_dirty(address, length);
+}
+
+/**
+ * Log the new value of a bitmap word that is updated atomically (without a
+ * lock).
+ *
+ * The value is read when the record is appended, so the last record of a
+ * word always holds its latest value.
+ *
+ * Input:
+ *   - word: the word (within the image)
+ */
+void journal_log_word(_Atomic uint64_t *word) {
+    if (!enabled) {
+        journal_dirty((void const *)word, sizeof(*word));
+        return;
+    }
+
+    mutex_lock(&log_mutex);
+    uint64_t value = atomic_load(word);
+    log_append((size_t)((char const *)word - journal_image->base), &value,
+               sizeof(value));
+    mutex_unlock(&log_mutex);
+
+    journal_dirty((void const *)word, sizeof(value));
+}
+
+/**
+ * Record that a range of the image changed (without logging it, as for file
+ * data), so that it is written back by the next checkpoint, and by the buffer
+ * cache.
+ *
+ * Input:
+ *   - address: start of the range (within the image)
+ *   - length: length of the range
+ */
+void journal_dirty(void const *address, size_t length) {
+    if (journal_image == NULL || length == 0) {
+        return;
+    }
+
+    size_t offset = (size_t)((char const *)address - journal_image->base);
+    bcache_write(offset, length);
+    if (!enabled) {
+        return;
+    }
+
+    for (size_t page = offset / page_size;
+         page <= (offset + length - 1) / page_size; page++) {
+        atomic_store(&dirty_pages[page], 1);
+    }
+}
@@ -0,0 +1,25 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include "image.h"
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+int journal_recover(char const *image_path);
+int journal_init(image_t const *image, char const *image_path);
+int journal_destroy(void);
+
+int journal_begin(void);
+int journal_end(void);
+int journal_freeze(void);
+void journal_thaw(void);
+
+void journal_log(void const *address, size_t length);
+void journal_log_word(_Atomic uint64_t *word);
+void journal_dirty(void const *address, size_t length);
+
+int journal_checkpoint(void);
+
+#endif // JOURNAL_H
@@ -0,0 +1,255 @@
+#include "lz.h"
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * LZ77 codec (in the format of LZ4 blocks)
+ *
+ * The compressed data is a sequence of sequences, each made of a token byte
+ * (literal count in the high nibble, match length - LZ_MIN_MATCH in the low
+ * one, 15 meaning that more length bytes follow), the literals, and the match:
+ * a 2-byte little-endian offset back into the output, and more length bytes
+ * if needed. The last sequence only has literals.
+ *
+ * Matches are found with a single hash table of recent positions, which makes
+ * compression fast rather than thorough.
+ */
+#define LZ_MIN_MATCH (4)
+#define LZ_LAST_LITERALS (5) // the data always ends with literals
+#define LZ_MATCH_LIMIT (12)  // no match starts this close to the end
+#define LZ_MAX_OFFSET (65535)
+#define LZ_HASH_BITS (12)
+
+static uint32_t read32(unsigned char const *bytes) {
+    uint32_t value;
+    memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+static uint32_t lz_hash(uint32_t value) {
+    return (value * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/**
+ * Write a length that did not fit in a token nibble.
+ *
+ * Input:
+ *   - output: where to write it (advanced past what is written)
+ *   - end: end of the output buffer
+ *   - length: the length minus 15
+ *
+ * Returns 0 if successful, -1 if it does not fit.
+ */
+static int write_length(unsigned char **output, unsigned char const *end,
+                        size_t length) {
+    unsigned char *op = *output;
+    for (; length >= 255; length -= 255) {
+        if (op == end) {
+            return -1;
+        }
+        *op++ = 255;
+    }
+    if (op == end) {
+        return -1;
+    }
+    *op++ = (unsigned char)length;
+    *output = op;
+    return 0;
+}
+
+/**
+ * Write a sequence.
+ *
+ * Input:
+ *   - output: where to write it (advanced past what is written)
+ *   - end: end of the output buffer
+ *   - literals: the literals
+ *   - literal_count: number of literals
+ *   - offset: the offset of the match (0 for the last sequence)
+ *   - match_length: the length of the match
+ *
+ * Returns 0 if successful, -1 if it does not fit.
+ */
+static int write_sequence(unsigned char **output, unsigned char const *end,
+                          unsigned char const *literals, size_t literal_count,
+                          size_t offset, size_t match_length) {
+    unsigned char *op = *output;
+    if (op == end) {
+        return -1;
+    }
+
+    size_t match_code = offset == 0 ? 0 : match_length - LZ_MIN_MATCH;
+    unsigned char *token = op++;
+    *token = (unsigned char)(((literal_count < 15 ? literal_count : 15) << 4) |
+                             (match_code < 15 ? match_code : 15));
+    if (literal_count >= 15 && write_length(&op, end, literal_count - 15)) {
+        return -1;
+    }
+    if ((size_t)(end - op) < literal_count) {
+        return -1;
+    }
+    memcpy(op, literals, literal_count);
+    op += literal_count;
+
+    if (offset != 0) {
+        if (end - op < 2) {
+            return -1;
+        }
+        *op++ = (unsigned char)(offset & 0xff);
+        *op++ = (unsigned char)(offset >> 8);
+        if (match_code >= 15 && write_length(&op, end, match_code - 15)) {
+            return -1;
+        }
+    }
+
+    *output = op;
+    return 0;
+}
+
+/**
+ * Compress some bytes.
+ *
+ * Input:
+ *   - source: the bytes
+ *   - length: number of bytes
+ *   - destination: where to store the compressed bytes
+ *   - capacity: size of destination
+ *
+ * Returns the number of compressed bytes, or 0 if they do not fit in capacity
+ * (in which case the bytes are better kept uncompressed).
+ */
+size_t lz_compress(void const *source, size_t length, void *destination,
+                   size_t capacity) {
+    unsigned char const *src = source;
+    unsigned char *op = destination;
+    unsigned char const *end = op + capacity;
+
+    // Positions (plus one, 0 meaning none) of the last bytes with each hash
+    uint32_t table[1 << LZ_HASH_BITS];
+    memset(table, 0, sizeof(table));
+
+    size_t anchor = 0; // first byte not yet written
+    size_t position = 0;
+    while (position + LZ_MATCH_LIMIT <= length) {
+        uint32_t value = read32(src + position);
+        uint32_t hash = lz_hash(value);
+        size_t candidate = table[hash];
+        table[hash] = (uint32_t)(position + 1);
+
+        if (candidate == 0 || position - (candidate - 1) > LZ_MAX_OFFSET ||
+            read32(src + candidate - 1) != value) {
+            position++;
+            continue;
+        }
+        size_t match = candidate - 1;
+
+        size_t match_length = LZ_MIN_MATCH;
+        while (position + match_length < length - LZ_LAST_LITERALS &&
+               src[match + match_length] == src[position + match_length]) {
+            match_length++;
+        }
+
+        if (write_sequence(&op, end, src + anchor, position - anchor,
+                           position - match, match_length) == -1) {
+            return 0;
+        }
+        position += match_length;
+        anchor = position;
+    }
+
+    if (write_sequence(&op, end, src + anchor, length - anchor, 0, 0) == -1) {
+        return 0;
+    }
+    return (size_t)(op - (unsigned char *)destination);
+}
+
+/**
+ * Read a length that did not fit in a token nibble.
+ *
+ * Input:
+ *   - input: where to read it from (advanced past what is read)
+ *   - end: end of the input buffer
+ *   - length: the length so far (15), to which the rest is added
+ *
+ * Returns 0 if successful, -1 if the input ends first.
+ */
+static int read_length(unsigned char const **input, unsigned char const *end,
+                       size_t *length) {
+    unsigned char const *ip = *input;
+    unsigned char byte;
+    do {
+        if (ip == end) {
+            return -1;
+        }
+        byte = *ip++;
+        *length += byte;
+    } while (byte == 255);
+    *input = ip;
+    return 0;
+}
+
+/**
+ * Decompress bytes compressed with lz_compress.
+ *
+ * Input:
+ *   - source: the compressed bytes
+ *   - length: number of compressed bytes
+ *   - destination: where to store the decompressed bytes
+ *   - capacity: size of destination
+ *
+ * Returns the number of decompressed bytes, or -1 if the compressed bytes are
+ * malformed or do not fit in capacity.
+ */
+ssize_t lz_decompress(void const *source, size_t length, void *destination,
+                      size_t capacity) {
+    unsigned char const *ip = source;
+    unsigned char const *input_end = ip + length;
+    unsigned char *output = destination;
+    size_t position = 0;
+
+    while (ip < input_end) {
+        unsigned char token = *ip++;
+
+        size_t literal_count = token >> 4;
+        if (literal_count == 15 &&
+            read_length(&ip, input_end, &literal_count) == -1) {
+            return -1;
+        }
+        if ((size_t)(input_end - ip) < literal_count ||
+            capacity - position < literal_count) {
+            return -1;
+        }
+        memcpy(output + position, ip, literal_count);
+        ip += literal_count;
+        position += literal_count;
+
+        if (ip == input_end) {
+            break; // last sequence
+        }
+
+        if (input_end - ip < 2) {
+            return -1;
+        }
+        size_t offset = (size_t)ip[0] | ((size_t)ip[1] << 8);
+        ip += 2;
+        size_t match_length = token & 0xf;
+        if (match_length == 15 &&
+            read_length(&ip, input_end, &match_length) == -1) {
+            return -1;
+        }
+        match_length += LZ_MIN_MATCH;
+        if (offset == 0 || offset > position ||
+            capacity - position < match_length) {
+            return -1;
+        }
+
+        // Matches may overlap what they produce
+        for (size_t i = 0; i < match_length; i++) {
+            output[position + i] = output[position - offset + i];
+        }
+        position += match_length;
+    }
+
+    return (ssize_t)position;
+}
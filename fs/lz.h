@@ -0,0 +1,12 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+size_t lz_compress(void const *source, size_t length, void *destination,
+                   size_t capacity);
+ssize_t lz_decompress(void const *source, size_t length, void *destination,
+                      size_t capacity);
+
+#endif // LZ_H
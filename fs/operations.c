@@ -1,15 +1,24 @@
 #include "operations.h"
 #include "config.h"
+#include "journal.h"
 #include "state.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "betterassert.h"
 #include "pthread.h"
-
-static pthread_mutex_t tfs_open_mutex;
+#include "utils.h"
 
 tfs_params tfs_default_params() {
     tfs_params params = {
@@ -17,6 +26,8 @@ tfs_params tfs_default_params() {
         .max_block_count = 1024,
         .max_open_files_count = 16,
         .block_size = 1024,
+        .image_path = NULL,
+        .dedup = false,
     };
     return params;
 }
@@ -30,15 +41,15 @@ int tfs_init(tfs_params const *params_ptr) {
         params = tfs_default_params();
     }
 
-    if (state_init(params) != 0) {
+    bool created;
+    if (state_init(params, &created) != 0) {
         return -1;
     }
 
-    pthread_mutex_init(&tfs_open_mutex, NULL);
-
-    // create root inode
-    int root = inode_create(T_DIRECTORY);
-    if (root != ROOT_DIR_INUM) {
+    // create root inode (unless an existing image was loaded), and write the
+    // new image back
+    if (created && (inode_create(T_DIRECTORY) != ROOT_DIR_INUM ||
+                    journal_checkpoint() == -1)) {
         return -1;
     }
 
@@ -49,7 +60,6 @@ int tfs_destroy() {
     if (state_destroy() != 0) {
         return -1;
     }
-    pthread_mutex_destroy(&tfs_open_mutex);
     return 0;
 }
 
@@ -58,189 +68,368 @@ static bool valid_pathname(char const *name) {
 }
 
 /**
- * Looks for a file.
+ * Copies the next component of a path name.
+ *
+ * Input:
+ *   - path: path name, without the leading '/' characters
+ *   - component: buffer where the component is copied to
+ *
+ * Returns a pointer to the rest of the path (after the component and the '/'
+ * characters that follow it), or NULL if the component is too long.
+ */
+static char const *next_component(char const *path,
+                                  char component[MAX_FILE_NAME]) {
+    size_t len = strcspn(path, "/");
+    if (len > MAX_FILE_NAME - 1) {
+        return NULL;
+    }
+
+    memcpy(component, path, len);
+    component[len] = '\0';
+
+    path += len;
+    while (*path == '/') {
+        path++;
+    }
+    return path;
+}
+
+/**
+ * Looks for the directory that contains a file.
  *
- * Note: as a simplification, only a plain directory space (root directory only)
- * is supported.
+ * Every intermediate component of the path must be a directory. Only the
+ * directory being searched at each step is locked, so lookups in different
+ * subtrees do not contend (and lookups in snapshots take no locks at all).
  *
  * Input:
  *   - name: absolute path name
- *   - root_inode: the root directory inode
- * Returns the inumber of the file, -1 if unsuccessful.
+ *   - sub_name: buffer where the last component of the path is copied to
+ *   - snapshot: the snapshot to look in (acquired), or NO_SNAPSHOT
+ *
+ * Returns the inumber of the parent directory, -1 if unsuccessful.
  */
-static int tfs_lookup(char const *name) {
+static int tfs_lookup_parent(char const *name, char sub_name[MAX_FILE_NAME],
+                             int snapshot) {
     if (!valid_pathname(name)) {
         return -1;
     }
 
-    inode_t *root_inode = inode_get(ROOT_DIR_INUM);
-    ALWAYS_ASSERT(root_inode != NULL, "tfs_open: root dir inode must exist");
+    // skip the initial '/' characters
+    while (*name == '/') {
+        name++;
+    }
+
+    int dir_inum = ROOT_DIR_INUM;
+    while ((name = next_component(name, sub_name)) != NULL) {
+        if (*name == '\0') {
+            // sub_name is the last component
+            return strlen(sub_name) > 0 ? dir_inum : -1;
+        }
 
-    // skip the initial '/' character
-    name++;
+        dir_inum = snapshot == NO_SNAPSHOT
+                       ? dir_lookup(dir_inum, sub_name)
+                       : snapshot_dir_lookup(snapshot, dir_inum, sub_name);
+        if (dir_inum == -1) {
+            return -1;
+        }
+    }
 
-    return find_in_dir(root_inode, name);
+    return -1; // component name too long
 }
 
-int tfs_open(char const *name, tfs_file_mode_t mode) {
+/**
+ * Looks for a file.
+ *
+ * Input:
+ *   - name: absolute path name
+ *   - snapshot: the snapshot to look in (acquired), or NO_SNAPSHOT
+ * Returns the inumber of the file, -1 if unsuccessful.
+ */
+static int tfs_lookup(char const *name, int snapshot) {
+    char sub_name[MAX_FILE_NAME];
+    int dir_inum = tfs_lookup_parent(name, sub_name, snapshot);
+    if (dir_inum == -1) {
+        return -1;
+    }
+
+    return snapshot == NO_SNAPSHOT
+               ? dir_lookup(dir_inum, sub_name)
+               : snapshot_dir_lookup(snapshot, dir_inum, sub_name);
+}
+
+/**
+ * Creates a new file, directory or symbolic link.
+ *
+ * Input:
+ *   - name: absolute path name
+ *   - type: the type of the inode to create
+ *   - target: for symbolic links, the target path name (NULL otherwise)
+ *
+ * Returns the inumber of the new inode, -1 if unsuccessful.
+ *
+ * Possible errors:
+ *   - The parent directory does not exist.
+ *   - A file with the same name already exists.
+ *   - No space in the inode table, the data blocks or the parent directory.
+ */
+static int tfs_create(char const *name, inode_type type, char const *target) {
+    char sub_name[MAX_FILE_NAME];
+    int dir_inum = tfs_lookup_parent(name, sub_name, NO_SNAPSHOT);
+    if (dir_inum == -1) {
+        return -1;
+    }
+
+    inode_t *dir_inode = inode_get(dir_inum);
+    ALWAYS_ASSERT(dir_inode != NULL,
+                  "tfs_create: directories must have an inode");
+
+    int inum = inode_create(type);
+    if (inum == -1) {
+        return -1; // no space in inode table
+    }
+
+    if (target != NULL) {
+        inode_t *link_inode = inode_get(inum);
+        ALWAYS_ASSERT(link_inode != NULL,
+                      "tfs_create: inode of new file deleted");
+
+        // Allocates a data block and copies the target pathname to it
+        if (inode_grow(link_inode, 1) != 1) {
+            inode_delete(inum);
+            return -1; // no space
+        }
+
+        void *block = inode_block_get(link_inode, 0, NULL);
+        ALWAYS_ASSERT(block != NULL,
+                      "tfs_create: data block deleted mid-write");
+        memcpy(block, target, strlen(target) + 1);
+        journal_log(block, strlen(target) + 1);
+    }
+
+    // Add entry in the parent directory (fails if the name is taken)
+    if (add_dir_entry(dir_inode, sub_name, inum) == -1) {
+        inode_delete(inum);
+        return -1;
+    }
+
+    return inum;
+}
+
+/**
+ * Adds a looked up file to the open file table, checking that it was not
+ * unlinked in the meantime.
+ *
+ * Input:
+ *   - path: the path the file was looked up from
+ *   - inum: the inode number found
+ *
+ * Returns the file handle if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - The file was unlinked (or replaced) since it was looked up.
+ *   - No space in open file table for a new open file.
+ */
+static int open_looked_up(char const *path, int inum) {
+    int fhandle = add_to_open_file_table(inum, 0, NO_SNAPSHOT);
+    if (fhandle != -1 && tfs_lookup(path, NO_SNAPSHOT) != inum) {
+        remove_from_open_file_table(fhandle);
+        return -1;
+    }
+    return fhandle;
+}
+
+/**
+ * Opens a file (see tfs_open), as part of a journaled operation.
+ */
+static int open_file(char const *name, tfs_file_mode_t mode) {
     // Checks if the path name is valid
     if (!valid_pathname(name)) {
         return -1;
     }
 
-    pthread_mutex_lock(&tfs_open_mutex);
-    inode_t *root_dir_inode = inode_get(ROOT_DIR_INUM);
-    ALWAYS_ASSERT(root_dir_inode != NULL,
-                  "tfs_open: root dir inode must exist");
+    int inum = tfs_lookup(name, NO_SNAPSHOT);
+    if (inum == -1 && (mode & TFS_O_CREAT)) {
+        // The file does not exist; the mode specified that it should be
+        // created. If another thread creates it first, open that one instead
+        inum = tfs_create(name, T_FILE, NULL);
+        if (inum == -1) {
+            inum = tfs_lookup(name, NO_SNAPSHOT);
+        }
+    }
 
-    // We need to ensure that while we check is the file exists there isn't
-    // another one being created
-    int inum = tfs_lookup(name);
-    size_t offset;
+    if (inum == -1) {
+        return -1;
+    }
 
-    if (inum >= 0) {
-        pthread_mutex_unlock(&tfs_open_mutex);
+    // Holding a handle keeps the inode from being reclaimed, but it may have
+    // been unlinked (and even reused) since it was looked up
+    int fhandle = open_looked_up(name, inum);
+    if (fhandle == -1) {
+        return -1;
+    }
 
-        // The file already exists
-        inode_t *inode = inode_get(inum);
+    inode_t *inode = inode_get(inum);
+    ALWAYS_ASSERT(inode != NULL,
+                  "tfs_open: directory files must have an inode");
+
+    // if we're opening a soft link
+    inode_read_lock(inum);
+    if (inode->i_node_type == T_LINK) {
+        // get (a copy of) the target pahtname to open it
+        char *target = strdup((char *)inode_block_get(inode, 0, NULL));
+        inode_unlock(inum);
+        remove_from_open_file_table(fhandle);
+        if (target == NULL) {
+            return -1;
+        }
+        ALWAYS_ASSERT(valid_pathname(target),
+                      "tfs_open: symlink name must be valid");
+
+        // checks if the file exists
+        inum = tfs_lookup(target, NO_SNAPSHOT);
+        fhandle = inum == -1 ? -1 : open_looked_up(target, inum);
+        free(target);
+        if (fhandle == -1) {
+            return -1;
+        }
+        inode = inode_get(inum);
         ALWAYS_ASSERT(inode != NULL,
                       "tfs_open: directory files must have an inode");
+        inode_read_lock(inum);
+    }
 
-        // if we're opening a soft link
-        if (inode->i_node_type == T_LINK) {
-            pthread_mutex_lock(&tfs_open_mutex);
-            // get the target pahtname to open it
-            char *target = (char *)data_block_get(inode->i_data_block);
-            ALWAYS_ASSERT(valid_pathname(target),
-                          "tfs_open: symlink name must be valid");
-
-            // checks if the file exists
-            int target_inum = tfs_lookup(target);
-            pthread_mutex_unlock(&tfs_open_mutex);
-            if (target_inum == -1) {
-                return -1;
-            }
-            inum = target_inum;
-            inode = inode_get(inum);
-            ALWAYS_ASSERT(inode != NULL,
-                          "tfs_open: directory files must have an inode");
-        }
+    inode_type type = inode->i_node_type;
+    inode_unlock(inum);
+    if (type == T_DIRECTORY) {
+        remove_from_open_file_table(fhandle);
+        return -1; // directories cannot be opened
+    }
 
-        // Truncate (if requested)
+    // Truncate and mark the file as compressed (if requested)
+    if (mode & (TFS_O_TRUNC | TFS_O_COMPRESS)) {
+        inode_write_lock(inum);
+        inode_wait_unpinned(inum);
         if (mode & TFS_O_TRUNC) {
-            if (inode->i_size > 0) {
-                data_block_free(inode->i_data_block);
-                inode->i_size = 0;
-            }
-        }
-        // Determine initial offset
-        if (mode & TFS_O_APPEND) {
-            offset = inode->i_size;
-        } else {
-            offset = 0;
-        }
-    } else if (mode & TFS_O_CREAT) {
-        // The file does not exist; the mode specified that it should be created
-        // Create inode
-        inum = inode_create(T_FILE);
-        if (inum == -1) {
-            pthread_mutex_unlock(&tfs_open_mutex);
-            return -1; // no space in inode table
+            inode_truncate(inode, 0);
+            inode->i_size = 0;
         }
-
-        // Add entry in the root directory
-        if (add_dir_entry(root_dir_inode, name + 1, inum) == -1) {
-            inode_delete(inum);
-            pthread_mutex_unlock(&tfs_open_mutex);
-            return -1; // no space in directory
+        if ((mode & TFS_O_COMPRESS) && inode->i_size == 0) {
+            inode_truncate(inode, 0); // (blocks left by failed writes)
+            inode->i_flags |= INODE_COMPRESSED;
         }
-
-        pthread_mutex_unlock(&tfs_open_mutex);
-        offset = 0;
+        journal_log(inode, sizeof(inode_t));
     } else {
-        pthread_mutex_unlock(&tfs_open_mutex);
-        return -1;
+        inode_read_lock(inum);
     }
+    // Determine initial offset
+    size_t offset = (mode & TFS_O_APPEND) ? inode->i_size : 0;
+    inode_unlock(inum);
+
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    mutex_lock(&file->lock);
+    file->of_offset = offset;
+    mutex_unlock(&file->lock);
 
-    // Finally, add entry to the open file table and return the corresponding
-    // handle
-    return add_to_open_file_table(inum, offset);
+    return fhandle;
 
     // Note: for simplification, if file was created with TFS_O_CREAT and there
     // is an error adding an entry to the open file table, the file is not
     // opened but it remains created
 }
 
-int tfs_sym_link(char const *target, char const *link_name) {
-    // Checks if the path names are valid
-    if (!valid_pathname(link_name) && !valid_pathname(target)) {
+int tfs_open(char const *name, tfs_file_mode_t mode) {
+    if (journal_begin() == -1) {
         return -1;
     }
-
-    inode_t *root_dir_inode = inode_get(ROOT_DIR_INUM);
-    ALWAYS_ASSERT(root_dir_inode != NULL,
-                  "tfs_sym_link: root inode must exist");
-
-    // Creates the inode for the soft link
-    int link_inum = inode_create(T_LINK);
-    if (link_inum == -1) {
+    int fhandle = open_file(name, mode);
+    if (journal_end() == -1 && fhandle != -1) {
+        tfs_close(fhandle);
         return -1;
     }
+    return fhandle;
+}
 
-    inode_t *link_inode = inode_get(link_inum);
-    ALWAYS_ASSERT(link_inode != NULL,
-                  "tfs_sym_link: inode of open file deleted");
-
-    // Allocates a data block and assigns it to the inode
-    int bnum = data_block_alloc();
-    if (bnum == -1) {
-        return -1; // no space
+int tfs_sym_link(char const *target, char const *link_name) {
+    // Checks if the path names are valid
+    if (!valid_pathname(link_name) || !valid_pathname(target)) {
+        return -1;
     }
 
-    link_inode->i_data_block = bnum;
-
-    void *block = data_block_get(link_inode->i_data_block);
-    ALWAYS_ASSERT(block != NULL, "tfs_sym_link: data block deleted mid-write");
-
-    // Copies hte target pathname to the actal data block
-    memcpy(block, target, strlen(target) + 1);
+    if (strlen(target) + 1 > state_block_size()) {
+        return -1; // the target name must fit in a data block
+    }
 
-    add_dir_entry(root_dir_inode, link_name + 1, link_inum);
-    return 0;
+    if (journal_begin() == -1) {
+        return -1;
+    }
+    int inum = tfs_create(link_name, T_LINK, target);
+    return journal_end() == -1 || inum == -1 ? -1 : 0;
 }
 
-int tfs_link(char const *target, char const *link_name) {
+/**
+ * Creates a hard link (see tfs_link), as part of a journaled operation.
+ */
+static int link_file(char const *target, char const *link_name) {
     // Checks if the path names are valid
     if (!valid_pathname(link_name) || !valid_pathname(target)) {
         return -1;
     }
 
-    inode_t *root_dir_inode = inode_get(ROOT_DIR_INUM);
-    ALWAYS_ASSERT(root_dir_inode != NULL,
-                  "tfs_link: root dir inode must exist");
-    int target_inum = tfs_lookup(target);
+    int target_inum = tfs_lookup(target, NO_SNAPSHOT);
     // Checks if the target file exists
     if (target_inum < 0) {
         return -1;
     }
 
+    char sub_name[MAX_FILE_NAME];
+    int dir_inum = tfs_lookup_parent(link_name, sub_name, NO_SNAPSHOT);
+    if (dir_inum == -1) {
+        return -1;
+    }
+
+    inode_t *dir_inode = inode_get(dir_inum);
+    ALWAYS_ASSERT(dir_inode != NULL,
+                  "tfs_link: directories must have an inode");
+
     inode_t *target_inode = inode_get(target_inum);
     ALWAYS_ASSERT(target_inode != NULL,
                   "tfs_link: target file must have an inode");
 
-    if (target_inode->i_node_type == T_LINK) {
+    // The link count is raised before the entry is added (and lowered after
+    // an entry is removed), so that it never drops below the number of entries
+    // even if the operation is interrupted
+    inode_write_lock(target_inum);
+    if (target_inode->i_node_type != T_FILE ||
+        target_inode->i_link_count == 0) {
+        inode_unlock(target_inum);
+        return -1; // no hard links to soft links, directories or removed files
+    }
+    target_inode->i_link_count++;
+    journal_log(target_inode, sizeof(inode_t));
+    inode_unlock(target_inum);
+
+    // Fails if the link file already exists
+    if (add_dir_entry(dir_inode, sub_name, target_inum) == -1) {
+        inode_write_lock(target_inum);
+        int link_count = --target_inode->i_link_count;
+        journal_log(target_inode, sizeof(inode_t));
+        inode_unlock(target_inum);
+
+        // the file may have been unlinked meanwhile
+        if (link_count == 0) {
+            inode_orphan(target_inum);
+        }
         return -1;
     }
+    return 0;
+}
 
-    // Checks if the link file already exists
-    int link_inum = tfs_lookup(link_name);
-    if (link_inum >= 0) {
+int tfs_link(char const *target, char const *link_name) {
+    if (journal_begin() == -1) {
         return -1;
     }
-
-    add_dir_entry(root_dir_inode, link_name + 1, target_inum);
-    target_inode->i_link_count++;
-    return 0;
+    int result = link_file(target, link_name);
+    return journal_end() == -1 ? -1 : result;
 }
 
 int tfs_close(int fhandle) {
@@ -249,160 +438,1949 @@ int tfs_close(int fhandle) {
         return -1; // invalid fd
     }
 
+    int snapshot = file->of_snapshot;
     remove_from_open_file_table(fhandle);
+    if (snapshot != NO_SNAPSHOT) {
+        snapshot_release(snapshot);
+    }
 
     return 0;
 }
 
-ssize_t tfs_write(int fhandle, void const *buffer, size_t to_write) {
-    open_file_entry_t *file = get_open_file_entry(fhandle);
-    if (file == NULL) {
-        return -1;
-    }
-    pthread_mutex_lock(&tfs_open_mutex);
-
-    //  From the open file table entry, we get the inode
-    inode_t *inode = inode_get(file->of_inumber);
-    ALWAYS_ASSERT(inode != NULL, "tfs_write: inode of open file deleted");
+/**
+ * Position in a sequence of buffers (iovecs).
+ */
+typedef struct {
+    struct iovec const *iov; // current buffer
+    size_t offset;           // offset within the current buffer
+} iov_cursor_t;
 
-    // Determine how many bytes to write
-    size_t block_size = state_block_size();
-    if (to_write + file->of_offset > block_size) {
-        to_write = block_size - file->of_offset;
+/**
+ * Copy bytes out of a sequence of buffers, advancing the cursor.
+ *
+ * Input:
+ *   - cursor: position in the buffers (which must hold at least len bytes),
+ *     or in no buffers (iov is NULL) to copy zeros
+ *   - dest: destination
+ *   - len: number of bytes to copy
+ */
+static void iov_gather(iov_cursor_t *cursor, char *dest, size_t len) {
+    if (cursor->iov == NULL) {
+        memset(dest, 0, len);
+        return;
     }
 
-    if (to_write > 0) {
-        if (inode->i_size == 0) {
-            // If empty file, allocate new block
-            int bnum = data_block_alloc();
-            if (bnum == -1) {
-                pthread_mutex_unlock(&tfs_open_mutex);
-                return -1; // no space
-            }
-
-            inode->i_data_block = bnum;
+    while (len > 0) {
+        size_t chunk = cursor->iov->iov_len - cursor->offset;
+        if (chunk > len) {
+            chunk = len;
         }
+        memcpy(dest, (char const *)cursor->iov->iov_base + cursor->offset,
+               chunk);
+        dest += chunk;
+        len -= chunk;
+
+        cursor->offset += chunk;
+        if (cursor->offset == cursor->iov->iov_len) {
+            cursor->iov++;
+            cursor->offset = 0;
+        }
+    }
+}
 
-        void *block = data_block_get(inode->i_data_block);
-        ALWAYS_ASSERT(block != NULL, "tfs_write: data block deleted mid-write");
-
-        // Perform the actual write
-        memcpy(block + file->of_offset, buffer, to_write);
+/**
+ * Copy bytes into a sequence of buffers, advancing the cursor.
+ *
+ * Input:
+ *   - cursor: position in the buffers (which must hold at least len bytes)
+ *   - src: source, or NULL to copy zeros
+ *   - len: number of bytes to copy
+ */
+static void iov_scatter(iov_cursor_t *cursor, char const *src, size_t len) {
+    while (len > 0) {
+        size_t chunk = cursor->iov->iov_len - cursor->offset;
+        if (chunk > len) {
+            chunk = len;
+        }
+        char *dest = (char *)cursor->iov->iov_base + cursor->offset;
+        if (src == NULL) {
+            memset(dest, 0, chunk);
+        } else {
+            memcpy(dest, src, chunk);
+            src += chunk;
+        }
+        len -= chunk;
 
-        // The offset associated with the file handle is incremented accordingly
-        file->of_offset += to_write;
-        if (file->of_offset > inode->i_size) {
-            inode->i_size = file->of_offset;
+        cursor->offset += chunk;
+        if (cursor->offset == cursor->iov->iov_len) {
+            cursor->iov++;
+            cursor->offset = 0;
         }
     }
-    pthread_mutex_unlock(&tfs_open_mutex);
-    return (ssize_t)to_write;
 }
 
-ssize_t tfs_read(int fhandle, void *buffer, size_t len) {
-    open_file_entry_t *file = get_open_file_entry(fhandle);
-    if (file == NULL) {
+/**
+ * Total length of a sequence of buffers.
+ *
+ * Input:
+ *   - iov: the buffers
+ *   - iovcnt: number of buffers
+ *
+ * Returns the total length, or -1 if iovcnt is negative or the total
+ * overflows.
+ */
+static ssize_t iov_length(struct iovec const *iov, int iovcnt) {
+    if (iovcnt < 0) {
         return -1;
     }
 
-    pthread_mutex_lock(&tfs_open_mutex);
-    // From the open file table entry, we get the inode
-    inode_t const *inode = inode_get(file->of_inumber);
-    ALWAYS_ASSERT(inode != NULL, "tfs_read: inode of open file deleted");
-
-    // Determine how many bytes to read
-    size_t to_read = inode->i_size - file->of_offset;
-    if (to_read > len) {
-        to_read = len;
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        if (iov[i].iov_len > SSIZE_MAX - total) {
+            return -1;
+        }
+        total += iov[i].iov_len;
     }
+    return (ssize_t)total;
+}
 
-    if (to_read > 0) {
-        void *block = data_block_get(inode->i_data_block);
-        ALWAYS_ASSERT(block != NULL, "tfs_read: data block deleted mid-read");
-
-        // Perform the actual read
-        memcpy(buffer, block + file->of_offset, to_read);
-        // The offset associated with the file handle is incremented accordingly
-        file->of_offset += to_read;
+/**
+ * Copy data into a range of a file, one extent at a time.
+ *
+ * The range must be within the blocks mapped by the file (unless it is filled
+ * with zeros, which holes already are), and the file must be locked for
+ * writing.
+ *
+ * Input:
+ *   - inode: the file's inode
+ *   - iov: the buffers holding the data to copy (at least len bytes), or NULL
+ *     to fill the range with zeros
+ *   - offset: the offset of the range
+ *   - len: the length of the range
+ */
+static void inode_write_range(inode_t *inode, struct iovec const *iov,
+                              size_t offset, size_t len) {
+    iov_cursor_t cursor = {.iov = iov, .offset = 0};
+    size_t block_size = state_block_size();
+    size_t written = 0;
+    while (written < len) {
+        size_t position = offset + written;
+        size_t run;
+        char *block = inode_block_get(inode, position / block_size, &run);
+        ALWAYS_ASSERT(block != NULL || iov == NULL,
+                      "tfs_write: data block deleted mid-write");
+
+        size_t chunk = run * block_size - position % block_size;
+        if (chunk > len - written) {
+            chunk = len - written;
+        }
+        if (block == NULL) {
+            written += chunk; // a hole
+            continue;
+        }
+        if (iov == NULL) {
+            memset(block + position % block_size, 0, chunk);
+        } else {
+            iov_gather(&cursor, block + position % block_size, chunk);
+        }
+        journal_dirty(block + position % block_size, chunk);
+        written += chunk;
     }
+}
 
-    pthread_mutex_unlock(&tfs_open_mutex);
-
-    return (ssize_t)to_read;
+/**
+ * Copy data out of a range of a file, one extent (or hole) at a time.
+ *
+ * The range must be within the file's size, and the file must be locked for
+ * reading.
+ *
+ * Input:
+ *   - inode: the file's inode
+ *   - iov: destination buffers (at least len bytes)
+ *   - offset: the offset of the range
+ *   - len: the length of the range
+ */
+static void inode_read_range(inode_t const *inode, struct iovec const *iov,
+                             size_t offset, size_t len) {
+    iov_cursor_t cursor = {.iov = iov, .offset = 0};
+    size_t block_size = state_block_size();
+    size_t read = 0;
+    while (read < len) {
+        size_t position = offset + read;
+        size_t run;
+        char const *block = inode_block_get(inode, position / block_size, &run);
+
+        size_t chunk = run * block_size - position % block_size;
+        if (chunk > len - read) {
+            chunk = len - read;
+        }
+        // (holes read as zeros)
+        iov_scatter(&cursor,
+                    block == NULL ? NULL : block + position % block_size,
+                    chunk);
+        read += chunk;
+    }
 }
 
-int tfs_unlink(char const *target) {
-    // Checks if the path name is valid
-    if (!valid_pathname(target)) {
+/**
+ * Copy data into a range of a compressed file, one chunk at a time.
+ *
+ * Each chunk changed is read (unless it is overwritten as a whole), changed and
+ * written back. Writing past the end of the file fills the gap with zeros.
+ * The size of the file only covers the chunks written successfully (the
+ * chunks may hold stale bytes past it). The file must be locked for writing.
+ *
+ * Input:
+ *   - inode: the file's inode
+ *   - iov: the buffers holding the data to copy (at least len bytes), or NULL
+ *     to fill the range with zeros
+ *   - offset: the offset of the range
+ *   - len: the length of the range (0 to only fill the gap)
+ *
+ * Returns the number of bytes copied (lower than len if there is no space
+ * left), or -1 if nothing could be copied (in which case the size of the file
+ * does not change).
+ */
+static ssize_t inode_write_chunks(inode_t *inode, struct iovec const *iov,
+                                  size_t offset, size_t len) {
+    iov_cursor_t cursor = {.iov = iov, .offset = 0};
+    size_t chunk_size = state_chunk_size();
+    char *buffer = malloc(chunk_size);
+    if (buffer == NULL) {
         return -1;
     }
 
-    inode_t *root_dir_inode = inode_get(ROOT_DIR_INUM);
-    ALWAYS_ASSERT(root_dir_inode != NULL,
-                  "tfs_unlink: root dir inode must exist");
-    int target_inum = tfs_lookup(target);
+    // The chunks changed include the gap before offset, if any
+    size_t size = inode->i_size; // covering the chunks written so far
+    size_t end = offset + len;
+    size_t first = (offset < size ? offset : size);
+    size_t written = 0;
+    bool failed = false;
+    for (size_t chunk = first / chunk_size; chunk * chunk_size < end;
+         chunk++) {
+        size_t chunk_start = chunk * chunk_size;
+        size_t length = 0; // of the chunk, before the write
+        if (chunk_start < size) {
+            length = size - chunk_start;
+            if (length > chunk_size) {
+                length = chunk_size;
+            }
+        }
 
-    // Checks if the target file exists
-    if (target_inum < 0) {
-        return -1;
+        // The range of the chunk written (the part before it is a gap)
+        size_t write_end = end - chunk_start;
+        if (write_end > chunk_size) {
+            write_end = chunk_size;
+        }
+        size_t write_start = 0;
+        if (offset > chunk_start) {
+            write_start = offset - chunk_start;
+        }
+        if (write_start > write_end) {
+            write_start = write_end;
+        }
+
+        if (length > 0 && (write_start > 0 || write_end < length) &&
+            inode_chunk_read(inode, chunk, buffer) < (ssize_t)length) {
+            failed = true; // corrupted
+            break;
+        }
+        if (write_start > length) {
+            memset(buffer + length, 0, write_start - length);
+        }
+        iov_gather(&cursor, buffer + write_start, write_end - write_start);
+
+        size_t new_length = (length > write_end ? length : write_end);
+        if (inode_chunk_write(inode, chunk, buffer, new_length) == -1) {
+            failed = true; // no space
+            break;
+        }
+        written += write_end - write_start;
+        if (chunk_start + new_length > size) {
+            size = chunk_start + new_length;
+        }
     }
+    free(buffer);
 
-    if (inumber_is_open(target_inum)) {
+    if (failed && written == 0) {
+        // The chunks added for the gap are dropped
+        inode_chunk_truncate(inode,
+                             (inode->i_size + chunk_size - 1) / chunk_size);
         return -1;
     }
+    if (size > inode->i_size) {
+        inode->i_size = size;
+        journal_log(inode, sizeof(inode_t));
+    }
+    return (ssize_t)written;
+}
 
-    inode_t *target_inode = inode_get(target_inum);
-    ALWAYS_ASSERT(target_inode != NULL,
-                  "tfs_unlink: target file must have an inode");
-
-    // unlink the file
-    if (target_inode->i_link_count >= 1) {
-        target_inode->i_link_count--;
-        clear_dir_entry(root_dir_inode, target + 1);
+/**
+ * Copy data out of a range of a compressed file, one chunk at a time.
+ *
+ * The range must be within the file's size, and the file must be locked for
+ * reading (unless it is part of a snapshot).
+ *
+ * Input:
+ *   - inode: the file's inode
+ *   - iov: destination buffers (at least len bytes)
+ *   - offset: the offset of the range
+ *   - len: the length of the range
+ *
+ * Returns 0 if successful, -1 if the chunks read are corrupted.
+ */
+static int inode_read_chunks(inode_t const *inode, struct iovec const *iov,
+                             size_t offset, size_t len) {
+    iov_cursor_t cursor = {.iov = iov, .offset = 0};
+    size_t chunk_size = state_chunk_size();
+    char *buffer = malloc(chunk_size);
+    if (buffer == NULL) {
+        return -1;
     }
 
-    // delete the file if it is not linked to any other file
-    if (target_inode->i_link_count == 0) {
-        if (target_inode->i_data_block != -1)
-            data_block_free(target_inode->i_data_block);
-        inode_delete(target_inum);
+    int result = 0;
+    size_t read = 0;
+    while (read < len) {
+        size_t position = offset + read;
+        ssize_t length =
+            inode_chunk_read(inode, position / chunk_size, buffer);
+        size_t skip = position % chunk_size;
+        if (length == -1 || (size_t)length <= skip) {
+            result = -1; // corrupted
+            break;
+        }
+
+        size_t chunk = (size_t)length - skip;
+        if (chunk > len - read) {
+            chunk = len - read;
+        }
+        iov_scatter(&cursor, buffer + skip, chunk);
+        read += chunk;
     }
 
-    return 0;
+    free(buffer);
+    return result;
 }
 
-int tfs_copy_from_external_fs(char const *source_path, char const *dest_path) {
-    // Checks if the source path name is valid
-    FILE *src_file = fopen(source_path, "r");
-    if (src_file == NULL) {
-        return -1;
+/**
+ * Write to a file at a given offset, gathering the data from a sequence of
+ * buffers, in a single locked pass.
+ *
+ * Writing past the end of the file leaves a hole in the gap (which reads as
+ * zeros), and only the blocks written to are allocated.
+ *
+ * Input:
+ *   - inum: the file's inumber
+ *   - iov: the buffers
+ *   - iovcnt: number of buffers
+ *   - offset: where to write
+ *
+ * Returns the number of bytes written (can be lower than the total length of
+ * the buffers if the maximum file size is exceeded), or -1 if nothing could be
+ * written.
+ */
+static ssize_t file_writev_at(int inum, struct iovec const *iov, int iovcnt,
+                              size_t offset) {
+    ssize_t total = iov_length(iov, iovcnt);
+    if (total <= 0) {
+        return total;
     }
-
-    // Checks if the destination path name is valid
-    int dest_file = tfs_open(dest_path, TFS_O_CREAT | TFS_O_TRUNC);
-    if (dest_file == -1) {
+    size_t to_write = (size_t)total;
+    if (offset > SIZE_MAX - to_write) {
         return -1;
     }
 
-    char buffer[state_block_size()];
-    size_t read_bytes;
+    inode_t *inode = inode_get(inum);
+    ALWAYS_ASSERT(inode != NULL, "tfs_write: inode of open file deleted");
 
-    // Read from the source file and write to the destination file
-    while ((read_bytes = fread(buffer, 1, state_block_size(), src_file)) > 0) {
-        if (tfs_write(dest_file, buffer, read_bytes) != read_bytes) {
-            fclose(src_file);
-            tfs_close(dest_file);
-            return -1;
-        }
+    // Writes to the same file are serialized, writes to different files are
+    // not (borrowed blocks are written in place, see tfs_read_borrow)
+    inode_write_lock(inum);
+
+    if (inode->i_flags & INODE_COMPRESSED) {
+        ssize_t written = inode_write_chunks(inode, iov, offset, to_write);
+        inode_unlock(inum);
+        return written;
     }
 
-    // Close the source file and the destination file
-    if (fclose(src_file) == EOF) {
-        tfs_close(dest_file);
-        return -1;
+    // The stale contents of the blocks past the end of the file must not show
+    // up in the gap
+    if (offset > inode->i_size && inode_clear_tail(inode) == -1) {
+        inode_unlock(inum);
+        return -1; // no space
     }
-    if (tfs_close(dest_file) == -1) {
+
+    // Make sure the blocks written are mapped, and determine how many bytes to
+    // write
+    size_t block_size = state_block_size();
+    size_t end = offset + to_write;
+    size_t first_block = offset / block_size;
+    size_t end_block = (end + block_size - 1) / block_size;
+    bool head_mapped = inode_block_get(inode, first_block, NULL) != NULL;
+    bool tail_mapped = inode_block_get(inode, end_block - 1, NULL) != NULL;
+    size_t capacity =
+        (first_block + inode_map(inode, first_block, end_block - first_block)) *
+        block_size;
+    if (capacity <= offset) {
+        inode_unlock(inum);
+        return -1; // no space
+    }
+    if (end > capacity) {
+        to_write = capacity - offset;
+        end = capacity;
+        end_block = capacity / block_size;
+    }
+    size_t block_count = end_block - first_block;
+
+    // Blocks shared with snapshots are copied before being changed
+    if (inode_unshare(inode, first_block, block_count) == -1) {
+        inode_unlock(inum);
+        return -1; // no space
+    }
+
+    // The parts of new blocks that are not written are zeros, as the holes
+    // they replace
+    if (!head_mapped && offset % block_size > 0) {
+        inode_write_range(inode, NULL, first_block * block_size,
+                          offset % block_size);
+    }
+    if (!tail_mapped && end % block_size > 0) {
+        inode_write_range(inode, NULL, end, block_size - end % block_size);
+    }
+    inode_write_range(inode, iov, offset, to_write);
+    inode_checksum_update(inode, first_block, block_count);
+
+    if (offset + to_write > inode->i_size) {
+        inode->i_size = offset + to_write;
+        journal_log(inode, sizeof(inode_t));
+    }
+
+    // Blocks already stored elsewhere are shared (if enabled)
+    inode_dedup(inode, first_block, block_count);
+
+    inode_unlock(inum);
+    return (ssize_t)to_write;
+}
+
+/**
+ * Read from a file at a given offset, scattering the data over a sequence of
+ * buffers, in a single locked pass.
+ *
+ * Input:
+ *   - inum: the file's inumber
+ *   - snapshot: the snapshot the file is read from, or NO_SNAPSHOT
+ *   - iov: the buffers
+ *   - iovcnt: number of buffers
+ *   - offset: where to read from
+ *
+ * Returns the number of bytes read (0 if offset is at or past the end of the
+ * file), or -1 if iovcnt is invalid or the blocks read are corrupted.
+ */
+static ssize_t file_readv_at(int inum, int snapshot, struct iovec const *iov,
+                             int iovcnt, size_t offset) {
+    ssize_t total = iov_length(iov, iovcnt);
+    if (total <= 0) {
+        return total;
+    }
+
+    // Reads of the same file run in parallel (and files of snapshots never
+    // change, so they are read without locks)
+    inode_t const *inode;
+    if (snapshot == NO_SNAPSHOT) {
+        inode = inode_get(inum);
+        inode_read_lock(inum);
+    } else {
+        inode = snapshot_inode_get(snapshot, inum);
+    }
+    ALWAYS_ASSERT(inode != NULL, "tfs_read: inode of open file deleted");
+
+    // Determine how many bytes to read
+    size_t to_read = 0;
+    if (offset < inode->i_size) {
+        to_read = inode->i_size - offset;
+    }
+    if (to_read > (size_t)total) {
+        to_read = (size_t)total;
+    }
+
+    // The blocks are checked before anything is copied out of them
+    ssize_t result = (ssize_t)to_read;
+    size_t block_size = state_block_size();
+    size_t first_block = offset / block_size;
+    size_t end_block = (offset + to_read + block_size - 1) / block_size;
+    if (inode->i_flags & INODE_COMPRESSED) {
+        if (inode_read_chunks(inode, iov, offset, to_read) == -1) {
+            result = -1; // corrupted
+        }
+    } else if (to_read > 0 &&
+               inode_checksum_verify(inode, first_block,
+                                     end_block - first_block) == -1) {
+        result = -1; // corrupted
+    } else {
+        inode_read_range(inode, iov, offset, to_read);
+    }
+
+    if (snapshot == NO_SNAPSHOT) {
+        inode_unlock(inum);
+    }
+    return result;
+}
+
+ssize_t tfs_writev(int fhandle, struct iovec const *iov, int iovcnt) {
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    if (file == NULL || file->of_snapshot != NO_SNAPSHOT) {
+        return -1; // snapshots are read-only
+    }
+
+    // The entry lock protects the offset
+    if (journal_begin() == -1) {
+        return -1;
+    }
+    mutex_lock(&file->lock);
+
+    ssize_t written =
+        file_writev_at(file->of_inumber, iov, iovcnt, file->of_offset);
+
+    // The offset associated with the file handle is incremented accordingly
+    if (written > 0) {
+        file->of_offset += (size_t)written;
+    }
+
+    mutex_unlock(&file->lock);
+    return journal_end() == -1 ? -1 : written;
+}
+
+ssize_t tfs_readv(int fhandle, struct iovec const *iov, int iovcnt) {
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    if (file == NULL) {
+        return -1;
+    }
+
+    // The entry lock protects the offset
+    mutex_lock(&file->lock);
+
+    ssize_t read = file_readv_at(file->of_inumber, file->of_snapshot, iov,
+                                 iovcnt, file->of_offset);
+
+    // The offset associated with the file handle is incremented accordingly
+    if (read > 0) {
+        file->of_offset += (size_t)read;
+    }
+
+    mutex_unlock(&file->lock);
+    return read;
+}
+
+ssize_t tfs_pwritev(int fhandle, struct iovec const *iov, int iovcnt,
+                    size_t offset) {
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    if (file == NULL || file->of_snapshot != NO_SNAPSHOT) {
+        return -1; // snapshots are read-only
+    }
+
+    // The offset of the handle is neither used nor changed, so its lock is not
+    // needed (and the inumber does not change while the file is open)
+    if (journal_begin() == -1) {
+        return -1;
+    }
+    ssize_t written = file_writev_at(file->of_inumber, iov, iovcnt, offset);
+    return journal_end() == -1 ? -1 : written;
+}
+
+ssize_t tfs_preadv(int fhandle, struct iovec const *iov, int iovcnt,
+                   size_t offset) {
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    if (file == NULL) {
+        return -1;
+    }
+
+    // See tfs_pwritev
+    return file_readv_at(file->of_inumber, file->of_snapshot, iov, iovcnt,
+                         offset);
+}
+
+ssize_t tfs_write(int fhandle, void const *buffer, size_t len) {
+    struct iovec iov = {.iov_base = (void *)buffer, .iov_len = len};
+    return tfs_writev(fhandle, &iov, 1);
+}
+
+ssize_t tfs_read(int fhandle, void *buffer, size_t len) {
+    struct iovec iov = {.iov_base = buffer, .iov_len = len};
+    return tfs_readv(fhandle, &iov, 1);
+}
+
+ssize_t tfs_pwrite(int fhandle, void const *buffer, size_t len,
+                   size_t offset) {
+    struct iovec iov = {.iov_base = (void *)buffer, .iov_len = len};
+    return tfs_pwritev(fhandle, &iov, 1, offset);
+}
+
+ssize_t tfs_pread(int fhandle, void *buffer, size_t len, size_t offset) {
+    struct iovec iov = {.iov_base = buffer, .iov_len = len};
+    return tfs_preadv(fhandle, &iov, 1, offset);
+}
+
+/**
+ * Fill a range of a file with zeros, in place (holes are left as they are).
+ *
+ * The range must be within the file's size, and the file must be locked for
+ * writing.
+ *
+ * Input:
+ *   - inode: the file's inode (not compressed)
+ *   - offset: the offset of the range
+ *   - len: the length of the range
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - No space to copy the blocks of the range shared with snapshots.
+ */
+static int inode_zero_range(inode_t *inode, size_t offset, size_t len) {
+    if (len == 0) {
+        return 0;
+    }
+
+    size_t block_size = state_block_size();
+    size_t first_block = offset / block_size;
+    size_t block_count =
+        (offset + len + block_size - 1) / block_size - first_block;
+    if (inode_unshare(inode, first_block, block_count) == -1) {
+        return -1;
+    }
+    inode_write_range(inode, NULL, offset, len);
+    inode_checksum_update(inode, first_block, block_count);
+    return 0;
+}
+
+/**
+ * Change the size of a compressed file (see tfs_ftruncate): the chunks past
+ * the new end are freed (and the one it falls in is rewritten), or the file
+ * is extended with zeros.
+ *
+ * Must be called with the file locked for writing.
+ *
+ * Input:
+ *   - inode: the file's inode (INODE_COMPRESSED)
+ *   - length: the new size of the file
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - No space for the chunks written.
+ *   - The chunk the new end falls in is corrupted.
+ */
+static int inode_resize_chunks(inode_t *inode, size_t length) {
+    if (length > inode->i_size) {
+        // (nothing but the gap)
+        return inode_write_chunks(inode, NULL, length, 0) == -1 ? -1 : 0;
+    }
+
+    size_t chunk_size = state_chunk_size();
+    size_t chunk_count = (length + chunk_size - 1) / chunk_size;
+    if (length % chunk_size > 0) {
+        char *buffer = malloc(chunk_size);
+        if (buffer == NULL) {
+            return -1;
+        }
+        ssize_t old_length = inode_chunk_read(inode, chunk_count - 1, buffer);
+        int result = old_length == -1 ? -1 : 0; // (-1 if corrupted)
+        if (old_length > (ssize_t)(length % chunk_size)) {
+            result = inode_chunk_write(inode, chunk_count - 1, buffer,
+                                       length % chunk_size);
+        }
+        free(buffer);
+        if (result == -1) {
+            return -1;
+        }
+    }
+    inode_chunk_truncate(inode, chunk_count);
+    return 0;
+}
+
+int tfs_ftruncate(int fhandle, size_t length) {
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    if (file == NULL || file->of_snapshot != NO_SNAPSHOT) {
+        return -1; // snapshots are read-only
+    }
+    if (length / state_block_size() > INT_MAX) {
+        return -1; // (see inode_map)
+    }
+
+    int inum = file->of_inumber;
+    inode_t *inode = inode_get(inum);
+    ALWAYS_ASSERT(inode != NULL, "tfs_ftruncate: inode of open file deleted");
+
+    // Only dropping blocks waits for leases (see inode_clear_tail)
+    if (journal_begin() == -1) {
+        return -1;
+    }
+    inode_write_lock(inum);
+
+    int result = 0;
+    if (inode->i_flags & INODE_COMPRESSED) {
+        result = inode_resize_chunks(inode, length);
+    } else if (length > inode->i_size) {
+        result = inode_clear_tail(inode); // the rest is a hole
+    } else if (length < inode->i_size) {
+        inode_trim_later(inum); // the blocks past the end stay until then
+    }
+    if (result == 0 && length != inode->i_size) {
+        inode->i_size = length;
+        journal_log(inode, sizeof(inode_t));
+    }
+
+    inode_unlock(inum);
+    return journal_end() == -1 ? -1 : result;
+}
+
+int tfs_punch_hole(int fhandle, size_t offset, size_t len) {
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    if (file == NULL || file->of_snapshot != NO_SNAPSHOT) {
+        return -1; // snapshots are read-only
+    }
+
+    int inum = file->of_inumber;
+    inode_t *inode = inode_get(inum);
+    ALWAYS_ASSERT(inode != NULL, "tfs_punch_hole: inode of open file deleted");
+
+    if (journal_begin() == -1) {
+        return -1;
+    }
+    inode_write_lock(inum);
+
+    // Nothing past the end of the file is changed
+    size_t end = len > SIZE_MAX - offset ? SIZE_MAX : offset + len;
+    if (end > inode->i_size) {
+        end = inode->i_size;
+    }
+
+    int result = 0;
+    if (offset >= end) {
+        result = 0;
+    } else if (inode->i_flags & INODE_COMPRESSED) {
+        ssize_t written = inode_write_chunks(inode, NULL, offset, end - offset);
+        result = written == (ssize_t)(end - offset) ? 0 : -1;
+    } else {
+        // The whole blocks of the range (including the last block of the
+        // file, past its end) are freed, and the rest is zeroed
+        size_t block_size = state_block_size();
+        size_t first_block = (offset + block_size - 1) / block_size;
+        size_t end_block = end == inode->i_size
+                               ? (end + block_size - 1) / block_size
+                               : end / block_size;
+        if (first_block < end_block) {
+            inode_wait_unpinned(inum); // borrowed blocks cannot be freed
+        }
+        if (first_block >= end_block ||
+            inode_punch(inode, first_block, end_block - first_block) == -1) {
+            first_block = end_block = end / block_size; // zero it all
+        }
+
+        size_t head_end = first_block * block_size;
+        if (head_end > end || first_block == end_block) {
+            head_end = end;
+        }
+        size_t tail_start = end_block * block_size;
+        if (tail_start < head_end) {
+            tail_start = head_end;
+        }
+        if (inode_zero_range(inode, offset, head_end - offset) == -1 ||
+            (tail_start < end &&
+             inode_zero_range(inode, tail_start, end - tail_start) == -1)) {
+            result = -1;
+        }
+    }
+
+    inode_unlock(inum);
+    return journal_end() == -1 ? -1 : result;
+}
+
+// Lent for the holes of files (see tfs_read_borrow)
+static char const hole_zeros[HOLE_SPAN_SIZE];
+
+ssize_t tfs_read_borrow(int fhandle, size_t offset, size_t len,
+                        tfs_span_t *spans, int *span_count,
+                        tfs_lease_t *lease) {
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    if (file == NULL || *span_count <= 0 || file->of_snapshot != NO_SNAPSHOT) {
+        return -1; // (files of snapshots are not pinned, see tfs_pread)
+    }
+
+    int inum = file->of_inumber;
+    inode_t const *inode = inode_get(inum);
+    ALWAYS_ASSERT(inode != NULL, "tfs_read_borrow: inode of open file deleted");
+
+    inode_read_lock(inum);
+    if (inode->i_flags & INODE_COMPRESSED) {
+        inode_unlock(inum);
+        return -1; // the blocks do not hold the file's contents as they are
+    }
+
+    // Determine how many bytes to borrow
+    size_t to_read = 0;
+    if (offset < inode->i_size) {
+        to_read = inode->i_size - offset;
+    }
+    if (to_read > len) {
+        to_read = len;
+    }
+
+    // One span per extent, while there are spans left (holes are lent as
+    // zeros, HOLE_SPAN_SIZE bytes at a time)
+    size_t block_size = state_block_size();
+    size_t borrowed = 0;
+    int count = 0;
+    while (borrowed < to_read && count < *span_count) {
+        size_t position = offset + borrowed;
+        size_t run;
+        char const *block = inode_block_get(inode, position / block_size, &run);
+
+        size_t chunk = run * block_size - position % block_size;
+        if (block == NULL && chunk > HOLE_SPAN_SIZE) {
+            chunk = HOLE_SPAN_SIZE;
+        }
+        if (chunk > to_read - borrowed) {
+            chunk = to_read - borrowed;
+        }
+        spans[count].base =
+            block == NULL ? hole_zeros : block + position % block_size;
+        spans[count].len = chunk;
+        count++;
+        borrowed += chunk;
+    }
+
+    size_t first_block = offset / block_size;
+    size_t end_block = (offset + borrowed + block_size - 1) / block_size;
+    if (borrowed > 0 && inode_checksum_verify(inode, first_block,
+                                              end_block - first_block) == -1) {
+        inode_unlock(inum);
+        return -1; // corrupted
+    }
+
+    // The blocks stay as they are until the lease is released
+    inode_pin(inum);
+    inode_unlock(inum);
+
+    *span_count = count;
+    lease->inumber = inum;
+    return (ssize_t)borrowed;
+}
+
+int tfs_read_release(tfs_lease_t *lease) {
+    if (lease->inumber < 0) {
+        return -1; // already released
+    }
+
+    inode_unpin(lease->inumber);
+    lease->inumber = -1;
+    return 0;
+}
+
+/**
+ * Checks whether an inode is a directory.
+ *
+ * Input:
+ *   - inum: the inumber
+ */
+static bool inode_is_directory(int inum) {
+    inode_t *inode = inode_get(inum);
+    ALWAYS_ASSERT(inode != NULL, "tfs_unlink: target file must have an inode");
+
+    inode_read_lock(inum);
+    inode_type type = inode->i_node_type;
+    inode_unlock(inum);
+    return type == T_DIRECTORY;
+}
+
+/**
+ * Drops a hard link to a file whose directory entry was removed, handing the
+ * file over to the reclaimer (see inode_orphan) if it is not linked to any
+ * other file.
+ *
+ * Input:
+ *   - inum: the inumber of the file
+ */
+static void drop_link(int inum) {
+    inode_t *inode = inode_get(inum);
+    ALWAYS_ASSERT(inode != NULL, "tfs_unlink: target file must have an inode");
+
+    inode_write_lock(inum);
+    int link_count = inode->i_link_count;
+    if (link_count >= 1) {
+        link_count = --inode->i_link_count;
+        journal_log(inode, sizeof(inode_t));
+    }
+    inode_unlock(inum);
+
+    if (link_count == 0) {
+        inode_orphan(inum);
+    }
+}
+
+/**
+ * Removes a file (see tfs_unlink), as part of a journaled operation.
+ */
+static int unlink_file(char const *target) {
+    // Checks if the path name is valid
+    if (!valid_pathname(target)) {
+        return -1;
+    }
+
+    char sub_name[MAX_FILE_NAME];
+    int dir_inum = tfs_lookup_parent(target, sub_name, NO_SNAPSHOT);
+    if (dir_inum == -1) {
+        return -1;
+    }
+
+    inode_t *dir_inode = inode_get(dir_inum);
+    ALWAYS_ASSERT(dir_inode != NULL,
+                  "tfs_unlink: directories must have an inode");
+    int target_inum = dir_lookup(dir_inum, sub_name);
+
+    // Checks if the target file exists
+    if (target_inum < 0) {
+        return -1;
+    }
+
+    if (inode_is_directory(target_inum)) {
+        return -1; // directories are removed with tfs_rmdir
+    }
+
+    // unlink the file (removing the entry first, see tfs_link)
+    if (clear_dir_entry(dir_inode, sub_name, target_inum) == -1) {
+        return -1; // removed meanwhile
+    }
+
+    drop_link(target_inum);
+    return 0;
+}
+
+int tfs_unlink(char const *target) {
+    if (journal_begin() == -1) {
+        return -1;
+    }
+    int result = unlink_file(target);
+    return journal_end() == -1 ? -1 : result;
+}
+
+int tfs_mkdir(char const *name) {
+    // Checks if the path name is valid
+    if (!valid_pathname(name)) {
+        return -1;
+    }
+
+    if (journal_begin() == -1) {
+        return -1;
+    }
+    int inum = tfs_create(name, T_DIRECTORY, NULL);
+    return journal_end() == -1 || inum == -1 ? -1 : 0;
+}
+
+/**
+ * Removes an empty directory (see tfs_rmdir), as part of a journaled
+ * operation.
+ */
+static int remove_dir(char const *name) {
+    // Checks if the path name is valid
+    if (!valid_pathname(name)) {
+        return -1;
+    }
+
+    char sub_name[MAX_FILE_NAME];
+    int dir_inum = tfs_lookup_parent(name, sub_name, NO_SNAPSHOT);
+    if (dir_inum == -1) {
+        return -1;
+    }
+
+    inode_t *dir_inode = inode_get(dir_inum);
+    ALWAYS_ASSERT(dir_inode != NULL,
+                  "tfs_rmdir: directories must have an inode");
+    int target_inum = dir_lookup(dir_inum, sub_name);
+    if (target_inum < 0) {
+        return -1;
+    }
+
+    inode_t *target_inode = inode_get(target_inum);
+    ALWAYS_ASSERT(target_inode != NULL,
+                  "tfs_rmdir: target directory must have an inode");
+
+    // Fails if the target is not an empty directory; otherwise, no more
+    // entries can be added to it from now on
+    if (seal_empty_dir(target_inode) == -1) {
+        return -1;
+    }
+
+    // Whoever removes the entry deletes the directory (it may be removed
+    // concurrently, or have been sealed by an interrupted tfs_rmdir)
+    if (clear_dir_entry(dir_inode, sub_name, target_inum) == -1) {
+        return -1;
+    }
+    inode_delete(target_inum);
+
+    return 0;
+}
+
+int tfs_rmdir(char const *name) {
+    if (journal_begin() == -1) {
+        return -1;
+    }
+    int result = remove_dir(name);
+    return journal_end() == -1 ? -1 : result;
+}
+
+/**
+ * Path name of a batch (see name_batch_t), resolved to its parent directory.
+ */
+typedef struct {
+    int dir_inum; // -1 if the parent directory was not found
+    size_t index; // position of the path name in the batch
+    char sub_name[MAX_FILE_NAME];
+} batch_name_t;
+
+/**
+ * Path names handled together (see tfs_create_many), sorted by their parent
+ * directories, so that the names in each directory are handled with a single
+ * pass over it. The names whose parent directory was not found come first.
+ */
+typedef struct {
+    size_t count;
+    batch_name_t *names;
+    // for each name (in sorted order): its last component, its inumber, and
+    // whether it was handled successfully (0) or not (-1)
+    char const **sub_names;
+    int *inumbers;
+    int *results;
+} name_batch_t;
+
+static int batch_name_compare(void const *a, void const *b) {
+    batch_name_t const *name_a = a;
+    batch_name_t const *name_b = b;
+    if (name_a->dir_inum != name_b->dir_inum) {
+        return name_a->dir_inum < name_b->dir_inum ? -1 : 1;
+    }
+    return name_a->index < name_b->index ? -1 : name_a->index > name_b->index;
+}
+
+static void name_batch_destroy(name_batch_t *batch) {
+    free(batch->names);
+    free(batch->sub_names);
+    free(batch->inumbers);
+    free(batch->results);
+}
+
+/**
+ * Resolves the parent directories of the path names of a batch.
+ *
+ * Input:
+ *   - batch: the batch
+ *   - names: absolute path names
+ *   - count: number of path names
+ *
+ * Returns 0 if successful, -1 otherwise (failure to allocate the batch).
+ */
+static int name_batch_init(name_batch_t *batch, char const *const *names,
+                           size_t count) {
+    batch->count = count;
+    batch->names = malloc(count * sizeof(batch_name_t));
+    batch->sub_names = malloc(count * sizeof(char const *));
+    batch->inumbers = malloc(count * sizeof(int));
+    batch->results = malloc(count * sizeof(int));
+    if (count > 0 && (batch->names == NULL || batch->sub_names == NULL ||
+                      batch->inumbers == NULL || batch->results == NULL)) {
+        name_batch_destroy(batch);
+        return -1;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        batch->names[i].index = i;
+        batch->names[i].dir_inum = tfs_lookup_parent(
+            names[i], batch->names[i].sub_name, NO_SNAPSHOT);
+    }
+    if (count > 0) {
+        qsort(batch->names, count, sizeof(batch_name_t), batch_name_compare);
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        batch->sub_names[i] = batch->names[i].sub_name;
+        batch->inumbers[i] = -1;
+        batch->results[i] = batch->names[i].dir_inum == -1 ? -1 : 0;
+    }
+    return 0;
+}
+
+/**
+ * Finds the first name of a batch whose parent directory was found.
+ */
+static size_t name_batch_first(name_batch_t const *batch) {
+    size_t first = 0;
+    while (first < batch->count && batch->names[first].dir_inum == -1) {
+        first++;
+    }
+    return first;
+}
+
+/**
+ * Finds the end of the group of names of a batch in the same directory.
+ *
+ * Input:
+ *   - batch: the batch
+ *   - start: the first name of the group
+ */
+static size_t name_batch_group_end(name_batch_t const *batch, size_t start) {
+    size_t end = start + 1;
+    while (end < batch->count &&
+           batch->names[end].dir_inum == batch->names[start].dir_inum) {
+        end++;
+    }
+    return end;
+}
+
+/**
+ * Reports the results of a batch, in the order of its path names, and
+ * destroys it.
+ *
+ * Input:
+ *   - batch: the batch
+ *   - results: where to store the results (NULL not to)
+ *
+ * Returns the number of names handled successfully.
+ */
+static int name_batch_finish(name_batch_t *batch, int *results) {
+    int succeeded = 0;
+    for (size_t i = 0; i < batch->count; i++) {
+        if (results != NULL) {
+            results[batch->names[i].index] = batch->results[i];
+        }
+        succeeded += batch->results[i] == 0;
+    }
+    name_batch_destroy(batch);
+    return succeeded;
+}
+
+int tfs_create_many(char const *const *names, size_t count, int *results) {
+    name_batch_t batch;
+    if (name_batch_init(&batch, names, count) == -1) {
+        return -1;
+    }
+
+    if (journal_begin() == -1) {
+        name_batch_destroy(&batch);
+        return -1;
+    }
+
+    // Allocates the inodes all at once
+    size_t first = name_batch_first(&batch);
+    size_t created =
+        inode_create_files(count - first, batch.inumbers + first);
+    for (size_t i = first + created; i < count; i++) {
+        batch.results[i] = -1; // no space in inode table
+    }
+
+    // Adds the entries of each parent directory in a single pass
+    for (size_t start = first, end; start < count; start = end) {
+        end = name_batch_group_end(&batch, start);
+        inode_t *dir_inode = inode_get(batch.names[start].dir_inum);
+        add_dir_entries(dir_inode, batch.sub_names + start,
+                        batch.inumbers + start, end - start,
+                        batch.results + start);
+    }
+
+    for (size_t i = first; i < first + created; i++) {
+        if (batch.results[i] == -1) {
+            inode_delete(batch.inumbers[i]); // the name is taken
+        }
+    }
+
+    if (journal_end() == -1) {
+        name_batch_destroy(&batch);
+        return -1;
+    }
+    return name_batch_finish(&batch, results);
+}
+
+int tfs_lookup_many(char const *const *names, size_t count, int *results) {
+    name_batch_t batch;
+    if (name_batch_init(&batch, names, count) == -1) {
+        return -1;
+    }
+
+    size_t first = name_batch_first(&batch);
+    for (size_t start = first, end; start < count; start = end) {
+        end = name_batch_group_end(&batch, start);
+        inode_t *dir_inode = inode_get(batch.names[start].dir_inum);
+        find_many_in_dir(dir_inode, batch.sub_names + start, end - start,
+                         batch.inumbers + start);
+    }
+    for (size_t i = first; i < count; i++) {
+        batch.results[i] = batch.inumbers[i] == -1 ? -1 : 0;
+    }
+
+    return name_batch_finish(&batch, results);
+}
+
+int tfs_unlink_many(char const *const *names, size_t count, int *results) {
+    name_batch_t batch;
+    if (name_batch_init(&batch, names, count) == -1) {
+        return -1;
+    }
+
+    if (journal_begin() == -1) {
+        name_batch_destroy(&batch);
+        return -1;
+    }
+
+    // Finds the targets, in a single pass over each parent directory
+    size_t first = name_batch_first(&batch);
+    for (size_t start = first, end; start < count; start = end) {
+        end = name_batch_group_end(&batch, start);
+        inode_t *dir_inode = inode_get(batch.names[start].dir_inum);
+        find_many_in_dir(dir_inode, batch.sub_names + start, end - start,
+                         batch.inumbers + start);
+    }
+    for (size_t i = first; i < count; i++) {
+        int inum = batch.inumbers[i];
+        if (inum == -1 || inode_is_directory(inum)) {
+            batch.results[i] = -1;
+        }
+    }
+
+    // Removes their entries in a second pass (see unlink_file)
+    for (size_t start = first, end; start < count; start = end) {
+        end = name_batch_group_end(&batch, start);
+        inode_t *dir_inode = inode_get(batch.names[start].dir_inum);
+        clear_dir_entries(dir_inode, batch.sub_names + start,
+                          batch.inumbers + start, end - start,
+                          batch.results + start);
+    }
+    for (size_t i = first; i < count; i++) {
+        if (batch.results[i] == 0) {
+            drop_link(batch.inumbers[i]);
+        }
+    }
+
+    if (journal_end() == -1) {
+        name_batch_destroy(&batch);
+        return -1;
+    }
+    return name_batch_finish(&batch, results);
+}
+
+int tfs_get_stats(tfs_stats_t *stats) {
+    if (stats == NULL) {
+        return -1;
+    }
+
+    state_stats(stats);
+    return 0;
+}
+
+int tfs_snapshot_create(void) {
+    // No operation can be halfway through while the inodes are copied
+    if (journal_freeze() == -1) {
+        return -1;
+    }
+    int snapshot = snapshot_create();
+    journal_thaw();
+    return snapshot;
+}
+
+int tfs_snapshot_open_readonly(int snapshot, char const *name) {
+    if (!valid_pathname(name) || snapshot_acquire(snapshot) == -1) {
+        return -1;
+    }
+
+    int inum = tfs_lookup(name, snapshot);
+    inode_t const *inode =
+        inum == -1 ? NULL : snapshot_inode_get(snapshot, inum);
+
+    // Symbolic links are followed within the snapshot
+    if (inode != NULL && inode->i_node_type == T_LINK) {
+        char const *target = inode_block_get(inode, 0, NULL);
+        ALWAYS_ASSERT(target != NULL && valid_pathname(target),
+                      "tfs_snapshot_open_readonly: symlink name must be valid");
+        inum = tfs_lookup(target, snapshot);
+        inode = inum == -1 ? NULL : snapshot_inode_get(snapshot, inum);
+    }
+
+    int fhandle = -1;
+    if (inode != NULL && inode->i_node_type == T_FILE) {
+        fhandle = add_to_open_file_table(inum, 0, snapshot);
+    }
+    if (fhandle == -1) {
+        snapshot_release(snapshot);
+    }
+    return fhandle;
+}
+
+int tfs_snapshot_delete(int snapshot) {
+    if (journal_begin() == -1) {
+        return -1;
+    }
+    int result = snapshot_delete(snapshot);
+    return journal_end() == -1 ? -1 : result;
+}
+
+/**
+ * Copies the rest of an external file to an open file, in chunks of
+ * EXTERNAL_CHUNK_SIZE bytes.
+ *
+ * Input:
+ *   - source: file descriptor of the external file
+ *   - dest_file: file handle of the destination file
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int copy_in_chunks(int source, int dest_file) {
+    char *buffer = malloc(EXTERNAL_CHUNK_SIZE);
+    if (buffer == NULL) {
+        return -1;
+    }
+
+    int result = 0;
+    ssize_t read_bytes;
+    while ((read_bytes = read(source, buffer, EXTERNAL_CHUNK_SIZE)) > 0) {
+        if (tfs_write(dest_file, buffer, (size_t)read_bytes) != read_bytes) {
+            result = -1;
+            break;
+        }
+    }
+    if (read_bytes == -1) {
+        result = -1;
+    }
+
+    free(buffer);
+    return result;
+}
+
+/**
+ * Copies an external file to an open file.
+ *
+ * Regular files are mapped and written with a single write, which locks the
+ * destination inode once and copies the contents straight from the page cache
+ * to its blocks (other files, and those that cannot be mapped, are read in
+ * chunks).
+ *
+ * Input:
+ *   - source: file descriptor of the external file
+ *   - dest_file: file handle of the destination file
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int import_file(int source, int dest_file) {
+    struct stat source_stat;
+    if (fstat(source, &source_stat) == -1) {
+        return -1;
+    }
+
+    size_t size = (size_t)source_stat.st_size;
+    void *contents = MAP_FAILED;
+    if (S_ISREG(source_stat.st_mode) && size > 0) {
+        contents = mmap(NULL, size, PROT_READ, MAP_PRIVATE, source, 0);
+    }
+    if (contents == MAP_FAILED) {
+        return copy_in_chunks(source, dest_file);
+    }
+
+    posix_madvise(contents, size, POSIX_MADV_SEQUENTIAL);
+    int result = tfs_write(dest_file, contents, size) == size ? 0 : -1;
+    munmap(contents, size);
+    return result;
+}
+
+int tfs_copy_from_external_fs(char const *source_path, char const *dest_path) {
+    // Checks if the source path name is valid
+    int source = open(source_path, O_RDONLY);
+    if (source == -1) {
+        return -1;
+    }
+
+    // Checks if the destination path name is valid
+    int dest_file = tfs_open(dest_path, TFS_O_CREAT | TFS_O_TRUNC);
+    if (dest_file == -1) {
+        close(source);
+        return -1;
+    }
+
+    int result = import_file(source, dest_file);
+
+    // Close the source file and the destination file
+    if (close(source) == -1) {
+        result = -1;
+    }
+    if (tfs_close(dest_file) == -1) {
+        result = -1;
+    }
+    return result;
+}
+
+/**
+ * Writes the whole contents of several buffers to an external file, retrying
+ * after partial writes.
+ *
+ * Input:
+ *   - dest: file descriptor of the external file
+ *   - iov: the buffers (changed as they are written)
+ *   - iovcnt: number of buffers
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int write_all(int dest, struct iovec *iov, int iovcnt) {
+    while (iovcnt > 0) {
+        ssize_t written = writev(dest, iov, iovcnt);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+
+        size_t left = (size_t)written;
+        while (iovcnt > 0 && left >= iov->iov_len) {
+            left -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + left;
+            iov->iov_len -= left;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Copies an open file to an external file by borrowing its blocks, up to
+ * EXPORT_SPANS extents at a time, and gathering them into a single writev.
+ *
+ * Input:
+ *   - source_file: file handle of the source file
+ *   - dest: file descriptor of the external file
+ *
+ * Returns 0 if successful, 1 if the file's blocks cannot be borrowed (before
+ * anything is written), -1 otherwise.
+ */
+static int copy_borrowed(int source_file, int dest) {
+    tfs_span_t spans[EXPORT_SPANS];
+    struct iovec iov[EXPORT_SPANS];
+    size_t offset = 0;
+    while (true) {
+        int span_count = EXPORT_SPANS;
+        tfs_lease_t lease;
+        ssize_t borrowed = tfs_read_borrow(source_file, offset, SIZE_MAX,
+                                           spans, &span_count, &lease);
+        if (borrowed == -1) {
+            return offset == 0 ? 1 : -1;
+        }
+        if (borrowed == 0) {
+            tfs_read_release(&lease);
+            return 0;
+        }
+
+        for (int i = 0; i < span_count; i++) {
+            iov[i].iov_base = (void *)spans[i].base;
+            iov[i].iov_len = spans[i].len;
+        }
+        int result = write_all(dest, iov, span_count);
+        tfs_read_release(&lease);
+        if (result == -1) {
+            return -1;
+        }
+        offset += (size_t)borrowed;
+    }
+}
+
+/**
+ * Copies the rest of an open file to an external file, through a buffer of
+ * EXTERNAL_CHUNK_SIZE bytes.
+ *
+ * Input:
+ *   - source_file: file handle of the source file
+ *   - dest: file descriptor of the external file
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int copy_through_buffer(int source_file, int dest) {
+    char *buffer = malloc(EXTERNAL_CHUNK_SIZE);
+    if (buffer == NULL) {
+        return -1;
+    }
+
+    int result = 0;
+    ssize_t read_bytes;
+    while ((read_bytes = tfs_read(source_file, buffer, EXTERNAL_CHUNK_SIZE)) >
+           0) {
+        struct iovec iov = {.iov_base = buffer, .iov_len = (size_t)read_bytes};
+        if (write_all(dest, &iov, 1) == -1) {
+            result = -1;
+            break;
+        }
+    }
+    if (read_bytes == -1) {
+        result = -1;
+    }
+
+    free(buffer);
+    return result;
+}
+
+int tfs_copy_to_external_fs(char const *source_path, char const *dest_path) {
+    int source_file = tfs_open(source_path, 0);
+    if (source_file == -1) {
+        return -1;
+    }
+
+    int dest = open(dest_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (dest == -1) {
+        tfs_close(source_file);
+        return -1;
+    }
+
+    // The contents go straight from the blocks of the file to the OS, unless
+    // they are compressed
+    int result = copy_borrowed(source_file, dest);
+    if (result == 1) {
+        result = copy_through_buffer(source_file, dest);
+    }
+
+    if (close(dest) == -1) {
+        result = -1;
+    }
+    if (tfs_close(source_file) == -1) {
+        result = -1;
+    }
+    return result;
+}
+
+/**
+ * File of a tree being imported (see tfs_import_tree).
+ */
+typedef struct {
+    char *source_path;
+    char *dest_path;
+    size_t size;
+} import_file_t;
+
+/**
+ * Contents of a tree being imported: the directories (parents first) and the
+ * files found in it.
+ */
+typedef struct {
+    char **dirs; // destination path names
+    size_t dir_count;
+    size_t dir_capacity;
+    import_file_t *files;
+    size_t file_count;
+    size_t file_capacity;
+} import_tree_t;
+
+static void import_tree_destroy(import_tree_t *tree) {
+    for (size_t i = 0; i < tree->dir_count; i++) {
+        free(tree->dirs[i]);
+    }
+    for (size_t i = 0; i < tree->file_count; i++) {
+        free(tree->files[i].source_path);
+        free(tree->files[i].dest_path);
+    }
+    free(tree->dirs);
+    free(tree->files);
+}
+
+/**
+ * Joins a directory's path name and the name of an entry in it.
+ *
+ * Returns the (allocated) path name of the entry, or NULL if unsuccessful.
+ */
+static char *path_join(char const *dir, char const *name) {
+    size_t length = strlen(dir) + 1 + strlen(name) + 1;
+    char *path = malloc(length);
+    if (path != NULL) {
+        snprintf(path, length, "%s/%s", dir, name);
+    }
+    return path;
+}
+
+/**
+ * Walks a directory tree of the OS' file system, gathering its directories
+ * and regular files.
+ *
+ * Input:
+ *   - tree: where to add them
+ *   - source_dir: path name of the directory to walk
+ *   - dest_dir: path name of its destination in TécnicoFS
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int import_tree_walk(import_tree_t *tree, char const *source_dir,
+                            char const *dest_dir) {
+    DIR *dir = opendir(source_dir);
+    if (dir == NULL) {
+        return -1;
+    }
+
+    int result = 0;
+    struct dirent *entry;
+    while (result == 0 && (entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 ||
+            strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+
+        char *source_path = path_join(source_dir, entry->d_name);
+        char *dest_path = path_join(dest_dir, entry->d_name);
+        struct stat source_stat;
+        if (source_path == NULL || dest_path == NULL ||
+            lstat(source_path, &source_stat) == -1) {
+            result = -1;
+        } else if (S_ISDIR(source_stat.st_mode)) {
+            if (tree->dir_count == tree->dir_capacity) {
+                size_t capacity = 2 * tree->dir_capacity + 16;
+                char **dirs = realloc(tree->dirs, capacity * sizeof(char *));
+                if (dirs != NULL) {
+                    tree->dirs = dirs;
+                    tree->dir_capacity = capacity;
+                }
+            }
+            if (tree->dir_count < tree->dir_capacity) {
+                tree->dirs[tree->dir_count++] = dest_path;
+                result = import_tree_walk(tree, source_path, dest_path);
+                dest_path = NULL; // owned by the tree
+            } else {
+                result = -1;
+            }
+        } else if (S_ISREG(source_stat.st_mode)) {
+            if (tree->file_count == tree->file_capacity) {
+                size_t capacity = 2 * tree->file_capacity + 16;
+                import_file_t *files =
+                    realloc(tree->files, capacity * sizeof(import_file_t));
+                if (files != NULL) {
+                    tree->files = files;
+                    tree->file_capacity = capacity;
+                }
+            }
+            if (tree->file_count < tree->file_capacity) {
+                import_file_t *file = &tree->files[tree->file_count++];
+                file->source_path = source_path;
+                file->dest_path = dest_path;
+                file->size = (size_t)source_stat.st_size;
+                source_path = dest_path = NULL; // owned by the tree
+            } else {
+                result = -1;
+            }
+        }
+        free(source_path);
+        free(dest_path);
+    }
+
+    closedir(dir);
+    return result;
+}
+
+/**
+ * Creates a directory, unless it already exists.
+ *
+ * Returns 0 if successful, -1 otherwise (including if the path exists but is
+ * not a directory).
+ */
+static int import_mkdir(char const *path) {
+    if (tfs_mkdir(path) == 0) {
+        return 0;
+    }
+    int inum = tfs_lookup(path, NO_SNAPSHOT);
+    return inum != -1 && inode_is_directory(inum) ? 0 : -1;
+}
+
+/**
+ * Reserves the blocks an open (empty) file needs to hold a given size, so
+ * that writing its contents needs no allocation.
+ *
+ * Input:
+ *   - fhandle: file handle
+ *   - size: the size of the contents
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int reserve_blocks(int fhandle, size_t size) {
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    if (file == NULL) {
+        return -1;
+    }
+    int inum = file->of_inumber;
+    inode_t *inode = inode_get(inum);
+    ALWAYS_ASSERT(inode != NULL, "tfs_import_tree: inode of open file deleted");
+
+    size_t block_size = state_block_size();
+    size_t block_count = (size + block_size - 1) / block_size;
+    size_t reserved = block_count;
+
+    // Compressed files allocate their chunks as they are written
+    if (journal_begin() == -1) {
+        return -1;
+    }
+    inode_write_lock(inum);
+    if (!(inode->i_flags & INODE_COMPRESSED)) {
+        reserved = inode_grow(inode, block_count);
+    }
+    inode_unlock(inum);
+
+    return journal_end() == -1 || reserved != block_count ? -1 : 0;
+}
+
+/**
+ * Creates all the files of a tree at once (overwriting existing ones), and
+ * reserves their blocks, from a single thread, so that each file gets them in
+ * as few extents as possible.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int import_tree_reserve(import_tree_t const *tree) {
+    char const **names = malloc(tree->file_count * sizeof(char const *));
+    if (names == NULL && tree->file_count > 0) {
         return -1;
     }
+    for (size_t i = 0; i < tree->file_count; i++) {
+        names[i] = tree->files[i].dest_path;
+    }
+    int created = tfs_create_many(names, tree->file_count, NULL);
+    free(names);
+    if (created == -1) {
+        return -1;
+    }
+
+    // (files that were not created must already exist)
+    for (size_t i = 0; i < tree->file_count; i++) {
+        int fhandle = tfs_open(tree->files[i].dest_path, TFS_O_TRUNC);
+        if (fhandle == -1) {
+            return -1;
+        }
+        int result = reserve_blocks(fhandle, tree->files[i].size);
+        if (tfs_close(fhandle) == -1 || result == -1) {
+            return -1;
+        }
+    }
     return 0;
 }
+
+/**
+ * Copies a file of a tree (see import_file).
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int import_tree_file(import_file_t const *file) {
+    int source = open(file->source_path, O_RDONLY);
+    if (source == -1) {
+        return -1;
+    }
+    int dest_file = tfs_open(file->dest_path, 0);
+    if (dest_file == -1) {
+        close(source);
+        return -1;
+    }
+
+    int result = import_file(source, dest_file);
+    if (close(source) == -1) {
+        result = -1;
+    }
+    if (tfs_close(dest_file) == -1) {
+        result = -1;
+    }
+    return result;
+}
+
+/**
+ * Files left for a thread of an import pool to copy. Its thread takes them
+ * from the head, other threads steal them from the tail.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    size_t *files; // indices of the files in the tree
+    size_t head;
+    size_t tail;
+} import_queue_t;
+
+/**
+ * Threads copying the files of a tree.
+ */
+typedef struct {
+    import_tree_t const *tree;
+    import_queue_t *queues; // one per thread
+    size_t thread_count;
+    atomic_bool failed;
+} import_pool_t;
+
+typedef struct {
+    import_pool_t *pool;
+    size_t id;
+} import_worker_t;
+
+/**
+ * Takes a file from a queue.
+ *
+ * Input:
+ *   - queue: the queue
+ *   - steal: whether the file is taken by another thread (from the tail)
+ *   - file: set to the index of the file
+ *
+ * Returns true if a file was taken, false if the queue is empty.
+ */
+static bool import_queue_take(import_queue_t *queue, bool steal,
+                              size_t *file) {
+    mutex_lock(&queue->lock);
+    bool taken = queue->head < queue->tail;
+    if (taken) {
+        *file = steal ? queue->files[--queue->tail]
+                      : queue->files[queue->head++];
+    }
+    mutex_unlock(&queue->lock);
+    return taken;
+}
+
+static void *import_worker(void *arg) {
+    import_worker_t const *worker = arg;
+    import_pool_t *pool = worker->pool;
+
+    while (!atomic_load(&pool->failed)) {
+        // Own files first, then those of the other threads (no files are
+        // added, so once all queues are empty the work is done)
+        size_t file;
+        bool taken = import_queue_take(&pool->queues[worker->id], false, &file);
+        for (size_t i = 1; !taken && i < pool->thread_count; i++) {
+            size_t victim = (worker->id + i) % pool->thread_count;
+            taken = import_queue_take(&pool->queues[victim], true, &file);
+        }
+        if (!taken) {
+            break;
+        }
+
+        if (import_tree_file(&pool->tree->files[file]) == -1) {
+            atomic_store(&pool->failed, true);
+        }
+    }
+
+    return NULL;
+}
+
+static int import_file_compare(void const *a, void const *b) {
+    import_file_t const *file_a = a;
+    import_file_t const *file_b = b;
+    return (file_a->size < file_b->size) - (file_a->size > file_b->size);
+}
+
+/**
+ * Copies the files of a tree with a pool of threads. The files are dealt to
+ * the threads largest first, so that the largest ones start early and the
+ * smallest ones, stolen last, even out the work.
+ *
+ * Input:
+ *   - tree: the tree (with its files sorted by decreasing size)
+ *   - thread_count: number of threads
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int import_tree_copy(import_tree_t const *tree, size_t thread_count) {
+    if (tree->file_count == 0) {
+        return 0;
+    }
+    if (thread_count > tree->file_count) {
+        thread_count = tree->file_count;
+    }
+
+    import_pool_t pool = {.tree = tree, .thread_count = thread_count};
+    atomic_init(&pool.failed, false);
+    pool.queues = malloc(thread_count * sizeof(import_queue_t));
+    import_worker_t *workers = malloc(thread_count * sizeof(import_worker_t));
+    pthread_t *threads = malloc(thread_count * sizeof(pthread_t));
+    size_t *files = malloc(tree->file_count * sizeof(size_t));
+    if (pool.queues == NULL || workers == NULL || threads == NULL ||
+        files == NULL) {
+        free(pool.queues);
+        free(workers);
+        free(threads);
+        free(files);
+        return -1;
+    }
+
+    // Thread t gets files t, t + thread_count, ... (stored contiguously)
+    size_t next = 0;
+    for (size_t t = 0; t < thread_count; t++) {
+        import_queue_t *queue = &pool.queues[t];
+        mutex_init(&queue->lock);
+        queue->files = files + next;
+        queue->head = 0;
+        queue->tail = 0;
+        for (size_t i = t; i < tree->file_count; i += thread_count) {
+            queue->files[queue->tail++] = i;
+        }
+        next += queue->tail;
+    }
+
+    size_t started = 0;
+    for (; started < thread_count; started++) {
+        workers[started].pool = &pool;
+        workers[started].id = started;
+        if (pthread_create(&threads[started], NULL, import_worker,
+                           &workers[started]) != 0) {
+            atomic_store(&pool.failed, true);
+            break;
+        }
+    }
+    for (size_t t = 0; t < started; t++) {
+        pthread_join(threads[t], NULL);
+    }
+
+    for (size_t t = 0; t < thread_count; t++) {
+        mutex_destroy(&pool.queues[t].lock);
+    }
+    free(pool.queues);
+    free(workers);
+    free(threads);
+    free(files);
+
+    return atomic_load(&pool.failed) ? -1 : 0;
+}
+
+int tfs_import_tree(char const *source_dir, char const *dest_dir,
+                    size_t thread_count) {
+    if (source_dir == NULL || dest_dir == NULL) {
+        return -1;
+    }
+    if (!valid_pathname(dest_dir) && strcmp(dest_dir, "/") != 0) {
+        return -1;
+    }
+    if (thread_count == 0) {
+        return -1;
+    }
+
+    // The destination, without trailing '/' characters (empty for the root
+    // directory)
+    size_t length = strlen(dest_dir);
+    while (length > 0 && dest_dir[length - 1] == '/') {
+        length--;
+    }
+    char *prefix = strndup(dest_dir, length);
+    if (prefix == NULL) {
+        return -1;
+    }
+
+    import_tree_t tree = {0};
+    int result = length > 0 ? import_mkdir(prefix) : 0;
+    if (result == 0) {
+        result = import_tree_walk(&tree, source_dir, prefix);
+    }
+    for (size_t i = 0; result == 0 && i < tree.dir_count; i++) {
+        result = import_mkdir(tree.dirs[i]);
+    }
+
+    if (result == 0 && tree.file_count > 0) {
+        qsort(tree.files, tree.file_count, sizeof(import_file_t),
+              import_file_compare);
+        result = import_tree_reserve(&tree);
+    }
+    if (result == 0) {
+        result = import_tree_copy(&tree, thread_count);
+    }
+
+    import_tree_destroy(&tree);
+    free(prefix);
+    return result;
+}
@@ -2,7 +2,9 @@
 #define OPERATIONS_H
 
 #include "config.h"
+#include <stdbool.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 /**
  * TécnicoFS parameters.
@@ -13,6 +15,16 @@ typedef struct {
     size_t max_open_files_count;
 
     size_t block_size;
+
+    // path (in the OS' file system) of the file holding the FS image, which is
+    // loaded if it exists and created otherwise; NULL to keep the FS in memory
+    // only. Once its journal cannot be written (e.g., if the disk is full),
+    // the operations that change the FS fail (their changes may be lost)
+    char const *image_path;
+
+    // whether full blocks with the same contents are stored only once (shared
+    // by the files that hold them)
+    bool dedup;
 } tfs_params;
 
 /**
@@ -22,12 +34,15 @@ tfs_params tfs_default_params();
 
 /**
  * Initialize tecnicofs, optionally with a given configuration.
+ * If the configuration names an existing image file, its contents are loaded
+ * (the image must have been created with the same inode count, block count and
+ * block size).
  * Returns 0 if successful, -1 otherwise.
  */
 int tfs_init(tfs_params const *params);
 
 /**
- * Destroy tecnicofs.
+ * Destroy tecnicofs (writing its image back to the image file, if any).
  * Returns 0 if successful, -1 otherwise.
  */
 int tfs_destroy();
@@ -36,20 +51,25 @@ int tfs_destroy();
  * TécnicoFS file opening modes.
  */
 typedef enum {
-    TFS_O_CREAT = 0b001,
-    TFS_O_TRUNC = 0b010,
-    TFS_O_APPEND = 0b100,
+    TFS_O_CREAT = 0b0001,
+    TFS_O_TRUNC = 0b0010,
+    TFS_O_APPEND = 0b0100,
+    TFS_O_COMPRESS = 0b1000,
 } tfs_file_mode_t;
 
 /**
  * Open a file.
  *
  * Input:
- *   - name: absolute path name
+ *   - name: absolute path name (e.g. "/dir/file"), whose intermediate
+ *     components must be existing directories
  *   - mode: can be a combination (with bitwise or) of the following flags:
  *     - append mode (TFS_O_APPEND)
  *     - truncate file contents (TFS_O_TRUNC)
  *     - create file if it does not exist (TFS_O_CREAT)
+ *     - compress the file's contents (TFS_O_COMPRESS), if it is empty (once
+ *       created or truncated); the file then stays compressed, and cannot be
+ *       read with tfs_read_borrow
  *
  * Returns file handle of the opened file if successful, -1 otherwise.
  */
@@ -108,15 +128,192 @@ ssize_t tfs_write(int fhandle, void const *buffer, size_t len);
  *   - buffer: destination buffer
  *   - len: length of the buffer
  *
+ * The blocks read are checked against their checksums (kept since they were
+ * last written), so corrupted contents are never returned.
+ *
  * Returns the number of bytes that were copied from the file to the buffer (can
- * be lower than 'len' if the file size was reached), or -1 in case of error.
+ * be lower than 'len' if the file size was reached), or -1 in case of error
+ * (including if the blocks read are corrupted).
  */
 ssize_t tfs_read(int fhandle, void *buffer, size_t len);
 
+/**
+ * Write to an open file at a given offset, without using nor changing the
+ * current offset.
+ *
+ * Writing past the end of the file leaves a hole in the gap: it reads as
+ * zeros, but takes no data blocks (unless the file is compressed, in which
+ * case it is filled with zeros).
+ *
+ * Input:
+ *   - fhandle: file handle (obtained from a previous call to tfs_open)
+ *   - buffer: buffer containing the contents to write
+ *   - len: length of the buffer contents (in bytes)
+ *   - offset: offset in the file where to write
+ *
+ * Returns the number of bytes that were written (can be lower than 'len' if the
+ * maximum file size is exceeded), or -1 in case of error.
+ */
+ssize_t tfs_pwrite(int fhandle, void const *buffer, size_t len, size_t offset);
+
+/**
+ * Read from an open file at a given offset, without using nor changing the
+ * current offset.
+ *
+ * Input:
+ *   - fhandle: file handle (obtained from a previous call to tfs_open)
+ *   - buffer: destination buffer
+ *   - len: length of the buffer
+ *   - offset: offset in the file where to read from
+ *
+ * Returns the number of bytes that were copied from the file to the buffer (0
+ * if the offset is at or past the end of the file), or -1 in case of error.
+ */
+ssize_t tfs_pread(int fhandle, void *buffer, size_t len, size_t offset);
+
+/**
+ * Write to an open file, starting at the current offset, gathering the
+ * contents from several buffers (in a single atomic write).
+ *
+ * Input:
+ *   - fhandle: file handle (obtained from a previous call to tfs_open)
+ *   - iov: array of buffers (base and length) containing the contents to write
+ *   - iovcnt: number of buffers
+ *
+ * Returns the number of bytes that were written (can be lower than the total
+ * length of the buffers if the maximum file size is exceeded), or -1 in case
+ * of error.
+ */
+ssize_t tfs_writev(int fhandle, struct iovec const *iov, int iovcnt);
+
+/**
+ * Read from an open file, starting at the current offset, scattering the
+ * contents over several buffers (in a single atomic read).
+ *
+ * Input:
+ *   - fhandle: file handle (obtained from a previous call to tfs_open)
+ *   - iov: array of destination buffers (base and length), filled in order
+ *   - iovcnt: number of buffers
+ *
+ * Returns the number of bytes that were copied from the file to the buffers
+ * (can be lower than their total length if the file size was reached), or -1
+ * in case of error.
+ */
+ssize_t tfs_readv(int fhandle, struct iovec const *iov, int iovcnt);
+
+/**
+ * Like tfs_writev, but at a given offset, without using nor changing the
+ * current offset (see tfs_pwrite).
+ */
+ssize_t tfs_pwritev(int fhandle, struct iovec const *iov, int iovcnt,
+                    size_t offset);
+
+/**
+ * Like tfs_readv, but at a given offset, without using nor changing the
+ * current offset (see tfs_pread).
+ */
+ssize_t tfs_preadv(int fhandle, struct iovec const *iov, int iovcnt,
+                   size_t offset);
+
+/**
+ * Change the size of an open file.
+ *
+ * A file that grows is extended with a hole (see tfs_pwrite). The data blocks
+ * past the end of a file that shrinks are freed lazily, in the background.
+ *
+ * Input:
+ *   - fhandle: file handle (obtained from a previous call to tfs_open)
+ *   - length: the new size of the file
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_ftruncate(int fhandle, size_t length);
+
+/**
+ * Turn a range of an open file into a hole, returning its data blocks to the
+ * allocator. The range then reads as zeros, and the size of the file does not
+ * change.
+ *
+ * Only whole blocks are freed: the parts of the range in its first and last
+ * blocks are zeroed instead (as are the chunks of compressed files, which
+ * then take little space).
+ *
+ * Input:
+ *   - fhandle: file handle (obtained from a previous call to tfs_open)
+ *   - offset: offset in the file where the range starts
+ *   - len: length of the range
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_punch_hole(int fhandle, size_t offset, size_t len);
+
+/**
+ * Span of file contents borrowed with tfs_read_borrow.
+ */
+typedef struct {
+    void const *base;
+    size_t len;
+} tfs_span_t;
+
+/**
+ * Lease on borrowed file contents.
+ */
+typedef struct {
+    int inumber; // -1 once released
+} tfs_lease_t;
+
+/**
+ * Borrow the contents of an open file at a given offset, without copying them.
+ *
+ * The spans point directly to the blocks holding the contents, which are
+ * pinned until the lease is released. Writes to the file (from any thread,
+ * including the lease holder) go through, changing the blocks in place, so
+ * they show up in the spans. Whatever would free the blocks or move them
+ * elsewhere waits for the lease instead: opening the file with TFS_O_TRUNC,
+ * deleting it, punching holes in it, extending it after it shrank, and
+ * writing to blocks shared with snapshots or other files. The lease holder
+ * must thus not do any of these itself (nor create snapshots while others may
+ * be waiting for the lease), and must not write through the spans. Holes are
+ * lent as spans of zeros.
+ *
+ * Input:
+ *   - fhandle: file handle (obtained from a previous call to tfs_open)
+ *   - offset: offset in the file where to start
+ *   - len: number of bytes to borrow
+ *   - spans: array where to store the spans (one per run of contiguous
+ *     blocks)
+ *   - span_count: capacity of spans (at least 1); set to the number of spans
+ *     filled
+ *   - lease: set to the lease on the spans, to be released with
+ *     tfs_read_release (even if no bytes were borrowed)
+ *
+ * Returns the number of bytes borrowed (can be lower than 'len' if the file
+ * size was reached or there were not enough spans), or -1 in case of error (in
+ * which case there is no lease to release).
+ */
+ssize_t tfs_read_borrow(int fhandle, size_t offset, size_t len,
+                        tfs_span_t *spans, int *span_count,
+                        tfs_lease_t *lease);
+
+/**
+ * Release the lease on contents borrowed with tfs_read_borrow. The spans must
+ * not be used after this.
+ *
+ * Input:
+ *   - lease: the lease
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_read_release(tfs_lease_t *lease);
+
 /**
  * Delete a link, or a file if the number of hard links reaches 0, that
  * exists in TécnicoFS.
  *
+ * Only the name is removed right away: a deleted file can still be used
+ * through the handles that were open on it, and its inode and data blocks are
+ * freed in the background once they are all closed.
+ *
  * Input:
  *   - target: path name of the target (in TécnicoFS)
  *
@@ -124,6 +321,150 @@ ssize_t tfs_read(int fhandle, void *buffer, size_t len);
  */
 int tfs_unlink(char const *target);
 
+/**
+ * Create a directory.
+ *
+ * Input:
+ *   - name: absolute path name of the directory (its parent must exist)
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_mkdir(char const *name);
+
+/**
+ * Remove an empty directory.
+ *
+ * Input:
+ *   - name: absolute path name of the directory
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_rmdir(char const *name);
+
+/**
+ * Create many (empty) files at once. The names in the same directory are
+ * added to it with a single pass over it, and the inodes of all the files are
+ * allocated together.
+ *
+ * Input:
+ *   - names: absolute path names of the files, whose intermediate components
+ *     must be existing directories
+ *   - count: number of path names
+ *   - results: where to store, for each path name, 0 if the file was created
+ *     or -1 otherwise (e.g., if a file with that name already exists); can be
+ *     NULL
+ *
+ * Returns the number of files created, or -1 in case of error.
+ */
+int tfs_create_many(char const *const *names, size_t count, int *results);
+
+/**
+ * Check whether many files (or directories) exist, with a single pass over
+ * each directory they are in.
+ *
+ * Input:
+ *   - names: absolute path names
+ *   - count: number of path names
+ *   - results: where to store, for each path name, 0 if it exists or -1
+ *     otherwise; can be NULL
+ *
+ * Returns the number of path names that exist, or -1 in case of error.
+ */
+int tfs_lookup_many(char const *const *names, size_t count, int *results);
+
+/**
+ * Delete many links at once (see tfs_unlink), with a single pass over each
+ * directory they are in to find them, and another to remove them.
+ *
+ * Input:
+ *   - names: absolute path names of the targets
+ *   - count: number of path names
+ *   - results: where to store, for each path name, 0 if it was deleted or -1
+ *     otherwise; can be NULL
+ *
+ * Returns the number of links deleted, or -1 in case of error.
+ */
+int tfs_unlink_many(char const *const *names, size_t count, int *results);
+
+/**
+ * Take a point-in-time snapshot of the whole file system.
+ *
+ * Only metadata is copied: the data blocks of files are shared with the live
+ * file system until they are written to (or truncated), at which point the
+ * writer copies them. Snapshots are not kept in the image.
+ *
+ * Returns the snapshot number if successful, -1 otherwise.
+ */
+int tfs_snapshot_create(void);
+
+/**
+ * Open a file, as it was when a snapshot was taken, for reading only.
+ *
+ * Reads of the file do not take any locks, so they never wait for (nor delay)
+ * writers of the live file system. Writes to the file fail, as do borrowed
+ * reads (tfs_read_borrow).
+ *
+ * Input:
+ *   - snapshot: the snapshot number (obtained from tfs_snapshot_create)
+ *   - name: absolute path name of the file in the snapshot
+ *
+ * Returns file handle if successful, -1 otherwise.
+ */
+int tfs_snapshot_open_readonly(int snapshot, char const *name);
+
+/**
+ * Delete a snapshot, freeing the blocks only it still holds.
+ *
+ * Input:
+ *   - snapshot: the snapshot number
+ *
+ * Returns 0 if successful, -1 otherwise (including if files of the snapshot
+ * are open).
+ */
+int tfs_snapshot_delete(int snapshot);
+
+/**
+ * TécnicoFS statistics (since tfs_init).
+ */
+typedef struct {
+    // Compressed files: bytes compressed, the bytes they took once stored (in
+    // whole blocks, with their headers), and the ratio between them
+    size_t compress_in_bytes;
+    size_t compress_stored_bytes;
+    double compression_ratio;
+    // CPU time spent compressing and decompressing, and bytes decompressed
+    size_t compress_ns;
+    size_t decompress_ns;
+    size_t decompress_out_bytes;
+
+    // Blocks written that were found in the content index (see
+    // tfs_params.dedup), and so took no new data block
+    size_t dedup_hits;
+
+    // Unlinked files whose inodes and data blocks are not yet freed (as they
+    // are still open, or waiting for the background reclaimer), and those
+    // already freed
+    size_t orphans_pending;
+    size_t orphans_reclaimed;
+
+    // Accesses to inodes, blocks and bitmaps that hit the buffer cache, those
+    // that missed it (and so paid the storage access delay), and dirty units
+    // written back to storage
+    size_t cache_hits;
+    size_t cache_misses;
+    size_t cache_write_backs;
+} tfs_stats_t;
+
+/**
+ * Obtain the statistics of TécnicoFS.
+ *
+ * Input:
+ *   - stats: where to store them
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_get_stats(tfs_stats_t *stats);
+
 /**
  * Copy the contents of a file that exists in the OS' file system tree
  * (outside TécnicoFS) to the TécnicoFS.
@@ -137,4 +478,162 @@ int tfs_unlink(char const *target);
  */
 int tfs_copy_from_external_fs(char const *source_path, char const *dest_path);
 
+/**
+ * Copy the contents of a file in TécnicoFS to a file in the OS' file system
+ * tree (outside TécnicoFS).
+ *
+ * The contents are written straight from the blocks that hold them (see
+ * tfs_read_borrow), so writes to the file wait while they are copied.
+ *
+ * Input:
+ *   - source_path: absolute path name of the source file (in TécnicoFS)
+ *   - dest_path: path name of the destination file (in the OS' file system),
+ *     which is created if needed, and overwritten if it already exists
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_copy_to_external_fs(char const *source_path, char const *dest_path);
+
+/**
+ * Import a directory tree of the OS' file system into TécnicoFS, copying its
+ * files in parallel.
+ *
+ * The tree is walked first: its directories are created, then all its files at
+ * once (see tfs_create_many), and the blocks each file needs are reserved, so
+ * that copying them allocates nothing. The files are then copied by a pool of
+ * threads, largest first, with threads that run out of files taking them from
+ * the others.
+ *
+ * Only directories and regular files are imported (symbolic links and special
+ * files are skipped), and existing files are overwritten.
+ *
+ * Input:
+ *   - source_dir: path name of the directory (in the OS' file system)
+ *   - dest_dir: absolute path name of the directory (in TécnicoFS) where its
+ *     contents are placed, which is created if needed ("/" for the root
+ *     directory)
+ *   - thread_count: number of threads copying files (each one keeps a file
+ *     open at a time)
+ *
+ * Returns 0 if successful, -1 otherwise (in which case part of the tree may
+ * have been imported).
+ */
+int tfs_import_tree(char const *source_dir, char const *dest_dir,
+                    size_t thread_count);
+
+/**
+ * Asynchronous operations
+ *
+ * Requests are queued in the submission ring of a ring, and run by its worker
+ * threads, which queue the result of each one in its completion ring. Many
+ * requests can thus be in flight at the same time.
+ *
+ * The requests submitted together (with a single call to tfs_ring_submit) form
+ * a batch, which is run by a single worker in order, except that reads (or
+ * writes) of the same file handle submitted one after the other may be merged
+ * into a single vectored read (or write), and positional ones reordered by
+ * offset to allow it (writes only if they do not overlap). Requests of
+ * different batches may run in any order.
+ */
+typedef struct tfs_ring tfs_ring_t;
+
+typedef enum {
+    TFS_RING_OPEN,
+    TFS_RING_CLOSE,
+    TFS_RING_READ,
+    TFS_RING_WRITE,
+    TFS_RING_UNLINK,
+} tfs_ring_op_t;
+
+/**
+ * Request submitted to a ring, with the arguments of the equivalent call.
+ */
+typedef struct {
+    tfs_ring_op_t op;
+    char const *name;     // open, unlink
+    tfs_file_mode_t mode; // open
+    int fhandle;          // close, read, write
+    void *buffer;         // read, write
+    size_t len;           // read, write
+    // read, write: offset in the file (as in tfs_pread and tfs_pwrite), or -1
+    // to use (and advance) the current offset of the handle
+    ssize_t offset;
+    void *user_data; // returned with the completion
+} tfs_ring_request_t;
+
+/**
+ * Completion of a request.
+ */
+typedef struct {
+    void *user_data;
+    ssize_t result; // what the equivalent call returns
+} tfs_ring_completion_t;
+
+/**
+ * Create a ring.
+ *
+ * Input:
+ *   - entries: maximum number of requests in flight (submitted and whose
+ *     completions were not reaped yet)
+ *   - workers: number of worker threads
+ *
+ * Returns the ring if successful, NULL otherwise.
+ */
+tfs_ring_t *tfs_ring_create(size_t entries, size_t workers);
+
+/**
+ * Submit a batch of requests to a ring.
+ *
+ * Input:
+ *   - ring: the ring
+ *   - requests: the requests (copied to the submission ring, but the names and
+ *     buffers they point to must stay valid until they complete)
+ *   - count: number of requests
+ *
+ * Returns the number of requests submitted (all of them) if successful, -1
+ * otherwise (including if the ring does not have room for them all).
+ */
+ssize_t tfs_ring_submit(tfs_ring_t *ring, tfs_ring_request_t const *requests,
+                        size_t count);
+
+/**
+ * Reap the completions of requests submitted to a ring, in the order they
+ * completed.
+ *
+ * Input:
+ *   - ring: the ring
+ *   - completions: where to store the completions
+ *   - max: maximum number of completions to reap
+ *   - wait_for: number of completions to wait for (0 not to wait)
+ *
+ * Returns the number of completions reaped if successful, -1 otherwise
+ * (including if wait_for is greater than max or than the number of requests in
+ * flight).
+ */
+ssize_t tfs_ring_reap(tfs_ring_t *ring, tfs_ring_completion_t *completions,
+                      size_t max, size_t wait_for);
+
+/**
+ * Obtain the eventfd of a ring, for event loops: it becomes readable when
+ * requests complete (its counter is increased by the number of completions),
+ * and is non-blocking. Reading it is left to the caller.
+ *
+ * Input:
+ *   - ring: the ring
+ *
+ * Returns the file descriptor, which is valid until the ring is destroyed.
+ */
+int tfs_ring_eventfd(tfs_ring_t const *ring);
+
+/**
+ * Destroy a ring, once the requests submitted to it complete (completions not
+ * reaped are discarded). Rings must be destroyed before TécnicoFS itself.
+ *
+ * Input:
+ *   - ring: the ring
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_ring_destroy(tfs_ring_t *ring);
+
 #endif // OPERATIONS_H
@@ -0,0 +1,435 @@
+#include "betterassert.h"
+#include "config.h"
+#include "operations.h"
+#include "utils.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+/*
+ * Worker thread, with room for a whole batch (allocated along with the ring)
+ */
+typedef struct {
+    pthread_t thread;
+    tfs_ring_t *ring;
+    tfs_ring_request_t *batch;
+    ssize_t *results;
+} ring_worker_t;
+
+/*
+ * Submission/completion rings
+ *
+ * Both rings are circular arrays with room for every request in flight, so
+ * submissions are admitted only while there is room for their completions,
+ * and workers never wait to queue one. Each entry of the submission ring
+ * records whether it ends its batch; a worker takes a whole batch at once,
+ * runs it without holding the lock of the ring, and then queues all its
+ * completions (and signals the eventfd) together.
+ */
+struct tfs_ring {
+    pthread_mutex_t lock;
+    pthread_cond_t submitted; // requests were queued, or the ring is destroyed
+    pthread_cond_t completed; // completions were queued
+
+    size_t entries;
+    size_t in_flight; // submitted, and whose completions were not reaped
+
+    tfs_ring_request_t *requests;
+    bool *batch_ends;
+    size_t request_head;
+    size_t request_count;
+
+    tfs_ring_completion_t *completions;
+    size_t completion_head;
+    size_t completion_count;
+
+    bool stopping;
+    int event_fd;
+
+    ring_worker_t *workers;
+    size_t worker_count; // started
+    tfs_ring_request_t *batches; // entries for each worker
+    ssize_t *results;            // entries for each worker
+};
+
+/**
+ * Run a single request.
+ *
+ * Input:
+ *   - request: the request
+ *
+ * Returns the result of the equivalent call.
+ */
+static ssize_t ring_run_one(tfs_ring_request_t const *request) {
+    switch (request->op) {
+    case TFS_RING_OPEN:
+        return tfs_open(request->name, request->mode);
+    case TFS_RING_CLOSE:
+        return tfs_close(request->fhandle);
+    case TFS_RING_UNLINK:
+        return tfs_unlink(request->name);
+    case TFS_RING_READ:
+        if (request->offset < 0) {
+            return tfs_read(request->fhandle, request->buffer, request->len);
+        }
+        return tfs_pread(request->fhandle, request->buffer, request->len,
+                         (size_t)request->offset);
+    case TFS_RING_WRITE:
+        if (request->offset < 0) {
+            return tfs_write(request->fhandle, request->buffer, request->len);
+        }
+        return tfs_pwrite(request->fhandle, request->buffer, request->len,
+                          (size_t)request->offset);
+    default:
+        return -1;
+    }
+}
+
+/**
+ * Check whether two requests are reads (or writes) of the same file handle,
+ * both at the current offset or both at a given one, which can thus be merged.
+ */
+static bool ring_can_merge(tfs_ring_request_t const *a,
+                           tfs_ring_request_t const *b) {
+    return (a->op == TFS_RING_READ || a->op == TFS_RING_WRITE) &&
+           a->op == b->op && a->fhandle == b->fhandle &&
+           (a->offset < 0) == (b->offset < 0);
+}
+
+/**
+ * Run requests merged into a single vectored read or write, and split its
+ * result among them (in the order they were merged).
+ *
+ * Input:
+ *   - requests: the requests of the batch
+ *   - order: indices of the requests merged, in the order of their ranges
+ *   - count: number of requests merged (at most RING_MAX_MERGE)
+ *   - results: where to store the results (by index)
+ */
+static void ring_run_merged(tfs_ring_request_t const *requests,
+                            size_t const *order, size_t count,
+                            ssize_t *results) {
+    struct iovec iov[RING_MAX_MERGE];
+    for (size_t i = 0; i < count; i++) {
+        iov[i].iov_base = requests[order[i]].buffer;
+        iov[i].iov_len = requests[order[i]].len;
+    }
+
+    tfs_ring_request_t const *first = &requests[order[0]];
+    int fhandle = first->fhandle;
+    ssize_t done;
+    if (first->op == TFS_RING_READ && first->offset < 0) {
+        done = tfs_readv(fhandle, iov, (int)count);
+    } else if (first->op == TFS_RING_READ) {
+        done = tfs_preadv(fhandle, iov, (int)count, (size_t)first->offset);
+    } else if (first->offset < 0) {
+        done = tfs_writev(fhandle, iov, (int)count);
+    } else {
+        done = tfs_pwritev(fhandle, iov, (int)count, (size_t)first->offset);
+    }
+
+    // Each request gets the bytes of its own range
+    for (size_t i = 0; i < count; i++) {
+        size_t len = requests[order[i]].len;
+        if (done < 0) {
+            results[order[i]] = -1;
+        } else {
+            size_t part = ((size_t)done < len ? (size_t)done : len);
+            results[order[i]] = (ssize_t)part;
+            done -= (ssize_t)part;
+        }
+    }
+}
+
+/**
+ * Run a run of requests that can be merged (see ring_can_merge): positional
+ * ones are sorted by offset (writes only if none overlap), and those whose
+ * ranges follow each other are merged.
+ *
+ * Input:
+ *   - requests: the requests of the batch
+ *   - first: index of the first request of the run
+ *   - count: number of requests in the run (at most RING_MAX_MERGE)
+ *   - results: where to store the results (by index)
+ */
+static void ring_run_mergeable(tfs_ring_request_t const *requests,
+                               size_t first, size_t count, ssize_t *results) {
+    size_t order[RING_MAX_MERGE];
+    for (size_t i = 0; i < count; i++) {
+        order[i] = first + i;
+    }
+
+    bool positional = requests[first].offset >= 0;
+    if (positional) {
+        size_t sorted[RING_MAX_MERGE];
+        for (size_t i = 0; i < count; i++) {
+            size_t j = i;
+            for (; j > 0 && requests[sorted[j - 1]].offset >
+                                requests[order[i]].offset;
+                 j--) {
+                sorted[j] = sorted[j - 1];
+            }
+            sorted[j] = order[i];
+        }
+
+        bool overlap = false;
+        for (size_t i = 1; i < count; i++) {
+            tfs_ring_request_t const *prev = &requests[sorted[i - 1]];
+            overlap |= (size_t)prev->offset + prev->len >
+                       (size_t)requests[sorted[i]].offset;
+        }
+        if (requests[first].op == TFS_RING_READ || !overlap) {
+            for (size_t i = 0; i < count; i++) {
+                order[i] = sorted[i];
+            }
+        }
+    }
+
+    for (size_t start = 0; start < count;) {
+        size_t end = start + 1;
+        while (end < count && positional) {
+            tfs_ring_request_t const *prev = &requests[order[end - 1]];
+            if ((size_t)prev->offset + prev->len !=
+                (size_t)requests[order[end]].offset) {
+                break;
+            }
+            end++;
+        }
+        if (!positional) {
+            end = count; // each one starts where the previous one ended
+        }
+        ring_run_merged(requests, order + start, end - start, results);
+        start = end;
+    }
+}
+
+/**
+ * Run a batch of requests.
+ *
+ * Input:
+ *   - requests: the requests
+ *   - count: number of requests
+ *   - results: where to store their results
+ */
+static void ring_run_batch(tfs_ring_request_t const *requests, size_t count,
+                           ssize_t *results) {
+    for (size_t i = 0; i < count;) {
+        size_t run = 1;
+        while (i + run < count && run < RING_MAX_MERGE &&
+               ring_can_merge(&requests[i], &requests[i + run])) {
+            run++;
+        }
+
+        if (run == 1) {
+            results[i] = ring_run_one(&requests[i]);
+        } else {
+            ring_run_mergeable(requests, i, run, results);
+        }
+        i += run;
+    }
+}
+
+/**
+ * Worker thread: runs batches until the ring is destroyed and no request is
+ * left.
+ *
+ * Input:
+ *   - arg: the worker
+ */
+static void *ring_worker(void *arg) {
+    ring_worker_t *worker = arg;
+    tfs_ring_t *ring = worker->ring;
+    tfs_ring_request_t *batch = worker->batch;
+    ssize_t *results = worker->results;
+
+    mutex_lock(&ring->lock);
+    while (true) {
+        while (ring->request_count == 0 && !ring->stopping) {
+            cond_wait(&ring->submitted, &ring->lock);
+        }
+        if (ring->request_count == 0) {
+            break;
+        }
+
+        size_t count = 0;
+        bool batch_end = false;
+        while (!batch_end) {
+            size_t slot = (ring->request_head + count) % ring->entries;
+            batch[count++] = ring->requests[slot];
+            batch_end = ring->batch_ends[slot];
+        }
+        ring->request_head = (ring->request_head + count) % ring->entries;
+        ring->request_count -= count;
+        mutex_unlock(&ring->lock);
+
+        ring_run_batch(batch, count, results);
+
+        mutex_lock(&ring->lock);
+        for (size_t i = 0; i < count; i++) {
+            size_t slot = (ring->completion_head + ring->completion_count) %
+                          ring->entries;
+            ring->completions[slot].user_data = batch[i].user_data;
+            ring->completions[slot].result = results[i];
+            ring->completion_count++;
+        }
+        cond_broadcast(&ring->completed);
+
+        uint64_t events = count;
+        ALWAYS_ASSERT(write(ring->event_fd, &events, sizeof(events)) ==
+                          sizeof(events),
+                      "ring_worker: failed to signal eventfd");
+    }
+    mutex_unlock(&ring->lock);
+
+    return NULL;
+}
+
+tfs_ring_t *tfs_ring_create(size_t entries, size_t workers) {
+    if (entries == 0 || workers == 0) {
+        return NULL;
+    }
+
+    tfs_ring_t *ring = malloc(sizeof(tfs_ring_t));
+    if (ring == NULL) {
+        return NULL;
+    }
+    ring->entries = entries;
+    ring->in_flight = 0;
+    ring->requests = malloc(entries * sizeof(tfs_ring_request_t));
+    ring->batch_ends = malloc(entries * sizeof(bool));
+    ring->request_head = 0;
+    ring->request_count = 0;
+    ring->completions = malloc(entries * sizeof(tfs_ring_completion_t));
+    ring->completion_head = 0;
+    ring->completion_count = 0;
+    ring->stopping = false;
+    ring->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    ring->workers = malloc(workers * sizeof(ring_worker_t));
+    ring->worker_count = 0;
+    ring->batches = malloc(workers * entries * sizeof(tfs_ring_request_t));
+    ring->results = malloc(workers * entries * sizeof(ssize_t));
+
+    if (ring->requests == NULL || ring->batch_ends == NULL ||
+        ring->completions == NULL || ring->event_fd == -1 ||
+        ring->workers == NULL || ring->batches == NULL ||
+        ring->results == NULL) {
+        if (ring->event_fd != -1) {
+            close(ring->event_fd);
+        }
+        free(ring->requests);
+        free(ring->batch_ends);
+        free(ring->completions);
+        free(ring->workers);
+        free(ring->batches);
+        free(ring->results);
+        free(ring);
+        return NULL;
+    }
+
+    mutex_init(&ring->lock);
+    cond_init(&ring->submitted);
+    cond_init(&ring->completed);
+
+    for (size_t i = 0; i < workers; i++) {
+        ring_worker_t *worker = &ring->workers[i];
+        worker->ring = ring;
+        worker->batch = ring->batches + i * entries;
+        worker->results = ring->results + i * entries;
+        if (pthread_create(&worker->thread, NULL, ring_worker, worker) != 0) {
+            tfs_ring_destroy(ring); // stops the workers already created
+            return NULL;
+        }
+        ring->worker_count++;
+    }
+
+    return ring;
+}
+
+ssize_t tfs_ring_submit(tfs_ring_t *ring, tfs_ring_request_t const *requests,
+                        size_t count) {
+    if (count == 0) {
+        return 0;
+    }
+
+    mutex_lock(&ring->lock);
+    if (ring->in_flight + count > ring->entries) {
+        mutex_unlock(&ring->lock);
+        return -1;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        size_t slot =
+            (ring->request_head + ring->request_count) % ring->entries;
+        ring->requests[slot] = requests[i];
+        ring->batch_ends[slot] = (i == count - 1);
+        ring->request_count++;
+    }
+    ring->in_flight += count;
+    cond_broadcast(&ring->submitted);
+    mutex_unlock(&ring->lock);
+
+    return (ssize_t)count;
+}
+
+ssize_t tfs_ring_reap(tfs_ring_t *ring, tfs_ring_completion_t *completions,
+                      size_t max, size_t wait_for) {
+    mutex_lock(&ring->lock);
+    if (wait_for > max || wait_for > ring->in_flight) {
+        mutex_unlock(&ring->lock);
+        return -1;
+    }
+
+    while (ring->completion_count < wait_for) {
+        cond_wait(&ring->completed, &ring->lock);
+    }
+
+    size_t count = ring->completion_count;
+    if (count > max) {
+        count = max;
+    }
+    for (size_t i = 0; i < count; i++) {
+        completions[i] = ring->completions[ring->completion_head];
+        ring->completion_head = (ring->completion_head + 1) % ring->entries;
+    }
+    ring->completion_count -= count;
+    ring->in_flight -= count;
+    mutex_unlock(&ring->lock);
+
+    return (ssize_t)count;
+}
+
+int tfs_ring_eventfd(tfs_ring_t const *ring) { return ring->event_fd; }
+
+int tfs_ring_destroy(tfs_ring_t *ring) {
+    // The workers run what is left before they stop
+    mutex_lock(&ring->lock);
+    ring->stopping = true;
+    cond_broadcast(&ring->submitted);
+    mutex_unlock(&ring->lock);
+
+    int result = 0;
+    for (size_t i = 0; i < ring->worker_count; i++) {
+        if (pthread_join(ring->workers[i].thread, NULL) != 0) {
+            result = -1;
+        }
+    }
+
+    cond_destroy(&ring->submitted);
+    cond_destroy(&ring->completed);
+    mutex_destroy(&ring->lock);
+    if (close(ring->event_fd) != 0) {
+        result = -1;
+    }
+    free(ring->requests);
+    free(ring->batch_ends);
+    free(ring->completions);
+    free(ring->workers);
+    free(ring->batches);
+    free(ring->results);
+    free(ring);
+
+    return result;
+}
@@ -1,32 +1,46 @@
 #define _GNU_SOURCE
 #include "state.h"
+#include "bcache.h"
 #include "betterassert.h"
+#include "bitmap.h"
+#include "crc32c.h"
+#include "dcache.h"
+#include "image.h"
+#include "journal.h"
+#include "lz.h"
 #include "utils.h"
 
+#include <limits.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 /*
  * Persistent FS state
- * (in reality, it should be maintained in secondary memory;
- * for simplicity, this project maintains it in primary memory).
+ * (kept in an image mapped in memory: superblock, inode table, bitmap words
+ * and data blocks, each in its own page-aligned region; the image is backed by
+ * a file if fs_params.image_path is set, and is anonymous memory otherwise).
+ *
+ * Changes to the metadata of image files are journaled (see journal.c): they
+ * are logged right after being made, with the lock that protects them held.
  */
 static tfs_params fs_params;
+static image_t image;
 
 // Inode table
 static inode_t *inode_table;
-static allocation_state_t *freeinode_ts;
-static pthread_rwlock_t inode_locker;
+static bitmap_t inode_bitmap;
 static pthread_rwlock_t *inode_table_locker;
-static pthread_rwlock_t data_block_locker;
 
 // Data blocks
 static char *fs_data; // # blocks * block size
-static allocation_state_t *free_blocks;
+static bitmap_t block_bitmap;
+static uint32_t *block_checksums; // CRC32C of the blocks of files
 
 /*
  * Volatile FS state
@@ -35,12 +49,164 @@ static open_file_entry_t *open_file_table;
 static allocation_state_t *free_open_file_entries;
 static pthread_mutex_t open_file_mutex;
 
+// Pins on inodes, held by borrowed reads (see inode_pin)
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t unpinned;
+    size_t count;
+} inode_pin_t;
+
+static inode_pin_t *inode_pins;
+
+/*
+ * Snapshots (see snapshot_create)
+ *
+ * A snapshot holds copies of the inodes that were reachable from the root when
+ * it was taken. The blocks of directories and symbolic links are copied too,
+ * while the data blocks of files are shared with the live FS: each holder
+ * beyond the first one is counted in block_refs, and a block is only freed by
+ * its last holder. Writes to shared blocks copy them first (see inode_unshare).
+ *
+ * Snapshots are not kept in the image, so blocks that are only held by
+ * snapshots when the FS is not destroyed cleanly are not freed.
+ */
+typedef enum {
+    SNAPSHOT_FREE,
+    SNAPSHOT_CREATING,
+    SNAPSHOT_READY
+} snapshot_status_t;
+
+typedef struct {
+    snapshot_status_t status;
+    size_t open_count; // files of the snapshot that are open
+    inode_t *inodes;   // indexed by inumber
+    bool *present;     // whether each inode is part of the snapshot
+} snapshot_t;
+
+static snapshot_t snapshots[MAX_SNAPSHOTS];
+static pthread_mutex_t snapshots_mutex;
+static atomic_size_t snapshot_count; // see blocks_may_be_shared
+static atomic_uint *block_refs; // # holders - 1, for every data block
+static bool blocks_deduplicated; // superblock's s_shared, see state_init
+
+/*
+ * Block deduplication (if fs_params.dedup)
+ *
+ * Full blocks written to files are looked up by checksum in a content index (a
+ * hash table chained through dedup_next), and those with the same contents as
+ * an indexed block are replaced by it, which gains a holder in block_refs.
+ * Indexed blocks never change: writes to them either copy them first, if they
+ * are shared, or take them out of the index (see inode_unshare).
+ *
+ * The index and the holders of the blocks are not kept in the image, but
+ * rebuilt from the inodes when the FS is loaded. The superblock records
+ * (s_shared) that an image was used with deduplication, so that the holders
+ * are rebuilt even if it is later loaded without it.
+ */
+#define DEDUP_UNINDEXED (-2) // in dedup_next, for blocks not in the index
+
+static int *dedup_buckets;
+static size_t dedup_bucket_count; // a power of 2
+static int *dedup_next; // next block of the bucket (-1 if none), per block
+static pthread_mutex_t dedup_mutex;
+static atomic_size_t dedup_hits;
+
+/*
+ * Compressed files
+ *
+ * The data of a compressed file is split in chunks of CHUNK_SIZE bytes, each
+ * compressed on its own and stored in a single extent (the i-th extent of the
+ * inode holds the i-th chunk), of up to COMPRESS_CHUNK_BLOCKS blocks. Chunks
+ * that do not compress are stored as they are. Chunks are rewritten as a
+ * whole, into newly allocated blocks.
+ */
+typedef struct {
+    uint32_t c_stored; // bytes stored after the header
+    uint32_t c_length; // bytes of the chunk (c_stored if not compressed)
+} chunk_header_t;
+
+static atomic_size_t compress_in_bytes;
+static atomic_size_t compress_stored_bytes;
+static atomic_size_t compress_ns;
+static atomic_size_t decompress_ns;
+static atomic_size_t decompress_out_bytes;
+
+/*
+ * Per-thread allocation caches (magazines)
+ *
+ * Each thread keeps some inumbers and a run of data blocks that are already
+ * taken in the bitmaps but not yet in use, so that most allocations and frees
+ * only touch memory private to the thread. Magazines are refilled from and
+ * drained to the bitmaps in batches, and are flushed back to the bitmaps when
+ * their thread exits, when an allocation would otherwise fail, and when the FS
+ * is destroyed. What they hold when the FS crashes is freed when the image is
+ * loaded again (see bitmaps_rebuild).
+ */
+#define INODE_MAGAZINE_SIZE (16)
+#define BLOCK_MAGAZINE_SIZE (32) // refilled with half of this
+
+typedef struct magazine {
+    pthread_mutex_t lock; // only contended when flushing
+    bool in_use; // owned by a live thread (protected by magazines_mutex)
+    int inumbers[INODE_MAGAZINE_SIZE]; // stack, lowest inumber on top
+    size_t inumber_count;
+    int block_start; // cached run of data blocks
+    size_t block_count;
+    struct magazine *next;
+} magazine_t;
+
+static pthread_key_t magazine_key;
+static magazine_t *magazines; // every magazine ever created
+static pthread_mutex_t magazines_mutex;
+static bool *inode_cached; // per inode, whether it is held by a magazine
+
+/*
+ * Orphans (see inode_orphan)
+ *
+ * Files whose last link is removed lose their name at once, but their inodes
+ * and data blocks are only freed later, in batches, by a background thread
+ * (the reclaimer). Orphans that are open in the live FS are marked in
+ * orphan_open (protected by open_file_mutex) until their last handle is
+ * closed; the others wait in a queue, chained through orphan_next. Allocations
+ * that would otherwise fail reclaim the queued orphans themselves (see
+ * orphans_flush).
+ *
+ * The reclaimer also frees, lazily, the blocks that files keep past their size
+ * after being truncated (see inode_trim_later), which wait in a second queue,
+ * chained through trim_next.
+ *
+ * The queues are not kept in the image: the orphans of an image (files without
+ * links) and the files with blocks past their size are queued again when it
+ * is loaded.
+ */
+static bool *orphan_open;
+static atomic_bool *orphan_unlinked; // from inode_orphan until reclaimed
+static int *orphan_next; // next orphan in the queue (-1 if none), per inode
+static int orphan_head;  // -1 if the queue is empty
+static int orphan_tail;
+static size_t orphan_reclaiming; // taken from the queue, but not yet freed
+static bool *trim_queued;
+static int *trim_next; // next file in the trim queue (-1 if none), per inode
+static int trim_head;  // -1 if the queue is empty
+static int trim_tail;
+static bool orphan_stopping;
+static pthread_mutex_t orphan_mutex;
+static pthread_cond_t orphan_queued;    // wakes up the reclaimer
+static pthread_cond_t orphan_reclaimed; // see orphans_flush
+static pthread_t orphan_reclaimer;
+static atomic_size_t orphans_pending; // not yet freed (open or queued)
+static atomic_size_t orphans_reclaimed;
+
 // Convenience macros
 #define INODE_TABLE_SIZE (fs_params.max_inode_count)
 #define DATA_BLOCKS (fs_params.max_block_count)
 #define MAX_OPEN_FILES (fs_params.max_open_files_count)
 #define BLOCK_SIZE (fs_params.block_size)
-#define MAX_DIR_ENTRIES (BLOCK_SIZE / sizeof(dir_entry_t))
+#define DIR_ENTRIES_PER_BLOCK (BLOCK_SIZE / sizeof(dir_entry_t))
+#define EXTENTS_PER_BLOCK (BLOCK_SIZE / sizeof(extent_t))
+#define MAX_EXTENTS (INODE_EXTENTS + EXTENTS_PER_BLOCK)
+#define CHUNK_BLOCKS (COMPRESS_CHUNK_BLOCKS)
+#define CHUNK_SIZE (CHUNK_BLOCKS * BLOCK_SIZE - sizeof(chunk_header_t))
 
 static inline bool valid_inumber(int inumber) {
     return inumber >= 0 && inumber < INODE_TABLE_SIZE;
@@ -56,6 +222,44 @@ static inline bool valid_file_handle(int file_handle) {
 
 size_t state_block_size(void) { return BLOCK_SIZE; }
 
+size_t state_chunk_size(void) { return CHUNK_SIZE; }
+
+/**
+ * Obtain the statistics of the FS.
+ *
+ * Input:
+ *   - stats: where to store them
+ */
+void state_stats(tfs_stats_t *stats) {
+    stats->compress_in_bytes = atomic_load(&compress_in_bytes);
+    stats->compress_stored_bytes = atomic_load(&compress_stored_bytes);
+    stats->compression_ratio =
+        stats->compress_stored_bytes == 0
+            ? 0
+            : (double)stats->compress_in_bytes /
+                  (double)stats->compress_stored_bytes;
+    stats->compress_ns = atomic_load(&compress_ns);
+    stats->decompress_ns = atomic_load(&decompress_ns);
+    stats->decompress_out_bytes = atomic_load(&decompress_out_bytes);
+    stats->dedup_hits = atomic_load(&dedup_hits);
+    stats->orphans_pending = atomic_load(&orphans_pending);
+    stats->orphans_reclaimed = atomic_load(&orphans_reclaimed);
+
+    bcache_stats_t cache;
+    bcache_stats(&cache);
+    stats->cache_hits = cache.hits;
+    stats->cache_misses = cache.misses;
+    stats->cache_write_backs = cache.write_backs;
+}
+
+/**
+ * Check whether data blocks can be shared, i.e., whether some snapshot exists
+ * or the image was ever used with deduplication (see block_refs).
+ */
+static bool blocks_may_be_shared(void) {
+    return blocks_deduplicated || atomic_load(&snapshot_count) > 0;
+}
+
 /**
  * Do nothing, while preventing the compiler from performing any optimizations.
  *
@@ -88,453 +292,3716 @@ static void insert_delay(void) {
 }
 
 /**
- * Initialize FS state.
+ * Read a part of the image, through the buffer cache (which only pays the
+ * storage access delay on misses).
  *
  * Input:
- *   - params: TécnicoFS parameters
+ *   - address: the address read (within the image)
+ */
+static void storage_read(void const *address) {
+    bcache_read((size_t)((char const *)address - image.base));
+}
+
+/**
+ * Read the word of a bitmap that holds a given bit (see storage_read).
  *
- * Returns 0 if successful, -1 otherwise.
+ * Input:
+ *   - bitmap: the bitmap
+ *   - bit: the bit
+ */
+static void bitmap_read(bitmap_t const *bitmap, size_t bit) {
+    storage_read((void const *)&bitmap->words[bit / 64]);
+}
+
+/**
+ * Read the word of a bitmap where the next search starts (see storage_read).
  *
- * Possible errors:
- *   - TFS already initialized.
- *   - malloc failure when allocating TFS structures.
+ * Input:
+ *   - bitmap: the bitmap
  */
-int state_init(tfs_params params) {
-    fs_params = params;
+static void bitmap_search_read(bitmap_t *bitmap) {
+    storage_read((void const *)&bitmap->words[atomic_load(&bitmap->cursor)]);
+}
 
-    if (inode_table != NULL) {
-        return -1; // already initialized
+/**
+ * Return the contents of a magazine to the bitmaps.
+ *
+ * Must be called with the lock of the magazine held.
+ *
+ * Input:
+ *   - magazine: the magazine
+ *
+ * Returns the number of inodes and data blocks returned.
+ */
+static size_t magazine_drain(magazine_t *magazine) {
+    size_t drained = magazine->inumber_count + magazine->block_count;
+    if (drained == 0) {
+        return 0;
     }
 
-    rwlock_init(&inode_locker);
-    mutex_init(&open_file_mutex);
+    for (size_t i = 0; i < magazine->inumber_count; i++) {
+        inode_cached[magazine->inumbers[i]] = false;
+        bitmap_read(&inode_bitmap, (size_t)magazine->inumbers[i]);
+        bitmap_free_run(&inode_bitmap, (size_t)magazine->inumbers[i], 1);
+    }
+    magazine->inumber_count = 0;
 
-    inode_table = malloc(INODE_TABLE_SIZE * sizeof(inode_t));
-    freeinode_ts = malloc(INODE_TABLE_SIZE * sizeof(allocation_state_t));
-    fs_data = malloc(DATA_BLOCKS * BLOCK_SIZE);
-    free_blocks = malloc(DATA_BLOCKS * sizeof(allocation_state_t));
-    open_file_table = malloc(MAX_OPEN_FILES * sizeof(open_file_entry_t));
-    free_open_file_entries =
-        malloc(MAX_OPEN_FILES * sizeof(allocation_state_t));
-    inode_table_locker = malloc(INODE_TABLE_SIZE * sizeof(pthread_rwlock_t));
+    if (magazine->block_count > 0) {
+        bitmap_read(&block_bitmap, (size_t)magazine->block_start);
+        bitmap_free_run(&block_bitmap, (size_t)magazine->block_start,
+                        magazine->block_count);
+        magazine->block_count = 0;
+    }
 
-    for (size_t i = 0; i < INODE_TABLE_SIZE; i++) {
-        rwlock_init(&inode_table_locker[i]);
+    return drained;
+}
+
+/**
+ * Release the magazine of an exiting thread (magazine_key destructor).
+ *
+ * Input:
+ *   - arg: the magazine
+ */
+static void magazine_release(void *arg) {
+    magazine_t *magazine = arg;
+
+    // (if the journal failed, the next thread to take the magazine gets its
+    // contents instead)
+    bool begun = journal_begin() == 0;
+    mutex_lock(&magazines_mutex);
+    mutex_lock(&magazine->lock);
+    if (begun) {
+        magazine_drain(magazine);
+    }
+    magazine->in_use = false;
+    mutex_unlock(&magazine->lock);
+    mutex_unlock(&magazines_mutex);
+    if (begun) {
+        journal_end();
     }
+}
 
-    if (!inode_table || !freeinode_ts || !fs_data || !free_blocks ||
-        !open_file_table || !free_open_file_entries) {
-        return -1; // allocation failed
+/**
+ * Obtain the magazine of the calling thread, assigning it one if needed.
+ *
+ * Returns the magazine, or NULL if none could be allocated (in which case the
+ * bitmaps should be used directly).
+ */
+static magazine_t *magazine_get(void) {
+    magazine_t *magazine = pthread_getspecific(magazine_key);
+    if (magazine != NULL) {
+        return magazine;
     }
 
-    for (size_t i = 0; i < INODE_TABLE_SIZE; i++) {
-        freeinode_ts[i] = FREE;
+    mutex_lock(&magazines_mutex);
+    for (magazine = magazines; magazine != NULL; magazine = magazine->next) {
+        if (!magazine->in_use) {
+            break; // reuse the magazine of a thread that exited
+        }
+    }
+    if (magazine == NULL) {
+        magazine = malloc(sizeof(magazine_t));
+        if (magazine == NULL) {
+            mutex_unlock(&magazines_mutex);
+            return NULL;
+        }
+        mutex_init(&magazine->lock);
+        magazine->inumber_count = 0;
+        magazine->block_count = 0;
+        magazine->next = magazines;
+        magazines = magazine;
     }
+    magazine->in_use = true;
+    mutex_unlock(&magazines_mutex);
 
-    for (size_t i = 0; i < DATA_BLOCKS; i++) {
-        free_blocks[i] = FREE;
+    if (pthread_setspecific(magazine_key, magazine) != 0) {
+        magazine_release(magazine);
+        return NULL;
     }
+    return magazine;
+}
 
-    for (size_t i = 0; i < MAX_OPEN_FILES; i++) {
-        mutex_init(&open_file_table[i].lock);
-        free_open_file_entries[i] = FREE;
+/**
+ * Return the contents of every magazine to the bitmaps.
+ *
+ * Returns the number of inodes and data blocks returned.
+ */
+static size_t magazines_flush(void) {
+    size_t drained = 0;
+
+    mutex_lock(&magazines_mutex);
+    for (magazine_t *magazine = magazines; magazine != NULL;
+         magazine = magazine->next) {
+        mutex_lock(&magazine->lock);
+        drained += magazine_drain(magazine);
+        mutex_unlock(&magazine->lock);
     }
+    mutex_unlock(&magazines_mutex);
 
-    return 0;
+    return drained;
 }
 
 /**
- * Destroy FS state.
+ * Allocate an inumber from the magazine of the calling thread, refilling it
+ * from inode_bitmap if it is empty.
  *
- * Returns 0 if succesful, -1 otherwise.
+ * Returns the inumber, or -1 if neither the magazine nor the bitmap have free
+ * inodes.
  */
-int state_destroy(void) {
+static int magazine_alloc_inode(void) {
+    size_t length;
+    magazine_t *magazine = magazine_get();
+    if (magazine == NULL) {
+        bitmap_search_read(&inode_bitmap);
+        return (int)bitmap_alloc_run(&inode_bitmap, 1, &length);
+    }
 
-    for (size_t i = 0; i < INODE_TABLE_SIZE; i++) {
-        rwlock_destroy(&inode_table_locker[i]);
+    int inumber = -1;
+    mutex_lock(&magazine->lock);
+    if (magazine->inumber_count == 0) {
+        bitmap_search_read(&inode_bitmap);
+        long first =
+            bitmap_alloc_run(&inode_bitmap, INODE_MAGAZINE_SIZE, &length);
+        // Push in reverse, so that lower inumbers are handed out first
+        for (size_t i = length; first != -1 && i > 0; i--) {
+            int cached = (int)first + (int)i - 1;
+            inode_cached[cached] = true;
+            magazine->inumbers[magazine->inumber_count++] = cached;
+        }
+    }
+    if (magazine->inumber_count > 0) {
+        inumber = magazine->inumbers[--magazine->inumber_count];
+        inode_cached[inumber] = false;
     }
+    mutex_unlock(&magazine->lock);
 
-    for (size_t i = 0; i < MAX_OPEN_FILES; i++) {
-        mutex_destroy(&open_file_table[i].lock);
+    return inumber;
+}
+
+/**
+ * Free an inumber into the magazine of the calling thread, or into
+ * inode_bitmap if the magazine is full.
+ *
+ * Input:
+ *   - inumber: the inumber
+ */
+static void magazine_free_inode(int inumber) {
+    magazine_t *magazine = magazine_get();
+    if (magazine != NULL) {
+        mutex_lock(&magazine->lock);
+        if (magazine->inumber_count < INODE_MAGAZINE_SIZE) {
+            inode_cached[inumber] = true;
+            magazine->inumbers[magazine->inumber_count++] = inumber;
+            mutex_unlock(&magazine->lock);
+            return;
+        }
+        mutex_unlock(&magazine->lock);
     }
 
-    rwlock_destroy(&inode_locker);
-    mutex_destroy(&open_file_mutex);
-    rwlock_destroy(&data_block_locker);
+    bitmap_read(&inode_bitmap, (size_t)inumber);
+    bitmap_free_run(&inode_bitmap, (size_t)inumber, 1);
+}
 
-    free(inode_table);
-    free(freeinode_ts);
-    free(fs_data);
-    free(free_blocks);
-    free(open_file_table);
-    free(free_open_file_entries);
+/**
+ * Allocate a run of data blocks from the magazine of the calling thread,
+ * refilling it from block_bitmap if it is empty. Runs longer than a refill
+ * batch are allocated from the bitmap directly.
+ *
+ * Input:
+ *   - max_length: maximum number of blocks to allocate (at least 1)
+ *   - length: set to the number of blocks actually allocated
+ *
+ * Returns the first block of the run, or -1 if neither the magazine nor the
+ * bitmap have free blocks.
+ */
+static int magazine_alloc_run(size_t max_length, size_t *length) {
+    magazine_t *magazine = magazine_get();
+    if (magazine != NULL) {
+        mutex_lock(&magazine->lock);
+        if (magazine->block_count == 0 &&
+            max_length < BLOCK_MAGAZINE_SIZE / 2) {
+            bitmap_search_read(&block_bitmap);
+            size_t count;
+            long start = bitmap_alloc_run(&block_bitmap,
+                                          BLOCK_MAGAZINE_SIZE / 2, &count);
+            if (start != -1) {
+                magazine->block_start = (int)start;
+                magazine->block_count = count;
+            }
+        }
+        if (magazine->block_count > 0) {
+            int start = magazine->block_start;
+            *length = max_length < magazine->block_count
+                          ? max_length
+                          : magazine->block_count;
+            magazine->block_start += (int)*length;
+            magazine->block_count -= *length;
+            mutex_unlock(&magazine->lock);
+            return start;
+        }
+        mutex_unlock(&magazine->lock);
+    }
 
-    inode_table = NULL;
-    freeinode_ts = NULL;
-    fs_data = NULL;
-    free_blocks = NULL;
-    open_file_table = NULL;
-    free_open_file_entries = NULL;
+    bitmap_search_read(&block_bitmap);
+    return (int)bitmap_alloc_run(&block_bitmap, max_length, length);
+}
 
-    return 0;
+/**
+ * Allocate the data blocks starting at a given block, taking them from the
+ * magazine of the calling thread if its cached run starts there.
+ *
+ * Input:
+ *   - block_number: the first block to allocate
+ *   - max_length: maximum number of blocks to allocate
+ *
+ * Returns the number of blocks allocated (0 if block_number is not free).
+ */
+static size_t magazine_alloc_at(int block_number, size_t max_length) {
+    size_t taken = 0;
+
+    magazine_t *magazine = magazine_get();
+    if (magazine != NULL) {
+        mutex_lock(&magazine->lock);
+        if (magazine->block_count > 0 &&
+            magazine->block_start == block_number) {
+            taken = max_length < magazine->block_count
+                        ? max_length
+                        : magazine->block_count;
+            magazine->block_start += (int)taken;
+            magazine->block_count -= taken;
+        }
+        mutex_unlock(&magazine->lock);
+    }
+
+    if (taken < max_length) {
+        bitmap_read(&block_bitmap, (size_t)block_number + taken);
+        taken += bitmap_alloc_at(&block_bitmap,
+                                 (size_t)block_number + taken,
+                                 max_length - taken);
+    }
+    return taken;
+}
+
+/**
+ * Free a run of data blocks into the magazine of the calling thread if it is
+ * empty or adjacent to the cached run (and fits), or into block_bitmap
+ * otherwise.
+ *
+ * Input:
+ *   - block_number: the first block of the run
+ *   - length: the number of blocks in the run
+ */
+static void magazine_free_run(int block_number, size_t length) {
+    magazine_t *magazine = magazine_get();
+    if (magazine != NULL) {
+        mutex_lock(&magazine->lock);
+        bool cached = true;
+        if (magazine->block_count + length > BLOCK_MAGAZINE_SIZE) {
+            cached = false;
+        } else if (magazine->block_count == 0) {
+            magazine->block_start = block_number;
+            magazine->block_count = length;
+        } else if (block_number + (int)length == magazine->block_start) {
+            magazine->block_start = block_number;
+            magazine->block_count += length;
+        } else if (magazine->block_start + (int)magazine->block_count ==
+                   block_number) {
+            magazine->block_count += length;
+        } else {
+            cached = false;
+        }
+        mutex_unlock(&magazine->lock);
+        if (cached) {
+            return;
+        }
+    }
+
+    bitmap_read(&block_bitmap, (size_t)block_number);
+    bitmap_free_run(&block_bitmap, (size_t)block_number, length);
+}
+
+/**
+ * Obtain a pointer to one of the extents of an inode.
+ *
+ * The first INODE_EXTENTS extents live in the inode itself, the remaining ones
+ * in the inode's extent block.
+ *
+ * Input:
+ *   - inode: the inode
+ *   - index: index of the extent (extents are kept in file order)
+ *
+ * Returns pointer to the extent.
+ */
+static extent_t *inode_extent(inode_t const *inode, size_t index) {
+    if (index < INODE_EXTENTS) {
+        return (extent_t *)&inode->i_extents[index];
+    }
+
+    extent_t *extent_block = (extent_t *)data_block_get(inode->i_extent_block);
+    ALWAYS_ASSERT(extent_block != NULL,
+                  "inode_extent: inode must have an extent block");
+    return &extent_block[index - INODE_EXTENTS];
+}
+
+/**
+ * Count the blocks covered by the extents of an inode (including holes).
+ *
+ * Input:
+ *   - inode: the inode
+ */
+static size_t inode_block_count(inode_t const *inode) {
+    size_t blocks = 0;
+    for (size_t i = 0; i < inode->i_extent_count; i++) {
+        blocks += (size_t)inode_extent(inode, i)->e_length;
+    }
+    return blocks;
+}
+
+/**
+ * Check whether a file is open in the live FS.
+ *
+ * Must be called with open_file_mutex locked.
+ *
+ * Input:
+ *   - inumber: inode number of the file to check
+ */
+static bool inumber_is_open(int inumber) {
+    for (int i = 0; i < MAX_OPEN_FILES; i++) {
+        if (free_open_file_entries[i] == TAKEN) {
+            mutex_lock(&open_file_table[i].lock);
+            bool found = open_file_table[i].of_inumber == inumber &&
+                         open_file_table[i].of_snapshot == NO_SNAPSHOT;
+            mutex_unlock(&open_file_table[i].lock);
+            if (found) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+/**
+ * Queue an orphan to be reclaimed, waking up the reclaimer.
+ *
+ * Input:
+ *   - inumber: the orphan's inumber
+ */
+static void orphan_enqueue(int inumber) {
+    mutex_lock(&orphan_mutex);
+    orphan_next[inumber] = -1;
+    if (orphan_head == -1) {
+        orphan_head = inumber;
+    } else {
+        orphan_next[orphan_tail] = inumber;
+    }
+    orphan_tail = inumber;
+    cond_broadcast(&orphan_queued);
+    mutex_unlock(&orphan_mutex);
+}
+
+/**
+ * Reclaim a batch of queued orphans, freeing their inodes and data blocks.
+ *
+ * Returns the number of orphans reclaimed (0 if the queue was empty).
+ */
+static size_t orphans_reclaim(void) {
+    int batch[ORPHAN_BATCH];
+    size_t count = 0;
+
+    mutex_lock(&orphan_mutex);
+    while (count < ORPHAN_BATCH && orphan_head != -1) {
+        batch[count++] = orphan_head;
+        orphan_head = orphan_next[orphan_head];
+    }
+    orphan_reclaiming += count;
+    mutex_unlock(&orphan_mutex);
+
+    if (count == 0) {
+        return 0;
+    }
+
+    // Once they are reused, the inodes may be opened again (handles opened
+    // before that are checked by open_file)
+    for (size_t i = 0; i < count; i++) {
+        atomic_store(&orphan_unlinked[batch[i]], false);
+        inode_delete(batch[i]);
+    }
+    atomic_fetch_sub(&orphans_pending, count);
+    atomic_fetch_add(&orphans_reclaimed, count);
+
+    mutex_lock(&orphan_mutex);
+    orphan_reclaiming -= count;
+    cond_broadcast(&orphan_reclaimed);
+    mutex_unlock(&orphan_mutex);
+
+    return count;
+}
+
+/**
+ * Reclaim every queued orphan from the calling thread, and wait for those that
+ * are being reclaimed by other threads, so that their inodes and data blocks
+ * can be allocated.
+ *
+ * Must not be called with dedup_mutex locked (see data_block_free_run).
+ *
+ * Input:
+ *   - seen: the count of reclaimed orphans from before the caller's last
+ *     allocation attempt (orphans reclaimed by other threads since then may
+ *     have left their blocks in the caches); updated to the current count
+ *
+ * Returns the number of orphans reclaimed since then.
+ */
+static size_t orphans_flush(size_t *seen) {
+    while (orphans_reclaim() > 0) {
+        // one batch at a time
+    }
+
+    mutex_lock(&orphan_mutex);
+    while (orphan_reclaiming > 0) {
+        cond_wait(&orphan_reclaimed, &orphan_mutex);
+    }
+    mutex_unlock(&orphan_mutex);
+
+    size_t reclaimed = atomic_load(&orphans_reclaimed);
+    size_t count = reclaimed - *seen;
+    *seen = reclaimed;
+    return count;
+}
+
+/**
+ * Allocate a run of contiguous data blocks (see data_block_alloc_run).
+ *
+ * Input:
+ *   - max_length: maximum number of blocks to allocate (at least 1)
+ *   - length: set to the number of blocks actually allocated
+ *   - reclaim: whether orphans may be reclaimed to make room for the run
+ *
+ * Returns the number/index of the first block if successful, -1 otherwise.
+ */
+static int block_alloc_run(size_t max_length, size_t *length, bool reclaim) {
+    size_t seen = atomic_load(&orphans_reclaimed);
+    int start = magazine_alloc_run(max_length, length);
+
+    // Free blocks may be cached by other threads (see inode_alloc)
+    while (start == -1) {
+        size_t flushed = magazines_flush();
+        start = magazine_alloc_run(max_length, length);
+        if (start == -1 && flushed == 0 && magazines_flush() == 0 &&
+            (!reclaim || orphans_flush(&seen) == 0)) {
+            break;
+        }
+    }
+
+    return start;
+}
+
+/**
+ * Queue a file to have the blocks past its size freed, waking up the
+ * reclaimer (unless it is already queued).
+ *
+ * Must be called with orphan_mutex locked.
+ *
+ * Input:
+ *   - inumber: the file's inumber
+ */
+static void trim_enqueue(int inumber) {
+    if (trim_queued[inumber]) {
+        return;
+    }
+    trim_queued[inumber] = true;
+    trim_next[inumber] = -1;
+    if (trim_head == -1) {
+        trim_head = inumber;
+    } else {
+        trim_next[trim_tail] = inumber;
+    }
+    trim_tail = inumber;
+    cond_broadcast(&orphan_queued);
+}
+
+/**
+ * Free the blocks past the size of a batch of queued files.
+ *
+ * Unlike orphans, files are only trimmed by the reclaimer, as they may be
+ * locked by any other thread.
+ */
+static void trims_run(void) {
+    int batch[ORPHAN_BATCH];
+    size_t count = 0;
+
+    mutex_lock(&orphan_mutex);
+    while (count < ORPHAN_BATCH && trim_head != -1) {
+        batch[count++] = trim_head;
+        trim_queued[trim_head] = false;
+        trim_head = trim_next[trim_head];
+    }
+    mutex_unlock(&orphan_mutex);
+
+    // The file may have been deleted (or even replaced) meanwhile, which is
+    // harmless, as the blocks past the size of a file are never read
+    for (size_t i = 0; i < count; i++) {
+        int inumber = batch[i];
+        inode_t *inode = &inode_table[inumber];
+        storage_read(inode);
+
+        rwlock_writelock(&inode_table_locker[inumber]);
+        inode_wait_unpinned(inumber); // borrowed blocks cannot be freed
+        if (inode->i_node_type == T_FILE &&
+            !(inode->i_flags & INODE_COMPRESSED)) {
+            size_t block_count = (inode->i_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+            inode_truncate(inode, block_count);
+        }
+        rwlock_unlock(&inode_table_locker[inumber]);
+    }
+}
+
+/**
+ * Main function of the reclaimer: reclaims the queued orphans and trims the
+ * queued files, one batch of each per journaled operation, until the FS is
+ * destroyed.
+ *
+ * Input:
+ *   - arg: unused
+ */
+static void *orphan_reclaimer_main(void *arg) {
+    (void)arg;
+
+    mutex_lock(&orphan_mutex);
+    while (orphan_head != -1 || trim_head != -1 || !orphan_stopping) {
+        if (orphan_head == -1 && trim_head == -1) {
+            cond_wait(&orphan_queued, &orphan_mutex);
+            continue;
+        }
+        mutex_unlock(&orphan_mutex);
+
+        // Nothing is freed once the journal failed
+        if (journal_begin() == -1) {
+            return NULL;
+        }
+        orphans_reclaim();
+        trims_run();
+        journal_end();
+
+        mutex_lock(&orphan_mutex);
+    }
+    mutex_unlock(&orphan_mutex);
+
+    return NULL;
+}
+
+/**
+ * Initialize the orphan queue, queueing the orphans of a loaded image, and
+ * start the reclaimer.
+ *
+ * Input:
+ *   - created: whether the image was just created (and so is empty)
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int orphans_init(bool created) {
+    orphan_open = calloc(INODE_TABLE_SIZE, sizeof(bool));
+    orphan_unlinked = calloc(INODE_TABLE_SIZE, sizeof(atomic_bool));
+    orphan_next = malloc(INODE_TABLE_SIZE * sizeof(int));
+    trim_queued = calloc(INODE_TABLE_SIZE, sizeof(bool));
+    trim_next = malloc(INODE_TABLE_SIZE * sizeof(int));
+    if (orphan_open == NULL || orphan_unlinked == NULL ||
+        orphan_next == NULL || trim_queued == NULL || trim_next == NULL) {
+        return -1;
+    }
+    orphan_head = -1;
+    orphan_tail = -1;
+    trim_head = -1;
+    trim_tail = -1;
+    orphan_reclaiming = 0;
+    orphan_stopping = false;
+    mutex_init(&orphan_mutex);
+    cond_init(&orphan_queued);
+    cond_init(&orphan_reclaimed);
+    atomic_init(&orphans_pending, 0);
+    atomic_init(&orphans_reclaimed, 0);
+
+    // Directories without links are left to tfs_rmdir (see seal_empty_dir)
+    for (size_t inumber = 0; !created && inumber < INODE_TABLE_SIZE;
+         inumber++) {
+        inode_t const *inode = &inode_table[inumber];
+        if (!bitmap_is_set(&inode_bitmap, inumber) ||
+            inode->i_node_type == T_DIRECTORY) {
+            continue;
+        }
+        if (inode->i_link_count == 0) {
+            atomic_fetch_add(&orphans_pending, 1);
+            atomic_store(&orphan_unlinked[inumber], true);
+            orphan_enqueue((int)inumber);
+        } else if (inode->i_node_type == T_FILE &&
+                   !(inode->i_flags & INODE_COMPRESSED) &&
+                   inode_block_count(inode) * BLOCK_SIZE >= inode->i_size +
+                                                              BLOCK_SIZE) {
+            mutex_lock(&orphan_mutex);
+            trim_enqueue((int)inumber);
+            mutex_unlock(&orphan_mutex);
+        }
+    }
+
+    if (pthread_create(&orphan_reclaimer, NULL, orphan_reclaimer_main,
+                       NULL) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Reclaim every orphan, including those that are still open (as their handles
+ * go away with the FS), and stop the reclaimer.
+ */
+static void orphans_destroy(void) {
+    mutex_lock(&open_file_mutex);
+    for (size_t inumber = 0; inumber < INODE_TABLE_SIZE; inumber++) {
+        if (orphan_open[inumber]) {
+            orphan_open[inumber] = false;
+            orphan_enqueue((int)inumber);
+        }
+    }
+    mutex_unlock(&open_file_mutex);
+
+    mutex_lock(&orphan_mutex);
+    orphan_stopping = true;
+    cond_broadcast(&orphan_queued);
+    mutex_unlock(&orphan_mutex);
+    pthread_join(orphan_reclaimer, NULL);
+
+    mutex_destroy(&orphan_mutex);
+    cond_destroy(&orphan_queued);
+    cond_destroy(&orphan_reclaimed);
+    free(orphan_open);
+    free(orphan_unlinked);
+    free(orphan_next);
+    free(trim_queued);
+    free(trim_next);
+    orphan_open = NULL;
+    orphan_unlinked = NULL;
+    orphan_next = NULL;
+    trim_queued = NULL;
+    trim_next = NULL;
+}
+
+/**
+ * Add a block to the content index.
+ *
+ * Must be called with dedup_mutex locked.
+ *
+ * Input:
+ *   - block_number: the block (not in the index)
+ */
+static void dedup_insert(int block_number) {
+    size_t bucket = block_checksums[block_number] & (dedup_bucket_count - 1);
+    dedup_next[block_number] = dedup_buckets[bucket];
+    dedup_buckets[bucket] = block_number;
+}
+
+/**
+ * Take a block out of the content index, if it is there.
+ *
+ * Must be called with dedup_mutex locked.
+ *
+ * Input:
+ *   - block_number: the block
+ */
+static void dedup_remove(int block_number) {
+    if (dedup_next[block_number] == DEDUP_UNINDEXED) {
+        return;
+    }
+
+    size_t bucket = block_checksums[block_number] & (dedup_bucket_count - 1);
+    int *link = &dedup_buckets[bucket];
+    while (*link != block_number) {
+        ALWAYS_ASSERT(*link != -1, "dedup_remove: block missing from index");
+        link = &dedup_next[*link];
+    }
+    *link = dedup_next[block_number];
+    dedup_next[block_number] = DEDUP_UNINDEXED;
+}
+
+/**
+ * Find an indexed block with the same contents as a given block.
+ *
+ * Must be called with dedup_mutex locked.
+ *
+ * Input:
+ *   - block_number: the block (with an up to date checksum)
+ *
+ * Returns the indexed block (block_number itself, if it is in the index), or
+ * -1 if there is none.
+ */
+static int dedup_find(int block_number) {
+    uint32_t checksum = block_checksums[block_number];
+    char const *data = fs_data + (size_t)block_number * BLOCK_SIZE;
+
+    int candidate = dedup_buckets[checksum & (dedup_bucket_count - 1)];
+    for (; candidate != -1; candidate = dedup_next[candidate]) {
+        if (candidate == block_number ||
+            (block_checksums[candidate] == checksum &&
+             memcmp(fs_data + (size_t)candidate * BLOCK_SIZE, data,
+                    BLOCK_SIZE) == 0)) {
+            return candidate;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Set up the content index used by deduplication (empty until
+ * block_holders_rebuild fills it).
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int dedup_init(void) {
+    dedup_bucket_count = 1;
+    while (dedup_bucket_count < DATA_BLOCKS) {
+        dedup_bucket_count <<= 1;
+    }
+    dedup_buckets = malloc(dedup_bucket_count * sizeof(int));
+    dedup_next = malloc(DATA_BLOCKS * sizeof(int));
+    if (dedup_buckets == NULL || dedup_next == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < dedup_bucket_count; i++) {
+        dedup_buckets[i] = -1;
+    }
+    for (size_t i = 0; i < DATA_BLOCKS; i++) {
+        dedup_next[i] = DEDUP_UNINDEXED;
+    }
+    mutex_init(&dedup_mutex);
+    return 0;
+}
+
+/**
+ * Rebuild the holders of the blocks from the inodes of a loaded image whose
+ * blocks may be shared by deduplication, and (if fs_params.dedup) index their
+ * full blocks.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int block_holders_rebuild(void) {
+    bool *held = calloc(DATA_BLOCKS, sizeof(bool));
+    if (held == NULL) {
+        return -1;
+    }
+    for (size_t inumber = 0; inumber < INODE_TABLE_SIZE; inumber++) {
+        inode_t const *inode = &inode_table[inumber];
+        if (!bitmap_is_set(&inode_bitmap, inumber) ||
+            inode->i_node_type != T_FILE) {
+            continue;
+        }
+
+        size_t full_blocks = inode->i_size / BLOCK_SIZE;
+        size_t file_block = 0;
+        for (size_t i = 0; i < inode->i_extent_count; i++) {
+            extent_t const *extent = inode_extent(inode, i);
+            if (extent->e_start == EXTENT_HOLE) {
+                file_block += (size_t)extent->e_length;
+                continue;
+            }
+            for (int b = 0; b < extent->e_length; b++, file_block++) {
+                int block = extent->e_start + b;
+                if (held[block]) {
+                    atomic_fetch_add(&block_refs[block], 1);
+                } else {
+                    held[block] = true;
+                }
+                if (fs_params.dedup && file_block < full_blocks &&
+                    !(inode->i_flags & INODE_COMPRESSED) &&
+                    dedup_next[block] == DEDUP_UNINDEXED) {
+                    dedup_insert(block);
+                }
+            }
+        }
+    }
+    free(held);
+    return 0;
+}
+
+/**
+ * Clear the bits of the first slots of a bitmap's words (those past the end
+ * stay set).
+ *
+ * Input:
+ *   - words: the words of the bitmap
+ *   - bit_count: number of slots
+ */
+static void bitmap_words_clear(_Atomic uint64_t *words, size_t bit_count) {
+    for (size_t i = 0; i < bit_count / 64; i++) {
+        atomic_store(&words[i], 0);
+    }
+    if (bit_count % 64 != 0) {
+        uint64_t slots = ((uint64_t)1 << (bit_count % 64)) - 1;
+        atomic_fetch_and(&words[bit_count / 64], ~slots);
+    }
+}
+
+/**
+ * Set the bit of a slot in a bitmap's words.
+ *
+ * Input:
+ *   - words: the words of the bitmap
+ *   - bit: the slot
+ */
+static void bitmap_words_set(_Atomic uint64_t *words, size_t bit) {
+    atomic_fetch_or(&words[bit / 64], (uint64_t)1 << (bit % 64));
+}
+
+/**
+ * Rebuild the allocation bitmaps of an image that was not closed cleanly from
+ * the inodes that are reachable from the root, and the data blocks they use.
+ *
+ * The bitmaps of such an image may still have inodes and blocks taken that
+ * were cached by magazines, or held by orphans and interrupted operations,
+ * when it crashed; these are freed. Must be called before the bitmaps are
+ * initialized.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - malloc failure.
+ */
+static int bitmaps_rebuild(void) {
+    _Atomic uint64_t *inode_words =
+        (void *)(image.base + image.superblock->s_inode_bitmap);
+    _Atomic uint64_t *block_words =
+        (void *)(image.base + image.superblock->s_block_bitmap);
+    bool *reached = calloc(INODE_TABLE_SIZE, sizeof(bool));
+    int *queue = malloc(INODE_TABLE_SIZE * sizeof(int));
+    if (reached == NULL || queue == NULL) {
+        free(reached);
+        free(queue);
+        return -1;
+    }
+    bitmap_words_clear(inode_words, INODE_TABLE_SIZE);
+    bitmap_words_clear(block_words, DATA_BLOCKS);
+
+    // Breadth-first walk from the root (as in snapshot_create)
+    size_t visited = 0, queued = 0;
+    queue[queued++] = ROOT_DIR_INUM;
+    reached[ROOT_DIR_INUM] = true;
+    while (visited < queued) {
+        int inumber = queue[visited++];
+        inode_t const *inode = &inode_table[inumber];
+        bitmap_words_set(inode_words, (size_t)inumber);
+        if (inode->i_extent_block != -1) {
+            bitmap_words_set(block_words, (size_t)inode->i_extent_block);
+        }
+
+        // The entries of directories are in their first i_size bytes
+        size_t dir_blocks = inode->i_node_type == T_DIRECTORY
+                                ? inode->i_size / BLOCK_SIZE
+                                : 0;
+        size_t file_block = 0;
+        for (size_t i = 0; i < inode->i_extent_count; i++) {
+            extent_t const *extent = inode_extent(inode, i);
+            for (int b = 0; b < extent->e_length; b++, file_block++) {
+                if (extent->e_start == EXTENT_HOLE) {
+                    continue;
+                }
+                int block = extent->e_start + b;
+                bitmap_words_set(block_words, (size_t)block);
+                if (file_block >= dir_blocks) {
+                    continue;
+                }
+
+                dir_entry_t const *entries =
+                    (dir_entry_t const *)data_block_get(block);
+                for (size_t e = 0; e < DIR_ENTRIES_PER_BLOCK; e++) {
+                    int sub_inumber = entries[e].d_inumber;
+                    if (valid_inumber(sub_inumber) && !reached[sub_inumber]) {
+                        reached[sub_inumber] = true;
+                        queue[queued++] = sub_inumber;
+                    }
+                }
+            }
+        }
+    }
+
+    free(reached);
+    free(queue);
+    return 0;
+}
+
+/**
+ * Initialize FS state.
+ *
+ * If params.image_path names an existing image, its contents are loaded
+ * (mapped), after completing the changes left in its journal; otherwise, the
+ * FS starts out empty.
+ *
+ * Input:
+ *   - params: TécnicoFS parameters
+ *   - created: set to whether the FS is new (in which case the caller must
+ *     create the root directory)
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - TFS already initialized.
+ *   - The image cannot be mapped, or is invalid or of a different geometry.
+ *   - The journal cannot be recovered or opened.
+ *   - malloc failure when allocating TFS structures.
+ */
+int state_init(tfs_params params, bool *created) {
+    if (inode_table != NULL) {
+        return -1; // already initialized
+    }
+
+    fs_params = params;
+
+    superblock_t geometry = {
+        .s_inode_size = sizeof(inode_t),
+        .s_inode_count = INODE_TABLE_SIZE,
+        .s_block_count = DATA_BLOCKS,
+        .s_block_size = BLOCK_SIZE,
+    };
+    if (params.image_path != NULL && journal_recover(params.image_path) == -1) {
+        return -1;
+    }
+    if (image_open(&image, params.image_path, &geometry, created) == -1) {
+        return -1;
+    }
+    if (journal_init(&image, params.image_path) == -1) {
+        image_close(&image);
+        return -1;
+    }
+    inode_table = (inode_t *)(image.base + image.superblock->s_inode_table);
+    fs_data = image.base + image.superblock->s_data;
+    block_checksums =
+        (uint32_t *)(image.base + image.superblock->s_block_checksums);
+    crc32c_init();
+
+    // A new image is written back in full by the first checkpoint (its data
+    // blocks are already zeros)
+    journal_dirty(image.base, *created ? image.superblock->s_data
+                                       : sizeof(superblock_t));
+
+    mutex_init(&open_file_mutex);
+    mutex_init(&magazines_mutex);
+    mutex_init(&snapshots_mutex);
+    if (pthread_key_create(&magazine_key, magazine_release) != 0) {
+        return -1;
+    }
+
+    open_file_table = malloc(MAX_OPEN_FILES * sizeof(open_file_entry_t));
+    free_open_file_entries =
+        malloc(MAX_OPEN_FILES * sizeof(allocation_state_t));
+    inode_table_locker = malloc(INODE_TABLE_SIZE * sizeof(pthread_rwlock_t));
+    inode_pins = malloc(INODE_TABLE_SIZE * sizeof(inode_pin_t));
+    block_refs = malloc(DATA_BLOCKS * sizeof(atomic_uint));
+    inode_cached = calloc(INODE_TABLE_SIZE, sizeof(bool));
+
+    if (!open_file_table || !free_open_file_entries || !inode_table_locker ||
+        !inode_pins || !block_refs || !inode_cached) {
+        return -1; // allocation failed
+    }
+
+    for (size_t i = 0; i < DATA_BLOCKS; i++) {
+        atomic_init(&block_refs[i], 0);
+    }
+    for (size_t i = 0; i < MAX_SNAPSHOTS; i++) {
+        snapshots[i].status = SNAPSHOT_FREE;
+    }
+    atomic_init(&snapshot_count, 0);
+    atomic_init(&compress_in_bytes, 0);
+    atomic_init(&compress_stored_bytes, 0);
+    atomic_init(&compress_ns, 0);
+    atomic_init(&decompress_ns, 0);
+    atomic_init(&decompress_out_bytes, 0);
+    atomic_init(&dedup_hits, 0);
+
+    for (size_t i = 0; i < INODE_TABLE_SIZE; i++) {
+        rwlock_init(&inode_table_locker[i]);
+        mutex_init(&inode_pins[i].lock);
+        cond_init(&inode_pins[i].unpinned);
+        inode_pins[i].count = 0;
+    }
+
+    // (the rebuilt bitmaps are committed in full)
+    if (image.unclean) {
+        if (bitmaps_rebuild() == -1) {
+            return -1;
+        }
+        if (journal_begin() == -1) {
+            return -1;
+        }
+        journal_log(image.base + image.superblock->s_inode_bitmap,
+                    bitmap_words_size(INODE_TABLE_SIZE));
+        journal_log(image.base + image.superblock->s_block_bitmap,
+                    bitmap_words_size(DATA_BLOCKS));
+        if (journal_end() == -1) {
+            return -1;
+        }
+    }
+
+    // Blocks stay shared once they may have been deduplicated (a new image
+    // gets its superblock with the first checkpoint)
+    if (params.dedup && image.superblock->s_shared == 0) {
+        image.superblock->s_shared = 1;
+        if (!*created) {
+            if (journal_begin() == -1) {
+                return -1;
+            }
+            journal_log(image.superblock, sizeof(superblock_t));
+            if (journal_end() == -1) {
+                return -1;
+            }
+        }
+    }
+    blocks_deduplicated = image.superblock->s_shared != 0;
+
+    if (bitmap_init(&inode_bitmap, INODE_TABLE_SIZE,
+                    image.base + image.superblock->s_inode_bitmap, *created,
+                    journal_log_word) == -1 ||
+        bitmap_init(&block_bitmap, DATA_BLOCKS,
+                    image.base + image.superblock->s_block_bitmap, *created,
+                    journal_log_word) == -1) {
+        return -1; // allocation failed
+    }
+
+    for (size_t i = 0; i < MAX_OPEN_FILES; i++) {
+        mutex_init(&open_file_table[i].lock);
+        free_open_file_entries[i] = FREE;
+    }
+
+    dcache_init();
+    bcache_init(BLOCK_SIZE, insert_delay);
+
+    if (params.dedup && dedup_init() == -1) {
+        return -1;
+    }
+    if (blocks_deduplicated && !*created && block_holders_rebuild() == -1) {
+        return -1;
+    }
+
+    if (orphans_init(*created) == -1) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Destroy FS state.
+ *
+ * Returns 0 if succesful, -1 otherwise.
+ */
+int state_destroy(void) {
+    orphans_destroy();
+
+    // Blocks held by snapshots are freed as they go away
+    for (int i = 0; i < MAX_SNAPSHOTS; i++) {
+        if (snapshots[i].status == SNAPSHOT_READY) {
+            snapshots[i].open_count = 0;
+            snapshot_delete(i);
+        }
+    }
+    mutex_destroy(&snapshots_mutex);
+
+    // Return cached slots before the bitmaps go away
+    magazines_flush();
+    pthread_key_delete(magazine_key);
+    while (magazines != NULL) {
+        magazine_t *next = magazines->next;
+        mutex_destroy(&magazines->lock);
+        free(magazines);
+        magazines = next;
+    }
+    mutex_destroy(&magazines_mutex);
+
+    for (size_t i = 0; i < INODE_TABLE_SIZE; i++) {
+        rwlock_destroy(&inode_table_locker[i]);
+        mutex_destroy(&inode_pins[i].lock);
+        cond_destroy(&inode_pins[i].unpinned);
+    }
+
+    for (size_t i = 0; i < MAX_OPEN_FILES; i++) {
+        mutex_destroy(&open_file_table[i].lock);
+    }
+
+    mutex_destroy(&open_file_mutex);
+
+    bitmap_destroy(&inode_bitmap);
+    bitmap_destroy(&block_bitmap);
+
+    image.superblock->s_clean = 1;
+    journal_dirty(image.superblock, sizeof(superblock_t));
+    bcache_destroy();
+    int result = journal_destroy();
+    if (image_close(&image) == -1) {
+        result = -1;
+    }
+
+    free(open_file_table);
+    free(free_open_file_entries);
+    free(inode_table_locker);
+    free(inode_pins);
+    free(block_refs);
+    free(inode_cached);
+    if (fs_params.dedup) {
+        mutex_destroy(&dedup_mutex);
+        free(dedup_buckets);
+        free(dedup_next);
+        dedup_buckets = NULL;
+        dedup_next = NULL;
+    }
+
+    inode_table = NULL;
+    fs_data = NULL;
+    block_checksums = NULL;
+    open_file_table = NULL;
+    free_open_file_entries = NULL;
+    inode_table_locker = NULL;
+    inode_pins = NULL;
+    block_refs = NULL;
+    inode_cached = NULL;
+
+    return result;
+}
+
+/**
+ * (Try to) Allocate a new inode in the inode table, without initializing its
+ * data.
+ *
+ * Returns the inumber of the newly allocated inode, or -1 in the case of error.
+ *
+ * Possible errors:
+ *   - No free slots in inode table.
+ */
+static int inode_alloc(void) {
+    size_t seen = atomic_load(&orphans_reclaimed);
+    int inumber = magazine_alloc_inode();
+
+    // Free inodes may be cached by other threads, or held by orphans. Only
+    // give up once all caches were empty both before and after an attempt:
+    // another thread may have just flushed them, or refilled its own
+    while (inumber == -1) {
+        size_t flushed = magazines_flush();
+        inumber = magazine_alloc_inode();
+        if (inumber == -1 && flushed == 0 && magazines_flush() == 0 &&
+            orphans_flush(&seen) == 0) {
+            break;
+        }
+    }
+
+    return inumber;
+}
+
+/**
+ * Check whether an inode is in the inode table (rather than in a snapshot).
+ *
+ * Input:
+ *   - inode: the inode
+ */
+static bool in_inode_table(inode_t const *inode) {
+    uintptr_t address = (uintptr_t)inode;
+    return address >= (uintptr_t)inode_table &&
+           address < (uintptr_t)(inode_table + INODE_TABLE_SIZE);
+}
+
+/**
+ * Log the current contents of an inode (and of its extent block, if any) in
+ * the journal.
+ *
+ * Input:
+ *   - inode: the inode
+ */
+static void inode_log(inode_t const *inode) {
+    if (!in_inode_table(inode)) {
+        return; // snapshot inodes are not kept in the image
+    }
+
+    journal_log(inode, sizeof(inode_t));
+    if (inode->i_extent_count > INODE_EXTENTS) {
+        journal_log(fs_data + (size_t)inode->i_extent_block * BLOCK_SIZE,
+                    (inode->i_extent_count - INODE_EXTENTS) * sizeof(extent_t));
+    }
+}
+
+/**
+ * Log the current contents of the first blocks of an inode in the journal.
+ *
+ * Input:
+ *   - inode: the inode
+ *   - block_count: the number of blocks to log (at most those mapped)
+ */
+static void inode_log_blocks(inode_t const *inode, size_t block_count) {
+    for (size_t block = 0; block < block_count;) {
+        size_t run;
+        void const *data = inode_block_get(inode, block, &run);
+        if (run > block_count - block) {
+            run = block_count - block;
+        }
+        journal_log(data, run * BLOCK_SIZE);
+        block += run;
+    }
+}
+
+/**
+ * Initialize the fields of a newly allocated inode that do not depend on its
+ * type (no data blocks, no entries).
+ *
+ * Input:
+ *   - inode: the inode (locked for writing)
+ *   - i_type: the type of the node
+ */
+static void inode_reset(inode_t *inode, inode_type i_type) {
+    inode->i_node_type = i_type;
+    inode->i_flags = 0;
+    inode->i_extent_count = 0;
+    inode->i_extent_block = -1;
+    inode->i_entry_count = 0;
+}
+
+/**
+ * Create a new inode in the inode table.
+ *
+ * Allocates and initializes a new inode.
+ * Directories will have their data block allocated and initialized, with i_size
+ * set to BLOCK_SIZE. Regular files will not have any data block allocated
+ * (i_size and i_extent_count will be set to 0).
+ *
+ * Input:
+ *   - i_type: the type of the node (file or directory)
+ *
+ * Returns inumber of the new inode, or -1 in the case of error.
+ *
+ * Possible errors:
+ *   - No free slots in inode table.
+ *   - (if creating a directory) No free data blocks.
+ */
+int inode_create(inode_type i_type) {
+    int inumber = inode_alloc();
+    if (inumber == -1) {
+        return -1; // no free slots in inode table
+    }
+
+    inode_t *inode = &inode_table[inumber];
+    storage_read(inode);
+
+    rwlock_writelock(&inode_table_locker[inumber]);
+    inode_reset(inode, i_type);
+    switch (i_type) {
+    case T_DIRECTORY: {
+        // Initializes directory (filling its block with empty entries, labeled
+        // with inumber==-1)
+
+        if (inode_grow(inode, 1) != 1) {
+            // ensure fields are initialized
+            inode->i_size = 0;
+            inode->i_link_count = 0;
+
+            // run regular deletion process
+            rwlock_unlock(&inode_table_locker[inumber]);
+            inode_delete(inumber);
+            return -1;
+        }
+
+        inode_table[inumber].i_size = BLOCK_SIZE;
+        inode_table[inumber].i_link_count = 1;
+
+        dir_entry_t *dir_entry = (dir_entry_t *)inode_block_get(inode, 0, NULL);
+        ALWAYS_ASSERT(dir_entry != NULL,
+                      "inode_create: data block freed while in use");
+
+        for (size_t i = 0; i < DIR_ENTRIES_PER_BLOCK; i++) {
+            dir_entry[i].d_inumber = -1;
+        }
+        journal_log(dir_entry, BLOCK_SIZE);
+    } break;
+    case T_FILE:
+        // In case of a new file, simply sets its size to 0
+        inode_table[inumber].i_size = 0;
+        inode_table[inumber].i_link_count = 1;
+        break;
+    case T_LINK:
+        inode_table[inumber].i_size = 0;
+        inode_table[inumber].i_link_count = 1;
+        break;
+    default:
+        PANIC("inode_create: unknown file type");
+    }
+    inode_log(inode);
+    rwlock_unlock(&inode_table_locker[inumber]);
+
+    return inumber;
+}
+
+/**
+ * Create many (empty) regular files in the inode table at once.
+ *
+ * Inodes are allocated in runs straight from inode_bitmap, rather than one at
+ * a time through the magazine of the calling thread (which is only used once
+ * the bitmap has none left).
+ *
+ * Input:
+ *   - count: the number of files to create
+ *   - inumbers: where to store the inumbers of the new inodes
+ *
+ * Returns the number of files created (less than count if the inode table is
+ * full).
+ */
+size_t inode_create_files(size_t count, int *inumbers) {
+    size_t created = 0;
+    while (created < count) {
+        size_t length;
+        bitmap_search_read(&inode_bitmap);
+        long first = bitmap_alloc_run(&inode_bitmap, count - created, &length);
+        if (first == -1) {
+            first = inode_alloc();
+            length = 1;
+            if (first == -1) {
+                break; // no free slots in inode table
+            }
+        }
+
+        for (size_t i = 0; i < length; i++) {
+            int inumber = (int)first + (int)i;
+            inode_t *inode = &inode_table[inumber];
+            storage_read(inode);
+
+            rwlock_writelock(&inode_table_locker[inumber]);
+            inode_reset(inode, T_FILE);
+            inode->i_size = 0;
+            inode->i_link_count = 1;
+            inode_log(inode);
+            rwlock_unlock(&inode_table_locker[inumber]);
+
+            inumbers[created++] = inumber;
+        }
+    }
+
+    return created;
+}
+
+/**
+ * Delete an inode.
+ *
+ * Input:
+ *   - inumber: inode's number
+ */
+void inode_delete(int inumber) {
+    ALWAYS_ASSERT(valid_inumber(inumber), "inode_delete: invalid inumber");
+    storage_read(&inode_table[inumber]);
+
+    // (inodes cached by magazines are still taken in inode_bitmap)
+    ALWAYS_ASSERT(bitmap_is_set(&inode_bitmap, (size_t)inumber) &&
+                      !inode_cached[inumber],
+                  "inode_delete: inode already freed");
+
+    rwlock_writelock(&inode_table_locker[inumber]);
+    inode_wait_unpinned(inumber); // borrowed blocks cannot be freed
+    inode_truncate(&inode_table[inumber], 0);
+    rwlock_unlock(&inode_table_locker[inumber]);
+
+    magazine_free_inode(inumber);
+}
+
+/**
+ * Have the reclaimer free, later on, the blocks that a file keeps past its
+ * size (after it was truncated, see tfs_ftruncate).
+ *
+ * Input:
+ *   - inumber: inode's number
+ */
+void inode_trim_later(int inumber) {
+    ALWAYS_ASSERT(valid_inumber(inumber), "inode_trim_later: invalid inumber");
+    mutex_lock(&orphan_mutex);
+    trim_enqueue(inumber);
+    mutex_unlock(&orphan_mutex);
+}
+
+/**
+ * Hand a file whose last link was removed over to the reclaimer, which frees
+ * its inode and data blocks once the file is no longer open in the live FS.
+ *
+ * Input:
+ *   - inumber: inode's number
+ */
+void inode_orphan(int inumber) {
+    ALWAYS_ASSERT(valid_inumber(inumber), "inode_orphan: invalid inumber");
+    atomic_fetch_add(&orphans_pending, 1);
+
+    mutex_lock(&open_file_mutex);
+    atomic_store(&orphan_unlinked[inumber], true);
+    if (inumber_is_open(inumber)) {
+        orphan_open[inumber] = true;
+    } else {
+        orphan_enqueue(inumber);
+    }
+    mutex_unlock(&open_file_mutex);
+}
+
+/**
+ * Obtain a pointer to an inode from its inumber.
+ *
+ * Input:
+ *   - inumber: inode's number
+ *
+ * Returns pointer to inode.
+ */
+inode_t *inode_get(int inumber) {
+    ALWAYS_ASSERT(valid_inumber(inumber), "inode_get: invalid inumber");
+
+    storage_read(&inode_table[inumber]);
+    return &inode_table[inumber];
+}
+
+/**
+ * Lock an inode for reading (shared with other readers).
+ *
+ * Input:
+ *   - inumber: inode's number
+ */
+void inode_read_lock(int inumber) {
+    ALWAYS_ASSERT(valid_inumber(inumber), "inode_read_lock: invalid inumber");
+    rwlock_readlock(&inode_table_locker[inumber]);
+}
+
+/**
+ * Lock an inode for writing (exclusive).
+ *
+ * Input:
+ *   - inumber: inode's number
+ */
+void inode_write_lock(int inumber) {
+    ALWAYS_ASSERT(valid_inumber(inumber), "inode_write_lock: invalid inumber");
+    rwlock_writelock(&inode_table_locker[inumber]);
+}
+
+/**
+ * Unlock an inode locked with inode_read_lock or inode_write_lock.
+ *
+ * Input:
+ *   - inumber: inode's number
+ */
+void inode_unlock(int inumber) {
+    ALWAYS_ASSERT(valid_inumber(inumber), "inode_unlock: invalid inumber");
+    rwlock_unlock(&inode_table_locker[inumber]);
+}
+
+/**
+ * Pin the data blocks of an inode, so that they are not freed nor moved to
+ * other blocks until the pin is dropped with inode_unpin.
+ *
+ * Must be called with the inode locked (for reading or writing). Pins do not
+ * block readers nor writes in place, but anyone about to free or move the
+ * inode's data blocks must wait for them to be dropped with
+ * inode_wait_unpinned.
+ *
+ * Input:
+ *   - inumber: inode's number
+ */
+void inode_pin(int inumber) {
+    ALWAYS_ASSERT(valid_inumber(inumber), "inode_pin: invalid inumber");
+
+    mutex_lock(&inode_pins[inumber].lock);
+    inode_pins[inumber].count++;
+    mutex_unlock(&inode_pins[inumber].lock);
+}
+
+/**
+ * Drop a pin taken with inode_pin (the inode does not need to be locked).
+ *
+ * Input:
+ *   - inumber: inode's number
+ */
+void inode_unpin(int inumber) {
+    ALWAYS_ASSERT(valid_inumber(inumber), "inode_unpin: invalid inumber");
+
+    mutex_lock(&inode_pins[inumber].lock);
+    ALWAYS_ASSERT(inode_pins[inumber].count > 0, "inode_unpin: not pinned");
+    if (--inode_pins[inumber].count == 0) {
+        cond_broadcast(&inode_pins[inumber].unpinned);
+    }
+    mutex_unlock(&inode_pins[inumber].lock);
+}
+
+/**
+ * Wait until an inode has no pins.
+ *
+ * Must be called with the inode locked for writing (so no new pins can be
+ * taken until it is unlocked).
+ *
+ * Input:
+ *   - inumber: inode's number
+ */
+void inode_wait_unpinned(int inumber) {
+    ALWAYS_ASSERT(valid_inumber(inumber),
+                  "inode_wait_unpinned: invalid inumber");
+
+    mutex_lock(&inode_pins[inumber].lock);
+    while (inode_pins[inumber].count > 0) {
+        cond_wait(&inode_pins[inumber].unpinned, &inode_pins[inumber].lock);
+    }
+    mutex_unlock(&inode_pins[inumber].lock);
+}
+
+/**
+ * Check whether an inode has pins.
+ *
+ * Must be called with the inode locked for writing (see inode_wait_unpinned).
+ *
+ * Input:
+ *   - inumber: inode's number
+ */
+static bool inode_pinned(int inumber) {
+    mutex_lock(&inode_pins[inumber].lock);
+    bool pinned = inode_pins[inumber].count > 0;
+    mutex_unlock(&inode_pins[inumber].lock);
+    return pinned;
+}
+
+/**
+ * Obtain the inumber of an inode from a pointer to it.
+ *
+ * Input:
+ *   - inode: pointer to an inode of the inode table
+ */
+static int inode_number(inode_t const *inode) {
+    return (int)(inode - inode_table);
+}
+
+/**
+ * Hash a file name (32-bit FNV-1a).
+ *
+ * Input:
+ *   - name: the file name
+ */
+static unsigned int dir_name_hash(char const *name) {
+    unsigned int hash = 2166136261u;
+    for (size_t i = 0; i < MAX_FILE_NAME && name[i] != '\0'; i++) {
+        hash ^= (unsigned char)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * Cursor over the slots of a directory, which keeps track of the directory
+ * block being accessed so that probing within a block only accesses it once.
+ */
+typedef struct {
+    inode_t const *inode;
+    size_t slot_count;
+    size_t block_index;
+    dir_entry_t *block;
+} dir_cursor_t;
+
+static void dir_cursor_init(dir_cursor_t *cursor, inode_t const *inode) {
+    cursor->inode = inode;
+    cursor->slot_count = (inode->i_size / BLOCK_SIZE) * DIR_ENTRIES_PER_BLOCK;
+    cursor->block_index = (size_t)-1;
+    cursor->block = NULL;
+}
+
+/**
+ * Obtain a pointer to a slot of a directory.
+ *
+ * Input:
+ *   - cursor: cursor over the directory
+ *   - slot: the slot index (less than cursor->slot_count)
+ */
+static dir_entry_t *dir_slot(dir_cursor_t *cursor, size_t slot) {
+    size_t block_index = slot / DIR_ENTRIES_PER_BLOCK;
+    if (block_index != cursor->block_index) {
+        cursor->block = inode_block_get(cursor->inode, block_index, NULL);
+        ALWAYS_ASSERT(cursor->block != NULL,
+                      "dir_slot: directory must have its data blocks");
+        cursor->block_index = block_index;
+    }
+    return &cursor->block[slot % DIR_ENTRIES_PER_BLOCK];
+}
+
+/**
+ * Probe a directory for a name.
+ *
+ * Must be called with the directory lock held.
+ *
+ * Input:
+ *   - cursor: cursor over the directory
+ *   - sub_name: sub file name
+ *   - hash: the hash of sub_name
+ *   - slot: set to the slot holding sub_name if found, or else to the first
+ *     free slot in its probe sequence ((size_t)-1 if there is none)
+ *
+ * Returns true if sub_name was found, false otherwise.
+ */
+static bool dir_probe(dir_cursor_t *cursor, char const *sub_name,
+                      unsigned int hash, size_t *slot) {
+    size_t slots = cursor->slot_count;
+    size_t i = hash % slots;
+
+    for (size_t probes = 0; probes < slots; probes++, i = (i + 1) % slots) {
+        dir_entry_t *entry = dir_slot(cursor, i);
+        if (entry->d_inumber == -1) {
+            *slot = i;
+            return false;
+        }
+        if (entry->d_hash == hash &&
+            strncmp(entry->d_name, sub_name, MAX_FILE_NAME) == 0) {
+            *slot = i;
+            return true;
+        }
+    }
+
+    *slot = (size_t)-1;
+    return false; // directory is full
+}
+
+/**
+ * Rebuild the hash table of a directory over a different number of blocks.
+ *
+ * Must be called with the directory lock held.
+ *
+ * Input:
+ *   - inode: directory inode
+ *   - block_count: the new number of data blocks of the directory
+ *
+ * Returns 0 if successful, -1 otherwise (in which case the directory is left
+ * unchanged).
+ *
+ * Possible errors:
+ *   - No free data blocks (when growing).
+ *   - malloc failure when gathering the entries.
+ */
+static int dir_resize(inode_t *inode, size_t block_count) {
+    size_t old_block_count = inode->i_size / BLOCK_SIZE;
+
+    // Gather the current entries
+    dir_entry_t *entries = malloc(inode->i_entry_count * sizeof(dir_entry_t));
+    if (entries == NULL && inode->i_entry_count > 0) {
+        return -1;
+    }
+
+    dir_cursor_t cursor;
+    dir_cursor_init(&cursor, inode);
+    size_t count = 0;
+    for (size_t i = 0; i < cursor.slot_count; i++) {
+        dir_entry_t *entry = dir_slot(&cursor, i);
+        if (entry->d_inumber != -1) {
+            entries[count++] = *entry;
+        }
+    }
+    ALWAYS_ASSERT(count == inode->i_entry_count,
+                  "dir_resize: directory entry count is inconsistent");
+
+    if (block_count > old_block_count &&
+        inode_grow(inode, block_count) < block_count) {
+        inode_truncate(inode, old_block_count);
+        free(entries);
+        return -1; // no space
+    }
+
+    // Clear the new table and insert the entries back
+    inode->i_size = block_count * BLOCK_SIZE;
+    dir_cursor_init(&cursor, inode);
+    for (size_t i = 0; i < cursor.slot_count; i++) {
+        dir_slot(&cursor, i)->d_inumber = -1;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        size_t slot;
+        bool found =
+            dir_probe(&cursor, entries[i].d_name, entries[i].d_hash, &slot);
+        ALWAYS_ASSERT(!found && slot != (size_t)-1,
+                      "dir_resize: entries must fit in the new table");
+        *dir_slot(&cursor, slot) = entries[i];
+    }
+    free(entries);
+    inode_log_blocks(inode, block_count);
+
+    if (block_count < old_block_count) {
+        inode_truncate(inode, block_count);
+    }
+    inode_log(inode);
+
+    return 0;
+}
+
+/**
+ * Shrink the hash table of a directory, giving blocks back once it is mostly
+ * empty (the table is halved while the entries stay below 1/8 of its slots).
+ *
+ * Must be called with the directory lock held.
+ *
+ * Input:
+ *   - inode: directory inode
+ */
+static void dir_shrink(inode_t *inode) {
+    size_t block_count = inode->i_size / BLOCK_SIZE;
+    size_t new_block_count = block_count;
+    while (new_block_count > 1 &&
+           inode->i_entry_count * 8 < new_block_count * DIR_ENTRIES_PER_BLOCK) {
+        new_block_count /= 2;
+    }
+
+    if (new_block_count < block_count) {
+        dir_resize(inode, new_block_count);
+    }
+}
+
+/**
+ * Grow the hash table of a directory ahead of adding entries to it, doubling
+ * it until they keep it under 3/4 full, so that probe sequences stay short (if
+ * there is no space for it, the remaining slots are used).
+ *
+ * Must be called with the directory lock held.
+ *
+ * Input:
+ *   - inode: directory inode
+ *   - added: the number of entries to be added
+ */
+static void dir_reserve(inode_t *inode, size_t added) {
+    size_t block_count = inode->i_size / BLOCK_SIZE;
+    size_t new_block_count = block_count;
+    while ((inode->i_entry_count + added) * 4 >
+           new_block_count * DIR_ENTRIES_PER_BLOCK * 3) {
+        new_block_count *= 2;
+    }
+
+    if (new_block_count > block_count) {
+        dir_resize(inode, new_block_count);
+    }
+}
+
+/**
+ * Remove an entry from a directory (without shrinking it).
+ *
+ * Must be called with the directory lock held.
+ *
+ * Input:
+ *   - inode: directory inode
+ *   - sub_name: sub file name
+ *   - sub_inumber: the inumber sub_name must refer to
+ *
+ * Returns 0 if successful, -1 if the directory does not contain an entry for
+ * sub_name referring to sub_inumber.
+ */
+static int dir_remove(inode_t *inode, char const *sub_name, int sub_inumber) {
+    dir_cursor_t cursor;
+    dir_cursor_init(&cursor, inode);
+
+    size_t hole;
+    if (!dir_probe(&cursor, sub_name, dir_name_hash(sub_name), &hole) ||
+        dir_slot(&cursor, hole)->d_inumber != sub_inumber) {
+        return -1; // sub_name not found (or linked to another file since)
+    }
+
+    // Shift back the entries that follow in the probe sequence, so that no
+    // lookup stops early at the freed slot
+    size_t slots = cursor.slot_count;
+    size_t start = hole;
+    for (size_t step = 1; step < slots; step++) {
+        size_t i = (start + step) % slots;
+        dir_entry_t *entry = dir_slot(&cursor, i);
+        if (entry->d_inumber == -1) {
+            break;
+        }
+
+        // The entry may fill the hole if its home slot is not in (hole, i]
+        size_t home = entry->d_hash % slots;
+        size_t hole_distance = (i + slots - hole) % slots;
+        size_t home_distance = (i + slots - home) % slots;
+        if (home_distance >= hole_distance) {
+            dir_entry_t moved = *entry;
+            dir_entry_t *filled = dir_slot(&cursor, hole);
+            *filled = moved;
+            journal_log(filled, sizeof(dir_entry_t));
+            hole = i;
+        }
+    }
+
+    dir_entry_t *freed = dir_slot(&cursor, hole);
+    freed->d_inumber = -1;
+    memset(freed->d_name, 0, MAX_FILE_NAME);
+    journal_log(freed, sizeof(dir_entry_t));
+    inode->i_entry_count--;
+    dcache_update(inode_number(inode), sub_name, -1);
+
+    return 0;
+}
+
+/**
+ * Add an entry to a directory (without growing it).
+ *
+ * Must be called with the directory lock held.
+ *
+ * Input:
+ *   - inode: directory inode
+ *   - sub_name: sub file name
+ *   - sub_inumber: inumber of the sub inode
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - sub_name is not a valid file name (length 0 or > MAX_FILE_NAME - 1).
+ *   - Directory already contains an entry for sub_name.
+ *   - Directory is already full of entries.
+ */
+static int dir_insert(inode_t *inode, char const *sub_name, int sub_inumber) {
+    if (strlen(sub_name) == 0 || strlen(sub_name) > MAX_FILE_NAME - 1) {
+        return -1; // invalid sub_name
+    }
+
+    dir_cursor_t cursor;
+    dir_cursor_init(&cursor, inode);
+
+    // Finds the free slot for the entry, making sure the name is not taken
+    unsigned int hash = dir_name_hash(sub_name);
+    size_t slot;
+    if (dir_probe(&cursor, sub_name, hash, &slot)) {
+        return -1; // sub_name already exists
+    }
+    if (slot == (size_t)-1) {
+        return -1; // no space for entry
+    }
+
+    dir_entry_t *entry = dir_slot(&cursor, slot);
+    entry->d_inumber = sub_inumber;
+    entry->d_hash = hash;
+    strncpy(entry->d_name, sub_name, MAX_FILE_NAME - 1);
+    entry->d_name[MAX_FILE_NAME - 1] = '\0';
+    journal_log(entry, sizeof(dir_entry_t));
+    inode->i_entry_count++;
+    dcache_update(inode_number(inode), entry->d_name, sub_inumber);
+
+    return 0;
+}
+
+/**
+ * Clear the directory entry associated with a sub file.
+ *
+ * Input:
+ *   - inode: directory inode
+ *   - sub_name: sub file name
+ *   - sub_inumber: the inumber of the sub file, as looked up before
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - inode is not a directory inode.
+ *   - Directory does not contain an entry for sub_name.
+ *   - sub_name was unlinked and linked to another file since it was looked up.
+ */
+int clear_dir_entry(inode_t *inode, char const *sub_name, int sub_inumber) {
+    int result = 0;
+    clear_dir_entries(inode, &sub_name, &sub_inumber, 1, &result);
+    return result;
+}
+
+/**
+ * Clear the directory entries associated with many sub files, in a single
+ * pass over the directory (which is only shrunk once, at the end).
+ *
+ * Input:
+ *   - inode: directory inode
+ *   - sub_names: sub file names
+ *   - sub_inumbers: the inumbers of the sub files, as looked up before
+ *   - count: number of sub file names
+ *   - results: for each sub file, -1 to skip it; set to 0 if its entry was
+ *     cleared, -1 otherwise (see clear_dir_entry)
+ */
+void clear_dir_entries(inode_t *inode, char const *const *sub_names,
+                       int const *sub_inumbers, size_t count, int *results) {
+    storage_read(inode);
+    if (inode->i_node_type != T_DIRECTORY) {
+        for (size_t i = 0; i < count; i++) {
+            results[i] = -1; // not a directory
+        }
+        return;
+    }
+
+    pthread_rwlock_t *dir_lock = &inode_table_locker[inode_number(inode)];
+    rwlock_writelock(dir_lock);
+
+    size_t cleared = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (results[i] != -1) {
+            results[i] = dir_remove(inode, sub_names[i], sub_inumbers[i]);
+            cleared += (results[i] == 0);
+        }
+    }
+
+    if (cleared > 0) {
+        inode_log(inode);
+        dir_shrink(inode);
+    }
+
+    rwlock_unlock(dir_lock);
+}
+
+/**
+ * Store the inumber for a sub file in a directory.
+ *
+ * Input:
+ *   - inode: directory inode
+ *   - sub_name: sub file name
+ *   - sub_inumber: inumber of the sub inode
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - inode is not a directory inode.
+ *   - sub_name is not a valid file name (length 0 or > MAX_FILE_NAME - 1).
+ *   - Directory already contains an entry for sub_name.
+ *   - Directory was removed.
+ *   - Directory is already full of entries.
+ */
+int add_dir_entry(inode_t *inode, char const *sub_name, int sub_inumber) {
+    int result = 0;
+    add_dir_entries(inode, &sub_name, &sub_inumber, 1, &result);
+    return result;
+}
+
+/**
+ * Store the inumbers for many sub files in a directory, in a single pass over
+ * the directory (which is grown once, beforehand, to fit them all).
+ *
+ * Input:
+ *   - inode: directory inode
+ *   - sub_names: sub file names
+ *   - sub_inumbers: inumbers of the sub inodes
+ *   - count: number of sub files
+ *   - results: for each sub file, -1 to skip it; set to 0 if its entry was
+ *     stored, -1 otherwise (see add_dir_entry)
+ */
+void add_dir_entries(inode_t *inode, char const *const *sub_names,
+                     int const *sub_inumbers, size_t count, int *results) {
+    storage_read(inode);
+    if (inode->i_node_type != T_DIRECTORY) {
+        for (size_t i = 0; i < count; i++) {
+            results[i] = -1; // not a directory
+        }
+        return;
+    }
+
+    pthread_rwlock_t *dir_lock = &inode_table_locker[inode_number(inode)];
+    rwlock_writelock(dir_lock);
+
+    if (inode->i_link_count == 0) {
+        rwlock_unlock(dir_lock);
+        for (size_t i = 0; i < count; i++) {
+            results[i] = -1; // directory was removed
+        }
+        return;
+    }
+
+    size_t added = 0;
+    for (size_t i = 0; i < count; i++) {
+        added += (results[i] != -1);
+    }
+    dir_reserve(inode, added);
+
+    added = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (results[i] != -1) {
+            results[i] = dir_insert(inode, sub_names[i], sub_inumbers[i]);
+            added += (results[i] == 0);
+        }
+    }
+
+    if (added > 0) {
+        inode_log(inode);
+    }
+
+    rwlock_unlock(dir_lock);
+}
+
+/**
+ * Obtain the inumber for a sub file inside a directory.
+ *
+ * Input:
+ *   - inode: directory inode
+ *   - sub_name: sub file name
+ *
+ * Returns inumber linked to the target name, -1 if errors occur.
+ *
+ * Possible errors:
+ *   - inode is not a directory inode.
+ *   - Directory does not contain a file named sub_name.
+ */
+int find_in_dir(inode_t const *inode, char const *sub_name) {
+    int sub_inumber;
+    find_many_in_dir(inode, &sub_name, 1, &sub_inumber);
+    return sub_inumber;
+}
+
+/**
+ * Obtain the inumbers for many sub files inside a directory, with a single
+ * acquisition of its lock.
+ *
+ * Input:
+ *   - inode: directory inode
+ *   - sub_names: sub file names
+ *   - count: number of sub file names
+ *   - sub_inumbers: where to store the inumber of each sub file (-1 if not
+ *     found, see find_in_dir)
+ */
+void find_many_in_dir(inode_t const *inode, char const *const *sub_names,
+                      size_t count, int *sub_inumbers) {
+    ALWAYS_ASSERT(inode != NULL, "find_in_dir: inode must be non-NULL");
+
+    storage_read(inode);
+    if (inode->i_node_type != T_DIRECTORY) {
+        for (size_t i = 0; i < count; i++) {
+            sub_inumbers[i] = -1; // not a directory
+        }
+        return;
+    }
+
+    pthread_rwlock_t *dir_lock = &inode_table_locker[inode_number(inode)];
+    rwlock_readlock(dir_lock);
+
+    dir_cursor_t cursor;
+    dir_cursor_init(&cursor, inode);
+
+    for (size_t i = 0; i < count; i++) {
+        char const *sub_name = sub_names[i];
+        ALWAYS_ASSERT(sub_name != NULL,
+                      "find_in_dir: sub_name must be non-NULL");
+
+        sub_inumbers[i] = -1; // entry not found
+        size_t slot;
+        if (dir_probe(&cursor, sub_name, dir_name_hash(sub_name), &slot)) {
+            sub_inumbers[i] = dir_slot(&cursor, slot)->d_inumber;
+        }
+
+        // Remember the result (even if the entry was not found) while the
+        // directory cannot change
+        if (strnlen(sub_name, MAX_FILE_NAME) < MAX_FILE_NAME) {
+            dcache_update(inode_number(inode), sub_name, sub_inumbers[i]);
+        }
+    }
+
+    rwlock_unlock(dir_lock);
+}
+
+/**
+ * Obtain the inumber for a sub file inside a directory, given the directory's
+ * inumber.
+ *
+ * Unlike find_in_dir, names found in the directory entry cache do not require
+ * accessing the directory (or its inode) at all.
+ *
+ * Input:
+ *   - dir_inumber: directory inumber
+ *   - sub_name: sub file name
+ *
+ * Returns inumber linked to the target name, -1 if errors occur.
+ *
+ * Possible errors:
+ *   - dir_inumber is not a directory inode.
+ *   - Directory does not contain a file named sub_name.
+ */
+int dir_lookup(int dir_inumber, char const *sub_name) {
+    int sub_inumber;
+    if (dcache_lookup(dir_inumber, sub_name, &sub_inumber)) {
+        return sub_inumber;
+    }
+
+    return find_in_dir(inode_get(dir_inumber), sub_name);
+}
+
+/**
+ * Mark an empty directory as removed, so that no more entries can be added to
+ * it.
+ *
+ * Input:
+ *   - inode: directory inode
+ *
+ * Returns 0 if successful (including if the directory was already marked),
+ * -1 otherwise.
+ *
+ * Possible errors:
+ *   - inode is not a directory inode.
+ *   - Directory is not empty.
+ */
+int seal_empty_dir(inode_t *inode) {
+    storage_read(inode);
+    if (inode->i_node_type != T_DIRECTORY) {
+        return -1; // not a directory
+    }
+
+    pthread_rwlock_t *dir_lock = &inode_table_locker[inode_number(inode)];
+    rwlock_writelock(dir_lock);
+
+    if (inode->i_entry_count > 0) {
+        rwlock_unlock(dir_lock);
+        return -1; // not empty
+    }
+
+    if (inode->i_link_count > 0) {
+        inode->i_link_count = 0;
+        inode_log(inode);
+    }
+    rwlock_unlock(dir_lock);
+
+    return 0;
+}
+
+/**
+ * Grow the data of an inode until it maps (at least) a given number of blocks.
+ *
+ * New blocks are taken right after the last extent whenever possible, so that
+ * files stay in as few extents as possible.
+ *
+ * Input:
+ *   - inode: the inode
+ *   - block_count: the number of blocks the inode should map
+ *
+ * Returns the number of blocks mapped by the inode, which is lower than
+ * block_count if there are no free data blocks or extents left.
+ */
+size_t inode_grow(inode_t *inode, size_t block_count) {
+    size_t blocks = inode_block_count(inode);
+    size_t old_blocks = blocks;
+
+    while (blocks < block_count) {
+        size_t wanted = block_count - blocks;
+
+        // Try to extend the last extent (unless it is a hole)
+        extent_t *last = inode->i_extent_count > 0
+                             ? inode_extent(inode, inode->i_extent_count - 1)
+                             : NULL;
+        if (last != NULL && last->e_start != EXTENT_HOLE) {
+            size_t taken =
+                data_block_alloc_at(last->e_start + last->e_length, wanted);
+            if (taken > 0) {
+                last->e_length += (int)taken;
+                blocks += taken;
+                continue;
+            }
+        }
+
+        // Otherwise, start a new extent
+        if (inode->i_extent_count == MAX_EXTENTS) {
+            break; // no extents left
+        }
+
+        if (inode->i_extent_count == INODE_EXTENTS) {
+            inode->i_extent_block = data_block_alloc();
+            if (inode->i_extent_block == -1) {
+                break; // no space for the extent block
+            }
+        }
+
+        size_t length;
+        int start = data_block_alloc_run(wanted, &length);
+        if (start == -1) {
+            if (inode->i_extent_count == INODE_EXTENTS) {
+                data_block_free(inode->i_extent_block);
+                inode->i_extent_block = -1;
+            }
+            break; // no space
+        }
+
+        extent_t *extent = inode_extent(inode, inode->i_extent_count);
+        extent->e_start = start;
+        extent->e_length = (int)length;
+        inode->i_extent_count++;
+        blocks += length;
+    }
+
+    if (blocks != old_blocks) {
+        inode_log(inode);
+    }
+
+    return blocks;
+}
+
+/**
+ * Free the data blocks of an inode past a given number of blocks.
+ *
+ * Input:
+ *   - inode: the inode
+ *   - block_count: the number of blocks to keep
+ */
+void inode_truncate(inode_t *inode, size_t block_count) {
+    size_t blocks = 0;
+    size_t kept = 0;
+
+    for (size_t i = 0; i < inode->i_extent_count; i++) {
+        extent_t *extent = inode_extent(inode, i);
+        size_t length = (size_t)extent->e_length;
+
+        if (blocks >= block_count) {
+            if (extent->e_start != EXTENT_HOLE) {
+                data_block_free_run(extent->e_start, length);
+            }
+        } else if (blocks + length > block_count) {
+            size_t keep = block_count - blocks;
+            if (extent->e_start != EXTENT_HOLE) {
+                data_block_free_run(extent->e_start + (int)keep, length - keep);
+            }
+            extent->e_length = (int)keep;
+            kept = i + 1;
+        } else {
+            kept = i + 1;
+        }
+        blocks += length;
+    }
+
+    if (blocks <= block_count) {
+        return; // nothing to free
+    }
+
+    inode->i_extent_count = kept;
+    if (kept <= INODE_EXTENTS && inode->i_extent_block != -1) {
+        data_block_free(inode->i_extent_block);
+        inode->i_extent_block = -1;
+    }
+    inode_log(inode);
+}
+
+/**
+ * Check whether any block of a run is shared (with a snapshot, or with other
+ * files through deduplication). If none is, the blocks of the run are about to
+ * be changed in place, so they are taken out of the content index.
+ *
+ * Input:
+ *   - block_number: the first block of the run
+ *   - length: the number of blocks in the run
+ */
+static bool run_shared(int block_number, size_t length) {
+    if (fs_params.dedup) {
+        mutex_lock(&dedup_mutex); // blocks gain holders through the index
+    }
+
+    bool shared = false;
+    for (size_t i = 0; i < length && !shared; i++) {
+        if (atomic_load(&block_refs[block_number + (int)i]) > 0) {
+            shared = true;
+        }
+    }
+
+    if (fs_params.dedup) {
+        for (size_t i = 0; i < length && !shared; i++) {
+            dedup_remove(block_number + (int)i);
+        }
+        mutex_unlock(&dedup_mutex);
+    }
+    return shared;
+}
+
+/**
+ * List of extents being built, which merges adjacent runs.
+ */
+typedef struct {
+    extent_t *extents;
+    size_t count;
+    size_t capacity;
+} extent_list_t;
+
+/**
+ * Append a run of blocks (or a hole) to a list of extents.
+ *
+ * Input:
+ *   - list: the list
+ *   - start: the first block of the run, or EXTENT_HOLE
+ *   - length: the number of blocks in the run
+ *
+ * Returns 0 if successful, -1 if the list is full.
+ */
+static int extent_list_append(extent_list_t *list, int start, size_t length) {
+    if (list->count > 0) {
+        extent_t *last = &list->extents[list->count - 1];
+        bool holes = last->e_start == EXTENT_HOLE && start == EXTENT_HOLE;
+        if (holes || (last->e_start != EXTENT_HOLE && start != EXTENT_HOLE &&
+                      last->e_start + last->e_length == start)) {
+            last->e_length += (int)length;
+            return 0;
+        }
+    }
+
+    if (list->count == list->capacity) {
+        return -1;
+    }
+    list->extents[list->count].e_start = start;
+    list->extents[list->count].e_length = (int)length;
+    list->count++;
+    return 0;
+}
+
+/**
+ * Replace the extents of an inode by those of a list.
+ *
+ * Input:
+ *   - inode: the inode
+ *   - list: the new extents
+ *
+ * Returns 0 if successful, -1 otherwise (in which case the inode is left
+ * unchanged).
+ *
+ * Possible errors:
+ *   - No space for the extent block the new extents need.
+ */
+static int inode_set_extents(inode_t *inode, extent_list_t const *list) {
+    if (list->count > INODE_EXTENTS && inode->i_extent_block == -1) {
+        inode->i_extent_block = data_block_alloc();
+        if (inode->i_extent_block == -1) {
+            return -1;
+        }
+    }
+
+    for (size_t i = 0; i < list->count; i++) {
+        *inode_extent(inode, i) = list->extents[i];
+    }
+    inode->i_extent_count = list->count;
+    if (list->count <= INODE_EXTENTS && inode->i_extent_block != -1) {
+        data_block_free(inode->i_extent_block);
+        inode->i_extent_block = -1;
+    }
+    inode_log(inode);
+    return 0;
+}
+
+/**
+ * Append a hole to the extents of an inode.
+ *
+ * Input:
+ *   - inode: the inode
+ *   - length: the number of blocks in the hole
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - No extents left, or no space for the extent block.
+ */
+static int inode_append_hole(inode_t *inode, size_t length) {
+    size_t count = inode->i_extent_count;
+    if (count > 0 && inode_extent(inode, count - 1)->e_start == EXTENT_HOLE) {
+        inode_extent(inode, count - 1)->e_length += (int)length;
+        inode_log(inode);
+        return 0;
+    }
+
+    if (count == MAX_EXTENTS) {
+        return -1; // no extents left
+    }
+    if (count == INODE_EXTENTS) {
+        inode->i_extent_block = data_block_alloc();
+        if (inode->i_extent_block == -1) {
+            return -1; // no space for the extent block
+        }
+    }
+
+    extent_t *extent = inode_extent(inode, count);
+    extent->e_start = EXTENT_HOLE;
+    extent->e_length = (int)length;
+    inode->i_extent_count++;
+    inode_log(inode);
+    return 0;
+}
+
+/**
+ * Map the holes within a range of the blocks of a file to newly allocated
+ * (uninitialized) data blocks.
+ *
+ * Input:
+ *   - inode: the file's inode
+ *   - first_block: the first block of the range
+ *   - last_block: the block past the range (at most the blocks covered by the
+ *     extents of the inode)
+ *
+ * Returns 0 if successful, -1 otherwise (in which case the file is left
+ * unchanged).
+ *
+ * Possible errors:
+ *   - No free data blocks, or no extents left.
+ *   - malloc failure when building the new extents.
+ */
+static int inode_fill_holes(inode_t *inode, size_t first_block,
+                            size_t last_block) {
+    size_t extent_count = inode->i_extent_count;
+    bool holes = false;
+    size_t position = 0; // file block where the extent starts
+    for (size_t i = 0; i < extent_count && position < last_block; i++) {
+        extent_t const *extent = inode_extent(inode, i);
+        position += (size_t)extent->e_length;
+        holes |= extent->e_start == EXTENT_HOLE && position > first_block;
+    }
+    if (!holes) {
+        return 0;
+    }
+
+    // The new extents, and the runs allocated for them
+    extent_list_t extents = {.capacity = MAX_EXTENTS};
+    extent_list_t fresh = {.capacity = MAX_EXTENTS};
+    extents.extents = malloc(MAX_EXTENTS * sizeof(extent_t));
+    fresh.extents = malloc(MAX_EXTENTS * sizeof(extent_t));
+
+    int result = 0;
+    if (extents.extents == NULL || fresh.extents == NULL) {
+        result = -1;
+    }
+
+    position = 0;
+    for (size_t i = 0; i < extent_count && result == 0; i++) {
+        extent_t extent = *inode_extent(inode, i);
+        size_t length = (size_t)extent.e_length;
+        size_t low = position > first_block ? position : first_block;
+        size_t high = position + length < last_block ? position + length
+                                                     : last_block;
+
+        if (low >= high || extent.e_start != EXTENT_HOLE) {
+            result = extent_list_append(&extents, extent.e_start, length);
+            position += length;
+            continue;
+        }
+
+        // Keep the part of the hole before the range, fill the part within
+        // it and keep the part after it
+        if (low > position) {
+            result = extent_list_append(&extents, EXTENT_HOLE, low - position);
+        }
+        for (size_t filled = 0; filled < high - low && result == 0;) {
+            size_t run;
+            int start = data_block_alloc_run(high - low - filled, &run);
+            if (start == -1) {
+                result = -1;
+                break;
+            }
+            if (extent_list_append(&fresh, start, run) == -1) {
+                data_block_free_run(start, run);
+                result = -1;
+                break;
+            }
+            result = extent_list_append(&extents, start, run);
+            filled += run;
+        }
+        if (result == 0 && high < position + length) {
+            result = extent_list_append(&extents, EXTENT_HOLE,
+                                        position + length - high);
+        }
+        position += length;
+    }
+
+    if (result == 0) {
+        result = inode_set_extents(inode, &extents);
+    }
+    if (result == -1 && fresh.extents != NULL) {
+        for (size_t i = 0; i < fresh.count; i++) {
+            data_block_free_run(fresh.extents[i].e_start,
+                                (size_t)fresh.extents[i].e_length);
+        }
+    }
+
+    free(extents.extents);
+    free(fresh.extents);
+    return result;
+}
+
+/**
+ * Make sure a range of the blocks of a file is mapped to data blocks, by
+ * filling the holes within it and growing the file up to its end (past a new
+ * hole, if the range starts past the blocks covered by the file's extents).
+ *
+ * Blocks that were not mapped before are left uninitialized.
+ *
+ * Must be called with the inode locked for writing.
+ *
+ * Input:
+ *   - inode: the file's inode
+ *   - first_block: the first block of the range
+ *   - block_count: the number of blocks in the range
+ *
+ * Returns the number of blocks mapped from the start of the range, which is
+ * lower than block_count if there are no free data blocks or extents left.
+ */
+size_t inode_map(inode_t *inode, size_t first_block, size_t block_count) {
+    size_t last_block = first_block + block_count;
+    if (block_count == 0 || last_block > INT_MAX) {
+        return 0; // (extents count blocks in ints)
+    }
+
+    size_t covered = inode_block_count(inode);
+    size_t fill_end = last_block < covered ? last_block : covered;
+    if (first_block < fill_end &&
+        inode_fill_holes(inode, first_block, fill_end) == -1) {
+        return 0;
+    }
+    if (last_block <= covered) {
+        return block_count;
+    }
+
+    if (first_block > covered &&
+        inode_append_hole(inode, first_block - covered) == -1) {
+        return 0;
+    }
+    size_t mapped = inode_grow(inode, last_block);
+    if (mapped <= first_block) {
+        inode_truncate(inode, covered); // drops the new hole, if any
+        return 0;
+    }
+    return mapped - first_block;
+}
+
+/**
+ * Turn a range of the blocks of a file into a hole, freeing their data blocks
+ * (blocks shared with snapshots or other files lose a holder instead).
+ *
+ * Must be called with the inode locked for writing, and not pinned.
+ *
+ * Input:
+ *   - inode: the file's inode
+ *   - first_block: the first block of the range
+ *   - block_count: the number of blocks in the range
+ *
+ * Returns 0 if successful, -1 otherwise (in which case the file is left
+ * unchanged).
+ *
+ * Possible errors:
+ *   - No extents left for the hole, or no space for the extent block.
+ *   - malloc failure when building the new extents.
+ */
+int inode_punch(inode_t *inode, size_t first_block, size_t block_count) {
+    size_t covered = inode_block_count(inode);
+    if (block_count == 0 || first_block >= covered) {
+        return 0;
+    }
+    if (block_count >= covered - first_block) {
+        inode_truncate(inode, first_block); // nothing is left past the hole
+        return 0;
+    }
+    size_t last_block = first_block + block_count;
+
+    // The new extents, and the runs they no longer map
+    size_t extent_count = inode->i_extent_count;
+    extent_list_t extents = {.capacity = MAX_EXTENTS};
+    extent_list_t replaced = {.capacity = extent_count};
+    extents.extents = malloc(MAX_EXTENTS * sizeof(extent_t));
+    replaced.extents = malloc(extent_count * sizeof(extent_t));
+
+    int result = 0;
+    if (extents.extents == NULL || replaced.extents == NULL) {
+        result = -1;
+    }
+
+    size_t position = 0; // file block where the extent starts
+    for (size_t i = 0; i < extent_count && result == 0; i++) {
+        extent_t extent = *inode_extent(inode, i);
+        size_t length = (size_t)extent.e_length;
+        size_t low = position > first_block ? position : first_block;
+        size_t high = position + length < last_block ? position + length
+                                                     : last_block;
+
+        if (low >= high || extent.e_start == EXTENT_HOLE) {
+            result = extent_list_append(&extents, extent.e_start, length);
+            position += length;
+            continue;
+        }
+
+        // Keep the part before the range, drop the part within it and keep
+        // the part after it
+        int drop_start = extent.e_start + (int)(low - position);
+        if (low > position) {
+            result = extent_list_append(&extents, extent.e_start,
+                                        low - position);
+        }
+        if (result == 0) {
+            result = extent_list_append(&extents, EXTENT_HOLE, high - low);
+        }
+        if (result == 0 && high < position + length) {
+            result = extent_list_append(
+                &extents, extent.e_start + (int)(high - position),
+                position + length - high);
+        }
+        if (result == 0) {
+            result = extent_list_append(&replaced, drop_start, high - low);
+        }
+        position += length;
+    }
+
+    if (result == 0) {
+        result = inode_set_extents(inode, &extents);
+    }
+    if (result == 0) {
+        for (size_t i = 0; i < replaced.count; i++) {
+            data_block_free_run(replaced.extents[i].e_start,
+                                (size_t)replaced.extents[i].e_length);
+        }
+    }
+
+    free(extents.extents);
+    free(replaced.extents);
+    return result;
+}
+
+/**
+ * Drop the blocks that a file keeps past its size (see inode_trim_later), and
+ * zero the rest of its last block, so that the file can be extended with
+ * zeros, i.e., with a hole.
+ *
+ * Must be called with the inode locked for writing (the blocks past its size
+ * are only dropped once it is not pinned, as they may have been borrowed
+ * before it shrank).
+ *
+ * Input:
+ *   - inode: the file's inode (not compressed)
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - No space to copy the last block, if it is shared (see inode_unshare).
+ */
+int inode_clear_tail(inode_t *inode) {
+    size_t block_count = (inode->i_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (inode_block_count(inode) > block_count) {
+        inode_wait_unpinned(inode_number(inode));
+        inode_truncate(inode, block_count);
+    }
+
+    size_t used = inode->i_size % BLOCK_SIZE;
+    if (used == 0 || inode_block_get(inode, block_count - 1, NULL) == NULL) {
+        return 0; // the last block is full, or in a hole
+    }
+    if (inode_unshare(inode, block_count - 1, 1) == -1) {
+        return -1;
+    }
+
+    char *block = inode_block_get(inode, block_count - 1, NULL);
+    memset(block + used, 0, BLOCK_SIZE - used);
+    journal_dirty(block + used, BLOCK_SIZE - used);
+    inode_checksum_update(inode, block_count - 1, 1);
+    return 0;
+}
+
+/**
+ * Make sure a range of the blocks of a file is not shared with any snapshot,
+ * by moving the shared parts of the extents that overlap it to new blocks
+ * (with the same contents).
+ *
+ * Must be called with the inode locked for writing. Waits for the inode to
+ * be unpinned if there are shared blocks to move (their other holders may
+ * free them while they are borrowed).
+ *
+ * Input:
+ *   - inode: the file's inode
+ *   - first_block: the first block of the range
+ *   - block_count: the number of blocks in the range
+ *
+ * Returns 0 if successful, -1 otherwise (in which case the file is left
+ * unchanged).
+ *
+ * Possible errors:
+ *   - No free data blocks, or no extents left.
+ *   - malloc failure when building the new extents.
+ */
+int inode_unshare(inode_t *inode, size_t first_block, size_t block_count) {
+    if (!blocks_may_be_shared() || block_count == 0 ||
+        inode->i_extent_count == 0) {
+        return 0; // nothing is shared
+    }
+
+    size_t extent_count = inode->i_extent_count;
+    size_t last_block = first_block + block_count;
+
+    // The new extents, the runs allocated for them and the runs they replace
+    extent_list_t extents = {.capacity = MAX_EXTENTS};
+    extent_list_t fresh = {.capacity = MAX_EXTENTS};
+    extent_list_t replaced = {.capacity = extent_count};
+    extents.extents = malloc(MAX_EXTENTS * sizeof(extent_t));
+    fresh.extents = malloc(MAX_EXTENTS * sizeof(extent_t));
+    replaced.extents = malloc(extent_count * sizeof(extent_t));
+
+    int result = 0;
+    if (extents.extents == NULL || fresh.extents == NULL ||
+        replaced.extents == NULL) {
+        result = -1;
+    }
+
+    size_t position = 0; // file block where the extent starts
+    for (size_t i = 0; i < extent_count && result == 0; i++) {
+        extent_t extent = *inode_extent(inode, i);
+        size_t length = (size_t)extent.e_length;
+        size_t low = position > first_block ? position : first_block;
+        size_t high = position + length < last_block ? position + length
+                                                     : last_block;
+
+        if (low >= high || extent.e_start == EXTENT_HOLE ||
+            !run_shared(extent.e_start + (int)(low - position), high - low)) {
+            result = extent_list_append(&extents, extent.e_start, length);
+            position += length;
+            continue;
+        }
+
+        inode_wait_unpinned(inode_number(inode));
+
+        // Keep the part before the range, copy the part within it and keep
+        // the part after it
+        int copy_start = extent.e_start + (int)(low - position);
+        if (low > position) {
+            result = extent_list_append(&extents, extent.e_start,
+                                        low - position);
+        }
+        for (size_t copied = 0; copied < high - low && result == 0;) {
+            size_t run;
+            int start = data_block_alloc_run(high - low - copied, &run);
+            if (start == -1) {
+                result = -1;
+                break;
+            }
+            if (extent_list_append(&fresh, start, run) == -1) {
+                data_block_free_run(start, run);
+                result = -1;
+                break;
+            }
+            memcpy(data_block_get(start),
+                   data_block_get(copy_start + (int)copied), run * BLOCK_SIZE);
+            memcpy(&block_checksums[start],
+                   &block_checksums[copy_start + (int)copied],
+                   run * sizeof(uint32_t));
+            journal_dirty(&block_checksums[start], run * sizeof(uint32_t));
+            result = extent_list_append(&extents, start, run);
+            copied += run;
+        }
+        if (result == 0 && high < position + length) {
+            result = extent_list_append(
+                &extents, extent.e_start + (int)(high - position),
+                position + length - high);
+        }
+        if (result == 0) {
+            result = extent_list_append(&replaced, copy_start, high - low);
+        }
+        position += length;
+    }
+
+    // The new extents may need an extent block
+    if (result == 0 && extents.count > INODE_EXTENTS &&
+        inode->i_extent_block == -1) {
+        inode->i_extent_block = data_block_alloc();
+        if (inode->i_extent_block == -1) {
+            result = -1;
+        }
+    }
+
+    if (result == 0 && replaced.count > 0) {
+        for (size_t i = 0; i < extents.count; i++) {
+            *inode_extent(inode, i) = extents.extents[i];
+        }
+        inode->i_extent_count = extents.count;
+        if (extents.count <= INODE_EXTENTS && inode->i_extent_block != -1) {
+            data_block_free(inode->i_extent_block);
+            inode->i_extent_block = -1;
+        }
+        inode_log(inode);
+
+        // Only now are the old blocks dropped
+        for (size_t i = 0; i < replaced.count; i++) {
+            data_block_free_run(replaced.extents[i].e_start,
+                                (size_t)replaced.extents[i].e_length);
+        }
+    } else if (result == -1 && fresh.extents != NULL) {
+        for (size_t i = 0; i < fresh.count; i++) {
+            data_block_free_run(fresh.extents[i].e_start,
+                                (size_t)fresh.extents[i].e_length);
+        }
+    }
+
+    free(extents.extents);
+    free(fresh.extents);
+    free(replaced.extents);
+    return result;
+}
+
+/**
+ * Replace the full blocks in a range of the blocks of a file by indexed blocks
+ * with the same contents, if there are any, and index the others (if
+ * deduplication is enabled).
+ *
+ * Must be called with the inode locked for writing, after updating the
+ * checksums of the range.
+ *
+ * Input:
+ *   - inode: the file's inode
+ *   - first_block: the first block of the range
+ *   - block_count: the number of blocks in the range
+ *
+ * The file is left unchanged if the new extents do not fit (or in case of
+ * malloc failure), as its blocks are as good as the ones they would be
+ * replaced by, and while it is pinned (as they could not be freed).
+ */
+void inode_dedup(inode_t *inode, size_t first_block, size_t block_count) {
+    size_t last_block = first_block + block_count;
+    if (last_block > inode->i_size / BLOCK_SIZE) {
+        last_block = inode->i_size / BLOCK_SIZE; // only full blocks
+    }
+    if (!fs_params.dedup || (inode->i_flags & INODE_COMPRESSED) ||
+        first_block >= last_block || inode_pinned(inode_number(inode))) {
+        return;
+    }
+
+    // The new extents, and the blocks replaced and those replacing them
+    extent_list_t extents = {.capacity = MAX_EXTENTS};
+    extents.extents = malloc(MAX_EXTENTS * sizeof(extent_t));
+    int *replaced = malloc((last_block - first_block) * sizeof(int));
+    int *replacing = malloc((last_block - first_block) * sizeof(int));
+    size_t replaced_count = 0;
+    int result = 0;
+    if (extents.extents == NULL || replaced == NULL || replacing == NULL) {
+        result = -1;
+    }
+
+    // Indexed blocks stay as they are (and in the index) while it is locked
+    mutex_lock(&dedup_mutex);
+
+    size_t position = 0; // file block where the extent starts
+    for (size_t i = 0; i < inode->i_extent_count && result == 0; i++) {
+        extent_t extent = *inode_extent(inode, i);
+        if (extent.e_start == EXTENT_HOLE) {
+            result = extent_list_append(&extents, EXTENT_HOLE,
+                                        (size_t)extent.e_length);
+            position += (size_t)extent.e_length;
+            continue;
+        }
+        for (int b = 0; b < extent.e_length && result == 0; b++) {
+            size_t file_block = position + (size_t)b;
+            int block = extent.e_start + b;
+            if (file_block >= first_block && file_block < last_block) {
+                int found = dedup_find(block);
+                if (found == -1) {
+                    dedup_insert(block);
+                } else if (found != block) {
+                    replaced[replaced_count] = block;
+                    replacing[replaced_count] = found;
+                    replaced_count++;
+                    block = found;
+                }
+            }
+            result = extent_list_append(&extents, block, 1);
+        }
+        position += (size_t)extent.e_length;
+    }
+
+    // The new extents may need an extent block
+    // (without reclaiming orphans, as dedup_mutex is locked)
+    if (result == 0 && replaced_count > 0 && extents.count > INODE_EXTENTS &&
+        inode->i_extent_block == -1) {
+        size_t length;
+        inode->i_extent_block = block_alloc_run(1, &length, false);
+        if (inode->i_extent_block == -1) {
+            result = -1;
+        }
+    }
+
+    int unused_extent_block = -1;
+    if (result == 0 && replaced_count > 0) {
+        for (size_t i = 0; i < replaced_count; i++) {
+            atomic_fetch_add(&block_refs[replacing[i]], 1);
+        }
+        for (size_t i = 0; i < extents.count; i++) {
+            *inode_extent(inode, i) = extents.extents[i];
+        }
+        inode->i_extent_count = extents.count;
+        if (extents.count <= INODE_EXTENTS && inode->i_extent_block != -1) {
+            unused_extent_block = inode->i_extent_block;
+            inode->i_extent_block = -1;
+        }
+        inode_log(inode);
+        atomic_fetch_add(&dedup_hits, replaced_count);
+    } else {
+        replaced_count = 0; // the file is left as it was
+    }
+    mutex_unlock(&dedup_mutex);
+
+    // Only now are the replaced blocks dropped
+    for (size_t i = 0; i < replaced_count; i++) {
+        data_block_free(replaced[i]);
+    }
+    if (unused_extent_block != -1) {
+        data_block_free(unused_extent_block);
+    }
+
+    free(extents.extents);
+    free(replaced);
+    free(replacing);
+}
+
+/**
+ * Update the checksums of a run of data blocks.
+ *
+ * Input:
+ *   - block_number: the first block of the run
+ *   - length: the number of blocks in the run
+ */
+static void run_checksum_update(size_t block_number, size_t length) {
+    char const *data = fs_data + block_number * BLOCK_SIZE;
+    for (size_t i = 0; i < length; i++) {
+        block_checksums[block_number + i] =
+            crc32c(0, data + i * BLOCK_SIZE, BLOCK_SIZE);
+    }
+    journal_dirty(&block_checksums[block_number], length * sizeof(uint32_t));
+}
+
+/**
+ * Check a run of data blocks against their checksums.
+ *
+ * Input:
+ *   - block_number: the first block of the run
+ *   - length: the number of blocks in the run
+ *
+ * Returns 0 if every block matches its checksum, -1 otherwise.
+ */
+static int run_checksum_verify(size_t block_number, size_t length) {
+    char const *data = fs_data + block_number * BLOCK_SIZE;
+    for (size_t i = 0; i < length; i++) {
+        if (crc32c(0, data + i * BLOCK_SIZE, BLOCK_SIZE) !=
+            block_checksums[block_number + i]) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Update the checksums of a range of the blocks of a file, after writing to
+ * them (holes have no checksums).
+ *
+ * Must be called with the inode locked for writing.
+ *
+ * Input:
+ *   - inode: the file's inode
+ *   - first_block: the first block of the range
+ *   - block_count: the number of blocks in the range
+ */
+void inode_checksum_update(inode_t const *inode, size_t first_block,
+                           size_t block_count) {
+    for (size_t block = first_block; block < first_block + block_count;) {
+        size_t run;
+        char const *data = inode_block_get(inode, block, &run);
+        if (run > first_block + block_count - block) {
+            run = first_block + block_count - block;
+        }
+
+        if (data != NULL) {
+            run_checksum_update((size_t)(data - fs_data) / BLOCK_SIZE, run);
+        }
+        block += run;
+    }
+}
+
+/**
+ * Check the contents of a range of the blocks of a file against their
+ * checksums.
+ *
+ * Must be called with the inode locked (for reading, at least), unless it is
+ * part of a snapshot.
+ *
+ * Input:
+ *   - inode: the file's inode
+ *   - first_block: the first block of the range
+ *   - block_count: the number of blocks in the range (holes are skipped)
+ *
+ * Returns 0 if every block matches its checksum, -1 otherwise.
+ */
+int inode_checksum_verify(inode_t const *inode, size_t first_block,
+                          size_t block_count) {
+    for (size_t block = first_block; block < first_block + block_count;) {
+        size_t run;
+        char const *data = inode_block_get(inode, block, &run);
+        if (run > first_block + block_count - block) {
+            run = first_block + block_count - block;
+        }
+
+        if (data != NULL &&
+            run_checksum_verify((size_t)(data - fs_data) / BLOCK_SIZE, run) ==
+                -1) {
+            return -1; // corrupted
+        }
+        block += run;
+    }
+    return 0;
+}
+
+/**
+ * Measure the time elapsed since a given instant.
+ *
+ * Input:
+ *   - start: the instant (from CLOCK_MONOTONIC)
+ *
+ * Returns the time elapsed, in nanoseconds.
+ */
+static size_t elapsed_ns(struct timespec const *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (size_t)((now.tv_sec - start->tv_sec) * 1000000000l +
+                    (now.tv_nsec - start->tv_nsec));
+}
+
+/**
+ * Allocate a run of exactly a given number of contiguous data blocks.
+ *
+ * Unlike data_block_alloc_run, short runs of free blocks are skipped, and the
+ * blocks cached by the threads are not used (but are flushed back to the
+ * bitmap if no run is found).
+ *
+ * Input:
+ *   - length: the number of blocks (at most CHUNK_BLOCKS)
+ *
+ * Returns the number/index of the first block if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - No run of free data blocks that long.
+ */
+static int data_block_alloc_exact(size_t length) {
+    size_t seen = atomic_load(&orphans_reclaimed);
+    bitmap_search_read(&block_bitmap);
+    long start = bitmap_alloc_exact(&block_bitmap, length);
+    while (start == -1 && (magazines_flush() > 0 || orphans_flush(&seen) > 0)) {
+        start = bitmap_alloc_exact(&block_bitmap, length);
+    }
+    return (int)start;
+}
+
+/**
+ * Write a chunk of a compressed file.
+ *
+ * The chunk is compressed (or kept as it is, if that takes less space) into
+ * newly allocated blocks, which replace those of the previous contents of the
+ * chunk.
+ *
+ * Must be called with the inode locked for writing.
+ *
+ * Input:
+ *   - inode: the file's inode (INODE_COMPRESSED)
+ *   - chunk: index of the chunk (at most the number of chunks of the file)
+ *   - data: the contents of the chunk
+ *   - length: the size of the chunk (at most state_chunk_size(), and only
+ *     lower than that for the last chunk of the file)
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - No space for the chunk.
+ *   - The file has the maximum number of chunks.
+ *   - Failed to allocate memory to compress the chunk.
+ */
+int inode_chunk_write(inode_t *inode, size_t chunk, void const *data,
+                      size_t length) {
+    ALWAYS_ASSERT(inode->i_flags & INODE_COMPRESSED,
+                  "inode_chunk_write: inode must be compressed");
+    ALWAYS_ASSERT(chunk <= inode->i_extent_count && length > 0 &&
+                      length <= CHUNK_SIZE,
+                  "inode_chunk_write: invalid chunk");
+
+    char *buffer = malloc(CHUNK_BLOCKS * BLOCK_SIZE);
+    if (buffer == NULL) {
+        return -1;
+    }
+    chunk_header_t *header = (chunk_header_t *)buffer;
+    char *stored = buffer + sizeof(chunk_header_t);
+
+    struct timespec start_time;
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    size_t stored_length = lz_compress(data, length, stored, length - 1);
+    atomic_fetch_add(&compress_ns, elapsed_ns(&start_time));
+    if (stored_length == 0) {
+        memcpy(stored, data, length); // incompressible
+        stored_length = length;
+    }
+    header->c_stored = (uint32_t)stored_length;
+    header->c_length = (uint32_t)length;
+
+    size_t used = sizeof(chunk_header_t) + stored_length;
+    size_t block_count = (used + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    memset(buffer + used, 0, block_count * BLOCK_SIZE - used);
+
+    bool append = chunk == inode->i_extent_count;
+    bool new_extent_block = false;
+    if (append) {
+        if (inode->i_extent_count == MAX_EXTENTS) {
+            free(buffer);
+            return -1; // no extents left
+        }
+        if (inode->i_extent_count == INODE_EXTENTS) {
+            inode->i_extent_block = data_block_alloc();
+            if (inode->i_extent_block == -1) {
+                free(buffer);
+                return -1; // no space for the extent block
+            }
+            new_extent_block = true;
+        }
+    }
+
+    int start = data_block_alloc_exact(block_count);
+    if (start == -1) {
+        if (new_extent_block) {
+            data_block_free(inode->i_extent_block);
+            inode->i_extent_block = -1;
+        }
+        free(buffer);
+        return -1; // no space
+    }
+
+    void *blocks = data_block_get(start);
+    memcpy(blocks, buffer, block_count * BLOCK_SIZE);
+    journal_dirty(blocks, block_count * BLOCK_SIZE);
+    run_checksum_update((size_t)start, block_count);
+    free(buffer);
+
+    extent_t *extent = inode_extent(inode, chunk);
+    extent_t old = append ? (extent_t){-1, 0} : *extent;
+    extent->e_start = start;
+    extent->e_length = (int)block_count;
+    if (append) {
+        inode->i_extent_count++;
+    }
+    inode_log(inode);
+    data_block_free_run(old.e_start, (size_t)old.e_length);
+
+    atomic_fetch_add(&compress_in_bytes, length);
+    atomic_fetch_add(&compress_stored_bytes, block_count * BLOCK_SIZE);
+    return 0;
+}
+
+/**
+ * Free the chunks of a compressed file past a given number of chunks.
+ *
+ * Must be called with the inode locked for writing.
+ *
+ * Input:
+ *   - inode: the file's inode (INODE_COMPRESSED)
+ *   - chunk_count: the number of chunks to keep
+ */
+void inode_chunk_truncate(inode_t *inode, size_t chunk_count) {
+    ALWAYS_ASSERT(inode->i_flags & INODE_COMPRESSED,
+                  "inode_chunk_truncate: inode must be compressed");
+
+    // Each chunk takes a whole extent
+    size_t block_count = 0;
+    for (size_t i = 0; i < chunk_count && i < inode->i_extent_count; i++) {
+        block_count += (size_t)inode_extent(inode, i)->e_length;
+    }
+    inode_truncate(inode, block_count);
+}
+
+/**
+ * Read a chunk of a compressed file.
+ *
+ * Must be called with the inode locked (for reading, at least), unless it is
+ * part of a snapshot.
+ *
+ * Input:
+ *   - inode: the file's inode (INODE_COMPRESSED)
+ *   - chunk: index of the chunk
+ *   - buffer: where to store the contents of the chunk (with room for
+ *     state_chunk_size() bytes)
+ *
+ * Returns the size of the chunk if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - The file does not have that many chunks.
+ *   - The chunk is corrupted.
+ */
+ssize_t inode_chunk_read(inode_t const *inode, size_t chunk, void *buffer) {
+    ALWAYS_ASSERT(inode->i_flags & INODE_COMPRESSED,
+                  "inode_chunk_read: inode must be compressed");
+    if (chunk >= inode->i_extent_count) {
+        return -1;
+    }
+
+    extent_t const *extent = inode_extent(inode, chunk);
+    size_t block_count = (size_t)extent->e_length;
+    if (run_checksum_verify((size_t)extent->e_start, block_count) == -1) {
+        return -1; // corrupted
+    }
+
+    char const *blocks = data_block_get(extent->e_start);
+    chunk_header_t header;
+    memcpy(&header, blocks, sizeof(header));
+    char const *stored = blocks + sizeof(header);
+    if (header.c_length > CHUNK_SIZE ||
+        header.c_stored > block_count * BLOCK_SIZE - sizeof(header)) {
+        return -1; // corrupted
+    }
+
+    if (header.c_stored == header.c_length) {
+        memcpy(buffer, stored, header.c_length); // not compressed
+        return (ssize_t)header.c_length;
+    }
+
+    struct timespec start_time;
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    ssize_t length = lz_decompress(stored, header.c_stored, buffer, CHUNK_SIZE);
+    atomic_fetch_add(&decompress_ns, elapsed_ns(&start_time));
+    if (length != (ssize_t)header.c_length) {
+        return -1; // corrupted
+    }
+    atomic_fetch_add(&decompress_out_bytes, (size_t)length);
+    return length;
 }
 
 /**
- * (Try to) Allocate a new inode in the inode table, without initializing its
- * data.
+ * Obtain a pointer to the contents of a block of an inode.
  *
- * Returns the inumber of the newly allocated inode, or -1 in the case of error.
+ * Input:
+ *   - inode: the inode
+ *   - file_block: index of the block within the inode's data
+ *   - run: if not NULL, set to the number of blocks that follow contiguously
+ *     in memory (including this one), or, for blocks that are not mapped, to
+ *     the number of blocks that follow in the same hole (SIZE_MAX /
+ *     BLOCK_SIZE past the last extent)
  *
- * Possible errors:
- *   - No free slots in inode table.
+ * Returns a pointer to the first byte of the block, or NULL if the block is
+ * not mapped (it is in a hole, or past the last extent of the inode).
  */
-static int inode_alloc(void) {
-    for (size_t inumber = 0; inumber < INODE_TABLE_SIZE; inumber++) {
-        if ((inumber * sizeof(allocation_state_t) % BLOCK_SIZE) == 0) {
-            insert_delay(); // simulate storage access delay (to freeinode_ts)
-        }
-
-        // Finds first free entry in inode table
-        if (freeinode_ts[inumber] == FREE) {
-            //  Found a free entry, so takes it for the new inode
-            rwlock_unlock(&inode_locker);
-            rwlock_writelock(&inode_locker);
-            if (freeinode_ts[inumber] != FREE) {
-                rwlock_unlock(&inode_locker);
-                rwlock_readlock(&inode_locker);
-                continue;
-            }
+void *inode_block_get(inode_t const *inode, size_t file_block, size_t *run) {
+    size_t blocks = 0;
+    for (size_t i = 0; i < inode->i_extent_count; i++) {
+        extent_t const *extent = inode_extent(inode, i);
+        size_t length = (size_t)extent->e_length;
 
-            freeinode_ts[inumber] = TAKEN;
-            return (int)inumber;
+        if (file_block < blocks + length) {
+            size_t skip = file_block - blocks;
+            if (run != NULL) {
+                *run = length - skip;
+            }
+            if (extent->e_start == EXTENT_HOLE) {
+                return NULL;
+            }
+            char *block = data_block_get(extent->e_start);
+            return block + skip * BLOCK_SIZE;
         }
+        blocks += length;
     }
 
-    // no free inodes
-    return -1;
+    if (run != NULL) {
+        *run = SIZE_MAX / BLOCK_SIZE;
+    }
+    return NULL;
 }
 
 /**
- * Create a new inode in the inode table.
+ * Allocate a new data block.
  *
- * Allocates and initializes a new inode.
- * Directories will have their data block allocated and initialized, with i_size
- * set to BLOCK_SIZE. Regular files will not have their data block allocated
- * (i_size will be set to 0, i_data_block to -1).
+ * Returns block number/index if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - No free data blocks.
+ */
+int data_block_alloc(void) {
+    size_t length;
+    return data_block_alloc_run(1, &length);
+}
+
+/**
+ * Allocate a run of contiguous data blocks.
+ *
+ * Short runs are taken from the blocks cached by the calling thread. Otherwise,
+ * the run starts at the first free block found after the previous allocation
+ * and extends over the free blocks that follow it, up to max_length blocks (a
+ * run never spans more than one bitmap word, i.e., 64 blocks).
  *
  * Input:
- *   - i_type: the type of the node (file or directory)
+ *   - max_length: maximum number of blocks to allocate (at least 1)
+ *   - length: set to the number of blocks actually allocated
  *
- * Returns inumber of the new inode, or -1 in the case of error.
+ * Returns the number/index of the first block if successful, -1 otherwise.
  *
  * Possible errors:
- *   - No free slots in inode table.
- *   - (if creating a directory) No free data blocks.
+ *   - No free data blocks.
  */
-int inode_create(inode_type i_type) {
-    rwlock_readlock(&inode_locker);
-    int inumber = inode_alloc();
-    if (inumber == -1) {
-        return -1; // no free slots in inode table
-    }
-
-    inode_t *inode = &inode_table[inumber];
-    insert_delay(); // simulate storage access delay (to inode)
-
-    // rwlock_writelock(&inode_table_locker[inumber]);
-    inode->i_node_type = i_type;
-    switch (i_type) {
-    case T_DIRECTORY: {
-        // Initializes directory (filling its block with empty entries, labeled
-        // with inumber==-1)
-
-        int b = data_block_alloc();
-        if (b == -1) {
-            // ensure fields are initialized
-            inode->i_size = 0;
-            inode->i_data_block = -1;
-            inode->i_link_count = 0;
-
-            // run regular deletion process
-            inode_delete(inumber);
-            rwlock_unlock(&inode_locker);
-            // rwlock_unlock(&inode_table_locker[inumber]);
-            return -1;
-        }
+int data_block_alloc_run(size_t max_length, size_t *length) {
+    return block_alloc_run(max_length, length, true);
+}
 
-        inode_table[inumber].i_size = BLOCK_SIZE;
-        inode_table[inumber].i_data_block = b;
-        inode_table[inumber].i_link_count = 1;
+/**
+ * Allocate the free data blocks starting at a given block.
+ *
+ * Input:
+ *   - block_number: the first block to allocate
+ *   - max_length: maximum number of blocks to allocate
+ *
+ * Returns the number of blocks allocated (0 if block_number is not free).
+ */
+size_t data_block_alloc_at(int block_number, size_t max_length) {
+    if (!valid_block_number(block_number)) {
+        return 0;
+    }
 
-        dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(b);
-        ALWAYS_ASSERT(dir_entry != NULL,
-                      "inode_create: data block freed while in use");
+    return magazine_alloc_at(block_number, max_length);
+}
 
-        for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
-            dir_entry[i].d_inumber = -1;
+/**
+ * Drop one of the extra holders of a data block, if it has any.
+ *
+ * Input:
+ *   - block_number: the block number/index
+ *
+ * Returns true if the block is still held elsewhere (and must not be freed),
+ * false otherwise.
+ */
+static bool block_unref(int block_number) {
+    atomic_uint *refs = &block_refs[block_number];
+    unsigned int count = atomic_load(refs);
+    while (count > 0) {
+        if (atomic_compare_exchange_weak(refs, &count, count - 1)) {
+            return true;
         }
-        // rwlock_unlock(&inode_table_locker[inumber]);
-    } break;
-    case T_FILE:
-        // In case of a new file, simply sets its size to 0
-        inode_table[inumber].i_size = 0;
-        inode_table[inumber].i_data_block = -1;
-        inode_table[inumber].i_link_count = 1;
-        break;
-    case T_LINK:
-        inode_table[inumber].i_size = 0;
-        inode_table[inumber].i_data_block = -1;
-        inode_table[inumber].i_link_count = 1;
-        break;
-    default:
-        PANIC("inode_create: unknown file type");
     }
-    rwlock_unlock(&inode_locker);
+    return false;
+}
 
-    return inumber;
+/**
+ * Free a data block.
+ *
+ * Input:
+ *   - block_number: the block number/index
+ */
+void data_block_free(int block_number) {
+    ALWAYS_ASSERT(valid_block_number(block_number),
+                  "data_block_free: invalid block number");
+
+    data_block_free_run(block_number, 1);
 }
 
 /**
- * Delete an inode.
+ * Free a run of contiguous data blocks.
+ *
+ * Blocks shared with snapshots are not freed, but lose one of their holders
+ * instead.
  *
  * Input:
- *   - inumber: inode's number
+ *   - block_number: the first block of the run
+ *   - length: the number of blocks in the run
  */
-void inode_delete(int inumber) {
-    // simulate storage access delay (to inode and freeinode_ts)
-    insert_delay();
-    insert_delay();
+void data_block_free_run(int block_number, size_t length) {
+    if (length == 0) {
+        return;
+    }
 
-    ALWAYS_ASSERT(valid_inumber(inumber), "inode_delete: invalid inumber");
+    ALWAYS_ASSERT(valid_block_number(block_number) &&
+                      valid_block_number(block_number + (int)length - 1),
+                  "data_block_free_run: invalid block run");
 
-    ALWAYS_ASSERT(freeinode_ts[inumber] == TAKEN,
-                  "inode_delete: inode already freed");
+    if (!blocks_may_be_shared()) {
+        magazine_free_run(block_number, length);
+        return;
+    }
 
-    rwlock_writelock(&inode_locker);
-    if (inode_table[inumber].i_size > 0) {
-        data_block_free(inode_table[inumber].i_data_block);
+    if (fs_params.dedup) {
+        mutex_lock(&dedup_mutex); // blocks gain holders through the index
     }
 
-    freeinode_ts[inumber] = FREE;
+    // Free the sub-runs of blocks that have no other holders
+    size_t start = 0;
+    for (size_t i = 0; i <= length; i++) {
+        if (i == length || block_unref(block_number + (int)i)) {
+            if (i > start) {
+                magazine_free_run(block_number + (int)start, i - start);
+            }
+            start = i + 1;
+        } else if (fs_params.dedup) {
+            dedup_remove(block_number + (int)i);
+        }
+    }
 
-    rwlock_unlock(&inode_locker);
+    if (fs_params.dedup) {
+        mutex_unlock(&dedup_mutex);
+    }
 }
 
 /**
- * Obtain a pointer to an inode from its inumber.
+ * Obtain a pointer to the contents of a given block.
  *
  * Input:
- *   - inumber: inode's number
+ *   - block_number: the block number/index
  *
- * Returns pointer to inode.
+ * Returns a pointer to the first byte of the block.
  */
-inode_t *inode_get(int inumber) {
-    ALWAYS_ASSERT(valid_inumber(inumber), "inode_get: invalid inumber");
+void *data_block_get(int block_number) {
+    ALWAYS_ASSERT(valid_block_number(block_number),
+                  "data_block_get: invalid block number");
 
-    insert_delay(); // simulate storage access delay to inode
-    return &inode_table[inumber];
+    storage_read(&fs_data[(size_t)block_number * BLOCK_SIZE]);
+    return &fs_data[(size_t)block_number * BLOCK_SIZE];
 }
 
 /**
- * Clear the directory entry associated with a sub file.
+ * Copy an inode into a snapshot.
+ *
+ * The blocks of directories and symbolic links are copied, while the data
+ * blocks of files are shared (only their extent block, if any, is copied).
  *
  * Input:
- *   - inode: directory inode
- *   - sub_name: sub file name
+ *   - copy: where to copy the inode to
+ *   - inode: the inode
  *
  * Returns 0 if successful, -1 otherwise.
  *
  * Possible errors:
- *   - inode is not a directory inode.
- *   - Directory does not contain an entry for sub_name.
+ *   - No free data blocks.
  */
-int clear_dir_entry(inode_t *inode, char const *sub_name) {
-    insert_delay();
-    if (inode->i_node_type != T_DIRECTORY) {
-        return -1; // not a directory
-    }
-
-    rwlock_writelock(&inode_table_locker[ROOT_DIR_INUM]);
+static int snapshot_copy_inode(inode_t *copy, inode_t const *inode) {
+    *copy = *inode;
 
-    // Locates the block containing the entries of the directory
-    dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(inode->i_data_block);
-    ALWAYS_ASSERT(dir_entry != NULL,
-                  "clear_dir_entry: directory must have a data block");
-
-    for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (!strcmp(dir_entry[i].d_name, sub_name)) {
-            dir_entry[i].d_inumber = -1;
-            memset(dir_entry[i].d_name, 0, MAX_FILE_NAME);
-
-            rwlock_unlock(&inode_table_locker[ROOT_DIR_INUM]);
-            return 0;
+    if (inode->i_node_type == T_FILE) {
+        if (inode->i_extent_count > INODE_EXTENTS) {
+            copy->i_extent_block = data_block_alloc();
+            if (copy->i_extent_block == -1) {
+                return -1;
+            }
+            memcpy(data_block_get(copy->i_extent_block),
+                   data_block_get(inode->i_extent_block), BLOCK_SIZE);
+        }
+        for (size_t i = 0; i < inode->i_extent_count; i++) {
+            extent_t const *extent = inode_extent(inode, i);
+            for (int block = 0;
+                 extent->e_start != EXTENT_HOLE && block < extent->e_length;
+                 block++) {
+                atomic_fetch_add(&block_refs[extent->e_start + block], 1);
+            }
         }
+        return 0;
     }
 
-    rwlock_unlock(&inode_table_locker[ROOT_DIR_INUM]);
-    return -1; // sub_name not found
+    size_t block_count = inode_block_count(inode);
+    copy->i_extent_count = 0;
+    copy->i_extent_block = -1;
+    if (inode_grow(copy, block_count) != block_count) {
+        inode_truncate(copy, 0);
+        return -1;
+    }
+    for (size_t block = 0; block < block_count;) {
+        size_t run, copy_run;
+        void const *data = inode_block_get(inode, block, &run);
+        void *copy_data = inode_block_get(copy, block, &copy_run);
+        if (run > copy_run) {
+            run = copy_run;
+        }
+        if (run > block_count - block) {
+            run = block_count - block;
+        }
+        memcpy(copy_data, data, run * BLOCK_SIZE);
+        block += run;
+    }
+    return 0;
 }
 
 /**
- * Store the inumber for a sub file in a directory.
+ * Create a snapshot of the whole FS, by copying the inodes that are reachable
+ * from the root (file data is not copied, see inode_unshare).
  *
- * Input:
- *   - inode: directory inode
- *   - sub_name: sub file name
- *   - sub_inumber: inumber of the sub inode
+ * Must be called with the FS frozen (see journal_freeze), so that the snapshot
+ * reflects a single point in time between operations.
  *
- * Returns 0 if successful, -1 otherwise.
+ * Returns the snapshot number if successful, -1 otherwise.
  *
  * Possible errors:
- *   - inode is not a directory inode.
- *   - sub_name is not a valid file name (length 0 or > MAX_FILE_NAME - 1).
- *   - Directory is already full of entries.
+ *   - MAX_SNAPSHOTS snapshots already exist.
+ *   - No free data blocks for the copies.
+ *   - malloc failure when allocating the snapshot.
  */
-int add_dir_entry(inode_t *inode, char const *sub_name, int sub_inumber) {
-    if (strlen(sub_name) == 0 || strlen(sub_name) > MAX_FILE_NAME - 1) {
-        return -1; // invalid sub_name
+int snapshot_create(void) {
+    mutex_lock(&snapshots_mutex);
+    int id = -1;
+    for (int i = 0; i < MAX_SNAPSHOTS && id == -1; i++) {
+        if (snapshots[i].status == SNAPSHOT_FREE) {
+            snapshots[i].status = SNAPSHOT_CREATING;
+            id = i;
+        }
     }
-
-    insert_delay(); // simulate storage access delay to inode with inumber
-    if (inode->i_node_type != T_DIRECTORY) {
-        return -1; // not a directory
+    mutex_unlock(&snapshots_mutex);
+    if (id == -1) {
+        return -1; // no free snapshot slots
     }
 
-    // Locates the block containing the entries of the directory
-
-    rwlock_writelock(&inode_table_locker[ROOT_DIR_INUM]);
+    snapshot_t *snapshot = &snapshots[id];
+    snapshot->open_count = 0;
+    snapshot->inodes = malloc(INODE_TABLE_SIZE * sizeof(inode_t));
+    snapshot->present = calloc(INODE_TABLE_SIZE, sizeof(bool));
+    int *queue = malloc(INODE_TABLE_SIZE * sizeof(int));
+    if (!snapshot->inodes || !snapshot->present || !queue) {
+        free(snapshot->inodes);
+        free(snapshot->present);
+        free(queue);
+        mutex_lock(&snapshots_mutex);
+        snapshot->status = SNAPSHOT_FREE;
+        mutex_unlock(&snapshots_mutex);
+        return -1; // allocation failed
+    }
 
-    dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(inode->i_data_block);
-    ALWAYS_ASSERT(dir_entry != NULL,
-                  "add_dir_entry: directory must have a data block");
+    // Blocks become shared from now on
+    atomic_fetch_add(&snapshot_count, 1);
 
-    // Finds and fills the first empty entry
-    for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (dir_entry[i].d_inumber == -1) {
-            dir_entry[i].d_inumber = sub_inumber;
-            strncpy(dir_entry[i].d_name, sub_name, MAX_FILE_NAME - 1);
-            dir_entry[i].d_name[MAX_FILE_NAME - 1] = '\0';
+    // Breadth-first walk from the root (queue[0, copied) have been copied)
+    size_t copied = 0, queued = 0;
+    queue[queued++] = ROOT_DIR_INUM;
+    snapshot->present[ROOT_DIR_INUM] = true;
+    int result = 0;
+    while (copied < queued) {
+        int inumber = queue[copied];
+        inode_t const *inode = &inode_table[inumber];
+        storage_read(inode);
+        result = snapshot_copy_inode(&snapshot->inodes[inumber], inode);
+        if (result == -1) {
+            break;
+        }
+        copied++;
 
-            rwlock_unlock(&inode_table_locker[ROOT_DIR_INUM]);
+        if (inode->i_node_type != T_DIRECTORY) {
+            continue;
+        }
+        dir_cursor_t cursor;
+        dir_cursor_init(&cursor, inode);
+        for (size_t slot = 0; slot < cursor.slot_count; slot++) {
+            int sub_inumber = dir_slot(&cursor, slot)->d_inumber;
+            if (sub_inumber != -1 && !snapshot->present[sub_inumber]) {
+                snapshot->present[sub_inumber] = true;
+                queue[queued++] = sub_inumber;
+            }
+        }
+    }
 
-            return 0;
+    if (result == -1) {
+        for (size_t i = 0; i < copied; i++) {
+            inode_truncate(&snapshot->inodes[queue[i]], 0);
         }
+        free(snapshot->inodes);
+        free(snapshot->present);
+        atomic_fetch_sub(&snapshot_count, 1);
     }
+    free(queue);
 
-    rwlock_unlock(&inode_table_locker[ROOT_DIR_INUM]);
+    mutex_lock(&snapshots_mutex);
+    snapshot->status = result == 0 ? SNAPSHOT_READY : SNAPSHOT_FREE;
+    mutex_unlock(&snapshots_mutex);
 
-    return -1; // no space for entry
+    return result == 0 ? id : -1;
 }
 
 /**
- * Obtain the inumber for a sub file inside a directory.
+ * Delete a snapshot, freeing the blocks that no one else holds.
  *
  * Input:
- *   - inode: directory inode
- *   - sub_name: sub file name
+ *   - snapshot: the snapshot number
  *
- * Returns inumber linked to the target name, -1 if errors occur.
+ * Returns 0 if successful, -1 otherwise.
  *
  * Possible errors:
- *   - inode is not a directory inode.
- *   - Directory does not contain a file named sub_name.
+ *   - The snapshot does not exist.
+ *   - Files of the snapshot are open.
  */
-int find_in_dir(inode_t const *inode, char const *sub_name) {
-    ALWAYS_ASSERT(inode != NULL, "find_in_dir: inode must be non-NULL");
-    ALWAYS_ASSERT(sub_name != NULL, "find_in_dir: sub_name must be non-NULL");
-
-    insert_delay(); // simulate storage access delay to inode with inumber
-    if (inode->i_node_type != T_DIRECTORY) {
-        return -1; // not a directory
+int snapshot_delete(int snapshot) {
+    mutex_lock(&snapshots_mutex);
+    if (snapshot < 0 || snapshot >= MAX_SNAPSHOTS ||
+        snapshots[snapshot].status != SNAPSHOT_READY ||
+        snapshots[snapshot].open_count > 0) {
+        mutex_unlock(&snapshots_mutex);
+        return -1;
     }
+    inode_t *inodes = snapshots[snapshot].inodes;
+    bool *present = snapshots[snapshot].present;
+    snapshots[snapshot].status = SNAPSHOT_CREATING; // not free just yet
+    mutex_unlock(&snapshots_mutex);
 
-    rwlock_readlock(&inode_table_locker[ROOT_DIR_INUM]);
-
-    // Locates the block containing the entries of the directory
-    dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(inode->i_data_block);
-    ALWAYS_ASSERT(dir_entry != NULL,
-                  "find_in_dir: directory inode must have a data block");
-
-    // Iterates over the directory entries looking for one that has the target
-    // name
-    for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if ((dir_entry[i].d_inumber != -1) &&
-            (strncmp(dir_entry[i].d_name, sub_name, MAX_FILE_NAME) == 0)) {
-            int sub_inumber = dir_entry[i].d_inumber;
-
-            rwlock_unlock(&inode_table_locker[ROOT_DIR_INUM]);
-            return sub_inumber;
+    for (size_t i = 0; i < INODE_TABLE_SIZE; i++) {
+        if (present[i]) {
+            inode_truncate(&inodes[i], 0);
         }
     }
+    free(inodes);
+    free(present);
+    atomic_fetch_sub(&snapshot_count, 1);
 
-    rwlock_unlock(&inode_table_locker[ROOT_DIR_INUM]);
+    mutex_lock(&snapshots_mutex);
+    snapshots[snapshot].status = SNAPSHOT_FREE;
+    mutex_unlock(&snapshots_mutex);
 
-    return -1; // entry not found
+    return 0;
 }
 
 /**
- * Allocate a new data block.
+ * Keep a snapshot from being deleted (while one of its files is open).
  *
- * Returns block number/index if successful, -1 otherwise.
+ * Input:
+ *   - snapshot: the snapshot number
  *
- * Possible errors:
- *   - No free data blocks.
+ * Returns 0 if successful, -1 if the snapshot does not exist.
  */
-int data_block_alloc(void) {
-    rwlock_readlock(&data_block_locker);
-
-    for (size_t i = 0; i < DATA_BLOCKS; i++) {
-        if (i * sizeof(allocation_state_t) % BLOCK_SIZE == 0) {
-            insert_delay(); // simulate storage access delay to free_blocks
-        }
-
-        if (free_blocks[i] == FREE) {
-            rwlock_unlock(&data_block_locker);
-            rwlock_writelock(&data_block_locker);
-            if (free_blocks[i] == FREE) {
-                free_blocks[i] = TAKEN;
-                rwlock_unlock(&data_block_locker);
-                return (int)i;
-            } else {
-                rwlock_unlock(&data_block_locker);
-                rwlock_readlock(&data_block_locker);
-            }
-        }
+int snapshot_acquire(int snapshot) {
+    int result = -1;
+    mutex_lock(&snapshots_mutex);
+    if (snapshot >= 0 && snapshot < MAX_SNAPSHOTS &&
+        snapshots[snapshot].status == SNAPSHOT_READY) {
+        snapshots[snapshot].open_count++;
+        result = 0;
     }
-    rwlock_unlock(&data_block_locker);
-
-    return -1;
+    mutex_unlock(&snapshots_mutex);
+    return result;
 }
 
 /**
- * Free a data block.
+ * Undo a snapshot_acquire.
  *
  * Input:
- *   - block_number: the block number/index
+ *   - snapshot: the snapshot number
  */
-void data_block_free(int block_number) {
-    ALWAYS_ASSERT(valid_block_number(block_number),
-                  "data_block_free: invalid block number");
+void snapshot_release(int snapshot) {
+    mutex_lock(&snapshots_mutex);
+    ALWAYS_ASSERT(snapshots[snapshot].open_count > 0,
+                  "snapshot_release: snapshot must be acquired");
+    snapshots[snapshot].open_count--;
+    mutex_unlock(&snapshots_mutex);
+}
 
-    insert_delay(); // simulate storage access delay to free_blocks
+/**
+ * Obtain a pointer to the copy of an inode in a snapshot.
+ *
+ * The snapshot must be acquired. Its inodes, and the blocks they map, never
+ * change, so they can be read without any locks.
+ *
+ * Input:
+ *   - snapshot: the snapshot number
+ *   - inumber: inode's number
+ *
+ * Returns pointer to the inode, or NULL if it is not part of the snapshot.
+ */
+inode_t const *snapshot_inode_get(int snapshot, int inumber) {
+    ALWAYS_ASSERT(valid_inumber(inumber),
+                  "snapshot_inode_get: invalid inumber");
 
-    free_blocks[block_number] = FREE;
+    if (!snapshots[snapshot].present[inumber]) {
+        return NULL;
+    }
+    // (snapshots are not part of the image, so they are not cached)
+    insert_delay(); // simulate storage access delay to inode
+    return &snapshots[snapshot].inodes[inumber];
 }
 
 /**
- * Obtain a pointer to the contents of a given block.
+ * Obtain the inumber for a sub file inside a directory of a snapshot (see
+ * dir_lookup).
  *
  * Input:
- *   - block_number: the block number/index
+ *   - snapshot: the snapshot number (which must be acquired)
+ *   - dir_inumber: directory inumber
+ *   - sub_name: sub file name
  *
- * Returns a pointer to the first byte of the block.
+ * Returns inumber linked to the target name, -1 if errors occur.
+ *
+ * Possible errors:
+ *   - dir_inumber is not a directory inode of the snapshot.
+ *   - Directory does not contain a file named sub_name.
  */
-void *data_block_get(int block_number) {
-    ALWAYS_ASSERT(valid_block_number(block_number),
-                  "data_block_get: invalid block number");
+int snapshot_dir_lookup(int snapshot, int dir_inumber, char const *sub_name) {
+    inode_t const *inode = snapshot_inode_get(snapshot, dir_inumber);
+    if (inode == NULL || inode->i_node_type != T_DIRECTORY) {
+        return -1;
+    }
 
-    insert_delay(); // simulate storage access delay to block
-    return &fs_data[(size_t)block_number * BLOCK_SIZE];
+    dir_cursor_t cursor;
+    dir_cursor_init(&cursor, inode);
+
+    size_t slot;
+    if (dir_probe(&cursor, sub_name, dir_name_hash(sub_name), &slot)) {
+        return dir_slot(&cursor, slot)->d_inumber;
+    }
+    return -1;
 }
 
 /**
@@ -543,14 +4010,25 @@ void *data_block_get(int block_number) {
  * Input:
  *   - inumber: inode number of the file to open
  *   - offset: initial offset
+ *   - snapshot: the snapshot the file is read from, or NO_SNAPSHOT
  *
  * Returns file handle if successful, -1 otherwise.
  *
  * Possible errors:
+ *   - The file was unlinked, and is not kept by any other handle.
  *   - No space in open file table for a new open file.
  */
-int add_to_open_file_table(int inumber, size_t offset) {
+int add_to_open_file_table(int inumber, size_t offset, int snapshot) {
     mutex_lock(&open_file_mutex);
+
+    // Files that were unlinked after being looked up may already be queued to
+    // be reclaimed (only those kept by open handles can be opened again)
+    if (snapshot == NO_SNAPSHOT && atomic_load(&orphan_unlinked[inumber]) &&
+        !orphan_open[inumber]) {
+        mutex_unlock(&open_file_mutex);
+        return -1;
+    }
+
     for (int i = 0; i < MAX_OPEN_FILES; i++) {
 
         // If the entry is free, mark it as taken
@@ -559,6 +4037,7 @@ int add_to_open_file_table(int inumber, size_t offset) {
             mutex_lock(&open_file_table[i].lock);
             open_file_table[i].of_inumber = inumber;
             open_file_table[i].of_offset = offset;
+            open_file_table[i].of_snapshot = snapshot;
             mutex_unlock(&open_file_table[i].lock);
             mutex_unlock(&open_file_mutex);
             return i;
@@ -584,35 +4063,18 @@ void remove_from_open_file_table(int fhandle) {
                   "remove_from_open_file_table: file handle must be taken");
 
     free_open_file_entries[fhandle] = FREE;
-    mutex_unlock(&open_file_mutex);
-}
-
 
-
-/**
- * Checks if a file from a given inode is open
- *
- * Input:
- *   - inumber: inode number of the file to check
- */
-int inumber_is_open(int inumber) {
-    mutex_lock(&open_file_mutex);
-    for (int i = 0; i < MAX_OPEN_FILES; i++) {
-        // Checks if a file is open
-        if (free_open_file_entries[i] == TAKEN) {
-            mutex_lock(&open_file_table[i].lock);
-
-            // Checks if the file is the one we are looking for
-            if (open_file_table[i].of_inumber == inumber) {
-                mutex_unlock(&open_file_table[i].lock);
-                mutex_unlock(&open_file_mutex);
-                return 1;
-            }
-            mutex_unlock(&open_file_table[i].lock);
-        }
+    // Orphans are reclaimed once their last handle is closed
+    mutex_lock(&open_file_table[fhandle].lock);
+    int inumber = open_file_table[fhandle].of_inumber;
+    bool live = open_file_table[fhandle].of_snapshot == NO_SNAPSHOT;
+    mutex_unlock(&open_file_table[fhandle].lock);
+    if (live && orphan_open[inumber] && !inumber_is_open(inumber)) {
+        orphan_open[inumber] = false;
+        orphan_enqueue(inumber);
     }
+
     mutex_unlock(&open_file_mutex);
-    return 0;
 }
 
 /**
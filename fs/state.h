@@ -11,58 +11,131 @@
 
 /**
  * Directory entry
+ *
+ * Directories are open addressing hash tables of entries (linear probing on
+ * the hash of the name) spread over one or more data blocks, which grow and
+ * shrink with the number of entries; free slots have d_inumber == -1.
  */
 typedef struct {
     char d_name[MAX_FILE_NAME];
     int d_inumber;
+    unsigned int d_hash;
 } dir_entry_t;
 
 typedef enum { T_FILE, T_DIRECTORY, T_LINK } inode_type;
 
+/**
+ * Extent (run of contiguous data blocks, or hole)
+ */
+typedef struct {
+    int e_start; // EXTENT_HOLE for holes (blocks that read as zeros)
+    int e_length;
+} extent_t;
+
+#define EXTENT_HOLE (-1)
+
+// Inode flags
+#define INODE_COMPRESSED (1u << 0) // data kept in compressed chunks
+
 /**
  * Inode
  */
 typedef struct {
     inode_type i_node_type;
+    unsigned int i_flags;
 
     size_t i_size;
-    int i_data_block;
+    // the first extents are kept in the inode itself, the remaining ones in
+    // the extent block (-1 if not needed)
+    extent_t i_extents[INODE_EXTENTS];
+    size_t i_extent_count;
+    int i_extent_block;
     int i_link_count;
+    size_t i_entry_count; // number of entries (directories only)
 
     // in a more complete FS, more fields could exist here
 } inode_t;
 
 typedef enum { FREE = 0, TAKEN = 1 } allocation_state_t;
 
+// Snapshot number of files of the live FS (see open_file_entry_t)
+#define NO_SNAPSHOT (-1)
+
 /**
  * Open file entry (in open file table)
  */
 typedef struct {
     int of_inumber;
+    int of_snapshot; // NO_SNAPSHOT unless the file is read from a snapshot
     size_t of_offset;
     pthread_mutex_t lock;
 } open_file_entry_t;
 
-int state_init(tfs_params);
+int state_init(tfs_params params, bool *created);
 int state_destroy(void);
 
 size_t state_block_size(void);
+size_t state_chunk_size(void);
+void state_stats(tfs_stats_t *stats);
 
 int inode_create(inode_type n_type);
+size_t inode_create_files(size_t count, int *inumbers);
 void inode_delete(int inumber);
+void inode_orphan(int inumber);
+void inode_trim_later(int inumber);
 inode_t *inode_get(int inumber);
-
-int clear_dir_entry(inode_t *inode, char const *sub_name);
+void inode_read_lock(int inumber);
+void inode_write_lock(int inumber);
+void inode_unlock(int inumber);
+void inode_pin(int inumber);
+void inode_unpin(int inumber);
+void inode_wait_unpinned(int inumber);
+
+int clear_dir_entry(inode_t *inode, char const *sub_name, int sub_inumber);
+void clear_dir_entries(inode_t *inode, char const *const *sub_names,
+                       int const *sub_inumbers, size_t count, int *results);
 int add_dir_entry(inode_t *inode, char const *sub_name, int sub_inumber);
+void add_dir_entries(inode_t *inode, char const *const *sub_names,
+                     int const *sub_inumbers, size_t count, int *results);
 int find_in_dir(inode_t const *inode, char const *sub_name);
+void find_many_in_dir(inode_t const *inode, char const *const *sub_names,
+                      size_t count, int *sub_inumbers);
+int dir_lookup(int dir_inumber, char const *sub_name);
+int seal_empty_dir(inode_t *inode);
+
+size_t inode_grow(inode_t *inode, size_t block_count);
+size_t inode_map(inode_t *inode, size_t first_block, size_t block_count);
+void inode_truncate(inode_t *inode, size_t block_count);
+int inode_punch(inode_t *inode, size_t first_block, size_t block_count);
+int inode_clear_tail(inode_t *inode);
+int inode_unshare(inode_t *inode, size_t first_block, size_t block_count);
+void inode_dedup(inode_t *inode, size_t first_block, size_t block_count);
+void inode_checksum_update(inode_t const *inode, size_t first_block,
+                           size_t block_count);
+int inode_checksum_verify(inode_t const *inode, size_t first_block,
+                          size_t block_count);
+int inode_chunk_write(inode_t *inode, size_t chunk, void const *data,
+                      size_t length);
+void inode_chunk_truncate(inode_t *inode, size_t chunk_count);
+ssize_t inode_chunk_read(inode_t const *inode, size_t chunk, void *buffer);
+void *inode_block_get(inode_t const *inode, size_t file_block, size_t *run);
 
 int data_block_alloc(void);
+int data_block_alloc_run(size_t max_length, size_t *length);
+size_t data_block_alloc_at(int block_number, size_t max_length);
 void data_block_free(int block_number);
+void data_block_free_run(int block_number, size_t length);
 void *data_block_get(int block_number);
 
-int add_to_open_file_table(int inumber, size_t offset);
+int snapshot_create(void);
+int snapshot_delete(int snapshot);
+int snapshot_acquire(int snapshot);
+void snapshot_release(int snapshot);
+inode_t const *snapshot_inode_get(int snapshot, int inumber);
+int snapshot_dir_lookup(int snapshot, int dir_inumber, char const *sub_name);
+
+int add_to_open_file_table(int inumber, size_t offset, int snapshot);
 void remove_from_open_file_table(int fhandle);
-int inumber_is_open(int inumber);
 open_file_entry_t *get_open_file_entry(int fhandle);
 
 #endif // STATE_H
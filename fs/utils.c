@@ -66,4 +66,31 @@ void mutex_destroy(pthread_mutex_t *lock) {
         perror("Failed to destroy mutex");
         exit(EXIT_FAILURE);
     }
-}
\ No newline at end of file
+}
+void cond_wait(pthread_cond_t *cond, pthread_mutex_t *lock) {
+    if (pthread_cond_wait(cond, lock) != 0) {
+        perror("Failed to wait on condition variable");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void cond_broadcast(pthread_cond_t *cond) {
+    if (pthread_cond_broadcast(cond) != 0) {
+        perror("Failed to broadcast condition variable");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void cond_init(pthread_cond_t *cond) {
+    if (pthread_cond_init(cond, NULL) != 0) {
+        perror("Failed to initialize condition variable");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void cond_destroy(pthread_cond_t *cond) {
+    if (pthread_cond_destroy(cond) != 0) {
+        perror("Failed to destroy condition variable");
+        exit(EXIT_FAILURE);
+    }
+}
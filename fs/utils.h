@@ -12,5 +12,9 @@ void mutex_lock(pthread_mutex_t *mutex);
 void mutex_unlock(pthread_mutex_t *mutex);
 void mutex_init(pthread_mutex_t *mutex);
 void mutex_destroy(pthread_mutex_t *mutex);
+void cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex);
+void cond_broadcast(pthread_cond_t *cond);
+void cond_init(pthread_cond_t *cond);
+void cond_destroy(pthread_cond_t *cond);
 
 #endif
\ No newline at end of file
@@ -9,6 +9,7 @@
 
 uint8_t const file_contents[] = "This is a string to test links";
 char const target_path[] = "/file";
+uint8_t buffer[sizeof(file_contents) + 1];
 
 int main() {
     assert(tfs_init(NULL) != -1);
@@ -17,8 +18,15 @@ int main() {
     int f = tfs_open(target_path, TFS_O_CREAT);
     assert(f != -1);
 
-    // Tries to delete the file, and fails because it's open
-    assert(tfs_unlink(target_path) == -1);
+    // Deletes the file while it's open: its name is gone at once
+    assert(tfs_unlink(target_path) != -1);
+    assert(tfs_open(target_path, 0) == -1);
+
+    // The file can still be used until it is closed
+    assert(tfs_write(f, file_contents, sizeof(file_contents)) ==
+           sizeof(file_contents));
+    assert(tfs_pread(f, buffer, sizeof(buffer), 0) == sizeof(file_contents));
+    assert(memcmp(buffer, file_contents, sizeof(file_contents)) == 0);
 
     // Closes the file
     assert(tfs_close(f) != -1);
@@ -0,0 +1,101 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "prettyprint.h"
+
+#define RECORDS 50
+#define PAYLOAD_SIZE 100
+
+typedef struct {
+    int id;
+    int length;
+} header_t;
+
+int main() {
+    assert(tfs_init(NULL) != -1);
+
+    // Records written as header + payload + trailer, without staging them
+    int f = tfs_open("/records", TFS_O_CREAT);
+    assert(f != -1);
+    for (int i = 0; i < RECORDS; i++) {
+        header_t header = {.id = i, .length = PAYLOAD_SIZE};
+        char payload[PAYLOAD_SIZE];
+        memset(payload, 'a' + i % 26, sizeof(payload));
+        char trailer = '\n';
+
+        struct iovec iov[] = {
+            {.iov_base = &header, .iov_len = sizeof(header)},
+            {.iov_base = payload, .iov_len = sizeof(payload)},
+            {.iov_base = NULL, .iov_len = 0}, // empty buffers are skipped
+            {.iov_base = &trailer, .iov_len = sizeof(trailer)},
+        };
+        assert(tfs_writev(f, iov, 4) ==
+               sizeof(header) + sizeof(payload) + sizeof(trailer));
+    }
+    assert(tfs_close(f) != -1);
+
+    // And read back the same way, sequentially and by position
+    size_t record_size = sizeof(header_t) + PAYLOAD_SIZE + 1;
+    f = tfs_open("/records", 0);
+    assert(f != -1);
+    for (int i = 0; i < RECORDS; i++) {
+        header_t header;
+        char payload[PAYLOAD_SIZE];
+        char trailer;
+        struct iovec iov[] = {
+            {.iov_base = &header, .iov_len = sizeof(header)},
+            {.iov_base = payload, .iov_len = sizeof(payload)},
+            {.iov_base = &trailer, .iov_len = sizeof(trailer)},
+        };
+
+        assert(tfs_readv(f, iov, 3) == (ssize_t)record_size);
+        assert(header.id == i && header.length == PAYLOAD_SIZE);
+        for (size_t j = 0; j < sizeof(payload); j++) {
+            assert(payload[j] == 'a' + i % 26);
+        }
+        assert(trailer == '\n');
+
+        int back = RECORDS - 1 - i;
+        assert(tfs_preadv(f, iov, 3, (size_t)back * record_size) ==
+               (ssize_t)record_size);
+        assert(header.id == back && payload[0] == 'a' + back % 26);
+    }
+
+    // Short reads fill the buffers in order
+    char first[4];
+    char second[4];
+    struct iovec iov[] = {
+        {.iov_base = first, .iov_len = sizeof(first)},
+        {.iov_base = second, .iov_len = sizeof(second)},
+    };
+    size_t size = RECORDS * record_size;
+    assert(tfs_preadv(f, iov, 2, size - 6) == 6);
+    assert(first[3] == 'a' + (RECORDS - 1) % 26);
+    assert(second[1] == '\n');
+    assert(tfs_readv(f, iov, 2) == 0);
+    assert(tfs_readv(f, iov, -1) == -1);
+    assert(tfs_close(f) != -1);
+
+    // Positional writes do not move the offset
+    f = tfs_open("/records", 0);
+    assert(f != -1);
+    memcpy(first, "WXYZ", 4);
+    memcpy(second, "wxyz", 4);
+    assert(tfs_pwritev(f, iov, 2, size) == 8);
+    assert(tfs_preadv(f, iov, 2, size + 2) == 6);
+    assert(memcmp(first, "YZwx", 4) == 0);
+    header_t header;
+    assert(tfs_read(f, &header, sizeof(header)) == sizeof(header));
+    assert(header.id == 0);
+    assert(tfs_close(f) != -1);
+
+    assert(tfs_writev(f, iov, 2) == -1);
+
+    assert(tfs_destroy() != -1);
+
+    PRINT_GREEN("Successful test.\n");
+
+    return 0;
+}
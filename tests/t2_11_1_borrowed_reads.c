@@ -0,0 +1,137 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "prettyprint.h"
+
+#define FILE_SIZE 3000
+#define MAX_SPANS 8
+
+static atomic_bool truncated;
+
+void *truncate_file(void *args) {
+    (void)args;
+    int f = tfs_open("/file", TFS_O_TRUNC);
+    assert(f != -1);
+    atomic_store(&truncated, true);
+    assert(tfs_close(f) != -1);
+    return NULL;
+}
+
+// Check the borrowed spans hold the file contents (starting at offset)
+void check_spans(tfs_span_t const *spans, int count, size_t offset,
+                 size_t len) {
+    size_t total = 0;
+    for (int i = 0; i < count; i++) {
+        char const *bytes = spans[i].base;
+        for (size_t j = 0; j < spans[i].len; j++) {
+            assert(bytes[j] == (char)((offset + total + j) % 251));
+        }
+        total += spans[i].len;
+    }
+    assert(total == len);
+}
+
+// Find the byte at a given offset of the borrowed spans
+char span_byte(tfs_span_t const *spans, int count, size_t offset) {
+    for (int i = 0; i < count; i++) {
+        if (offset < spans[i].len) {
+            return ((char const *)spans[i].base)[offset];
+        }
+        offset -= spans[i].len;
+    }
+    assert(false);
+    return 0;
+}
+
+int main() {
+    assert(tfs_init(NULL) != -1);
+
+    char contents[FILE_SIZE];
+    for (size_t i = 0; i < sizeof(contents); i++) {
+        contents[i] = (char)(i % 251);
+    }
+    int f = tfs_open("/file", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, contents, sizeof(contents)) == sizeof(contents));
+
+    // Borrow the whole file (spread over several blocks)
+    tfs_span_t spans[MAX_SPANS];
+    int count = MAX_SPANS;
+    tfs_lease_t lease;
+    assert(tfs_read_borrow(f, 0, FILE_SIZE + 100, spans, &count, &lease) ==
+           FILE_SIZE);
+    assert(count >= 1);
+    check_spans(spans, count, 0, FILE_SIZE);
+
+    // Other readers are not blocked
+    tfs_span_t other_spans[MAX_SPANS];
+    int other_count = MAX_SPANS;
+    tfs_lease_t other_lease;
+    assert(tfs_read_borrow(f, 1000, 10, other_spans, &other_count,
+                           &other_lease) == 10);
+    check_spans(other_spans, other_count, 1000, 10);
+    assert(tfs_read_release(&other_lease) != -1);
+    assert(tfs_read_release(&other_lease) == -1);
+
+    char buffer[10];
+    assert(tfs_pread(f, buffer, sizeof(buffer), 5) == sizeof(buffer));
+
+    // Nor are writes, even by the lease holder: they change the borrowed
+    // blocks in place
+    assert(tfs_pwrite(f, "new", 3, 1500) == 3);
+    assert(span_byte(spans, count, 1500) == 'n');
+    assert(span_byte(spans, count, 1502) == 'w');
+    assert(tfs_pwrite(f, contents + 1500, 3, 1500) == 3);
+    assert(tfs_pwrite(f, contents, 100, FILE_SIZE) == 100);
+    check_spans(spans, count, 0, FILE_SIZE);
+
+    // Nor are snapshots
+    int snapshot = tfs_snapshot_create();
+    assert(snapshot != -1);
+    assert(tfs_snapshot_delete(snapshot) != -1);
+    assert(tfs_close(f) != -1);
+
+    // But truncation waits for the lease to be released
+    pthread_t tid;
+    assert(pthread_create(&tid, NULL, truncate_file, NULL) == 0);
+    struct timespec delay = {.tv_sec = 0, .tv_nsec = 100000000};
+    nanosleep(&delay, NULL);
+    assert(!atomic_load(&truncated));
+    check_spans(spans, count, 0, FILE_SIZE);
+
+    assert(tfs_read_release(&lease) != -1);
+    assert(pthread_join(tid, NULL) == 0);
+    assert(atomic_load(&truncated));
+
+    // Borrowing at or past the end of the file
+    f = tfs_open("/file", 0);
+    assert(f != -1);
+    count = MAX_SPANS;
+    assert(tfs_read_borrow(f, 0, 10, spans, &count, &lease) == 0);
+    assert(count == 0);
+    assert(tfs_read_release(&lease) != -1);
+
+    // With a single span, only the first run of blocks is borrowed
+    assert(tfs_write(f, contents, sizeof(contents)) == sizeof(contents));
+    count = 1;
+    ssize_t borrowed = tfs_read_borrow(f, 0, FILE_SIZE, spans, &count, &lease);
+    assert(borrowed > 0 && borrowed <= FILE_SIZE && count == 1);
+    check_spans(spans, count, 0, (size_t)borrowed);
+    assert(tfs_read_release(&lease) != -1);
+
+    count = 0;
+    assert(tfs_read_borrow(f, 0, FILE_SIZE, spans, &count, &lease) == -1);
+    assert(tfs_close(f) != -1);
+
+    assert(tfs_destroy() != -1);
+
+    PRINT_GREEN("Successful test.\n");
+
+    return 0;
+}
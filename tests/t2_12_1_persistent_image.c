@@ -0,0 +1,99 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "prettyprint.h"
+
+#define IMAGE_PATH "/tmp/tfs_t2_12_1_persistent_image.img"
+#define JOURNAL_PATH IMAGE_PATH ".journal"
+#define FILE_SIZE 5000
+
+void check_file(char const *path, char const *contents, size_t size) {
+    char buffer[FILE_SIZE + 1];
+    int f = tfs_open(path, 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == (ssize_t)size);
+    assert(memcmp(buffer, contents, size) == 0);
+    assert(tfs_close(f) != -1);
+}
+
+int main() {
+    char contents[FILE_SIZE];
+    for (size_t i = 0; i < sizeof(contents); i++) {
+        contents[i] = (char)('a' + i % 26);
+    }
+
+    unlink(IMAGE_PATH);
+    unlink(JOURNAL_PATH);
+    tfs_params params = tfs_default_params();
+    params.image_path = IMAGE_PATH;
+
+    // Create an image with some files
+    assert(tfs_init(&params) != -1);
+    assert(tfs_mkdir("/dir") != -1);
+    int f = tfs_open("/dir/file", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, contents, sizeof(contents)) == sizeof(contents));
+    assert(tfs_close(f) != -1);
+    assert(tfs_link("/dir/file", "/hard") != -1);
+    assert(tfs_sym_link("/dir/file", "/soft") != -1);
+    assert(tfs_destroy() != -1);
+
+    // Everything is there after loading it again
+    assert(tfs_init(&params) != -1);
+    check_file("/dir/file", contents, sizeof(contents));
+    check_file("/hard", contents, sizeof(contents));
+    check_file("/soft", contents, sizeof(contents));
+    assert(tfs_mkdir("/dir") == -1);
+
+    // Changes made after loading it are kept as well
+    assert(tfs_unlink("/hard") != -1);
+    f = tfs_open("/dir/other", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, "hello", 5) == 5);
+    assert(tfs_close(f) != -1);
+    assert(tfs_destroy() != -1);
+
+    assert(tfs_init(&params) != -1);
+    assert(tfs_open("/hard", 0) == -1);
+    check_file("/dir/other", "hello", 5);
+    check_file("/soft", contents, sizeof(contents));
+
+    // Freed inodes and blocks can be reused
+    assert(tfs_unlink("/soft") != -1);
+    assert(tfs_unlink("/dir/other") != -1);
+    assert(tfs_unlink("/dir/file") != -1);
+    assert(tfs_rmdir("/dir") != -1);
+    for (int i = 0; i < 3; i++) {
+        f = tfs_open("/big", TFS_O_CREAT | TFS_O_TRUNC);
+        assert(f != -1);
+        assert(tfs_write(f, contents, sizeof(contents)) == sizeof(contents));
+        assert(tfs_close(f) != -1);
+    }
+    assert(tfs_destroy() != -1);
+
+    // Images with a different geometry (or that are not images) are rejected
+    tfs_params other = params;
+    other.max_block_count *= 2;
+    assert(tfs_init(&other) == -1);
+
+    FILE *image = fopen(IMAGE_PATH, "r+");
+    assert(image != NULL);
+    assert(fwrite("nope", 1, 4, image) == 4);
+    assert(fclose(image) == 0);
+    assert(tfs_init(&params) == -1);
+
+    // The in-memory FS still starts out empty
+    assert(tfs_init(NULL) != -1);
+    assert(tfs_open("/big", 0) == -1);
+    assert(tfs_destroy() != -1);
+
+    assert(unlink(IMAGE_PATH) == 0);
+    assert(unlink(JOURNAL_PATH) == 0);
+
+    PRINT_GREEN("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,279 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "prettyprint.h"
+
+#define IMAGE_PATH "/tmp/tfs_t2_13_1_metadata_journal.img"
+#define JOURNAL_PATH IMAGE_PATH ".journal"
+#define THREAD_COUNT 4
+#define FILES_PER_THREAD 8
+#define SMALL_BLOCK_COUNT 64
+#define BLOCK_SIZE 1024 // see tfs_default_params
+#define JOURNAL_LIMIT 4096 // bytes the journal can grow to, in fail_journal
+#define MAX_FILES 200 // (the count must fit in an exit status)
+
+static char const contents[] = "written before the crash";
+
+void *create_files(void *arg) {
+    int id = *(int *)arg;
+    char path[32];
+
+    sprintf(path, "/t%d", id);
+    assert(tfs_mkdir(path) != -1);
+    for (int i = 0; i < FILES_PER_THREAD; i++) {
+        sprintf(path, "/t%d/f%d", id, i);
+        int f = tfs_open(path, TFS_O_CREAT);
+        assert(f != -1);
+        assert(tfs_close(f) != -1);
+    }
+
+    // Remove every other file again
+    for (int i = 0; i < FILES_PER_THREAD; i += 2) {
+        sprintf(path, "/t%d/f%d", id, i);
+        assert(tfs_unlink(path) != -1);
+    }
+    return NULL;
+}
+
+// Runs in a child process, which exits without destroying the FS
+void crash(tfs_params const *params) {
+    // Data written back by a clean shutdown
+    assert(tfs_init(params) != -1);
+    int f = tfs_open("/data", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, contents, sizeof(contents)) == sizeof(contents));
+    assert(tfs_close(f) != -1);
+    assert(tfs_destroy() != -1);
+
+    // Metadata changes that are only in the journal
+    assert(tfs_init(params) != -1);
+    pthread_t tids[THREAD_COUNT];
+    int ids[THREAD_COUNT];
+    for (int i = 0; i < THREAD_COUNT; i++) {
+        ids[i] = i;
+        assert(pthread_create(&tids[i], NULL, create_files, &ids[i]) == 0);
+    }
+    for (int i = 0; i < THREAD_COUNT; i++) {
+        assert(pthread_join(tids[i], NULL) == 0);
+    }
+
+    assert(tfs_link("/data", "/hard") != -1);
+    assert(tfs_sym_link("/data", "/soft") != -1);
+    assert(tfs_mkdir("/gone") != -1);
+    assert(tfs_rmdir("/gone") != -1);
+
+    _exit(0);
+}
+
+// Runs in a child process: leaves inodes and blocks cached by the allocation
+// caches of a thread, and an open orphan, behind
+void crash_with_cached(tfs_params const *params) {
+    static char block[BLOCK_SIZE];
+    assert(tfs_init(params) != -1);
+    char path[32];
+    for (int i = 0; i < FILES_PER_THREAD; i++) {
+        sprintf(path, "/f%d", i);
+        int f = tfs_open(path, TFS_O_CREAT);
+        assert(f != -1);
+        assert(tfs_write(f, block, sizeof(block)) == sizeof(block));
+        assert(tfs_close(f) != -1);
+    }
+    for (int i = 0; i < FILES_PER_THREAD; i++) {
+        sprintf(path, "/f%d", i);
+        assert(tfs_unlink(path) != -1);
+    }
+
+    int f = tfs_open("/orphan", TFS_O_CREAT);
+    assert(f != -1);
+    for (int i = 0; i < SMALL_BLOCK_COUNT / 2; i++) {
+        assert(tfs_write(f, block, sizeof(block)) == sizeof(block));
+    }
+    assert(tfs_unlink("/orphan") != -1);
+
+    _exit(0);
+}
+
+// Creates files until there are no inodes left, and then writes to one of
+// them until there are no blocks left
+void fill(size_t *inodes, size_t *blocks) {
+    static char block[BLOCK_SIZE];
+    char path[32];
+    int f = -1;
+    for (*inodes = 0;; (*inodes)++) {
+        sprintf(path, "/i%zu", *inodes);
+        int g = tfs_open(path, TFS_O_CREAT);
+        if (g == -1) {
+            break;
+        }
+        if (f == -1) {
+            f = g;
+        } else {
+            assert(tfs_close(g) != -1);
+        }
+    }
+    assert(f != -1);
+    for (*blocks = 0; tfs_write(f, block, sizeof(block)) == sizeof(block);
+         (*blocks)++) {
+    }
+    assert(tfs_close(f) != -1);
+}
+
+void check_data(char const *path) {
+    char buffer[sizeof(contents)];
+    int f = tfs_open(path, 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == sizeof(contents));
+    assert(memcmp(buffer, contents, sizeof(contents)) == 0);
+    assert(tfs_close(f) != -1);
+}
+
+// Runs in a child process, where the journal (and the image) cannot grow past
+// JOURNAL_LIMIT bytes; exits with the number of files created before it failed
+void fail_journal(tfs_params const *params) {
+    assert(tfs_init(params) != -1);
+    signal(SIGXFSZ, SIG_IGN); // (writes past the limit fail instead)
+    struct rlimit limit;
+    assert(getrlimit(RLIMIT_FSIZE, &limit) == 0);
+    limit.rlim_cur = JOURNAL_LIMIT;
+    assert(setrlimit(RLIMIT_FSIZE, &limit) == 0);
+
+    char path[32];
+    int created = 0;
+    for (; created < MAX_FILES; created++) {
+        sprintf(path, "/f%d", created);
+        int f = tfs_open(path, TFS_O_CREAT);
+        if (f == -1) {
+            break;
+        }
+        assert(tfs_close(f) != -1);
+    }
+    assert(created > 0 && created < MAX_FILES);
+
+    // No operation that changes the FS starts from then on
+    assert(tfs_mkdir("/late") == -1);
+    assert(tfs_open("/f0", 0) == -1);
+    assert(tfs_destroy() == -1);
+    _exit(created);
+}
+
+int main() {
+    unlink(IMAGE_PATH);
+    unlink(JOURNAL_PATH);
+    tfs_params params = tfs_default_params();
+    params.image_path = IMAGE_PATH;
+
+    pid_t pid = fork();
+    assert(pid != -1);
+    if (pid == 0) {
+        crash(&params);
+    }
+    int status;
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    // A torn batch at the end of the journal is ignored
+    FILE *journal = fopen(JOURNAL_PATH, "a");
+    assert(journal != NULL);
+    assert(fwrite("TFJL torn batch", 1, 15, journal) == 15);
+    assert(fclose(journal) == 0);
+
+    // Every committed change is there after loading the image again
+    assert(tfs_init(&params) != -1);
+    check_data("/data");
+    check_data("/hard");
+    check_data("/soft");
+    assert(tfs_open("/gone", 0) == -1);
+    assert(tfs_mkdir("/gone") != -1);
+
+    char path[32];
+    for (int t = 0; t < THREAD_COUNT; t++) {
+        for (int i = 0; i < FILES_PER_THREAD; i++) {
+            sprintf(path, "/t%d/f%d", t, i);
+            int f = tfs_open(path, 0);
+            assert((f != -1) == (i % 2 == 1));
+            if (f != -1) {
+                assert(tfs_close(f) != -1);
+                assert(tfs_unlink(path) != -1);
+            }
+        }
+        sprintf(path, "/t%d", t);
+        assert(tfs_rmdir(path) != -1);
+    }
+
+    // Link counts were kept too: the data stays until its last link is gone
+    assert(tfs_unlink("/data") != -1);
+    check_data("/hard");
+    assert(tfs_unlink("/hard") != -1);
+    assert(tfs_open("/soft", 0) == -1);
+    assert(tfs_destroy() != -1);
+
+    // And so were the changes made after recovering
+    assert(tfs_init(&params) != -1);
+    assert(tfs_open("/hard", 0) == -1);
+    assert(tfs_rmdir("/gone") != -1);
+    assert(tfs_destroy() != -1);
+
+    assert(unlink(IMAGE_PATH) == 0);
+    assert(unlink(JOURNAL_PATH) == 0);
+
+    // Nothing is left taken after a crash, but what is reachable
+    params.max_block_count = SMALL_BLOCK_COUNT;
+    pid = fork();
+    assert(pid != -1);
+    if (pid == 0) {
+        crash_with_cached(&params);
+    }
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    assert(tfs_init(&params) != -1);
+    size_t inodes, blocks;
+    fill(&inodes, &blocks);
+    assert(tfs_destroy() != -1);
+
+    tfs_params fresh = params;
+    fresh.image_path = NULL;
+    assert(tfs_init(&fresh) != -1);
+    size_t fresh_inodes, fresh_blocks;
+    fill(&fresh_inodes, &fresh_blocks);
+    assert(inodes == fresh_inodes && blocks == fresh_blocks);
+    assert(tfs_destroy() != -1);
+
+    assert(unlink(IMAGE_PATH) == 0);
+    assert(unlink(JOURNAL_PATH) == 0);
+
+    // Operations fail once the journal cannot be written, and those that
+    // succeeded before are recovered
+    pid = fork();
+    assert(pid != -1);
+    if (pid == 0) {
+        fail_journal(&params);
+    }
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFEXITED(status));
+    int created = WEXITSTATUS(status);
+    assert(created > 0);
+
+    assert(tfs_init(&params) != -1);
+    for (int i = 0; i < created; i++) {
+        sprintf(path, "/f%d", i);
+        int f = tfs_open(path, 0);
+        assert(f != -1);
+        assert(tfs_close(f) != -1);
+    }
+    assert(tfs_destroy() != -1);
+
+    assert(unlink(IMAGE_PATH) == 0);
+    assert(unlink(JOURNAL_PATH) == 0);
+
+    PRINT_GREEN("Successful test.\n");
+
+    return 0;
+}
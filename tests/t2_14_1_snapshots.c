@@ -0,0 +1,169 @@
+#include "fs/config.h"
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <string.h>
+
+#include "prettyprint.h"
+
+#define FILE_SIZE 3000 // spans several blocks
+#define ROUNDS 400 // enough to run out of blocks if they leaked
+#define READS 200
+
+static char before[FILE_SIZE];
+static char after[FILE_SIZE];
+static int snapshot;
+
+void check_file(int f, char const *contents, size_t size) {
+    char buffer[FILE_SIZE + 1];
+    assert(tfs_pread(f, buffer, sizeof(buffer), 0) == (ssize_t)size);
+    assert(memcmp(buffer, contents, size) == 0);
+}
+
+void check_snapshot_file(char const *path, char const *contents,
+                         size_t size) {
+    int f = tfs_snapshot_open_readonly(snapshot, path);
+    assert(f != -1);
+    check_file(f, contents, size);
+    assert(tfs_close(f) != -1);
+}
+
+void write_file(char const *path, char const *contents) {
+    int f = tfs_open(path, TFS_O_CREAT | TFS_O_TRUNC);
+    assert(f != -1);
+    assert(tfs_write(f, contents, FILE_SIZE) == FILE_SIZE);
+    assert(tfs_close(f) != -1);
+}
+
+void *read_snapshot(void *arg) {
+    (void)arg;
+    int f = tfs_snapshot_open_readonly(snapshot, "/dir/file");
+    assert(f != -1);
+    for (int i = 0; i < READS; i++) {
+        check_file(f, before, FILE_SIZE);
+    }
+    assert(tfs_close(f) != -1);
+    return NULL;
+}
+
+void *write_live(void *arg) {
+    (void)arg;
+    int f = tfs_open("/dir/file", 0);
+    assert(f != -1);
+    for (int i = 0; i < READS; i++) {
+        char const *contents = i % 2 == 0 ? after : before;
+        assert(tfs_pwrite(f, contents, FILE_SIZE, 0) == FILE_SIZE);
+    }
+    assert(tfs_close(f) != -1);
+    return NULL;
+}
+
+int main() {
+    for (size_t i = 0; i < FILE_SIZE; i++) {
+        before[i] = (char)('a' + i % 26);
+        after[i] = (char)('A' + i % 26);
+    }
+
+    assert(tfs_init(NULL) != -1);
+    assert(tfs_mkdir("/dir") != -1);
+    write_file("/dir/file", before);
+    write_file("/other", before);
+    assert(tfs_sym_link("/dir/file", "/dir/link") != -1);
+
+    snapshot = tfs_snapshot_create();
+    assert(snapshot != -1);
+
+    // Change the live FS in every way
+    int f = tfs_open("/dir/file", 0);
+    assert(f != -1);
+    assert(tfs_pwrite(f, after, 100, 1500) == 100);
+    assert(tfs_pwrite(f, after, 100, FILE_SIZE) == 100);
+    assert(tfs_close(f) != -1);
+    f = tfs_open("/other", TFS_O_TRUNC);
+    assert(f != -1);
+    assert(tfs_write(f, after, 10) == 10);
+    assert(tfs_close(f) != -1);
+    assert(tfs_unlink("/dir/link") != -1);
+    write_file("/new", after);
+
+    // The snapshot still sees the FS as it was
+    check_snapshot_file("/dir/file", before, FILE_SIZE);
+    check_snapshot_file("/dir/link", before, FILE_SIZE);
+    check_snapshot_file("/other", before, FILE_SIZE);
+    assert(tfs_snapshot_open_readonly(snapshot, "/new") == -1);
+    assert(tfs_snapshot_open_readonly(snapshot, "/dir") == -1);
+
+    // While the live FS sees the changes
+    char expected[FILE_SIZE + 100];
+    memcpy(expected, before, FILE_SIZE);
+    memcpy(expected + 1500, after, 100);
+    memcpy(expected + FILE_SIZE, after, 100);
+    f = tfs_open("/dir/file", 0);
+    assert(f != -1);
+    char buffer[sizeof(expected)];
+    assert(tfs_read(f, buffer, sizeof(buffer)) == sizeof(expected));
+    assert(memcmp(buffer, expected, sizeof(expected)) == 0);
+    assert(tfs_close(f) != -1);
+
+    // Snapshots are read-only, and cannot be deleted while in use
+    f = tfs_snapshot_open_readonly(snapshot, "/other");
+    assert(f != -1);
+    assert(tfs_write(f, after, 1) == -1);
+    tfs_span_t span;
+    int span_count = 1;
+    tfs_lease_t lease;
+    assert(tfs_read_borrow(f, 0, 1, &span, &span_count, &lease) == -1);
+    assert(tfs_snapshot_delete(snapshot) == -1);
+    assert(tfs_close(f) != -1);
+    assert(tfs_snapshot_delete(snapshot) != -1);
+    assert(tfs_snapshot_open_readonly(snapshot, "/other") == -1);
+    assert(tfs_snapshot_delete(snapshot) == -1);
+
+    // Readers of a snapshot and writers of the live FS do not interfere
+    write_file("/dir/file", before);
+    snapshot = tfs_snapshot_create();
+    assert(snapshot != -1);
+    pthread_t reader, writer;
+    assert(pthread_create(&reader, NULL, read_snapshot, NULL) == 0);
+    assert(pthread_create(&writer, NULL, write_live, NULL) == 0);
+    assert(pthread_join(reader, NULL) == 0);
+    assert(pthread_join(writer, NULL) == 0);
+    assert(tfs_snapshot_delete(snapshot) != -1);
+
+    // Only so many snapshots can exist at once
+    int snapshots[MAX_SNAPSHOTS];
+    for (int i = 0; i < MAX_SNAPSHOTS; i++) {
+        snapshots[i] = tfs_snapshot_create();
+        assert(snapshots[i] != -1);
+    }
+    assert(tfs_snapshot_create() == -1);
+    for (int i = 0; i < MAX_SNAPSHOTS; i++) {
+        assert(tfs_snapshot_delete(snapshots[i]) != -1);
+    }
+
+    // Blocks copied on write are freed along with the snapshots
+    for (int i = 0; i < ROUNDS; i++) {
+        snapshot = tfs_snapshot_create();
+        assert(snapshot != -1);
+        f = tfs_open("/dir/file", 0);
+        assert(f != -1);
+        assert(tfs_write(f, i % 2 == 0 ? after : before, FILE_SIZE) ==
+               FILE_SIZE);
+        assert(tfs_close(f) != -1);
+        if (i % 2 == 0) {
+            write_file("/other", after); // truncated while shared
+        } else {
+            assert(tfs_unlink("/other") != -1); // deleted while shared
+        }
+        assert(tfs_snapshot_delete(snapshot) != -1);
+        if (i % 2 == 1) {
+            write_file("/other", before);
+        }
+    }
+
+    assert(tfs_destroy() != -1);
+
+    PRINT_GREEN("Successful test.\n");
+
+    return 0;
+}
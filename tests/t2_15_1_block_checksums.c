@@ -0,0 +1,117 @@
+#include "fs/crc32c.h"
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "prettyprint.h"
+
+#define IMAGE_PATH "/tmp/tfs_t2_15_1_block_checksums.img"
+#define JOURNAL_PATH IMAGE_PATH ".journal"
+#define BLOCK_SIZE 1024 // see tfs_default_params
+#define FILE_SIZE (3 * BLOCK_SIZE)
+
+void check_crc32c(void) {
+    crc32c_init();
+    assert(crc32c(0, "123456789", 9) == 0xe3069283);
+    assert(crc32c_scalar(0, "123456789", 9) == 0xe3069283);
+    assert(crc32c(crc32c(0, "1234", 4), "56789", 5) == 0xe3069283);
+
+    // Both implementations agree at every length and alignment
+    unsigned char data[2048];
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = (unsigned char)(i * 7 + i / 13);
+    }
+    for (size_t start = 0; start < 8; start++) {
+        for (size_t length = 0; length + start <= sizeof(data); length += 37) {
+            assert(crc32c(0, data + start, length) ==
+                   crc32c_scalar(0, data + start, length));
+        }
+    }
+}
+
+// Flip a byte of the image where the given contents are stored
+void corrupt_image(char const *contents, size_t length) {
+    FILE *image = fopen(IMAGE_PATH, "r+");
+    assert(image != NULL);
+    assert(fseek(image, 0, SEEK_END) == 0);
+    long size = ftell(image);
+    char *bytes = malloc((size_t)size);
+    assert(bytes != NULL);
+    assert(fseek(image, 0, SEEK_SET) == 0);
+    assert(fread(bytes, 1, (size_t)size, image) == (size_t)size);
+
+    long found = -1;
+    for (long i = 0; i + (long)length <= size && found == -1; i++) {
+        if (memcmp(bytes + i, contents, length) == 0) {
+            found = i;
+        }
+    }
+    assert(found != -1);
+
+    assert(fseek(image, found + 100, SEEK_SET) == 0);
+    assert(fputc(bytes[found + 100] ^ 0x20, image) != EOF);
+    assert(fclose(image) == 0);
+    free(bytes);
+}
+
+int main() {
+    check_crc32c();
+
+    char contents[FILE_SIZE];
+    srand(1);
+    for (size_t i = 0; i < sizeof(contents); i++) {
+        contents[i] = (char)rand();
+    }
+
+    unlink(IMAGE_PATH);
+    unlink(JOURNAL_PATH);
+    tfs_params params = tfs_default_params();
+    params.image_path = IMAGE_PATH;
+
+    assert(tfs_init(&params) != -1);
+    int f = tfs_open("/file", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, contents, 10) == 10); // partial blocks are covered too
+    assert(tfs_write(f, contents + 10, FILE_SIZE - 10) == FILE_SIZE - 10);
+    assert(tfs_close(f) != -1);
+    assert(tfs_destroy() != -1);
+
+    // Corrupt the second block of the file
+    corrupt_image(contents + BLOCK_SIZE, BLOCK_SIZE);
+
+    assert(tfs_init(&params) != -1);
+    f = tfs_open("/file", 0);
+    assert(f != -1);
+    char buffer[FILE_SIZE];
+
+    // Reads of the other blocks work, reads of the corrupted one fail
+    assert(tfs_pread(f, buffer, BLOCK_SIZE, 0) == BLOCK_SIZE);
+    assert(memcmp(buffer, contents, BLOCK_SIZE) == 0);
+    assert(tfs_pread(f, buffer, BLOCK_SIZE, 2 * BLOCK_SIZE) == BLOCK_SIZE);
+    assert(memcmp(buffer, contents + 2 * BLOCK_SIZE, BLOCK_SIZE) == 0);
+    assert(tfs_pread(f, buffer, 1, BLOCK_SIZE + 500) == -1);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == -1);
+    tfs_span_t span;
+    int span_count = 1;
+    tfs_lease_t lease;
+    assert(tfs_read_borrow(f, BLOCK_SIZE, 10, &span, &span_count, &lease) ==
+           -1);
+
+    // Rewriting the block makes it readable again
+    assert(tfs_pwrite(f, contents + BLOCK_SIZE, BLOCK_SIZE, BLOCK_SIZE) ==
+           BLOCK_SIZE);
+    assert(tfs_pread(f, buffer, sizeof(buffer), 0) == FILE_SIZE);
+    assert(memcmp(buffer, contents, FILE_SIZE) == 0);
+    assert(tfs_close(f) != -1);
+    assert(tfs_destroy() != -1);
+
+    assert(unlink(IMAGE_PATH) == 0);
+    assert(unlink(JOURNAL_PATH) == 0);
+
+    PRINT_GREEN("Successful test.\n");
+
+    return 0;
+}
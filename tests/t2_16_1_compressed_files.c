@@ -0,0 +1,172 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "prettyprint.h"
+
+// More than the 1024 blocks of 1024 bytes of tfs_default_params could hold
+// uncompressed
+#define FILE_SIZE (1060000)
+#define WRITE_SIZE (10000)
+#define GAP_OFFSET (20000)
+
+static char text[FILE_SIZE];
+static char buffer[FILE_SIZE];
+
+void fill_text(void) {
+    size_t length = 0;
+    for (size_t line = 0; length < FILE_SIZE; line++) {
+        char line_text[64];
+        int line_length = snprintf(line_text, sizeof(line_text),
+                                   "line %06zu: the quick brown fox\n", line);
+        for (int i = 0; i < line_length && length < FILE_SIZE; i++) {
+            text[length++] = line_text[i];
+        }
+    }
+}
+
+void assert_contents(int f, char const *contents, size_t size) {
+    // In pieces that do not line up with the chunks
+    for (size_t offset = 0; offset < size; offset += 3001) {
+        size_t length = (size - offset < 3001 ? size - offset : 3001);
+        assert(tfs_pread(f, buffer, 3001, offset) == (ssize_t)length);
+        assert(memcmp(buffer, contents + offset, length) == 0);
+    }
+    assert(tfs_pread(f, buffer, 1, size) == 0);
+}
+
+int main() {
+    fill_text();
+    assert(tfs_init(NULL) != -1);
+
+    // A compressible file larger than the FS
+    int f = tfs_open("/text", TFS_O_CREAT | TFS_O_COMPRESS);
+    assert(f != -1);
+    for (size_t offset = 0; offset < FILE_SIZE; offset += WRITE_SIZE) {
+        size_t length = FILE_SIZE - offset;
+        if (length > WRITE_SIZE) {
+            length = WRITE_SIZE;
+        }
+        assert(tfs_write(f, text + offset, length) == (ssize_t)length);
+    }
+    assert_contents(f, text, FILE_SIZE);
+
+    tfs_stats_t stats;
+    assert(tfs_get_stats(&stats) == 0);
+    assert(stats.compress_in_bytes >= FILE_SIZE);
+    assert(stats.compression_ratio > 1);
+    assert(stats.decompress_out_bytes > 0);
+
+    // Compressed contents cannot be borrowed
+    tfs_span_t span;
+    int span_count = 1;
+    tfs_lease_t lease;
+    assert(tfs_read_borrow(f, 0, 10, &span, &span_count, &lease) == -1);
+
+    // Writes within the file, across chunks
+    int snapshot = tfs_snapshot_create();
+    assert(snapshot != -1);
+    char random[WRITE_SIZE];
+    srand(1);
+    for (size_t i = 0; i < sizeof(random); i++) {
+        random[i] = (char)rand();
+    }
+    assert(tfs_pwrite(f, random, sizeof(random), 5000) == sizeof(random));
+    assert(tfs_pwrite(f, "x", 1, 500000) == 1);
+    char *old_text = malloc(FILE_SIZE);
+    assert(old_text != NULL);
+    memcpy(old_text, text, FILE_SIZE);
+    memcpy(text + 5000, random, sizeof(random));
+    text[500000] = 'x';
+    assert_contents(f, text, FILE_SIZE);
+    assert(tfs_close(f) != -1);
+
+    // The snapshot still has the old contents
+    f = tfs_snapshot_open_readonly(snapshot, "/text");
+    assert(f != -1);
+    assert_contents(f, old_text, FILE_SIZE);
+    assert(tfs_close(f) != -1);
+    assert(tfs_snapshot_delete(snapshot) != -1);
+
+    // Truncated files stay compressed
+    f = tfs_open("/text", TFS_O_TRUNC);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, 1) == 0);
+    assert(tfs_write(f, text, FILE_SIZE) == FILE_SIZE);
+    assert_contents(f, text, FILE_SIZE);
+    assert(tfs_close(f) != -1);
+
+    // Writing past the end fills the gap with zeros
+    f = tfs_open("/gap", TFS_O_CREAT | TFS_O_COMPRESS);
+    assert(f != -1);
+    assert(tfs_pwrite(f, "abc", 3, GAP_OFFSET) == 3);
+    char gap[GAP_OFFSET + 3];
+    memset(gap, 0, GAP_OFFSET);
+    memcpy(gap + GAP_OFFSET, "abc", 3);
+    assert_contents(f, gap, sizeof(gap));
+    assert(tfs_close(f) != -1);
+
+    // Incompressible data is stored as it is
+    f = tfs_open("/random", TFS_O_CREAT | TFS_O_COMPRESS);
+    assert(f != -1);
+    assert(tfs_write(f, random, sizeof(random)) == sizeof(random));
+    assert_contents(f, random, sizeof(random));
+    assert(tfs_close(f) != -1);
+
+    // Files with contents are not compressed when opened
+    f = tfs_open("/plain", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, "plain", 5) == 5);
+    assert(tfs_close(f) != -1);
+    f = tfs_open("/plain", TFS_O_COMPRESS);
+    assert(f != -1);
+    span_count = 1;
+    assert(tfs_read_borrow(f, 0, 5, &span, &span_count, &lease) == 5);
+    assert(tfs_read_release(&lease) == 0);
+    assert(tfs_close(f) != -1);
+
+    // A gap that does not fit leaves the file as it was
+    f = tfs_open("/small", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, random, 2048) == 2048); // 2 blocks
+    assert(tfs_close(f) != -1);
+    int fill_count = 0;
+    for (;; fill_count++) {
+        char path[16];
+        snprintf(path, sizeof(path), "/fill%d", fill_count);
+        f = tfs_open(path, TFS_O_CREAT);
+        assert(f != -1);
+        ssize_t written;
+        do {
+            written = tfs_write(f, random, sizeof(random));
+        } while (written == sizeof(random));
+        assert(tfs_close(f) != -1);
+        if (written == -1) {
+            break; // full
+        }
+    }
+    assert(tfs_unlink("/small") != -1);
+    f = tfs_open("/gap2", TFS_O_CREAT | TFS_O_COMPRESS);
+    assert(f != -1);
+    assert(tfs_pwrite(f, "abc", 3, GAP_OFFSET) == -1);
+    assert(tfs_pread(f, buffer, 1, 0) == 0);
+    for (int i = 0; i <= fill_count; i++) {
+        char path[16];
+        snprintf(path, sizeof(path), "/fill%d", i);
+        assert(tfs_unlink(path) != -1);
+    }
+    assert(tfs_pwrite(f, "abc", 3, GAP_OFFSET) == 3);
+    assert_contents(f, gap, sizeof(gap));
+    assert(tfs_close(f) != -1);
+
+    assert(tfs_unlink("/text") != -1);
+    assert(tfs_destroy() != -1);
+
+    free(old_text);
+
+    PRINT_GREEN("Successful test.\n");
+
+    return 0;
+}
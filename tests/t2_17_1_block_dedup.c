@@ -0,0 +1,119 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "prettyprint.h"
+
+#define IMAGE_PATH "/tmp/tfs_t2_17_1_block_dedup.img"
+#define JOURNAL_PATH IMAGE_PATH ".journal"
+#define BLOCK_SIZE 1024
+#define BLOCK_COUNT 64
+#define FILE_BLOCKS 40 // three copies would not fit without deduplication
+#define FILE_SIZE (FILE_BLOCKS * BLOCK_SIZE + 100)
+#define OTHER_SIZE (16 * BLOCK_SIZE)
+
+static char contents[FILE_SIZE];
+static char buffer[FILE_SIZE + 1];
+
+void write_file(char const *path, char const *data, size_t size,
+                size_t write_size) {
+    int f = tfs_open(path, TFS_O_CREAT | TFS_O_TRUNC);
+    assert(f != -1);
+    for (size_t offset = 0; offset < size; offset += write_size) {
+        size_t length = (size - offset < write_size ? size - offset
+                                                    : write_size);
+        assert(tfs_write(f, data + offset, length) == (ssize_t)length);
+    }
+    assert(tfs_close(f) != -1);
+}
+
+void check_file(char const *path, char const *data, size_t size) {
+    int f = tfs_open(path, 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == (ssize_t)size);
+    assert(memcmp(buffer, data, size) == 0);
+    assert(tfs_close(f) != -1);
+}
+
+int main() {
+    srand(1);
+    for (size_t i = 0; i < sizeof(contents); i++) {
+        contents[i] = (char)rand();
+    }
+
+    unlink(IMAGE_PATH);
+    unlink(JOURNAL_PATH);
+    tfs_params params = tfs_default_params();
+    params.max_block_count = BLOCK_COUNT;
+    params.image_path = IMAGE_PATH;
+    params.dedup = true;
+    assert(tfs_init(&params) != -1);
+
+    // Copies written in pieces of any size share their full blocks
+    write_file("/a", contents, FILE_SIZE, BLOCK_SIZE);
+    write_file("/b", contents, FILE_SIZE, 100);
+    write_file("/c", contents, FILE_SIZE, 3000);
+    tfs_stats_t stats;
+    assert(tfs_get_stats(&stats) == 0);
+    assert(stats.dedup_hits == 2 * FILE_BLOCKS);
+    check_file("/a", contents, FILE_SIZE);
+    check_file("/b", contents, FILE_SIZE);
+    check_file("/c", contents, FILE_SIZE);
+
+    // Writes to shared blocks only change the file written to
+    int f = tfs_open("/b", 0);
+    assert(f != -1);
+    assert(tfs_pwrite(f, "changed", 7, 5 * BLOCK_SIZE + 10) == 7);
+    assert(tfs_close(f) != -1);
+    char changed[FILE_SIZE];
+    memcpy(changed, contents, FILE_SIZE);
+    memcpy(changed + 5 * BLOCK_SIZE + 10, "changed", 7);
+    check_file("/a", contents, FILE_SIZE);
+    check_file("/b", changed, FILE_SIZE);
+    check_file("/c", contents, FILE_SIZE);
+    assert(tfs_destroy() != -1);
+
+    // The holders of the blocks are known again after loading the image
+    assert(tfs_init(&params) != -1);
+    assert(tfs_unlink("/a") != -1);
+    check_file("/b", changed, FILE_SIZE);
+    check_file("/c", contents, FILE_SIZE);
+    write_file("/d", changed, FILE_SIZE, BLOCK_SIZE);
+    assert(tfs_get_stats(&stats) == 0);
+    assert(stats.dedup_hits == FILE_BLOCKS);
+    assert(tfs_unlink("/b") != -1);
+    check_file("/c", contents, FILE_SIZE);
+    check_file("/d", changed, FILE_SIZE);
+
+    // Once every copy is gone, all the blocks can be used again
+    assert(tfs_unlink("/c") != -1);
+    assert(tfs_unlink("/d") != -1);
+    for (size_t i = 0; i < sizeof(contents); i++) {
+        contents[i] = (char)rand();
+    }
+    write_file("/e", contents, FILE_SIZE, BLOCK_SIZE);
+    check_file("/e", contents, FILE_SIZE);
+    write_file("/f", contents, FILE_SIZE, BLOCK_SIZE);
+    assert(tfs_destroy() != -1);
+
+    // Blocks stay shared when the image is loaded without deduplication
+    params.dedup = false;
+    assert(tfs_init(&params) != -1);
+    assert(tfs_unlink("/e") != -1);
+    char other[OTHER_SIZE];
+    memset(other, 'B', sizeof(other));
+    write_file("/g", other, sizeof(other), BLOCK_SIZE);
+    check_file("/f", contents, FILE_SIZE);
+    check_file("/g", other, sizeof(other));
+    assert(tfs_destroy() != -1);
+
+    assert(unlink(IMAGE_PATH) == 0);
+    assert(unlink(JOURNAL_PATH) == 0);
+
+    PRINT_GREEN("Successful test.\n");
+
+    return 0;
+}
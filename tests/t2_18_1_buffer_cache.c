@@ -0,0 +1,63 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "prettyprint.h"
+
+#define BLOCK_SIZE 1024 // see tfs_default_params
+#define SMALL_SIZE (8 * BLOCK_SIZE)
+#define LARGE_SIZE (700 * BLOCK_SIZE) // more blocks than BCACHE_FRAMES
+
+static char contents[LARGE_SIZE];
+static char buffer[LARGE_SIZE];
+
+void read_file(char const *path, size_t size) {
+    int f = tfs_open(path, 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, size) == (ssize_t)size);
+    assert(memcmp(buffer, contents, size) == 0);
+    assert(tfs_close(f) != -1);
+}
+
+int main() {
+    for (size_t i = 0; i < sizeof(contents); i++) {
+        contents[i] = (char)(i * 31 / 7);
+    }
+
+    assert(tfs_init(NULL) != -1);
+    int f = tfs_open("/small", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, contents, SMALL_SIZE) == SMALL_SIZE);
+    assert(tfs_close(f) != -1);
+
+    // Data touched again soon is found in the cache
+    tfs_stats_t before, after;
+    read_file("/small", SMALL_SIZE);
+    assert(tfs_get_stats(&before) == 0);
+    read_file("/small", SMALL_SIZE);
+    assert(tfs_get_stats(&after) == 0);
+    assert(after.cache_hits > before.cache_hits);
+    assert(after.cache_misses == before.cache_misses);
+    assert(after.cache_write_backs == before.cache_write_backs);
+
+    // A file larger than the cache evicts (and writes back) what it replaces
+    f = tfs_open("/large", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, contents, LARGE_SIZE) == LARGE_SIZE);
+    assert(tfs_close(f) != -1);
+    read_file("/large", LARGE_SIZE);
+    before = after;
+    assert(tfs_get_stats(&after) == 0);
+    assert(after.cache_misses > before.cache_misses);
+    assert(after.cache_write_backs > before.cache_write_backs);
+
+    // Reads that miss the cache still return the right contents
+    read_file("/small", SMALL_SIZE);
+
+    assert(tfs_destroy() != -1);
+
+    PRINT_GREEN("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,166 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "prettyprint.h"
+
+#define ENTRIES 64
+#define WORKERS 4
+#define PIECE 100
+#define PIECES 32
+#define FILES 8
+
+static char contents[PIECES * PIECE];
+static char buffer[PIECES * PIECE];
+
+tfs_ring_request_t request(tfs_ring_op_t op, int fhandle, void *data,
+                           size_t len, ssize_t offset, size_t user_data) {
+    tfs_ring_request_t r = {.op = op,
+                            .fhandle = fhandle,
+                            .buffer = data,
+                            .len = len,
+                            .offset = offset,
+                            .user_data = (void *)user_data};
+    return r;
+}
+
+// Submit a batch and wait for all of it, checking the results by user_data
+void run_batch(tfs_ring_t *ring, tfs_ring_request_t const *requests,
+               size_t count, ssize_t const *results) {
+    assert(tfs_ring_submit(ring, requests, count) == (ssize_t)count);
+    tfs_ring_completion_t completions[ENTRIES];
+    assert(tfs_ring_reap(ring, completions, ENTRIES, count) ==
+           (ssize_t)count);
+    for (size_t i = 0; i < count; i++) {
+        size_t index = (size_t)completions[i].user_data;
+        assert(index < count);
+        assert(completions[i].result == results[index]);
+    }
+}
+
+int open_file(tfs_ring_t *ring, char const *name) {
+    tfs_ring_request_t open = {
+        .op = TFS_RING_OPEN, .name = name, .mode = TFS_O_CREAT};
+    assert(tfs_ring_submit(ring, &open, 1) == 1);
+    tfs_ring_completion_t completion;
+    assert(tfs_ring_reap(ring, &completion, 1, 1) == 1);
+    assert(completion.result != -1);
+    return (int)completion.result;
+}
+
+int main() {
+    for (size_t i = 0; i < sizeof(contents); i++) {
+        contents[i] = (char)('a' + i % 26);
+    }
+
+    assert(tfs_init(NULL) != -1);
+    tfs_ring_t *ring = tfs_ring_create(ENTRIES, WORKERS);
+    assert(ring != NULL);
+
+    // Completions are signaled through the eventfd
+    int f = open_file(ring, "/f");
+    struct pollfd event = {.fd = tfs_ring_eventfd(ring), .events = POLLIN};
+    assert(poll(&event, 1, 0) == 1);
+    uint64_t events;
+    assert(read(event.fd, &events, sizeof(events)) == sizeof(events));
+    assert(events == 1);
+
+    // Positional writes submitted out of order are merged
+    tfs_ring_request_t requests[ENTRIES];
+    ssize_t results[ENTRIES];
+    for (size_t i = 0; i < PIECES; i++) {
+        size_t piece = PIECES - 1 - i;
+        requests[i] = request(TFS_RING_WRITE, f, contents + piece * PIECE,
+                              PIECE, (ssize_t)(piece * PIECE), i);
+        results[i] = PIECE;
+    }
+    run_batch(ring, requests, PIECES, results);
+
+    // So are reads at the current offset, which advance it in order
+    for (size_t i = 0; i < 4; i++) {
+        requests[i] = request(TFS_RING_READ, f, buffer + i * 8 * PIECE,
+                              8 * PIECE, -1, i);
+        results[i] = 8 * PIECE;
+    }
+    requests[4] = request(TFS_RING_READ, f, buffer, PIECE, -1, 4);
+    results[4] = 0;
+    run_batch(ring, requests, 5, results);
+    assert(memcmp(buffer, contents, sizeof(contents)) == 0);
+
+    // Overlapping writes of a batch keep their order
+    requests[0] = request(TFS_RING_WRITE, f, "aaaa", 4, 1, 0);
+    requests[1] = request(TFS_RING_WRITE, f, "bb", 2, 2, 1);
+    requests[2] = request(TFS_RING_READ, f, buffer, 4, 1, 2);
+    results[0] = 4;
+    results[1] = 2;
+    results[2] = 4;
+    run_batch(ring, requests, 3, results);
+    assert(memcmp(buffer, "abba", 4) == 0);
+
+    // Errors are reported in the completions
+    requests[0] = request(TFS_RING_READ, -1, buffer, 1, -1, 0);
+    requests[1] = request(TFS_RING_CLOSE, f, NULL, 0, 0, 1);
+    requests[2] = request(TFS_RING_WRITE, f, "x", 1, -1, 2);
+    results[0] = -1;
+    results[1] = 0;
+    results[2] = -1;
+    run_batch(ring, requests, 3, results);
+
+    // Many batches in flight at once, on different files
+    int files[FILES];
+    char names[FILES][8];
+    for (size_t i = 0; i < FILES; i++) {
+        snprintf(names[i], sizeof(names[i]), "/f%zu", i);
+        files[i] = open_file(ring, names[i]);
+    }
+    for (size_t i = 0; i < FILES; i++) {
+        for (size_t j = 0; j < 4; j++) {
+            requests[j] = request(TFS_RING_WRITE, files[i],
+                                  contents + i * 4 * PIECE + j * PIECE, PIECE,
+                                  -1, 0);
+        }
+        assert(tfs_ring_submit(ring, requests, 4) == 4);
+    }
+    tfs_ring_completion_t completions[ENTRIES];
+    assert(tfs_ring_reap(ring, completions, ENTRIES, 4 * FILES) == 4 * FILES);
+    for (size_t i = 0; i < 4 * FILES; i++) {
+        assert(completions[i].result == PIECE);
+    }
+    for (size_t i = 0; i < FILES; i++) {
+        assert(tfs_pread(files[i], buffer, sizeof(buffer), 0) == 4 * PIECE);
+        assert(memcmp(buffer, contents + i * 4 * PIECE, 4 * PIECE) == 0);
+        requests[2 * i] = request(TFS_RING_CLOSE, files[i], NULL, 0, 0, 2 * i);
+        requests[2 * i + 1] = (tfs_ring_request_t){
+            .op = TFS_RING_UNLINK, .name = names[i], .user_data = (void *)0};
+    }
+    assert(tfs_ring_submit(ring, requests, 2 * FILES) == 2 * FILES);
+    assert(tfs_ring_reap(ring, completions, ENTRIES, 2 * FILES) ==
+           2 * FILES);
+    for (size_t i = 0; i < 2 * FILES; i++) {
+        assert(completions[i].result == 0);
+    }
+    assert(tfs_open("/f0", 0) == -1);
+
+    // The ring only holds as many requests as it has entries
+    for (size_t i = 0; i < ENTRIES; i++) {
+        requests[i] = request(TFS_RING_READ, -1, buffer, 1, -1, 0);
+    }
+    assert(tfs_ring_submit(ring, requests, ENTRIES - 1) == ENTRIES - 1);
+    assert(tfs_ring_submit(ring, requests, 2) == -1);
+    assert(tfs_ring_reap(ring, completions, ENTRIES, ENTRIES) == -1);
+    assert(tfs_ring_reap(ring, completions, ENTRIES, ENTRIES - 1) ==
+           ENTRIES - 1);
+
+    // Requests left in flight complete before the ring is destroyed
+    assert(tfs_ring_submit(ring, requests, 8) == 8);
+    assert(tfs_ring_destroy(ring) == 0);
+    assert(tfs_destroy() != -1);
+
+    PRINT_GREEN("Successful test.\n");
+
+    return 0;
+}
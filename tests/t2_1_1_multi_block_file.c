@@ -0,0 +1,87 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "prettyprint.h"
+
+#define FILE_SIZE (10 * 1024 + 123)
+#define CHUNK_SIZE (700)
+
+char const path[] = "/f1";
+char const other_path[] = "/f2";
+
+void fill(char *buffer, size_t len, char seed) {
+    for (size_t i = 0; i < len; i++) {
+        buffer[i] = (char)(seed + (char)(i % 61));
+    }
+}
+
+int main() {
+    static char contents[FILE_SIZE];
+    static char buffer[16 * 1024];
+
+    tfs_params params = tfs_default_params();
+    params.max_block_count = 16;
+    assert(tfs_init(&params) != -1);
+
+    fill(contents, sizeof(contents), 'A');
+
+    // Write a file spanning several blocks, in chunks that are not aligned
+    // with the block size
+    int f = tfs_open(path, TFS_O_CREAT);
+    assert(f != -1);
+    for (size_t written = 0; written < FILE_SIZE; written += CHUNK_SIZE) {
+        size_t len = FILE_SIZE - written;
+        if (len > CHUNK_SIZE) {
+            len = CHUNK_SIZE;
+        }
+        assert(tfs_write(f, contents + written, len) == len);
+    }
+    assert(tfs_close(f) != -1);
+
+    // Read it back in one go
+    f = tfs_open(path, 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == FILE_SIZE);
+    assert(memcmp(buffer, contents, FILE_SIZE) == 0);
+    assert(tfs_close(f) != -1);
+
+    // The file system is now full: writes to other files are short, then fail
+    f = tfs_open(other_path, TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, contents, 4 * 1024) == 4 * 1024);
+    assert(tfs_write(f, contents, 1) == -1);
+    assert(tfs_close(f) != -1);
+
+    // Truncating the first file returns its blocks to the file system
+    f = tfs_open(path, TFS_O_TRUNC);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == 0);
+    assert(tfs_close(f) != -1);
+
+    f = tfs_open(other_path, TFS_O_APPEND);
+    assert(f != -1);
+    assert(tfs_write(f, contents, 8 * 1024) == 8 * 1024);
+    assert(tfs_close(f) != -1);
+
+    f = tfs_open(other_path, 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == 12 * 1024);
+    assert(memcmp(buffer, contents, 4 * 1024) == 0);
+    assert(memcmp(buffer + 4 * 1024, contents, 8 * 1024) == 0);
+    assert(tfs_close(f) != -1);
+
+    // Unlinking the second file frees every block
+    assert(tfs_unlink(other_path) != -1);
+    f = tfs_open(path, 0);
+    assert(f != -1);
+    assert(tfs_write(f, contents, FILE_SIZE) == FILE_SIZE);
+    assert(tfs_close(f) != -1);
+
+    assert(tfs_destroy() != -1);
+
+    PRINT_GREEN("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,84 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "prettyprint.h"
+
+#define FILE_COUNT 300
+#define NAME_SIZE 32
+
+static char names[FILE_COUNT][NAME_SIZE];
+static char const *name_list[FILE_COUNT];
+static int results[FILE_COUNT];
+
+int main() {
+    tfs_params params = tfs_default_params();
+    params.max_inode_count = FILE_COUNT + 16;
+    assert(tfs_init(&params) != -1);
+    assert(tfs_mkdir("/dir") != -1);
+
+    // Files in two directories, created at once
+    for (size_t i = 0; i < FILE_COUNT; i++) {
+        snprintf(names[i], NAME_SIZE, i % 10 == 0 ? "/f%zu" : "/dir/f%zu", i);
+        name_list[i] = names[i];
+    }
+    assert(tfs_create_many(name_list, FILE_COUNT, results) == FILE_COUNT);
+    for (size_t i = 0; i < FILE_COUNT; i++) {
+        assert(results[i] == 0);
+    }
+
+    // They are regular (empty) files
+    int f = tfs_open("/dir/f1", 0);
+    assert(f != -1);
+    char buffer[4];
+    assert(tfs_read(f, buffer, sizeof(buffer)) == 0);
+    assert(tfs_write(f, "abc", 3) == 3);
+    assert(tfs_close(f) != -1);
+
+    // Names that are taken, repeated or in missing directories are not created
+    char const *more[] = {"/dir/f1", "/new", "/new", "/missing/f", "/dir",
+                          "/dir/new"};
+    int more_results[6];
+    assert(tfs_create_many(more, 6, more_results) == 2);
+    assert(more_results[0] == -1);
+    assert(more_results[1] == 0);
+    assert(more_results[2] == -1);
+    assert(more_results[3] == -1);
+    assert(more_results[4] == -1);
+    assert(more_results[5] == 0);
+
+    assert(tfs_lookup_many(name_list, FILE_COUNT, results) == FILE_COUNT);
+    assert(tfs_lookup_many(more, 6, more_results) == 5);
+    assert(more_results[3] == -1);
+    assert(tfs_lookup_many(more, 6, NULL) == 5);
+
+    // Directories are not deleted (open files are)
+    f = tfs_open("/new", 0);
+    assert(f != -1);
+    char const *targets[] = {"/dir", "/new", "/new", "/missing/f"};
+    int target_results[4];
+    assert(tfs_unlink_many(targets, 4, target_results) == 1);
+    assert(target_results[0] == -1);
+    assert(target_results[1] == 0);
+    assert(target_results[2] == -1);
+    assert(target_results[3] == -1);
+    assert(tfs_close(f) != -1);
+
+    // Deleting the files in bulk frees their inodes for new ones
+    assert(tfs_unlink_many(name_list, FILE_COUNT, results) == FILE_COUNT);
+    assert(tfs_lookup_many(name_list, FILE_COUNT, NULL) == 0);
+    assert(tfs_unlink("/dir/new") != -1);
+    assert(tfs_rmdir("/dir") != -1);
+    for (size_t i = 0; i < FILE_COUNT; i++) {
+        snprintf(names[i], NAME_SIZE, "/g%zu", i);
+    }
+    assert(tfs_create_many(name_list, FILE_COUNT, NULL) == FILE_COUNT);
+    assert(tfs_lookup_many(name_list, FILE_COUNT, NULL) == FILE_COUNT);
+
+    assert(tfs_destroy() != -1);
+
+    PRINT_GREEN("Successful test.\n");
+
+    return 0;
+}
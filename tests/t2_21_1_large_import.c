@@ -0,0 +1,70 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "prettyprint.h"
+
+#define SOURCE_PATH "/tmp/tfs_t2_21_1_large_import.src"
+#define BLOCK_SIZE 1024 // see tfs_default_params
+#define MAX_SIZE (900 * BLOCK_SIZE)
+#define TOO_LARGE (1100 * BLOCK_SIZE) // more than the FS can hold
+
+static char contents[TOO_LARGE];
+static char buffer[TOO_LARGE];
+
+void write_source(size_t size) {
+    FILE *source = fopen(SOURCE_PATH, "w");
+    assert(source != NULL);
+    assert(fwrite(contents, 1, size, source) == size);
+    assert(fclose(source) == 0);
+}
+
+void check_import(size_t size) {
+    write_source(size);
+    assert(tfs_copy_from_external_fs(SOURCE_PATH, "/imported") != -1);
+
+    int f = tfs_open("/imported", 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == (ssize_t)size);
+    assert(memcmp(buffer, contents, size) == 0);
+    assert(tfs_close(f) != -1);
+}
+
+int main() {
+    srand(1);
+    for (size_t i = 0; i < sizeof(contents); i++) {
+        contents[i] = (char)rand();
+    }
+
+    assert(tfs_init(NULL) != -1);
+
+    // Files of any size, overwriting the previous one each time
+    size_t const sizes[] = {MAX_SIZE, 0, 1, BLOCK_SIZE - 1, BLOCK_SIZE,
+                            3 * BLOCK_SIZE + 7, 100 * BLOCK_SIZE + 1};
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(*sizes); i++) {
+        check_import(sizes[i]);
+    }
+
+    // Files that do not fit are not imported whole
+    write_source(TOO_LARGE);
+    assert(tfs_copy_from_external_fs(SOURCE_PATH, "/imported") == -1);
+    assert(tfs_unlink("/imported") != -1);
+
+    // Files whose size is not known beforehand are read in chunks
+    assert(tfs_copy_from_external_fs("/proc/self/status", "/status") != -1);
+    int f = tfs_open("/status", 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, sizeof(buffer)) > 0);
+    assert(memcmp(buffer, "Name:", 5) == 0);
+    assert(tfs_close(f) != -1);
+
+    assert(tfs_destroy() != -1);
+    assert(unlink(SOURCE_PATH) == 0);
+
+    PRINT_GREEN("Successful test.\n");
+
+    return 0;
+}
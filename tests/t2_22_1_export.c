@@ -0,0 +1,93 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "prettyprint.h"
+
+#define DEST_PATH "/tmp/tfs_t2_22_1_export.dst"
+#define BLOCK_SIZE 1024 // see tfs_default_params
+#define FILE_SIZE (300 * BLOCK_SIZE + 17)
+#define WRITE_SIZE (3 * BLOCK_SIZE)
+
+static char contents[FILE_SIZE];
+static char buffer[FILE_SIZE + 1];
+
+void check_export(char const *path, char const *data, size_t size) {
+    assert(tfs_copy_to_external_fs(path, DEST_PATH) != -1);
+
+    FILE *dest = fopen(DEST_PATH, "r");
+    assert(dest != NULL);
+    assert(fread(buffer, 1, sizeof(buffer), dest) == size);
+    assert(memcmp(buffer, data, size) == 0);
+    assert(fclose(dest) == 0);
+}
+
+int main() {
+    srand(1);
+    for (size_t i = 0; i < sizeof(contents); i++) {
+        contents[i] = (char)rand();
+    }
+
+    assert(tfs_init(NULL) != -1);
+
+    // A file spread over many extents (writes to two files interleaved)
+    int f = tfs_open("/a", TFS_O_CREAT);
+    assert(f != -1);
+    int g = tfs_open("/b", TFS_O_CREAT);
+    assert(g != -1);
+    for (size_t offset = 0; offset < FILE_SIZE; offset += WRITE_SIZE) {
+        size_t length = FILE_SIZE - offset;
+        if (length > WRITE_SIZE) {
+            length = WRITE_SIZE;
+        }
+        assert(tfs_write(f, contents + offset, length) == (ssize_t)length);
+        assert(tfs_write(g, "b", 1) == 1);
+    }
+    assert(tfs_close(f) != -1);
+    assert(tfs_close(g) != -1);
+    check_export("/a", contents, FILE_SIZE);
+
+    // The destination is overwritten
+    char b_contents[FILE_SIZE / WRITE_SIZE + 1];
+    memset(b_contents, 'b', sizeof(b_contents));
+    check_export("/b", b_contents, sizeof(b_contents));
+    f = tfs_open("/empty", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_close(f) != -1);
+    check_export("/empty", "", 0);
+
+    // Compressed files are exported through a buffer
+    f = tfs_open("/compressed", TFS_O_CREAT | TFS_O_COMPRESS);
+    assert(f != -1);
+    memset(buffer, 'z', 100000);
+    assert(tfs_write(f, buffer, 100000) == 100000);
+    assert(tfs_close(f) != -1);
+    char *zeds = malloc(100000);
+    assert(zeds != NULL);
+    memset(zeds, 'z', 100000);
+    check_export("/compressed", zeds, 100000);
+    free(zeds);
+
+    // Exported files can be imported back
+    assert(tfs_copy_to_external_fs("/a", DEST_PATH) != -1);
+    assert(tfs_copy_from_external_fs(DEST_PATH, "/c") != -1);
+    f = tfs_open("/c", 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == FILE_SIZE);
+    assert(memcmp(buffer, contents, FILE_SIZE) == 0);
+    assert(tfs_close(f) != -1);
+
+    // Errors
+    assert(tfs_copy_to_external_fs("/missing", DEST_PATH) == -1);
+    assert(tfs_copy_to_external_fs("/a", "/missing/dir/file") == -1);
+
+    assert(tfs_destroy() != -1);
+    assert(unlink(DEST_PATH) == 0);
+
+    PRINT_GREEN("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,121 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "prettyprint.h"
+
+#define SOURCE_DIR "/tmp/tfs_t2_23_1_import_tree"
+#define FILE_COUNT 12
+#define MAX_SIZE (60000)
+
+// Files of the tree (relative to SOURCE_DIR), and their sizes
+static char const *files[FILE_COUNT] = {
+    "f0", "f1", "f2", "a/f3", "a/f4", "a/f5", "a/b/f6", "a/b/f7", "a/b/f8",
+    "c/f9", "c/f10", "c/d/f11"};
+static size_t const sizes[FILE_COUNT] = {
+    0, 1, 5000, MAX_SIZE, 1024, 1023, 30000, 7, 20000, 2048, 100, 44444};
+static char const *dirs[] = {"a", "a/b", "c", "c/d"};
+
+static char contents[MAX_SIZE];
+static char buffer[MAX_SIZE + 1];
+
+void host_path(char *path, char const *name) {
+    snprintf(path, 256, "%s/%s", SOURCE_DIR, name);
+}
+
+void create_tree(void) {
+    char path[256];
+    assert(mkdir(SOURCE_DIR, 0777) == 0);
+    for (size_t i = 0; i < sizeof(dirs) / sizeof(*dirs); i++) {
+        host_path(path, dirs[i]);
+        assert(mkdir(path, 0777) == 0);
+    }
+    for (size_t i = 0; i < FILE_COUNT; i++) {
+        host_path(path, files[i]);
+        FILE *file = fopen(path, "w");
+        assert(file != NULL);
+        // Each file starts at a different point of the contents
+        assert(fwrite(contents + i, 1, sizes[i], file) == sizes[i]);
+        assert(fclose(file) == 0);
+    }
+    host_path(path, "link");
+    assert(symlink("f2", path) == 0);
+}
+
+void remove_tree(void) {
+    char path[256];
+    for (size_t i = 0; i < FILE_COUNT; i++) {
+        host_path(path, files[i]);
+        assert(unlink(path) == 0);
+    }
+    host_path(path, "link");
+    assert(unlink(path) == 0);
+    for (size_t i = sizeof(dirs) / sizeof(*dirs); i > 0; i--) {
+        host_path(path, dirs[i - 1]);
+        assert(rmdir(path) == 0);
+    }
+    assert(rmdir(SOURCE_DIR) == 0);
+}
+
+void check_tree(char const *prefix) {
+    char path[256];
+    for (size_t i = 0; i < FILE_COUNT; i++) {
+        snprintf(path, sizeof(path), "%s/%s", prefix, files[i]);
+        int f = tfs_open(path, 0);
+        assert(f != -1);
+        assert(tfs_read(f, buffer, sizeof(buffer)) == (ssize_t)sizes[i]);
+        assert(memcmp(buffer, contents + i, sizes[i]) == 0);
+        assert(tfs_close(f) != -1);
+    }
+    snprintf(path, sizeof(path), "%s/link", prefix);
+    assert(tfs_open(path, 0) == -1);
+}
+
+int main() {
+    srand(1);
+    for (size_t i = 0; i < sizeof(contents); i++) {
+        contents[i] = (char)rand();
+    }
+    create_tree();
+
+    assert(tfs_init(NULL) != -1);
+
+    // Into the root directory, and into a new one
+    assert(tfs_import_tree(SOURCE_DIR, "/", 4) != -1);
+    check_tree("");
+    assert(tfs_import_tree(SOURCE_DIR, "/copy/", 3) != -1);
+    check_tree("/copy");
+
+    // Existing files are overwritten
+    int f = tfs_open("/a/b/f6", TFS_O_TRUNC);
+    assert(f != -1);
+    assert(tfs_write(f, "changed", 7) == 7);
+    assert(tfs_close(f) != -1);
+    assert(tfs_import_tree(SOURCE_DIR, "/", 16) != -1);
+    check_tree("");
+
+    // Errors
+    assert(tfs_import_tree(SOURCE_DIR "/missing", "/", 4) == -1);
+    assert(tfs_import_tree(SOURCE_DIR, "relative", 4) == -1);
+    assert(tfs_import_tree(SOURCE_DIR, "/", 0) == -1);
+    assert(tfs_import_tree(SOURCE_DIR, "/f1", 4) == -1); // not a directory
+    assert(tfs_import_tree(SOURCE_DIR, "/copy/f2", 4) == -1);
+    assert(tfs_mkdir("/x") != -1);
+    f = tfs_open("/x/a", TFS_O_CREAT); // where a directory of the tree goes
+    assert(f != -1);
+    assert(tfs_close(f) != -1);
+    assert(tfs_import_tree(SOURCE_DIR, "/x", 4) == -1);
+    assert(tfs_import_tree(NULL, "/", 4) == -1);
+    assert(tfs_import_tree(SOURCE_DIR, NULL, 4) == -1);
+
+    assert(tfs_destroy() != -1);
+    remove_tree();
+
+    PRINT_GREEN("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,163 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "prettyprint.h"
+
+#define IMAGE_PATH "/tmp/tfs_t2_24_1_orphan_files.img"
+#define JOURNAL_PATH IMAGE_PATH ".journal"
+#define BLOCK_SIZE 1024 // see tfs_default_params
+#define BLOCK_COUNT 64
+#define FILE_SIZE (40 * BLOCK_SIZE) // more than half of the FS
+#define SMALL_SIZE (4 * BLOCK_SIZE)
+#define THREAD_COUNT 4
+#define ITERATIONS 50
+
+static char contents[FILE_SIZE];
+static char buffer[FILE_SIZE + 1];
+
+void write_file(char const *path, size_t size) {
+    int f = tfs_open(path, TFS_O_CREAT | TFS_O_TRUNC);
+    assert(f != -1);
+    assert(tfs_write(f, contents, size) == (ssize_t)size);
+    assert(tfs_close(f) != -1);
+}
+
+void wait_reclaimed(void) {
+    tfs_stats_t stats;
+    assert(tfs_get_stats(&stats) != -1);
+    while (stats.orphans_pending > 0) {
+        sched_yield();
+        assert(tfs_get_stats(&stats) != -1);
+    }
+}
+
+void *create_and_unlink(void *arg) {
+    char path[16];
+    snprintf(path, sizeof(path), "/t%d", *(int *)arg);
+    for (int i = 0; i < ITERATIONS; i++) {
+        // Only fits if the space of earlier copies was reclaimed
+        write_file(path, SMALL_SIZE);
+        assert(tfs_unlink(path) != -1);
+    }
+    return NULL;
+}
+
+void *open_racing(void *arg) {
+    (void)arg;
+    char data[4];
+    for (int i = 0; i < ITERATIONS; i++) {
+        int f = tfs_open("/x", i % 2 ? TFS_O_CREAT | TFS_O_TRUNC : 0);
+        if (f != -1) {
+            assert(tfs_pwrite(f, "data", 4, 0) == 4);
+            assert(tfs_pread(f, data, sizeof(data), 0) >= 0);
+            assert(tfs_close(f) != -1);
+        }
+    }
+    return NULL;
+}
+
+void *unlink_racing(void *arg) {
+    (void)arg;
+    for (int i = 0; i < ITERATIONS; i++) {
+        tfs_unlink("/x");
+        sched_yield();
+    }
+    return NULL;
+}
+
+int main() {
+    for (size_t i = 0; i < sizeof(contents); i++) {
+        contents[i] = (char)('a' + i % 26);
+    }
+
+    unlink(IMAGE_PATH);
+    unlink(JOURNAL_PATH);
+    tfs_params params = tfs_default_params();
+    params.max_block_count = BLOCK_COUNT;
+    params.image_path = IMAGE_PATH;
+    assert(tfs_init(&params) != -1);
+
+    // A deleted file stays usable through its open handles
+    int f = tfs_open("/a", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, contents, FILE_SIZE) == FILE_SIZE);
+    int g = tfs_open("/a", 0);
+    assert(g != -1);
+    assert(tfs_unlink("/a") != -1);
+    assert(tfs_open("/a", 0) == -1);
+    assert(tfs_link("/a", "/b") == -1);
+
+    tfs_stats_t stats;
+    assert(tfs_get_stats(&stats) != -1);
+    assert(stats.orphans_pending == 1);
+    assert(stats.orphans_reclaimed == 0);
+
+    assert(tfs_close(f) != -1);
+    assert(tfs_read(g, buffer, sizeof(buffer)) == FILE_SIZE);
+    assert(memcmp(buffer, contents, FILE_SIZE) == 0);
+    assert(tfs_get_stats(&stats) != -1);
+    assert(stats.orphans_pending == 1);
+
+    // Its space can be used again once its last handle is closed
+    assert(tfs_close(g) != -1);
+    write_file("/b", FILE_SIZE);
+    wait_reclaimed();
+    assert(tfs_get_stats(&stats) != -1);
+    assert(stats.orphans_reclaimed == 1);
+
+    // Files deleted from many threads, while the FS is almost full
+    pthread_t threads[THREAD_COUNT];
+    int ids[THREAD_COUNT];
+    for (int i = 0; i < THREAD_COUNT; i++) {
+        ids[i] = i;
+        assert(pthread_create(&threads[i], NULL, create_and_unlink, &ids[i]) ==
+               0);
+    }
+    for (int i = 0; i < THREAD_COUNT; i++) {
+        assert(pthread_join(threads[i], NULL) == 0);
+    }
+    wait_reclaimed();
+    assert(tfs_get_stats(&stats) != -1);
+    assert(stats.orphans_reclaimed == 1 + THREAD_COUNT * ITERATIONS);
+
+    // Files opened while they are unlinked are either opened or not, but
+    // never reclaimed while open
+    for (int i = 0; i < THREAD_COUNT; i++) {
+        assert(pthread_create(&threads[i], NULL,
+                              i % 2 ? unlink_racing : open_racing,
+                              NULL) == 0);
+    }
+    for (int i = 0; i < THREAD_COUNT; i++) {
+        assert(pthread_join(threads[i], NULL) == 0);
+    }
+    tfs_unlink("/x");
+    wait_reclaimed();
+    write_file("/x", 4 * SMALL_SIZE); // no space was leaked
+    assert(tfs_unlink("/x") != -1);
+    wait_reclaimed();
+
+    // Files still open when the FS is destroyed are reclaimed then
+    f = tfs_open("/b", 0);
+    assert(f != -1);
+    assert(tfs_unlink("/b") != -1);
+    assert(tfs_destroy() != -1);
+
+    assert(tfs_init(&params) != -1);
+    assert(tfs_open("/b", 0) == -1);
+    write_file("/c", FILE_SIZE);
+    assert(tfs_get_stats(&stats) != -1);
+    assert(stats.orphans_pending == 0);
+    assert(tfs_destroy() != -1);
+
+    assert(unlink(IMAGE_PATH) == 0);
+    unlink(JOURNAL_PATH);
+
+    PRINT_GREEN("Successful test.\n");
+
+    return 0;
+}
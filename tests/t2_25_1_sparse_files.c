@@ -0,0 +1,197 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "prettyprint.h"
+
+#define DEST_PATH "/tmp/tfs_t2_25_1_sparse_files.dst"
+#define BLOCK_SIZE 1024 // see tfs_default_params
+#define BLOCK_COUNT 64
+#define FAR (1000 * BLOCK_SIZE) // far more than the FS can hold
+#define FILE_SIZE (40 * BLOCK_SIZE) // more than half of the FS
+#define MAX_SIZE (2 * FAR)
+#define COMPRESSED_SIZE (16 * BLOCK_SIZE)
+
+static char contents[FILE_SIZE];
+static char buffer[MAX_SIZE];
+static char zeros[MAX_SIZE];
+
+void write_file(char const *path, size_t size) {
+    int f = tfs_open(path, TFS_O_CREAT | TFS_O_TRUNC);
+    assert(f != -1);
+    assert(tfs_write(f, contents, size) == (ssize_t)size);
+    assert(tfs_close(f) != -1);
+}
+
+void check_range(int f, size_t offset, char const *data, size_t size) {
+    assert(tfs_pread(f, buffer, size, offset) == (ssize_t)size);
+    assert(memcmp(buffer, data, size) == 0);
+}
+
+// Blocks freed by ftruncate are only freed in the background
+void write_file_retrying(char const *path, size_t size) {
+    for (int f = tfs_open(path, TFS_O_CREAT | TFS_O_TRUNC);;
+         f = tfs_open(path, TFS_O_TRUNC)) {
+        assert(f != -1);
+        ssize_t written = tfs_write(f, contents, size);
+        assert(tfs_close(f) != -1);
+        if (written == (ssize_t)size) {
+            return;
+        }
+        sched_yield();
+    }
+}
+
+int main() {
+    srand(1);
+    for (size_t i = 0; i < sizeof(contents); i++) {
+        contents[i] = (char)rand();
+    }
+
+    tfs_params params = tfs_default_params();
+    params.max_block_count = BLOCK_COUNT;
+    assert(tfs_init(&params) != -1);
+
+    // Writes far past the end only take the blocks written to
+    int f = tfs_open("/sparse", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_pwrite(f, "head", 4, 10) == 4);
+    assert(tfs_pwrite(f, contents, 3 * BLOCK_SIZE, FAR + 100) ==
+           3 * BLOCK_SIZE);
+    assert(tfs_pwrite(f, "tail", 4, 2 * FAR - 4) == 4);
+    check_range(f, 0, zeros, 10);
+    check_range(f, 10, "head", 4);
+    check_range(f, 14, zeros, FAR + 100 - 14);
+    check_range(f, FAR + 100, contents, 3 * BLOCK_SIZE);
+    check_range(f, FAR + 100 + 3 * BLOCK_SIZE, zeros,
+                FAR - 104 - 3 * BLOCK_SIZE);
+    check_range(f, 2 * FAR - 4, "tail", 4);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == 2 * FAR);
+
+    // Holes can be filled in part
+    assert(tfs_pwrite(f, "middle", 6, FAR / 2) == 6);
+    check_range(f, FAR / 2 - BLOCK_SIZE, zeros, BLOCK_SIZE);
+    check_range(f, FAR / 2, "middle", 6);
+    check_range(f, FAR / 2 + 6, zeros, BLOCK_SIZE);
+
+    // The rest of the FS is still free
+    write_file("/full", FILE_SIZE);
+    assert(tfs_unlink("/full") != -1);
+
+    // Punched holes read as zeros, and their blocks can be used again
+    assert(tfs_pwrite(f, contents, FILE_SIZE, 0) == FILE_SIZE);
+    int g = tfs_open("/full", TFS_O_CREAT);
+    assert(g != -1);
+    assert(tfs_write(g, contents, FILE_SIZE) < FILE_SIZE); // no space
+    assert(tfs_close(g) != -1);
+    assert(tfs_punch_hole(f, 100, FILE_SIZE - 200) != -1);
+    check_range(f, 0, contents, 100);
+    check_range(f, 100, zeros, FILE_SIZE - 200);
+    check_range(f, FILE_SIZE - 100, contents + FILE_SIZE - 100, 100);
+    write_file("/full", FILE_SIZE);
+    assert(tfs_unlink("/full") != -1);
+    assert(tfs_punch_hole(f, 0, MAX_SIZE) != -1); // up to the end
+    check_range(f, 0, zeros, 2 * FAR);
+    write_file("/full", FILE_SIZE);
+    assert(tfs_unlink("/full") != -1);
+
+    // Sparse files can be borrowed and exported
+    assert(tfs_pwrite(f, "data", 4, FAR) == 4);
+    tfs_span_t spans[8];
+    int span_count = 8;
+    tfs_lease_t lease;
+    ssize_t borrowed =
+        tfs_read_borrow(f, FAR - 100, 200, spans, &span_count, &lease);
+    assert(borrowed == 200);
+    size_t position = 0;
+    for (int i = 0; i < span_count; i++) {
+        memcpy(buffer + position, spans[i].base, spans[i].len);
+        position += spans[i].len;
+    }
+    assert(position == 200);
+    assert(memcmp(buffer, zeros, 100) == 0);
+    assert(memcmp(buffer + 100, "data", 4) == 0);
+    assert(tfs_read_release(&lease) != -1);
+    assert(tfs_close(f) != -1);
+
+    assert(tfs_copy_to_external_fs("/sparse", DEST_PATH) != -1);
+    FILE *dest = fopen(DEST_PATH, "r");
+    assert(dest != NULL);
+    assert(fread(buffer, 1, sizeof(buffer), dest) == 2 * FAR);
+    assert(memcmp(buffer, zeros, FAR) == 0);
+    assert(memcmp(buffer + FAR, "data", 4) == 0);
+    assert(fclose(dest) == 0);
+    assert(unlink(DEST_PATH) == 0);
+    assert(tfs_unlink("/sparse") != -1);
+
+    // Files shrink, and grow back with zeros (not their old contents)
+    f = tfs_open("/sized", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, contents, FILE_SIZE) == FILE_SIZE);
+    assert(tfs_ftruncate(f, 100) != -1);
+    assert(tfs_pread(f, buffer, sizeof(buffer), 0) == 100);
+    assert(memcmp(buffer, contents, 100) == 0);
+    assert(tfs_ftruncate(f, 3000) != -1);
+    check_range(f, 0, contents, 100);
+    check_range(f, 100, zeros, 2900);
+
+    // The blocks past the end are freed in the background
+    assert(tfs_pwrite(f, contents, FILE_SIZE, 0) == FILE_SIZE);
+    assert(tfs_ftruncate(f, 100) != -1);
+    write_file_retrying("/full", FILE_SIZE);
+    assert(tfs_unlink("/full") != -1);
+    assert(tfs_ftruncate(f, FAR) != -1);
+    check_range(f, 0, contents, 100);
+    check_range(f, 100, zeros, FAR - 100);
+    assert(tfs_ftruncate(f, 0) != -1);
+    assert(tfs_pread(f, buffer, sizeof(buffer), 0) == 0);
+    assert(tfs_close(f) != -1);
+
+    // Compressed files are filled with zeros instead
+    f = tfs_open("/compressed", TFS_O_CREAT | TFS_O_COMPRESS);
+    assert(f != -1);
+    assert(tfs_write(f, contents, COMPRESSED_SIZE) == COMPRESSED_SIZE);
+    assert(tfs_punch_hole(f, 1000, 10000) != -1);
+    check_range(f, 0, contents, 1000);
+    check_range(f, 1000, zeros, 10000);
+    check_range(f, 11000, contents + 11000, COMPRESSED_SIZE - 11000);
+    assert(tfs_ftruncate(f, 5000) != -1);
+    assert(tfs_pread(f, buffer, sizeof(buffer), 0) == 5000);
+    assert(tfs_ftruncate(f, 20000) != -1);
+    check_range(f, 0, contents, 1000);
+    check_range(f, 1000, zeros, 19000);
+    assert(tfs_pread(f, buffer, sizeof(buffer), 0) == 20000);
+    assert(tfs_close(f) != -1);
+    assert(tfs_unlink("/compressed") != -1);
+
+    // Snapshots keep the blocks punched out of the live file
+    write_file("/snap", 8 * BLOCK_SIZE);
+    int snapshot = tfs_snapshot_create();
+    assert(snapshot != -1);
+    f = tfs_open("/snap", 0);
+    assert(f != -1);
+    assert(tfs_punch_hole(f, 0, 8 * BLOCK_SIZE) != -1);
+    check_range(f, 0, zeros, 8 * BLOCK_SIZE);
+    assert(tfs_close(f) != -1);
+    f = tfs_snapshot_open_readonly(snapshot, "/snap");
+    assert(f != -1);
+    check_range(f, 0, contents, 8 * BLOCK_SIZE);
+    assert(tfs_punch_hole(f, 0, 1) == -1); // read-only
+    assert(tfs_ftruncate(f, 0) == -1);
+    assert(tfs_close(f) != -1);
+    assert(tfs_snapshot_delete(snapshot) != -1);
+
+    // Errors
+    assert(tfs_ftruncate(-1, 0) == -1);
+    assert(tfs_punch_hole(-1, 0, 1) == -1);
+
+    assert(tfs_destroy() != -1);
+
+    PRINT_GREEN("Successful test.\n");
+
+    return 0;
+}
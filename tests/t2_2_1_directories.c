@@ -0,0 +1,119 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "prettyprint.h"
+
+#define NUM_THREADS 4
+#define FILES_PER_THREAD 5
+#define PATH_MAX_LEN 32
+
+uint8_t const file_contents[] = "AAA!";
+
+void *create_files(void *args) {
+    int id = *((int *)args);
+
+    char dir[PATH_MAX_LEN];
+    sprintf(dir, "/d%d", id);
+    assert(tfs_mkdir(dir) != -1);
+
+    char subdir[PATH_MAX_LEN];
+    sprintf(subdir, "/d%d/sub", id);
+    assert(tfs_mkdir(subdir) != -1);
+
+    // Every thread uses the same names, but in its own subtree
+    for (int i = 0; i < FILES_PER_THREAD; i++) {
+        char path[PATH_MAX_LEN];
+        sprintf(path, "/d%d/sub/f%d", id, i);
+
+        int f = tfs_open(path, TFS_O_CREAT);
+        assert(f != -1);
+        assert(tfs_write(f, path, strlen(path) + 1) == strlen(path) + 1);
+        assert(tfs_close(f) != -1);
+    }
+
+    return NULL;
+}
+
+int main() {
+    assert(tfs_init(NULL) != -1);
+
+    // Basic namespace operations
+    assert(tfs_mkdir("/a") != -1);
+    assert(tfs_mkdir("/a") == -1);
+    assert(tfs_mkdir("/b/c") == -1); // parent does not exist
+    assert(tfs_mkdir("/a/b") != -1);
+    assert(tfs_open("/a", 0) == -1); // directories cannot be opened
+
+    int f = tfs_open("/a/b/file", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, file_contents, sizeof(file_contents)) ==
+           sizeof(file_contents));
+    assert(tfs_close(f) != -1);
+
+    assert(tfs_open("/a/file", 0) == -1);
+    assert(tfs_open("/file", 0) == -1);
+    assert(tfs_open("/a/b/file/x", TFS_O_CREAT) == -1);
+
+    // Links across directories
+    assert(tfs_link("/a/b/file", "/hard") != -1);
+    assert(tfs_sym_link("/a/b/file", "/a/soft") != -1);
+
+    uint8_t buffer[sizeof(file_contents)];
+    f = tfs_open("/a/soft", 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == sizeof(buffer));
+    assert(memcmp(buffer, file_contents, sizeof(buffer)) == 0);
+    assert(tfs_close(f) != -1);
+
+    // Only empty directories can be removed
+    assert(tfs_unlink("/a/b") == -1);
+    assert(tfs_rmdir("/a/b") == -1);
+    assert(tfs_rmdir("/hard") == -1);
+    assert(tfs_unlink("/a/b/file") != -1);
+    assert(tfs_rmdir("/a/b") != -1);
+    assert(tfs_open("/a/b/file", TFS_O_CREAT) == -1);
+    assert(tfs_unlink("/a/soft") != -1);
+    assert(tfs_rmdir("/a") != -1);
+
+    f = tfs_open("/hard", 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == sizeof(buffer));
+    assert(memcmp(buffer, file_contents, sizeof(buffer)) == 0);
+    assert(tfs_close(f) != -1);
+
+    // Threads working in separate subtrees
+    pthread_t threads[NUM_THREADS];
+    int ids[NUM_THREADS];
+    for (int i = 0; i < NUM_THREADS; i++) {
+        ids[i] = i;
+        assert(pthread_create(&threads[i], NULL, create_files, &ids[i]) == 0);
+    }
+    for (int i = 0; i < NUM_THREADS; i++) {
+        assert(pthread_join(threads[i], NULL) == 0);
+    }
+
+    for (int t = 0; t < NUM_THREADS; t++) {
+        for (int i = 0; i < FILES_PER_THREAD; i++) {
+            char path[PATH_MAX_LEN];
+            char read_path[PATH_MAX_LEN];
+            sprintf(path, "/d%d/sub/f%d", t, i);
+
+            f = tfs_open(path, 0);
+            assert(f != -1);
+            assert(tfs_read(f, read_path, sizeof(read_path)) ==
+                   strlen(path) + 1);
+            assert(strcmp(path, read_path) == 0);
+            assert(tfs_close(f) != -1);
+        }
+    }
+
+    assert(tfs_destroy() != -1);
+
+    PRINT_GREEN("Successful test.\n");
+
+    return 0;
+}
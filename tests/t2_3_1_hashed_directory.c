@@ -0,0 +1,87 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "prettyprint.h"
+
+// Close to the number of entries that fit in a directory block, so that many
+// names collide
+#define NUM_FILES 20
+#define PATH_MAX_LEN 16
+
+void file_path(char *path, int i) { sprintf(path, "/file%d", i); }
+
+void assert_exists(int i, int exists) {
+    char path[PATH_MAX_LEN];
+    file_path(path, i);
+
+    int f = tfs_open(path, 0);
+    if (!exists) {
+        assert(f == -1);
+        return;
+    }
+    assert(f != -1);
+
+    int contents;
+    assert(tfs_read(f, &contents, sizeof(contents)) == sizeof(contents));
+    assert(contents == i);
+    assert(tfs_close(f) != -1);
+}
+
+void create(int i) {
+    char path[PATH_MAX_LEN];
+    file_path(path, i);
+
+    int f = tfs_open(path, TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, &i, sizeof(i)) == sizeof(i));
+    assert(tfs_close(f) != -1);
+}
+
+void unlink_file(int i) {
+    char path[PATH_MAX_LEN];
+    file_path(path, i);
+    assert(tfs_unlink(path) != -1);
+}
+
+int main() {
+    assert(tfs_init(NULL) != -1);
+
+    for (int i = 0; i < NUM_FILES; i++) {
+        create(i);
+    }
+    for (int i = 0; i < NUM_FILES; i++) {
+        assert_exists(i, 1);
+    }
+
+    // Removing entries must not hide the ones that collided with them
+    for (int i = 0; i < NUM_FILES; i += 3) {
+        unlink_file(i);
+    }
+    for (int i = 0; i < NUM_FILES; i++) {
+        assert_exists(i, i % 3 != 0);
+    }
+
+    // Names are unique within a directory
+    char path[PATH_MAX_LEN];
+    file_path(path, 1);
+    assert(tfs_link("/file2", path) == -1);
+
+    // Freed slots are reused
+    for (int i = 0; i < NUM_FILES; i += 3) {
+        create(i);
+    }
+    for (int i = 1; i < NUM_FILES; i += 3) {
+        unlink_file(i);
+    }
+    for (int i = 0; i < NUM_FILES; i++) {
+        assert_exists(i, i % 3 != 1);
+    }
+
+    assert(tfs_destroy() != -1);
+
+    PRINT_GREEN("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,77 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "prettyprint.h"
+
+// Many more entries than fit in a single directory block
+#define NUM_FILES 300
+#define BLOCK_COUNT 64
+#define PATH_MAX_LEN 32
+
+void file_path(char *path, int i) { sprintf(path, "/dir/file%d", i); }
+
+int main() {
+    static char contents[(BLOCK_COUNT - 1) * 1024];
+
+    tfs_params params = tfs_default_params();
+    params.max_inode_count = NUM_FILES + 2;
+    params.max_block_count = BLOCK_COUNT;
+    assert(tfs_init(&params) != -1);
+
+    assert(tfs_mkdir("/dir") != -1);
+
+    for (int i = 0; i < NUM_FILES; i++) {
+        char path[PATH_MAX_LEN];
+        file_path(path, i);
+        int f = tfs_open(path, TFS_O_CREAT);
+        assert(f != -1);
+        assert(tfs_close(f) != -1);
+    }
+
+    for (int i = 0; i < NUM_FILES; i++) {
+        char path[PATH_MAX_LEN];
+        file_path(path, i);
+        int f = tfs_open(path, 0);
+        assert(f != -1);
+        assert(tfs_close(f) != -1);
+    }
+    assert(tfs_open("/dir/file", 0) == -1);
+
+    // Remove every other file, and check the rest are still there
+    for (int i = 0; i < NUM_FILES; i += 2) {
+        char path[PATH_MAX_LEN];
+        file_path(path, i);
+        assert(tfs_unlink(path) != -1);
+    }
+    for (int i = 0; i < NUM_FILES; i++) {
+        char path[PATH_MAX_LEN];
+        file_path(path, i);
+        int f = tfs_open(path, 0);
+        assert((f != -1) == (i % 2 != 0));
+        if (f != -1) {
+            assert(tfs_close(f) != -1);
+        }
+    }
+
+    for (int i = 1; i < NUM_FILES; i += 2) {
+        char path[PATH_MAX_LEN];
+        file_path(path, i);
+        assert(tfs_unlink(path) != -1);
+    }
+    assert(tfs_rmdir("/dir") != -1);
+
+    // The directory gave back all of its blocks: a file can use every block
+    // but the root directory's
+    int f = tfs_open("/big", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, contents, sizeof(contents)) == sizeof(contents));
+    assert(tfs_close(f) != -1);
+
+    assert(tfs_destroy() != -1);
+
+    PRINT_GREEN("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,98 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "prettyprint.h"
+
+#define NUM_READERS 3
+#define ITERATIONS 50
+
+char const path[] = "/dir/file";
+
+void *create_and_unlink(void *args) {
+    (void)args;
+    for (int i = 0; i < ITERATIONS; i++) {
+        int f = tfs_open(path, TFS_O_CREAT);
+        assert(f != -1);
+        assert(tfs_write(f, &i, sizeof(i)) == sizeof(i));
+        assert(tfs_close(f) != -1);
+        // Readers may have the file open meanwhile, which does not prevent
+        // its name from being removed
+        assert(tfs_unlink(path) != -1);
+    }
+    return NULL;
+}
+
+void *open_repeatedly(void *args) {
+    (void)args;
+    for (int i = 0; i < ITERATIONS; i++) {
+        // The file may or may not exist, but if it is found it must be a
+        // regular file
+        int f = tfs_open(path, 0);
+        if (f != -1) {
+            assert(tfs_close(f) != -1);
+        }
+        assert(tfs_open("/dir/missing", 0) == -1);
+    }
+    return NULL;
+}
+
+int main() {
+    assert(tfs_init(NULL) != -1);
+
+    // Repeated misses, then a hit once the name is created
+    assert(tfs_mkdir("/dir") != -1);
+    for (int i = 0; i < 3; i++) {
+        assert(tfs_open(path, 0) == -1);
+    }
+    int f = tfs_open(path, TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_close(f) != -1);
+    for (int i = 0; i < 3; i++) {
+        f = tfs_open(path, 0);
+        assert(f != -1);
+        assert(tfs_close(f) != -1);
+    }
+
+    // Removed names are no longer found
+    assert(tfs_unlink(path) != -1);
+    assert(tfs_open(path, 0) == -1);
+
+    // A directory recreated with the same name starts out empty
+    f = tfs_open(path, TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_close(f) != -1);
+    assert(tfs_unlink(path) != -1);
+    assert(tfs_rmdir("/dir") != -1);
+    assert(tfs_open(path, 0) == -1);
+    assert(tfs_mkdir("/dir") != -1);
+    assert(tfs_open(path, 0) == -1);
+
+    // Lookups racing with creates and unlinks of the same name
+    pthread_t writer;
+    pthread_t readers[NUM_READERS];
+    assert(pthread_create(&writer, NULL, create_and_unlink, NULL) == 0);
+    for (int i = 0; i < NUM_READERS; i++) {
+        assert(pthread_create(&readers[i], NULL, open_repeatedly, NULL) == 0);
+    }
+    assert(pthread_join(writer, NULL) == 0);
+    for (int i = 0; i < NUM_READERS; i++) {
+        assert(pthread_join(readers[i], NULL) == 0);
+    }
+
+    assert(tfs_open(path, 0) == -1);
+    f = tfs_open(path, TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_close(f) != -1);
+    f = tfs_open(path, 0);
+    assert(f != -1);
+    assert(tfs_close(f) != -1);
+
+    assert(tfs_destroy() != -1);
+
+    PRINT_GREEN("Successful test.\n");
+
+    return 0;
+}
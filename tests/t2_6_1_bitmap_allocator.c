@@ -0,0 +1,121 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "prettyprint.h"
+
+// Inode and block counts that are not multiples of the bitmap word size
+#define NUM_THREADS 4
+#define FILES_PER_THREAD 32
+#define INODE_COUNT (NUM_THREADS * FILES_PER_THREAD + 2)
+#define BLOCK_COUNT 200
+#define BLOCK_SIZE 1024
+#define PATH_MAX_LEN 32
+
+void file_path(char *path, int thread, int i) {
+    sprintf(path, "/f%d_%d", thread, i);
+}
+
+void *create_files(void *args) {
+    int thread = *(int *)args;
+    char block[BLOCK_SIZE];
+
+    for (int i = 0; i < FILES_PER_THREAD; i++) {
+        char path[PATH_MAX_LEN];
+        file_path(path, thread, i);
+        memset(block, 'a' + thread, sizeof(block));
+        block[0] = (char)i;
+
+        int f = tfs_open(path, TFS_O_CREAT);
+        assert(f != -1);
+        assert(tfs_write(f, block, sizeof(block)) == sizeof(block));
+        assert(tfs_close(f) != -1);
+    }
+    return NULL;
+}
+
+void check_files(void) {
+    char block[BLOCK_SIZE];
+
+    for (int thread = 0; thread < NUM_THREADS; thread++) {
+        for (int i = 0; i < FILES_PER_THREAD; i++) {
+            char path[PATH_MAX_LEN];
+            file_path(path, thread, i);
+
+            int f = tfs_open(path, 0);
+            assert(f != -1);
+            assert(tfs_read(f, block, sizeof(block)) == sizeof(block));
+            assert(tfs_close(f) != -1);
+
+            // No block was handed out twice
+            assert(block[0] == (char)i);
+            for (size_t j = 1; j < sizeof(block); j++) {
+                assert(block[j] == 'a' + thread);
+            }
+        }
+    }
+}
+
+void create_concurrently(void) {
+    pthread_t tid[NUM_THREADS];
+    int ids[NUM_THREADS];
+
+    for (int i = 0; i < NUM_THREADS; i++) {
+        ids[i] = i;
+        assert(pthread_create(&tid[i], NULL, create_files, &ids[i]) == 0);
+    }
+    for (int i = 0; i < NUM_THREADS; i++) {
+        assert(pthread_join(tid[i], NULL) == 0);
+    }
+}
+
+void unlink_files(void) {
+    for (int thread = 0; thread < NUM_THREADS; thread++) {
+        for (int i = 0; i < FILES_PER_THREAD; i++) {
+            char path[PATH_MAX_LEN];
+            file_path(path, thread, i);
+            assert(tfs_unlink(path) != -1);
+        }
+    }
+}
+
+int main() {
+    tfs_params params = tfs_default_params();
+    params.max_inode_count = INODE_COUNT;
+    params.max_block_count = BLOCK_COUNT;
+    params.block_size = BLOCK_SIZE;
+    assert(tfs_init(&params) != -1);
+
+    create_concurrently();
+    check_files();
+
+    // Only the last inode is left
+    int f = tfs_open("/last", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_close(f) != -1);
+    assert(tfs_open("/one_too_many", TFS_O_CREAT) == -1);
+
+    // Freed inodes and blocks are reused
+    unlink_files();
+    create_concurrently();
+    check_files();
+    unlink_files();
+
+    // A single file can take every free block, across bitmap words
+    static char contents[BLOCK_COUNT * BLOCK_SIZE];
+    memset(contents, 'z', sizeof(contents));
+    f = tfs_open("/last", TFS_O_APPEND);
+    assert(f != -1);
+    ssize_t written = tfs_write(f, contents, sizeof(contents));
+    assert(written >= (BLOCK_COUNT / 2) * BLOCK_SIZE);
+    assert(written < (ssize_t)sizeof(contents));
+    assert(tfs_close(f) != -1);
+
+    assert(tfs_destroy() != -1);
+
+    PRINT_GREEN("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,106 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "prettyprint.h"
+
+#define INODE_COUNT 8
+#define BLOCK_COUNT 12
+#define BLOCK_SIZE 1024
+#define NUM_THREADS 4
+#define ITERATIONS 20
+#define PATH_MAX_LEN 32
+
+static pthread_barrier_t cached;
+static pthread_barrier_t done;
+
+// Leaves free inodes and blocks cached by this thread while it is alive
+void *cache_and_wait(void *args) {
+    (void)args;
+    char block[BLOCK_SIZE] = {0};
+
+    int f = tfs_open("/cached", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, block, sizeof(block)) == sizeof(block));
+    assert(tfs_close(f) != -1);
+    assert(tfs_unlink("/cached") != -1);
+
+    pthread_barrier_wait(&cached);
+    pthread_barrier_wait(&done);
+    return NULL;
+}
+
+void *churn(void *args) {
+    int id = *(int *)args;
+    char path[PATH_MAX_LEN];
+    sprintf(path, "/churn%d", id);
+
+    for (int i = 0; i < ITERATIONS; i++) {
+        int f = tfs_open(path, TFS_O_CREAT);
+        assert(f != -1);
+        assert(tfs_write(f, &i, sizeof(i)) == sizeof(i));
+        assert(tfs_close(f) != -1);
+        assert(tfs_unlink(path) != -1);
+    }
+    return NULL;
+}
+
+int main() {
+    tfs_params params = tfs_default_params();
+    params.max_inode_count = INODE_COUNT;
+    params.max_block_count = BLOCK_COUNT;
+    params.block_size = BLOCK_SIZE;
+    assert(tfs_init(&params) != -1);
+
+    // Every inode and block not in use can be allocated, even while another
+    // thread has them cached
+    assert(pthread_barrier_init(&cached, NULL, 2) == 0);
+    assert(pthread_barrier_init(&done, NULL, 2) == 0);
+    pthread_t tid;
+    assert(pthread_create(&tid, NULL, cache_and_wait, NULL) == 0);
+    pthread_barrier_wait(&cached);
+
+    static char contents[(BLOCK_COUNT - 1) * BLOCK_SIZE];
+    memset(contents, 'x', sizeof(contents));
+    int f = tfs_open("/big", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, contents, sizeof(contents)) == sizeof(contents));
+    assert(tfs_close(f) != -1);
+    assert(tfs_unlink("/big") != -1);
+
+    for (int i = 0; i < INODE_COUNT - 1; i++) {
+        char path[PATH_MAX_LEN];
+        sprintf(path, "/f%d", i);
+        f = tfs_open(path, TFS_O_CREAT);
+        assert(f != -1);
+        assert(tfs_close(f) != -1);
+    }
+    assert(tfs_open("/one_too_many", TFS_O_CREAT) == -1);
+    for (int i = 0; i < INODE_COUNT - 1; i++) {
+        char path[PATH_MAX_LEN];
+        sprintf(path, "/f%d", i);
+        assert(tfs_unlink(path) != -1);
+    }
+
+    pthread_barrier_wait(&done);
+    assert(pthread_join(tid, NULL) == 0);
+
+    // Concurrent creates and unlinks, with few free slots
+    pthread_t tids[NUM_THREADS];
+    int ids[NUM_THREADS];
+    for (int i = 0; i < NUM_THREADS; i++) {
+        ids[i] = i;
+        assert(pthread_create(&tids[i], NULL, churn, &ids[i]) == 0);
+    }
+    for (int i = 0; i < NUM_THREADS; i++) {
+        assert(pthread_join(tids[i], NULL) == 0);
+    }
+
+    assert(tfs_destroy() != -1);
+
+    PRINT_GREEN("Successful test.\n");
+
+    return 0;
+}
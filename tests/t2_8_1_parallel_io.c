@@ -0,0 +1,128 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "prettyprint.h"
+
+#define NUM_THREADS 4
+#define CHUNK_SIZE 100
+#define CHUNKS 20
+#define PATH_MAX_LEN 32
+
+// Each writer fills its own file with its id
+void *write_own_file(void *args) {
+    int id = *(int *)args;
+    char path[PATH_MAX_LEN];
+    sprintf(path, "/f%d", id);
+
+    char chunk[CHUNK_SIZE];
+    memset(chunk, 'a' + id, sizeof(chunk));
+
+    int f = tfs_open(path, TFS_O_CREAT | TFS_O_TRUNC);
+    assert(f != -1);
+    for (int i = 0; i < CHUNKS; i++) {
+        assert(tfs_write(f, chunk, sizeof(chunk)) == sizeof(chunk));
+    }
+    assert(tfs_close(f) != -1);
+    return NULL;
+}
+
+// Each reader reads the whole shared file through its own handle
+void *read_shared_file(void *args) {
+    (void)args;
+    char chunk[CHUNK_SIZE];
+
+    int f = tfs_open("/shared", 0);
+    assert(f != -1);
+    for (int i = 0; i < CHUNKS; i++) {
+        assert(tfs_read(f, chunk, sizeof(chunk)) == sizeof(chunk));
+        for (size_t j = 0; j < sizeof(chunk); j++) {
+            assert(chunk[j] == 'a' + i);
+        }
+    }
+    assert(tfs_read(f, chunk, sizeof(chunk)) == 0);
+    assert(tfs_close(f) != -1);
+    return NULL;
+}
+
+// Concurrent writes to the same file are not interleaved
+void *overwrite_shared_file(void *args) {
+    int id = *(int *)args;
+    char contents[CHUNKS * CHUNK_SIZE];
+    memset(contents, 'A' + id, sizeof(contents));
+
+    int f = tfs_open("/overwritten", 0);
+    assert(f != -1);
+    assert(tfs_write(f, contents, sizeof(contents)) == sizeof(contents));
+    assert(tfs_close(f) != -1);
+    return NULL;
+}
+
+void run_threads(void *(*routine)(void *)) {
+    pthread_t tid[NUM_THREADS];
+    int ids[NUM_THREADS];
+    for (int i = 0; i < NUM_THREADS; i++) {
+        ids[i] = i;
+        assert(pthread_create(&tid[i], NULL, routine, &ids[i]) == 0);
+    }
+    for (int i = 0; i < NUM_THREADS; i++) {
+        assert(pthread_join(tid[i], NULL) == 0);
+    }
+}
+
+int main() {
+    assert(tfs_init(NULL) != -1);
+
+    // Writers of different files
+    run_threads(write_own_file);
+    for (int id = 0; id < NUM_THREADS; id++) {
+        char path[PATH_MAX_LEN];
+        sprintf(path, "/f%d", id);
+        char chunk[CHUNK_SIZE];
+
+        int f = tfs_open(path, 0);
+        assert(f != -1);
+        for (int i = 0; i < CHUNKS; i++) {
+            assert(tfs_read(f, chunk, sizeof(chunk)) == sizeof(chunk));
+            for (size_t j = 0; j < sizeof(chunk); j++) {
+                assert(chunk[j] == 'a' + id);
+            }
+        }
+        assert(tfs_close(f) != -1);
+    }
+
+    // Readers of the same file
+    int f = tfs_open("/shared", TFS_O_CREAT);
+    assert(f != -1);
+    for (int i = 0; i < CHUNKS; i++) {
+        char chunk[CHUNK_SIZE];
+        memset(chunk, 'a' + i, sizeof(chunk));
+        assert(tfs_write(f, chunk, sizeof(chunk)) == sizeof(chunk));
+    }
+    assert(tfs_close(f) != -1);
+    run_threads(read_shared_file);
+
+    // Writers of the same file
+    f = tfs_open("/overwritten", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_close(f) != -1);
+    run_threads(overwrite_shared_file);
+
+    char contents[CHUNKS * CHUNK_SIZE];
+    f = tfs_open("/overwritten", 0);
+    assert(f != -1);
+    assert(tfs_read(f, contents, sizeof(contents)) == sizeof(contents));
+    assert(tfs_close(f) != -1);
+    assert(contents[0] >= 'A' && contents[0] < 'A' + NUM_THREADS);
+    for (size_t i = 1; i < sizeof(contents); i++) {
+        assert(contents[i] == contents[0]);
+    }
+
+    assert(tfs_destroy() != -1);
+
+    PRINT_GREEN("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,105 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "prettyprint.h"
+
+#define NUM_THREADS 4
+#define RECORD_SIZE 64
+#define RECORDS 64
+
+static int shared_handle;
+
+void fill_record(char *record, int i) {
+    memset(record, 'a' + i % 26, RECORD_SIZE);
+    record[0] = (char)i;
+}
+
+// Each thread writes its share of the records through the shared handle
+void *write_records(void *args) {
+    int id = *(int *)args;
+    char record[RECORD_SIZE];
+    for (int i = id; i < RECORDS; i += NUM_THREADS) {
+        fill_record(record, i);
+        assert(tfs_pwrite(shared_handle, record, RECORD_SIZE,
+                          (size_t)i * RECORD_SIZE) == RECORD_SIZE);
+    }
+    return NULL;
+}
+
+// Each thread reads every record through the shared handle, in its own order
+void *read_records(void *args) {
+    int id = *(int *)args;
+    char record[RECORD_SIZE];
+    char expected[RECORD_SIZE];
+    for (int n = 0; n < RECORDS; n++) {
+        int i = (n * 7 + id * 13) % RECORDS;
+        fill_record(expected, i);
+        assert(tfs_pread(shared_handle, record, RECORD_SIZE,
+                         (size_t)i * RECORD_SIZE) == RECORD_SIZE);
+        assert(memcmp(record, expected, RECORD_SIZE) == 0);
+    }
+    return NULL;
+}
+
+void run_threads(void *(*routine)(void *)) {
+    pthread_t tid[NUM_THREADS];
+    int ids[NUM_THREADS];
+    for (int i = 0; i < NUM_THREADS; i++) {
+        ids[i] = i;
+        assert(pthread_create(&tid[i], NULL, routine, &ids[i]) == 0);
+    }
+    for (int i = 0; i < NUM_THREADS; i++) {
+        assert(pthread_join(tid[i], NULL) == 0);
+    }
+}
+
+int main() {
+    assert(tfs_init(NULL) != -1);
+
+    shared_handle = tfs_open("/records", TFS_O_CREAT);
+    assert(shared_handle != -1);
+
+    // The records are written out of order (the file grows as needed)
+    run_threads(write_records);
+    run_threads(read_records);
+
+    // The offset of the handle was not used nor changed
+    char record[RECORD_SIZE];
+    char expected[RECORD_SIZE];
+    fill_record(expected, 0);
+    assert(tfs_read(shared_handle, record, RECORD_SIZE) == RECORD_SIZE);
+    assert(memcmp(record, expected, RECORD_SIZE) == 0);
+
+    // Reads past the end of the file
+    size_t size = RECORDS * RECORD_SIZE;
+    assert(tfs_pread(shared_handle, record, RECORD_SIZE, size) == 0);
+    assert(tfs_pread(shared_handle, record, RECORD_SIZE, size + 1000) == 0);
+    assert(tfs_pread(shared_handle, record, RECORD_SIZE, size - 10) == 10);
+
+    // Writes past the end of the file leave a gap of zeros
+    assert(tfs_close(shared_handle) != -1);
+    int f = tfs_open("/gap", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_pwrite(f, "abc", 3, 2000) == 3);
+    char contents[2003];
+    assert(tfs_read(f, contents, sizeof(contents)) == sizeof(contents));
+    for (size_t i = 0; i < 2000; i++) {
+        assert(contents[i] == 0);
+    }
+    assert(memcmp(contents + 2000, "abc", 3) == 0);
+    assert(tfs_pwrite(f, "", 0, 5000) == 0);
+    assert(tfs_pread(f, contents, sizeof(contents), 2003) == 0);
+    assert(tfs_close(f) != -1);
+
+    assert(tfs_pread(f, contents, 1, 0) == -1);
+    assert(tfs_pwrite(f, contents, 1, 0) == -1);
+
+    assert(tfs_destroy() != -1);
+
+    PRINT_GREEN("Successful test.\n");
+
+    return 0;
+}